@@ -0,0 +1,69 @@
+/* Copyright 2008 Cedric Cellier.
+ *
+ * This file is part of Scambio.
+ *
+ * Scambio is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Scambio is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with Scambio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+#include <ftw.h>
+#include <pth.h>
+#include "scambio.h"
+#include "check.h"
+
+unsigned check_nb_failures;
+static char tmpdir[PATH_MAX];	// empty if none
+
+void check_begin(void)
+{
+	if (! pth_init()) exit(EXIT_FAILURE);
+	error_begin();
+	log_level = 0;
+}
+
+void check_fail(char const *what, char const *how)
+{
+	fprintf(stderr, "%s : %s\n", what, how);
+	check_nb_failures ++;
+}
+
+char const *check_tmpdir(char const *name)
+{
+	snprintf(tmpdir, sizeof(tmpdir), "/tmp/%s.XXXXXX", name);
+	if (! mkdtemp(tmpdir)) {
+		perror("mkdtemp");
+		exit(EXIT_FAILURE);
+	}
+	return tmpdir;
+}
+
+static int remove_entry(char const *path, struct stat const *st, int flag, struct FTW *ftw)
+{
+	(void)st;
+	(void)flag;
+	(void)ftw;
+	if (0 != remove(path)) perror(path);
+	return 0;
+}
+
+int check_end(void)
+{
+	if (tmpdir[0] != '\0') {
+		(void)nftw(tmpdir, remove_entry, 16, FTW_DEPTH|FTW_PHYS);
+		tmpdir[0] = '\0';
+	}
+	error_end();
+	return check_nb_failures > 0 ? EXIT_FAILURE:EXIT_SUCCESS;
+}
@@ -0,0 +1,36 @@
+/* Copyright 2008 Cedric Cellier.
+ *
+ * This file is part of Scambio.
+ *
+ * Scambio is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Scambio is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with Scambio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef CHECK_H_090601
+#define CHECK_H_090601
+
+/* Helpers for the unit checks, that are run with "make check" in their directory.
+ * A check program calls check_begin(), reports each failed check with check_fail(),
+ * and returns check_end() which tells whether any check failed.
+ */
+
+extern unsigned check_nb_failures;
+
+// Initialize pth and the error stack, and silence the logs. Exits on failure.
+void check_begin(void);
+void check_fail(char const *what, char const *how);
+// Returns the path of a new temporary directory, removed by check_end(). Exits on failure.
+char const *check_tmpdir(char const *name);
+// Returns the exit status of the check program
+int check_end(void);
+
+#endif
@@ -0,0 +1,536 @@
+/* Copyright 2008 Cedric Cellier.
+ *
+ * This file is part of Scambio.
+ *
+ * Scambio is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Scambio is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with Scambio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+#include <assert.h>
+#include "scambio.h"
+#include "codec.h"
+
+/* The SIMD base64 codecs follow the algorithms described by Wojciech Mula
+ * and Daniel Lemire ("Faster Base64 Encoding and Decoding using AVX2
+ * Instructions"). They need pshufb, thus SSSE3 at least.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#	define CODEC_X86
+#	include <immintrin.h>
+#endif
+
+/*
+ * Implementation selection
+ */
+
+static bool impl_inited;
+static enum codec_impl impl = CODEC_SCALAR;
+
+static enum codec_impl best_impl(void)
+{
+#	ifdef CODEC_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) return CODEC_AVX2;
+	if (__builtin_cpu_supports("ssse3")) return CODEC_SSSE3;
+#	endif
+	return CODEC_SCALAR;
+}
+
+enum codec_impl codec_impl(void)
+{
+	if (! impl_inited) {
+		impl = best_impl();
+		impl_inited = true;
+	}
+	return impl;
+}
+
+enum codec_impl codec_set_impl(enum codec_impl new_impl)
+{
+	enum codec_impl const best = best_impl();
+	impl = new_impl > best ? best : new_impl;
+	impl_inited = true;
+	return impl;
+}
+
+char const *codec_impl_name(enum codec_impl impl)
+{
+	switch (impl) {
+		case CODEC_SCALAR: return "scalar";
+		case CODEC_SSSE3:  return "ssse3";
+		case CODEC_AVX2:   return "avx2";
+	}
+	return "unknown";
+}
+
+/*
+ * Base64 encoder
+ */
+
+static char const b64[64] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+#ifdef CODEC_X86
+// Spread 12 bytes of each lane into 16 6-bits values
+__attribute__((target("ssse3")))
+static __m128i enc_reshuffle_ssse3(__m128i in)
+{
+	in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+	__m128i const t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+	__m128i const t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+	__m128i const t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+	__m128i const t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+	return _mm_or_si128(t1, t3);
+}
+
+// 6-bits values to ASCII
+__attribute__((target("ssse3")))
+static __m128i enc_translate_ssse3(__m128i in)
+{
+	__m128i const lut = _mm_setr_epi8(
+		'a'-26, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52,
+		'0'-52, '0'-52, '0'-52, '+'-62, '/'-63, 'A', 0, 0);
+	__m128i idx = _mm_subs_epu8(in, _mm_set1_epi8(51));	// 0..51 -> 0, 52..63 -> 1..12
+	__m128i const less = _mm_cmpgt_epi8(_mm_set1_epi8(26), in);
+	idx = _mm_or_si128(idx, _mm_and_si128(less, _mm_set1_epi8(13)));	// 0..25 -> 13
+	return _mm_add_epi8(in, _mm_shuffle_epi8(lut, idx));
+}
+
+// Reads 16 bytes but encodes only the first 12
+__attribute__((target("ssse3")))
+static void enc_block_ssse3(char *out, unsigned char const *in)
+{
+	__m128i v = _mm_loadu_si128((__m128i const *)in);
+	v = enc_translate_ssse3(enc_reshuffle_ssse3(v));
+	_mm_storeu_si128((__m128i *)out, v);
+}
+
+__attribute__((target("avx2")))
+static __m256i enc_reshuffle_avx2(__m256i in)
+{
+	in = _mm256_shuffle_epi8(in, _mm256_set_epi8(
+		10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+		10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+	__m256i const t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+	__m256i const t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+	__m256i const t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+	__m256i const t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+	return _mm256_or_si256(t1, t3);
+}
+
+__attribute__((target("avx2")))
+static __m256i enc_translate_avx2(__m256i in)
+{
+	__m256i const lut = _mm256_setr_epi8(
+		'a'-26, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52,
+		'0'-52, '0'-52, '0'-52, '+'-62, '/'-63, 'A', 0, 0,
+		'a'-26, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52,
+		'0'-52, '0'-52, '0'-52, '+'-62, '/'-63, 'A', 0, 0);
+	__m256i idx = _mm256_subs_epu8(in, _mm256_set1_epi8(51));
+	__m256i const less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), in);
+	idx = _mm256_or_si256(idx, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+	return _mm256_add_epi8(in, _mm256_shuffle_epi8(lut, idx));
+}
+
+// Reads 28 bytes but encodes only the first 24 (12 per lane)
+__attribute__((target("avx2")))
+static void enc_block_avx2(char *out, unsigned char const *in)
+{
+	__m256i v = _mm256_inserti128_si256(
+		_mm256_castsi128_si256(_mm_loadu_si128((__m128i const *)in)),
+		_mm_loadu_si128((__m128i const *)(in + 12)), 1);
+	v = enc_translate_avx2(enc_reshuffle_avx2(v));
+	_mm256_storeu_si256((__m256i *)out, v);
+}
+#endif
+
+static void enc_triplet(char *out, unsigned char const *in)
+{
+	out[0] = b64[in[0] >> 2];
+	out[1] = b64[((in[0] & 0x3) << 4) | (in[1] >> 4)];
+	out[2] = b64[((in[1] & 0xF) << 2) | (in[2] >> 6)];
+	out[3] = b64[in[2] & 0x3F];
+}
+
+// Encode nb triplets. The vector versions may read (but not use) up to in_end.
+static void enc_triplets(char *out, unsigned char const *in, size_t nb, unsigned char const *in_end)
+{
+#	ifdef CODEC_X86
+	enum codec_impl const impl = codec_impl();
+	if (impl >= CODEC_AVX2) {
+		while (nb >= 8 && in + 28 <= in_end) {
+			enc_block_avx2(out, in);
+			in += 24; out += 32; nb -= 8;
+		}
+	}
+	if (impl >= CODEC_SSSE3) {
+		while (nb >= 4 && in + 16 <= in_end) {
+			enc_block_ssse3(out, in);
+			in += 12; out += 16; nb -= 4;
+		}
+	}
+#	else
+	(void)in_end;
+#	endif
+	while (nb > 0) {
+		enc_triplet(out, in);
+		in += 3; out += 4; nb --;
+	}
+}
+
+void base64_enc_ctor(struct base64_enc *enc, unsigned line_len)
+{
+	assert(line_len % 4 == 0);
+	enc->line_len = line_len;
+	enc->col = 0;
+	enc->nb_rest = 0;
+}
+
+// Returns the number of quads that can still be written on the current line (after a line break if needed)
+static size_t room_on_line(struct base64_enc *enc, char *out, size_t *o)
+{
+	if (! enc->line_len) return (size_t)-1;
+	if (enc->col >= enc->line_len) {
+		out[(*o)++] = '\r';
+		out[(*o)++] = '\n';
+		enc->col = 0;
+	}
+	return (enc->line_len - enc->col) / 4;
+}
+
+size_t base64_encode(struct base64_enc *enc, char *out, void const *in_, size_t size)
+{
+	unsigned char const *in = in_;
+	unsigned char const *const in_end = in + size;
+	size_t o = 0;
+	// Complete the triplet left from previous call
+	if (enc->nb_rest > 0) {
+		while (enc->nb_rest < 3 && size > 0) {
+			enc->rest[enc->nb_rest++] = *in++;
+			size --;
+		}
+		if (enc->nb_rest < 3) return 0;
+		(void)room_on_line(enc, out, &o);
+		enc_triplet(out + o, enc->rest);
+		o += 4;
+		enc->col += 4;
+		enc->nb_rest = 0;
+	}
+	// Then encode whole lines at once
+	while (size >= 3) {
+		size_t nb = size / 3;
+		size_t const room = room_on_line(enc, out, &o);
+		if (nb > room) nb = room;
+		enc_triplets(out + o, in, nb, in_end);
+		o += nb * 4;
+		if (enc->line_len) enc->col += nb * 4;
+		in += nb * 3;
+		size -= nb * 3;
+	}
+	// Keep what's left for next time
+	memcpy(enc->rest, in, size);
+	enc->nb_rest = size;
+	return o;
+}
+
+size_t base64_encode_finish(struct base64_enc *enc, char *out)
+{
+	size_t o = 0;
+	if (enc->nb_rest == 0) return 0;
+	(void)room_on_line(enc, out, &o);
+	memset(enc->rest + enc->nb_rest, 0, sizeof(enc->rest) - enc->nb_rest);
+	enc_triplet(out + o, enc->rest);
+	if (enc->nb_rest < 3) out[o + 3] = '=';
+	if (enc->nb_rest < 2) out[o + 2] = '=';
+	o += 4;
+	enc->col += 4;
+	enc->nb_rest = 0;
+	return o;
+}
+
+/*
+ * Base64 decoder
+ */
+
+#define B64_INVALID 0xFF
+#define B64_PAD 0xFE
+static unsigned char b64_values[256];
+
+static void init_b64_values(void)
+{
+	if (b64_values['='] == B64_PAD) return;
+	memset(b64_values, B64_INVALID, sizeof(b64_values));
+	for (unsigned v = 0; v < sizeof(b64); v++) b64_values[(unsigned char)b64[v]] = v;
+	b64_values['='] = B64_PAD;
+}
+
+#ifdef CODEC_X86
+/* Decode 16 chars into 12 bytes (16 bytes are written).
+ * Returns false (and writes nothing) if one of the chars is not in the base64 alphabet.
+ */
+__attribute__((target("ssse3")))
+static bool dec_block_ssse3(unsigned char *out, char const *in)
+{
+	__m128i const v = _mm_loadu_si128((__m128i const *)in);
+	__m128i const hi_nibbles = _mm_and_si128(_mm_srli_epi32(v, 4), _mm_set1_epi8(0x0f));
+	__m128i const lower_lut = _mm_setr_epi8(1, 1, 0x2b, 0x30, 0x41, 0x50, 0x61, 0x70, 1, 1, 1, 1, 1, 1, 1, 1);
+	__m128i const upper_lut = _mm_setr_epi8(0, 0, 0x2b, 0x39, 0x4f, 0x5a, 0x6f, 0x7a, 0, 0, 0, 0, 0, 0, 0, 0);
+	__m128i const shift_lut = _mm_setr_epi8(
+		0, 0, 0x3e - 0x2b, 0x34 - 0x30, 0x00 - 0x41, 0x0f - 0x50, 0x1a - 0x61, 0x29 - 0x70,
+		0, 0, 0, 0, 0, 0, 0, 0);
+	__m128i const below = _mm_cmplt_epi8(v, _mm_shuffle_epi8(lower_lut, hi_nibbles));
+	__m128i const above = _mm_cmpgt_epi8(v, _mm_shuffle_epi8(upper_lut, hi_nibbles));
+	__m128i const eq_2f = _mm_cmpeq_epi8(v, _mm_set1_epi8(0x2f));
+	__m128i const outside = _mm_andnot_si128(eq_2f, _mm_or_si128(above, below));
+	if (_mm_movemask_epi8(outside)) return false;
+	__m128i vals = _mm_add_epi8(v, _mm_shuffle_epi8(shift_lut, hi_nibbles));
+	vals = _mm_add_epi8(vals, _mm_and_si128(eq_2f, _mm_set1_epi8(-3)));
+	// Pack 4 6-bits values into 3 bytes
+	__m128i const ab_bc = _mm_maddubs_epi16(vals, _mm_set1_epi32(0x01400140));
+	__m128i packed = _mm_madd_epi16(ab_bc, _mm_set1_epi32(0x00011000));
+	packed = _mm_shuffle_epi8(packed, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+	_mm_storeu_si128((__m128i *)out, packed);
+	return true;
+}
+
+// Same as above for 32 chars into 24 bytes (32 are written)
+__attribute__((target("avx2")))
+static bool dec_block_avx2(unsigned char *out, char const *in)
+{
+	__m256i const v = _mm256_loadu_si256((__m256i const *)in);
+	__m256i const hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(v, 4), _mm256_set1_epi8(0x0f));
+	__m256i const lower_lut = _mm256_setr_epi8(
+		1, 1, 0x2b, 0x30, 0x41, 0x50, 0x61, 0x70, 1, 1, 1, 1, 1, 1, 1, 1,
+		1, 1, 0x2b, 0x30, 0x41, 0x50, 0x61, 0x70, 1, 1, 1, 1, 1, 1, 1, 1);
+	__m256i const upper_lut = _mm256_setr_epi8(
+		0, 0, 0x2b, 0x39, 0x4f, 0x5a, 0x6f, 0x7a, 0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0x2b, 0x39, 0x4f, 0x5a, 0x6f, 0x7a, 0, 0, 0, 0, 0, 0, 0, 0);
+	__m256i const shift_lut = _mm256_setr_epi8(
+		0, 0, 0x3e - 0x2b, 0x34 - 0x30, 0x00 - 0x41, 0x0f - 0x50, 0x1a - 0x61, 0x29 - 0x70,
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0x3e - 0x2b, 0x34 - 0x30, 0x00 - 0x41, 0x0f - 0x50, 0x1a - 0x61, 0x29 - 0x70,
+		0, 0, 0, 0, 0, 0, 0, 0);
+	__m256i const below = _mm256_cmpgt_epi8(_mm256_shuffle_epi8(lower_lut, hi_nibbles), v);
+	__m256i const above = _mm256_cmpgt_epi8(v, _mm256_shuffle_epi8(upper_lut, hi_nibbles));
+	__m256i const eq_2f = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x2f));
+	__m256i const outside = _mm256_andnot_si256(eq_2f, _mm256_or_si256(above, below));
+	if (_mm256_movemask_epi8(outside)) return false;
+	__m256i vals = _mm256_add_epi8(v, _mm256_shuffle_epi8(shift_lut, hi_nibbles));
+	vals = _mm256_add_epi8(vals, _mm256_and_si256(eq_2f, _mm256_set1_epi8(-3)));
+	__m256i const ab_bc = _mm256_maddubs_epi16(vals, _mm256_set1_epi32(0x01400140));
+	__m256i packed = _mm256_madd_epi16(ab_bc, _mm256_set1_epi32(0x00011000));
+	packed = _mm256_shuffle_epi8(packed, _mm256_setr_epi8(
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+	packed = _mm256_permutevar8x32_epi32(packed, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+	_mm256_storeu_si256((__m256i *)out, packed);
+	return true;
+}
+
+// Decode as many whole blocks as possible. Returns the number of chars consumed.
+static size_t dec_blocks(unsigned char *out, size_t *o, char const *in, size_t size)
+{
+	size_t i = 0;
+	enum codec_impl const impl = codec_impl();
+	if (impl >= CODEC_AVX2) {
+		while (size - i >= 32 && dec_block_avx2(out + *o, in + i)) {
+			i += 32; *o += 24;
+		}
+	}
+	if (impl >= CODEC_SSSE3) {
+		while (size - i >= 16 && dec_block_ssse3(out + *o, in + i)) {
+			i += 16; *o += 12;
+		}
+	}
+	return i;
+}
+#endif
+
+void base64_dec_ctor(struct base64_dec *dec)
+{
+	init_b64_values();
+	dec->nb_vals = 0;
+	dec->nb_pads = 0;
+}
+
+size_t base64_decode(struct base64_dec *dec, void *out_, char const *in, size_t size)
+{
+	unsigned char *out = out_;
+	size_t o = 0;
+	while (size > 0) {
+#		ifdef CODEC_X86
+		if (dec->nb_vals == 0 && dec->nb_pads == 0 && size >= 16) {
+			size_t const i = dec_blocks(out, &o, in, size);
+			in += i;
+			size -= i;
+			if (size == 0) break;
+		}
+#		endif
+		// Go on char by char up to the next quad boundary
+		do {
+			unsigned char const c = *in++;
+			unsigned char const val = b64_values[c];
+			size --;
+			if (val == B64_PAD) {
+				if (++dec->nb_pads > 2) with_error(0, "Invalid base64 encoding : too many padding") return o;
+			} else if (val == B64_INVALID) {	// ignore
+				if (c != '\n' && c != '\r' && c != ' ' && c != '\t') debug("Invalid char '%c' in base64 encoding", c);
+			} else {
+				if (dec->nb_pads > 0) with_error(0, "Invalid base64 encoding : padding chars within body") return o;
+				dec->vals[dec->nb_vals++] = val;
+			}
+			if (dec->nb_vals + dec->nb_pads >= sizeof_array(dec->vals)) {	// output the result
+				while (dec->nb_vals < sizeof_array(dec->vals)) dec->vals[dec->nb_vals++] = 0;
+				out[o++] = (dec->vals[0] << 2) | (dec->vals[1] >> 4);
+				out[o++] = (dec->vals[1] << 4) | (dec->vals[2] >> 2);
+				out[o++] = (dec->vals[2] << 6) | dec->vals[3];
+				o -= dec->nb_pads;
+				dec->nb_vals = 0;
+				dec->nb_pads = 0;
+				break;
+			}
+		} while (size > 0);
+	}
+	return o;
+}
+
+/*
+ * Quoted-printable encoder
+ */
+
+static char const hex[16] = "0123456789ABCDEF";
+
+void qp_enc_ctor(struct qp_enc *enc)
+{
+	enc->col = 0;
+	enc->pending_blank = -1;
+}
+
+// Write a token of len chars, with a soft line break before it if the line would be too long
+static size_t qp_put(struct qp_enc *enc, char *out, char const *token, unsigned len)
+{
+	size_t o = 0;
+	if (enc->col + len > CODEC_LINE_LENGTH - 1) {	// keep room for the '='
+		out[o++] = '=';
+		out[o++] = '\r';
+		out[o++] = '\n';
+		enc->col = 0;
+	}
+	memcpy(out + o, token, len);
+	enc->col += len;
+	return o + len;
+}
+
+static size_t qp_put_quoted(struct qp_enc *enc, char *out, unsigned char c)
+{
+	char const token[3] = { '=', hex[c >> 4], hex[c & 0xF] };
+	return qp_put(enc, out, token, sizeof(token));
+}
+
+size_t qp_encode(struct qp_enc *enc, char *out, void const *in_, size_t size)
+{
+	unsigned char const *in = in_;
+	size_t o = 0;
+	for (size_t i = 0; i < size; i++) {
+		unsigned char const c = in[i];
+		if (enc->pending_blank != -1) {
+			// A blank followed by a line break must be quoted
+			if (c == '\n') o += qp_put_quoted(enc, out + o, enc->pending_blank);
+			else o += qp_put(enc, out + o, (char const []){ enc->pending_blank }, 1);
+			enc->pending_blank = -1;
+		}
+		if (c == '\n') {
+			out[o++] = '\r';
+			out[o++] = '\n';
+			enc->col = 0;
+		} else if (c == ' ' || c == '\t') {
+			enc->pending_blank = c;
+		} else if (c >= 33 && c <= 126 && c != '=') {
+			// Copy runs of plain chars at once
+			size_t len = 1;
+			while (i + len < size && enc->col + len < CODEC_LINE_LENGTH - 1) {
+				unsigned char const n = in[i + len];
+				if (n < 33 || n > 126 || n == '=') break;
+				len ++;
+			}
+			o += qp_put(enc, out + o, (char const *)in + i, len);
+			i += len - 1;
+		} else {
+			o += qp_put_quoted(enc, out + o, c);
+		}
+	}
+	return o;
+}
+
+size_t qp_encode_finish(struct qp_enc *enc, char *out)
+{
+	if (enc->pending_blank == -1) return 0;
+	size_t const o = qp_put_quoted(enc, out, enc->pending_blank);
+	enc->pending_blank = -1;
+	return o;
+}
+
+/*
+ * Quoted-printable decoder
+ */
+
+void qp_dec_ctor(struct qp_dec *dec)
+{
+	dec->state = QP_UNQUOTED;
+	dec->quoted = 0;
+}
+
+static int hex_value(char c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'A' && c <= 'F') return 10 + c - 'A';
+	if (c >= 'a' && c <= 'f') return 10 + c - 'a';
+	return -1;
+}
+
+size_t qp_decode(struct qp_dec *dec, void *out_, char const *in, size_t size)
+{
+	char *out = out_;
+	size_t o = 0;
+	while (size > 0) {
+		if (dec->state == QP_UNQUOTED) {
+			// Copy everything up to the next quote at once
+			char const *quote = memchr(in, '=', size);
+			size_t const len = quote ? (size_t)(quote - in) : size;
+			memcpy(out + o, in, len);
+			o += len;
+			if (! quote) break;
+			dec->state = QP_QUOTE1;
+			dec->quoted = 0;
+			in = quote + 1;
+			size -= len + 1;
+			continue;
+		}
+		char const c = *in++;
+		size --;
+		if (c == '\r' && dec->state == QP_QUOTE1) continue;	// soft line break with CRLF
+		int const v = hex_value(c);
+		if (v < 0) {	// Either a soft break or an error. In both cases, ignore.
+			dec->state = QP_UNQUOTED;
+			continue;
+		}
+		dec->quoted = dec->quoted*16 + v;
+		if (dec->state == QP_QUOTE1) {
+			dec->state = QP_QUOTE2;
+		} else {
+			out[o++] = dec->quoted;
+			dec->state = QP_UNQUOTED;
+		}
+	}
+	return o;
+}
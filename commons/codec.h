@@ -0,0 +1,99 @@
+/* Copyright 2008 Cedric Cellier.
+ *
+ * This file is part of Scambio.
+ *
+ * Scambio is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Scambio is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with Scambio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef CODEC_H_090312
+#define CODEC_H_090312
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Base64 and quoted-printable codecs.
+ * All codecs are incremental : they keep in their state whatever they could
+ * not process yet, so that a stream can be fed by chunks of any size.
+ * They work on whole buffers (the caller is expected to give large ones) and
+ * the base64 codecs use SIMD instructions when the CPU has them.
+ * Output buffers must be at least as large as the corresponding *_MAX()
+ * macro tells.
+ */
+
+#define CODEC_LINE_LENGTH 76	// RFC 2045
+
+/* Base64 encoder.
+ * If line_len is not 0 (it must then be a multiple of 4) the output is
+ * wrapped with CRLF every line_len chars. No CRLF is appended after the last line.
+ */
+struct base64_enc {
+	unsigned line_len, col;
+	unsigned nb_rest;
+	unsigned char rest[3];
+};
+#define BASE64_ENCODE_MAX(size) (((size)+2)/3*4 + ((size)/54 + 1)*2 + 4)
+
+void base64_enc_ctor(struct base64_enc *enc, unsigned line_len);
+size_t base64_encode(struct base64_enc *enc, char *out, void const *in, size_t size);
+// Flush the last (padded) quad. Returns the number of chars written (at most 6).
+size_t base64_encode_finish(struct base64_enc *enc, char *out);
+
+/* Base64 decoder.
+ * Blanks and unknown chars (line breaks...) are skipped, padding within the
+ * data is an error.
+ */
+struct base64_dec {
+	unsigned nb_vals, nb_pads;
+	unsigned char vals[4];
+};
+#define BASE64_DECODE_MAX(size) ((size)/4*3 + 3 + 16)
+
+void base64_dec_ctor(struct base64_dec *dec);
+size_t base64_decode(struct base64_dec *dec, void *out, char const *in, size_t size);
+
+/* Quoted-printable encoder.
+ * Lines are ended with CRLF. Input '\n' are hard line breaks.
+ */
+struct qp_enc {
+	unsigned col;
+	int pending_blank;	// a blank we must not write before knowing what follows (or -1)
+};
+#define QP_ENCODE_MAX(size) ((size)*3 + ((size)*3/73 + 2)*3 + 3)
+
+void qp_enc_ctor(struct qp_enc *enc);
+size_t qp_encode(struct qp_enc *enc, char *out, void const *in, size_t size);
+size_t qp_encode_finish(struct qp_enc *enc, char *out);
+
+/* Quoted-printable decoder.
+ * Soft line breaks ("=" at end of line) are removed, invalid escapes are
+ * ignored.
+ */
+struct qp_dec {
+	enum { QP_UNQUOTED, QP_QUOTE1, QP_QUOTE2 } state;
+	unsigned char quoted;
+};
+#define QP_DECODE_MAX(size) (size)
+
+void qp_dec_ctor(struct qp_dec *dec);
+size_t qp_decode(struct qp_dec *dec, void *out, char const *in, size_t size);
+
+/* Which implementation is used (mostly for benchmarking).
+ * codec_impl() returns the best one available by default.
+ */
+enum codec_impl { CODEC_SCALAR, CODEC_SSSE3, CODEC_AVX2 };
+enum codec_impl codec_impl(void);
+// Returns the implementation actually set (the requested one might not be available)
+enum codec_impl codec_set_impl(enum codec_impl impl);
+char const *codec_impl_name(enum codec_impl impl);
+
+#endif
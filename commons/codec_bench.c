@@ -0,0 +1,158 @@
+/* Copyright 2008 Cedric Cellier.
+ *
+ * This file is part of Scambio.
+ *
+ * Scambio is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Scambio is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with Scambio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* Micro-benchmark for the codecs : run "make bench" in commons.
+ * For each available implementation, encode and decode a random buffer
+ * by chunks (as the daemons do) and report the throughput.
+ * Also checks that all implementations agree with the scalar one.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pth.h>
+#include "scambio.h"
+#include "codec.h"
+
+#define DATA_SIZE (16*1024*1024)
+#define CHUNK_SIZE (57*1024)	// what sendmail reads at once
+#define NB_RUNS 5
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t b64_encode_all(char *out, unsigned char const *in, size_t size)
+{
+	struct base64_enc enc;
+	base64_enc_ctor(&enc, CODEC_LINE_LENGTH);
+	size_t o = 0;
+	for (size_t i = 0; i < size; i += CHUNK_SIZE) {
+		size_t const len = size - i < CHUNK_SIZE ? size - i : CHUNK_SIZE;
+		o += base64_encode(&enc, out + o, in + i, len);
+	}
+	return o + base64_encode_finish(&enc, out + o);
+}
+
+// Decode line by line, as smtpd does
+static size_t b64_decode_all(unsigned char *out, char const *in, size_t size)
+{
+	struct base64_dec dec;
+	base64_dec_ctor(&dec);
+	size_t o = 0;
+	for (size_t i = 0; i < size; ) {
+		char const *eol = memchr(in + i, '\n', size - i);
+		size_t const len = eol ? (size_t)(eol - in - i) + 1 : size - i;
+		o += base64_decode(&dec, out + o, in + i, len);
+		i += len;
+	}
+	return o;
+}
+
+static size_t qp_encode_all(char *out, unsigned char const *in, size_t size)
+{
+	struct qp_enc enc;
+	qp_enc_ctor(&enc);
+	size_t o = 0;
+	for (size_t i = 0; i < size; i += CHUNK_SIZE) {
+		size_t const len = size - i < CHUNK_SIZE ? size - i : CHUNK_SIZE;
+		o += qp_encode(&enc, out + o, in + i, len);
+	}
+	return o + qp_encode_finish(&enc, out + o);
+}
+
+static size_t qp_decode_all(char *out, char const *in, size_t size)
+{
+	struct qp_dec dec;
+	qp_dec_ctor(&dec);
+	return qp_decode(&dec, out, in, size);
+}
+
+static void report(char const *what, enum codec_impl impl, double best, size_t size)
+{
+	printf("%-12s %-8s %8.1f MB/s\n", what, codec_impl_name(impl), size / best / (1024*1024));
+}
+
+int main(void)
+{
+	if (! pth_init()) return EXIT_FAILURE;
+	error_begin();
+	log_level = 0;
+
+	unsigned char *data = malloc(DATA_SIZE);
+	char *text = malloc(DATA_SIZE);
+	char *encoded = malloc(QP_ENCODE_MAX(DATA_SIZE));
+	char *ref = malloc(BASE64_ENCODE_MAX(DATA_SIZE));
+	unsigned char *decoded = malloc(BASE64_DECODE_MAX(QP_ENCODE_MAX(DATA_SIZE)));
+	if (!data || !text || !encoded || !ref || !decoded) {
+		fprintf(stderr, "Cannot allocate buffers\n");
+		return EXIT_FAILURE;
+	}
+	srand(42);
+	for (size_t i = 0; i < DATA_SIZE; i++) {
+		data[i] = rand();
+		// Mostly printable text, with a few lines and accents
+		int const r = rand() % 100;
+		text[i] = r < 2 ? '\n' : r < 15 ? ' ' : r < 17 ? (char)0xe9 : 'a' + r % 26;
+	}
+	size_t const ref_len = b64_encode_all(ref, data, DATA_SIZE);
+
+	int ret = EXIT_SUCCESS;
+	for (enum codec_impl impl = CODEC_SCALAR; impl <= CODEC_AVX2; impl++) {
+		if (codec_set_impl(impl) != impl) continue;
+		double best_enc = 1e9, best_dec = 1e9;
+		for (unsigned run = 0; run < NB_RUNS; run++) {
+			double const t0 = now();
+			size_t const len = b64_encode_all(encoded, data, DATA_SIZE);
+			double const t1 = now();
+			size_t const dlen = b64_decode_all(decoded, encoded, len);
+			double const t2 = now();
+			if (len != ref_len || 0 != memcmp(encoded, ref, len) || dlen != DATA_SIZE || 0 != memcmp(decoded, data, DATA_SIZE)) {
+				fprintf(stderr, "%s base64 codec gives wrong results !\n", codec_impl_name(impl));
+				ret = EXIT_FAILURE;
+			}
+			if (t1 - t0 < best_enc) best_enc = t1 - t0;
+			if (t2 - t1 < best_dec) best_dec = t2 - t1;
+		}
+		report("b64 encode", impl, best_enc, DATA_SIZE);
+		report("b64 decode", impl, best_dec, DATA_SIZE);
+	}
+
+	double best_enc = 1e9, best_dec = 1e9;
+	for (unsigned run = 0; run < NB_RUNS; run++) {
+		double const t0 = now();
+		size_t const len = qp_encode_all(encoded, (unsigned char *)text, DATA_SIZE);
+		double const t1 = now();
+		(void)qp_decode_all((char *)decoded, encoded, len);
+		double const t2 = now();
+		if (t1 - t0 < best_enc) best_enc = t1 - t0;
+		if (t2 - t1 < best_dec) best_dec = t2 - t1;
+	}
+	report("qp encode", CODEC_SCALAR, best_enc, DATA_SIZE);
+	report("qp decode", CODEC_SCALAR, best_dec, DATA_SIZE);
+
+	free(data);
+	free(text);
+	free(encoded);
+	free(ref);
+	free(decoded);
+	error_end();
+	return ret;
+}
@@ -65,6 +65,12 @@ static void make_pidfile(void)
 	(void)close(fd);
 }
 
+static void reopen_log(int sig)
+{
+	(void)sig;
+	log_reopen();
+}
+
 void daemonize(char const *log_ident)
 {
 	if (conf_get_str("SC_DEBUG")) return;
@@ -78,6 +84,10 @@ void daemonize(char const *log_ident)
 	if (sigaction(SIGHUP, &sa, NULL) < 0) with_error(errno, "sigaction") return;
 	if ((pid = fork()) < 0) with_error(errno, "fork[2]") return;
 	if (pid != 0) exit(0);
+	// Without a terminal, HUP is used to reopen the log file
+	sa.sa_handler = reopen_log;
+	sa.sa_flags = SA_RESTART;
+	if (sigaction(SIGHUP, &sa, NULL) < 0) with_error(errno, "sigaction") return;
 	if (chdir("/") < 0) with_error(errno, "chdir(/)") return;
 	for (int i=0; i<=2; i++) {
 		if (close(i) < 0) with_error(errno, "close(%d)", i) return;
@@ -15,9 +15,22 @@
  * You should have received a copy of the GNU Affero General Public License
  * along with Scambio.  If not, see <http://www.gnu.org/licenses/>.
  */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <pth.h>
 #include "digest.h"
 #include "scambio.h"
+#include "misc.h"
+
+#define DIGEST_CHUNK_SIZE (1024*1024)	// files are read by chunks of 1MB
+#define DIGEST_MAX_WORKERS 32
 
 static char tohex(unsigned i)
 {
@@ -37,37 +50,70 @@ static size_t stringify(char *str_, size_t digest_bytes, unsigned char const *di
 	return str - str_;
 }
 
+/*
+ * Digest implementations
+ *
+ * Beware that these functions may be called from worker threads, which
+ * are not pth threads and thus cannot use the error/log facilities.
+ */
+
+struct digest_ops {
+	size_t state_size;
+	int (*init)(void *state);	// returns 0 or an errno
+	void (*update)(void *state, void const *data, size_t len);
+	size_t (*final)(void *state, unsigned char *out);	// returns the number of bytes written
+};
+
 #if HAVE_LIBGNUTLS
 
 #include <gnutls/gnutls.h>
-size_t digest(char *out, size_t len, char const *in)
+#include <gnutls/crypto.h>
+static int sha1_init(void *state)
 {
-	gnutls_datum_t datum = {
-		.data = (unsigned char *)in,	// Oh mighty GNU please don't write in there
-		.size = len,
-	};
-	unsigned char result[MAX_DIGEST_LEN/2 +1];
-	size_t size = sizeof(result);
-	if (0 > gnutls_fingerprint(GNUTLS_DIG_SHA1, &datum, result, &size)) {
-		fatal("The digest function that can't fail failed. Think how few people can see this message !");
-	}
-	return stringify(out, size, result);
+	return gnutls_hash_init(state, GNUTLS_DIG_SHA1) < 0 ? EINVAL : 0;
+}
+static void sha1_update(void *state, void const *data, size_t len)
+{
+	(void)gnutls_hash(*(gnutls_hash_hd_t *)state, data, len);
 }
+static size_t sha1_final(void *state, unsigned char *out)
+{
+	gnutls_hash_deinit(*(gnutls_hash_hd_t *)state, out);
+	return gnutls_hash_get_len(GNUTLS_DIG_SHA1);
+}
+#define SHA1_STATE_SIZE sizeof(gnutls_hash_hd_t)
 
 #elif HAVE_LIBSSL
 
-#include <openssl/sha.h>
-size_t digest(char *out, size_t len, char const *in)
+#include <openssl/evp.h>
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#	define EVP_MD_CTX_new EVP_MD_CTX_create
+#	define EVP_MD_CTX_free EVP_MD_CTX_destroy
+#endif
+static int sha1_init(void *state)
+{
+	EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+	if (! ctx) return ENOMEM;
+	if (! EVP_DigestInit_ex(ctx, EVP_sha1(), NULL)) {
+		EVP_MD_CTX_free(ctx);
+		return EINVAL;
+	}
+	*(EVP_MD_CTX **)state = ctx;
+	return 0;
+}
+static void sha1_update(void *state, void const *data, size_t len)
+{
+	(void)EVP_DigestUpdate(*(EVP_MD_CTX **)state, data, len);
+}
+static size_t sha1_final(void *state, unsigned char *out)
 {
-	/* FIXME: 
-	 * "The EVP interface to message digests should almost always be used in preference to the low level interfaces. This is
-	 *  because the code then becomes transparent to the digest used and much more flexible."
-	 */
-	assert(MAX_DIGEST_LEN >= SHA_DIGEST_LENGTH*2);	// we use standard 4 bytes per character representation
-	unsigned char compact_digest[SHA_DIGEST_LENGTH];
-	(void)SHA1((unsigned char const *)in, len, compact_digest);
-	return stringify(out, sizeof(compact_digest), compact_digest);
+	EVP_MD_CTX *ctx = *(EVP_MD_CTX **)state;
+	unsigned len = 0;
+	(void)EVP_DigestFinal_ex(ctx, out, &len);
+	EVP_MD_CTX_free(ctx);
+	return len;
 }
+#define SHA1_STATE_SIZE sizeof(EVP_MD_CTX *)
 
 #else
 
@@ -75,29 +121,213 @@ size_t digest(char *out, size_t len, char const *in)
 
 #endif
 
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-#include <unistd.h>
-#include "misc.h"
+static struct digest_ops const digest_ops[] = {
+	[DIGEST_SHA1] = { .state_size = SHA1_STATE_SIZE, .init = sha1_init, .update = sha1_update, .final = sha1_final },
+};
+
+struct digest_ctx {
+	struct digest_ops const *ops;
+	union {	// the state of the digest follows, suitably aligned
+		long long ll;
+		long double ld;
+		void *p;
+	} state[];
+};
+
+static int ctx_new(struct digest_ctx **ctx, enum digest_type type)
+{
+	assert(type < sizeof_array(digest_ops));
+	struct digest_ops const *ops = digest_ops + type;
+	*ctx = malloc(sizeof(**ctx) + ops->state_size);
+	if (! *ctx) return ENOMEM;
+	(*ctx)->ops = ops;
+	int err = ops->init((*ctx)->state);
+	if (err) {
+		free(*ctx);
+		*ctx = NULL;
+	}
+	return err;
+}
+
+static size_t ctx_final(struct digest_ctx *ctx, char *out)
+{
+	unsigned char compact_digest[MAX_DIGEST_LEN/2];	// we use standard 2 chars per byte representation
+	size_t len = ctx->ops->final(ctx->state, compact_digest);
+	assert(len <= sizeof(compact_digest) && len*2 <= MAX_DIGEST_STRLEN);
+	free(ctx);
+	return stringify(out, len, compact_digest);
+}
+
+// Returns 0 or an errno. buf must be DIGEST_CHUNK_SIZE bytes long.
+static int digest_fd(char *out, size_t *out_len, int fd, unsigned char *buf)
+{
+	struct digest_ctx *ctx;
+	int err = ctx_new(&ctx, DIGEST_DEFAULT);
+	if (err) return err;
+#	ifdef POSIX_FADV_SEQUENTIAL
+	(void)posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#	endif
+	while (1) {
+		ssize_t ret = read(fd, buf, DIGEST_CHUNK_SIZE);
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+			err = errno;
+			break;
+		}
+		if (ret == 0) break;
+		ctx->ops->update(ctx->state, buf, ret);
+	}
+	size_t len = ctx_final(ctx, out);
+	if (err) return err;
+	if (out_len) *out_len = len;
+	return 0;
+}
+
+// Returns 0 or an errno.
+static int digest_path(char *out, size_t *out_len, char const *filename, unsigned char *buf)
+{
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) return errno;
+	int err = digest_fd(out, out_len, fd, buf);
+	(void)close(fd);
+	return err;
+}
+
+/*
+ * Public API
+ */
+
+struct digest_ctx *digest_new(enum digest_type type)
+{
+	struct digest_ctx *ctx;
+	int err = ctx_new(&ctx, type);
+	if (err) with_error(err, "Cannot init digest") return NULL;
+	return ctx;
+}
+
+void digest_update(struct digest_ctx *ctx, void const *data, size_t len)
+{
+	ctx->ops->update(ctx->state, data, len);
+}
+
+size_t digest_final(struct digest_ctx *ctx, char *out)
+{
+	return ctx_final(ctx, out);
+}
+
+size_t digest(char *out, size_t len, char const *in)
+{
+	struct digest_ctx *ctx;
+	if (0 != ctx_new(&ctx, DIGEST_DEFAULT)) {
+		fatal("The digest function that can't fail failed. Think how few people can see this message !");
+	}
+	ctx->ops->update(ctx->state, in, len);
+	return ctx_final(ctx, out);
+}
 
 size_t digest_file(char *out, char const *filename)
 {
 	debug("filename='%s'", filename);
+	unsigned char *buf = Malloc(DIGEST_CHUNK_SIZE);
 	size_t ret = 0;
-	// Stupid method : read the whole file in RAM, then compute its digest
-	int fd = open(filename, O_RDONLY);
-	if (fd < 0) with_error(errno, "open(%s)", filename) return 0;
-	do {
-		off_t size = filesize(fd);
-		on_error break;
-		char *in = malloc(size);
-		if (! in) with_error(ENOMEM, "malloc file %s", filename) break;
-		Read(in, fd, size);
-		unless_error ret = digest(out, size, in);
-		free(in);
-	} while (0);
-	(void)close(fd);
+	int err = digest_path(out, &ret, filename, buf);
+	free(buf);
+	if (err) with_error(err, "Cannot digest %s", filename) return 0;
 	return ret;
 }
 
+/*
+ * Batch digests
+ */
+
+struct digest_job {
+	pthread_mutex_t mutex;
+	unsigned next;	// next file to process
+	unsigned nb_files;
+	char const *const *filenames;
+	char (*outs)[MAX_DIGEST_STRLEN+1];
+	int *errs;
+	int done_fd;	// each worker writes one byte there when it's done
+};
+
+static void *digest_worker(void *job_)
+{
+	struct digest_job *job = job_;
+	unsigned char *buf = malloc(DIGEST_CHUNK_SIZE);
+	while (1) {
+		(void)pthread_mutex_lock(&job->mutex);
+		unsigned f = job->next;
+		if (f < job->nb_files) job->next ++;
+		(void)pthread_mutex_unlock(&job->mutex);
+		if (f >= job->nb_files) break;
+		job->outs[f][0] = '\0';
+		job->errs[f] = buf ? digest_path(job->outs[f], NULL, job->filenames[f], buf) : ENOMEM;
+	}
+	free(buf);
+	char c = 0;
+	if (job->done_fd != -1) while (write(job->done_fd, &c, 1) < 0 && errno == EINTR) ;
+	return NULL;
+}
+
+static unsigned nb_cpus(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 1) return 1;
+	if (n > DIGEST_MAX_WORKERS) return DIGEST_MAX_WORKERS;
+	return n;
+}
+
+unsigned digest_files(unsigned nb_files, char const *const *filenames, char (*outs)[MAX_DIGEST_STRLEN+1], int *errs)
+{
+	unsigned nb_workers = nb_cpus();
+	if (nb_workers > nb_files) nb_workers = nb_files;
+	debug("%u files with %u workers", nb_files, nb_workers);
+	struct digest_job job = {
+		.next = 0, .nb_files = nb_files, .filenames = filenames,
+		.outs = outs, .errs = errs,
+	};
+	pthread_t workers[DIGEST_MAX_WORKERS];
+	int pipe_fds[2] = { -1, -1 };
+	if (nb_workers > 1 && 0 != pipe(pipe_fds)) nb_workers = 1;
+	if (nb_workers <= 1) {	// no need for threads
+		unsigned char *buf = Malloc(DIGEST_CHUNK_SIZE);
+		for (unsigned f = 0; f < nb_files; f++) {
+			outs[f][0] = '\0';
+			errs[f] = digest_path(outs[f], NULL, filenames[f], buf);
+			pth_yield(NULL);
+		}
+		free(buf);
+		goto count;
+	}
+	(void)pthread_mutex_init(&job.mutex, NULL);
+	job.done_fd = pipe_fds[1];
+	unsigned nb_started = 0;
+	for (; nb_started < nb_workers; nb_started++) {
+		if (0 != pthread_create(workers+nb_started, NULL, digest_worker, &job)) break;
+	}
+	if (nb_started == 0) {	// do it ourself then
+		job.done_fd = -1;
+		(void)digest_worker(&job);
+	}
+	// Wait for our workers while letting other pth threads run
+	for (unsigned nb_done = 0; nb_done < nb_started; ) {
+		char c[DIGEST_MAX_WORKERS];
+		ssize_t ret = pth_read(pipe_fds[0], c, nb_started - nb_done);
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+			fatal("Cannot wait for digest workers : %s", strerror(errno));
+		}
+		nb_done += ret;
+	}
+	for (unsigned w = 0; w < nb_started; w++) (void)pthread_join(workers[w], NULL);
+	(void)pthread_mutex_destroy(&job.mutex);
+	(void)close(pipe_fds[0]);
+	(void)close(pipe_fds[1]);
+count:;
+	unsigned nb_ok = 0;
+	for (unsigned f = 0; f < nb_files; f++) {
+		if (errs[f]) debug("Cannot digest %s : %s", filenames[f], strerror(errs[f]));
+		else nb_ok ++;
+	}
+	return nb_ok;
+}
@@ -30,7 +30,33 @@
 size_t digest(char *out, size_t len, char const *in);
 
 /* This one may report an error.
+ * The file is read by chunks, so it can be arbitrarily large.
  */
 size_t digest_file(char *out, char const *filename);
 
+/* Compute the digests of several files at once, using as many worker threads
+ * as there are CPUs. Workers run outside of pth, but the calling pth thread
+ * only yields while waiting, so other pth threads keep running.
+ * outs[i] receives the digest of filenames[i], or an empty string if errs[i] is
+ * set to a non nul errno.
+ * Returns the number of successfully computed digests.
+ */
+unsigned digest_files(unsigned nb_files, char const *const *filenames, char (*outs)[MAX_DIGEST_STRLEN+1], int *errs);
+
+/* Incremental digests.
+ * Feed the data with digest_update() as many times as needed, then
+ * digest_final() returns the same string than digest() would have on the
+ * whole data, and frees the digest_ctx.
+ */
+enum digest_type {
+	DIGEST_SHA1,
+	// Add new types along with their digest_ops in digest.c
+};
+#define DIGEST_DEFAULT DIGEST_SHA1
+
+struct digest_ctx;
+struct digest_ctx *digest_new(enum digest_type type);
+void digest_update(struct digest_ctx *ctx, void const *data, size_t len);
+size_t digest_final(struct digest_ctx *ctx, char *out);
+
 #endif
@@ -15,65 +15,343 @@
  * You should have received a copy of the GNU Affero General Public License
  * along with Scambio.  If not, see <http://www.gnu.org/licenses/>.
  */
+/*
+ * Logs
+ *
+ * When logging to a file, log_print() merely formats the record into a ring of
+ * preformatted records, which a dedicated system thread writes by batches, so
+ * that a pth thread that logs (and all the others with it) never waits for the
+ * disk. Producers reserve their slot with an atomic compare and swap, and each
+ * slot has a sequence number telling the writer when it's ready (and producers
+ * when it's free again), so that there is no lock on this path.
+ * When the ring is full records are dropped (and counted), unless SC_LOG_BLOCK
+ * is set. The log file is reopened by log_reopen() (on SIGHUP once daemonized).
+ * Without a log file, records are printed on stdout at once.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
 #include <limits.h>
 #include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include "scambio.h"
 #include "log.h"
 #include "misc.h"
 
 /*
- * Public Functions
+ * Data Definitions
  */
 
-FILE *log_file = NULL;
+#define RING_SIZE 2048	// number of records, must be a power of 2
+#define RECORD_SIZE 512	// longer records are truncated
+#define BATCH_SIZE 65536	// write at most that much at once
+#define FLUSH_PERIOD_NS 100000000	// the writer wakes up at least every .1s
+#define FLUSH_TIMEOUT 1000	// log_flush() waits at most that many ms
+
+struct record {
+	unsigned long seq;	// pos when free for the producer at pos, pos+1 once ready for the writer
+	unsigned len;
+	char line[RECORD_SIZE];
+};
+
 int log_level = 3;
 static char file_path[PATH_MAX];
+static int log_fd = -1;
+static struct record *ring;	// NULL if we are not logging into a file
+static unsigned long head;	// next position to reserve (producers)
+static unsigned long tail;	// next position to write (writer)
+static unsigned long nb_dropped;
+static bool block_when_full;
+static volatile sig_atomic_t reopen_asked;
+static bool writer_running, writer_quit;
+static pthread_t writer;
+static pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;	// protects writer_quit
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;	// signaled to wake the writer up
+
+/*
+ * Log file
+ */
+
+static int open_log(void)
+{
+	int fd = open(file_path, O_WRONLY|O_APPEND|O_CREAT, 0666);
+	if (fd < 0) return -errno;
+	if (log_fd != -1) (void)close(log_fd);
+	log_fd = fd;
+	return 0;
+}
 
 static void close_log(void)
 {
-	if (log_file) {
-		(void)fclose(log_file);
-		log_file = NULL;
+	if (log_fd != -1) {
+		(void)close(log_fd);
+		log_fd = -1;
 	}
 }
-static int open_log(void)
+
+// Returns the length of the timestamp
+static size_t timestamp(char *buf, size_t size, time_t now)
 {
-	close_log();
-	log_file = fopen(file_path, "a");
-	if (! log_file) return -errno;
-	info("Start login with log level = %d", log_level);
+	struct tm tm;
+	return strftime(buf, size, "%F %T: ", localtime_r(&now, &tm));
+}
+
+/*
+ * Writer
+ */
+
+static void write_batch(char const *batch, size_t len)
+{
+	while (len > 0) {
+		ssize_t ret = write(log_fd, batch, len);
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+			return;	// and who would we tell ?
+		}
+		batch += ret;
+		len -= ret;
+	}
+}
+
+static void drain(char *batch)
+{
+	size_t used = 0;
+	while (1) {
+		struct record *r = ring + (tail & (RING_SIZE-1));
+		if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != tail + 1) break;	// not ready yet
+		if (used + r->len > BATCH_SIZE) {
+			write_batch(batch, used);
+			used = 0;
+		}
+		memcpy(batch + used, r->line, r->len);
+		used += r->len;
+		__atomic_store_n(&r->seq, tail + RING_SIZE, __ATOMIC_RELEASE);	// free for the producer one lap later
+		__atomic_store_n(&tail, tail + 1, __ATOMIC_RELEASE);
+	}
+	unsigned long const dropped = __atomic_exchange_n(&nb_dropped, 0, __ATOMIC_RELAXED);
+	if (dropped > 0) {
+		if (used + RECORD_SIZE > BATCH_SIZE) {
+			write_batch(batch, used);
+			used = 0;
+		}
+		used += timestamp(batch + used, RECORD_SIZE, time(NULL));
+		used += snprintf(batch + used, RECORD_SIZE/2, "WRN: %lu log records were dropped\n", dropped);
+	}
+	write_batch(batch, used);
+}
+
+static void *writer_thread(void *batch)
+{
+	(void)pthread_mutex_lock(&writer_mutex);
+	while (1) {
+		bool const quit = writer_quit;
+		(void)pthread_mutex_unlock(&writer_mutex);
+		if (__atomic_exchange_n(&reopen_asked, 0, __ATOMIC_RELAXED)) {
+			(void)open_log();	// if it fails we keep the old one
+		}
+		drain(batch);
+		(void)pthread_mutex_lock(&writer_mutex);
+		if (quit) break;
+		if (writer_quit) continue;	// drain once more
+		struct timespec ts;
+		(void)clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += FLUSH_PERIOD_NS;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec ++;
+			ts.tv_nsec -= 1000000000;
+		}
+		(void)pthread_cond_timedwait(&writer_cond, &writer_mutex, &ts);
+	}
+	(void)pthread_mutex_unlock(&writer_mutex);
+	free(batch);
+	return NULL;
+}
+
+static void wake_writer(void)
+{
+	(void)pthread_cond_signal(&writer_cond);
+}
+
+static int start_writer(void)
+{
+	writer_quit = false;
+	void *batch = malloc(BATCH_SIZE);
+	if (! batch) return -ENOMEM;
+	int err = pthread_create(&writer, NULL, writer_thread, batch);
+	if (err) {
+		free(batch);
+		return -err;
+	}
+	writer_running = true;
 	return 0;
 }
 
+static void stop_writer(void)
+{
+	if (! writer_running) return;
+	(void)pthread_mutex_lock(&writer_mutex);
+	writer_quit = true;
+	(void)pthread_mutex_unlock(&writer_mutex);
+	wake_writer();
+	(void)pthread_join(writer, NULL);
+	writer_running = false;
+}
+
+// Threads do not survive a fork : flush everything before, and start a new writer in the child.
+static void before_fork(void)
+{
+	log_flush();
+	(void)pthread_mutex_lock(&writer_mutex);
+}
+
+static void after_fork_parent(void)
+{
+	(void)pthread_mutex_unlock(&writer_mutex);
+}
+
+static void after_fork_child(void)
+{
+	(void)pthread_mutex_unlock(&writer_mutex);
+	if (writer_running && 0 != start_writer()) writer_running = false;
+}
+
+/*
+ * Producers
+ */
+
+// Returns a free record (which position is stored in pos), or NULL if the ring is full
+static struct record *reserve(unsigned long *pos)
+{
+	*pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+	while (1) {
+		struct record *r = ring + (*pos & (RING_SIZE-1));
+		long const diff = (long)(__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) - *pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&head, pos, *pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) return r;
+			// else pos was reloaded
+		} else if (diff < 0) {	// the writer did not free this one yet
+			return NULL;
+		} else {	// another producer took it
+			*pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+// The timestamp changes only once a second, while there can be thousands of records.
+// Each thread has its own cache, since a few helpers run in system threads.
+static size_t cached_timestamp(char *buf)
+{
+	static __thread time_t last = (time_t)-1;
+	static __thread char str[32];
+	static __thread size_t len;
+	time_t const now = time(NULL);
+	if (now != last) {
+		len = timestamp(str, sizeof(str), now);
+		last = now;
+	}
+	memcpy(buf, str, len);
+	return len;
+}
+
+static void record(char const *fmt, va_list ap)
+{
+	unsigned long pos;
+	struct record *r;
+	while (NULL == (r = reserve(&pos))) {
+		if (! block_when_full || ! writer_running) {
+			__atomic_add_fetch(&nb_dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		wake_writer();
+		struct timespec const ts = { .tv_sec = 0, .tv_nsec = 1000000 };
+		(void)nanosleep(&ts, NULL);
+	}
+	size_t len = cached_timestamp(r->line);
+	int ret = vsnprintf(r->line + len, RECORD_SIZE - len, fmt, ap);
+	if (ret > 0) len += ret;
+	if (len > RECORD_SIZE - 1) len = RECORD_SIZE - 1;	// truncated
+	r->line[len++] = '\n';
+	r->len = len;
+	__atomic_store_n(&r->seq, pos + 1, __ATOMIC_RELEASE);
+	if (pos - __atomic_load_n(&tail, __ATOMIC_RELAXED) >= RING_SIZE/2) wake_writer();	// do not wait for the period
+}
+
+/*
+ * Public Functions
+ */
+
 int log_begin(char const *dirname, char const *filename)
 {
 	if (!dirname || !filename) return 0;
 	if_fail (Mkdir(dirname)) return 0;
+	if_fail (conf_set_default_int("SC_LOG_BLOCK", 0)) return 0;
+	block_when_full = conf_get_int("SC_LOG_BLOCK");
 	snprintf(file_path, sizeof(file_path), "%s/%s.log", dirname, filename);
-	return open_log();
+	int err = open_log();
+	if (err) return err;
+	ring = malloc(RING_SIZE * sizeof(*ring));
+	if (! ring) {
+		err = ENOMEM;
+		goto q1;
+	}
+	for (unsigned long pos = 0; pos < RING_SIZE; pos++) ring[pos].seq = pos;
+	head = tail = 0;
+	static bool atfork_registered = false;
+	if (! atfork_registered) {
+		if (0 != (err = pthread_atfork(before_fork, after_fork_parent, after_fork_child))) goto q1;
+		atfork_registered = true;
+	}
+	if (0 != (err = -start_writer())) goto q1;
+	info("Start login with log level = %d", log_level);
+	return 0;
+q1:
+	free(ring);
+	ring = NULL;
+	close_log();
+	return -err;
 }
 
 void log_end(void)
 {
+	stop_writer();
+	if (ring) {
+		free(ring);
+		ring = NULL;
+	}
 	close_log();
 }
 
+void log_reopen(void)
+{
+	__atomic_store_n(&reopen_asked, 1, __ATOMIC_RELAXED);
+}
+
+void log_flush(void)
+{
+	if (! writer_running) return;
+	for (unsigned ms = 0; ms < FLUSH_TIMEOUT; ms++) {
+		if (__atomic_load_n(&tail, __ATOMIC_ACQUIRE) == __atomic_load_n(&head, __ATOMIC_RELAXED)) return;
+		wake_writer();
+		struct timespec const ts = { .tv_sec = 0, .tv_nsec = 1000000 };
+		(void)nanosleep(&ts, NULL);
+	}
+}
+
 void log_print(char const *fmt, ...)
 {
 	va_list ap;
 	va_start(ap, fmt);
-	if (log_file) {
-		char buf[24];
-		time_t t = time(NULL);
-		(void)strftime(buf, sizeof(buf), "%F %T", localtime(&t));
-		fprintf(log_file, "%s: ", buf);
-		vfprintf(log_file, fmt, ap);
-		fprintf(log_file, "\n");
-		fflush(log_file);
+	if (ring) {
+		record(fmt, ap);
 	} else {
 		vprintf(fmt, ap);
 		printf("\n");
 	}
 	va_end(ap);
 }
-
@@ -22,26 +22,25 @@
 #include <time.h>
 #include <stdlib.h>	// abort
 
-extern FILE *log_file;
 extern int log_level;
+/* If dirname and filename are set, log into dirname/filename.log from now on,
+ * through a dedicated writer thread (see log.c), otherwise log on stdout.
+ * Returns 0 or -errno.
+ */
 int log_begin(char const *dirname, char const *filename);
 void log_end(void);
+/* Ask the writer to reopen the log file (for logrotate). Can be called from a signal handler. */
+void log_reopen(void);
+/* Wait (a little) for the writer to write all the pending records. */
+void log_flush(void);
 
-#if 0
-#define log_print(fmt, ...) do if (log_file) { \
-	char buf[24]; \
-	time_t t = time(NULL); \
-	(void)strftime(buf, sizeof(buf), "%F %T", localtime(&t)); \
-	fprintf(log_file, "%s: "fmt "\n", buf, ##__VA_ARGS__); \
-	fflush(log_file); \
-} while(0)
-#endif
 void log_print(char const *fmt, ...)
 #ifdef __GNUC__
 	__attribute__ ((__format__ (__printf__, 1, 2)))
 #endif
 ;
 
+/* All these check the level before evaluating anything else. */
 #define error(...)      do if (log_level > 0) log_print("ERR: " __VA_ARGS__); while(0)
 #define error1(str)     do if (log_level > 0) log_print("ERR: %s", (str)); while(0)
 #define warning(...)    do if (log_level > 1) log_print("WRN: " __VA_ARGS__); while(0)
@@ -51,6 +50,6 @@ void log_print(char const *fmt, ...)
 #else
 #define debug(...)
 #endif
-#define fatal(...)      do { log_print("FATAL: " __VA_ARGS__); abort(); } while(0)
+#define fatal(...)      do { log_print("FATAL: " __VA_ARGS__); log_flush(); abort(); } while(0)
 
 #endif
@@ -69,9 +69,10 @@ void ReadFrom(void *buf, int fd, off_t offset, size_t len)
 	debug("ReadFrom(%p, %d, from=%u, len=%zu)", buf, fd, (unsigned)offset, len);
 	size_t done = 0;
 	while (done < len) {
-		ssize_t ret = pth_pread(fd, buf + done, len - done, offset + done);
+		// Not pth_pread(), which seeks the fd and thus the offset we share with forked processes
+		ssize_t ret = pread(fd, buf + done, len - done, offset + done);
 		if (ret < 0) {
-			if (! retryable(errno)) with_error(errno, "Cannot pth_pread") return;
+			if (! retryable(errno)) with_error(errno, "Cannot pread") return;
 			continue;
 		} else if (ret == 0) with_error(0, "EOF") return;
 		done += ret;
@@ -101,7 +102,7 @@ void WriteTo(int fd, off_t offset, void const *buf, size_t len)
 	debug("WriteTo(%d, %u, %p, %zu)", fd, (unsigned)offset, buf, len);
 	size_t done = 0;
 	while (done < len) {
-		ssize_t ret = pth_pwrite(fd, buf + done, len - done, offset);
+		ssize_t ret = pwrite(fd, buf + done, len - done, offset + done);	// same as above
 		if (ret < 0) {
 			// FIXME: truncate on short writes
 			if (! retryable(errno)) with_error(errno, "Cannot write %zu bytes", len-done) return;
@@ -88,16 +88,21 @@ void persist_write(struct persist *p, void *buf)
 	WriteTo(p->fd, 0, buf, p->size);
 }
 
-uint64_t persist_read_inc_sequence(struct persist *p)
+uint64_t persist_read_add_sequence(struct persist *p, uint64_t nb)
 {
 	uint64_t count;
 	if_fail (persist_lock(p)) return 0;
 	do {
 		count = *(uint64_t const *)persist_read(p);
-		uint64_t new = count+1;
+		uint64_t new = count+nb;
 		persist_write(p, &new);
 	} while (0);
 	persist_unlock(p);
 	return count;
 }
 
+uint64_t persist_read_inc_sequence(struct persist *p)
+{
+	return persist_read_add_sequence(p, 1);
+}
+
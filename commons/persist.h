@@ -41,5 +41,7 @@ static inline void const *persist_read(struct persist *persist)
 
 void persist_write(struct persist *, void *);
 uint64_t persist_read_inc_sequence(struct persist *);
+// Reserve nb values at once, returning the first one
+uint64_t persist_read_add_sequence(struct persist *, uint64_t nb);
 
 #endif
@@ -71,7 +71,7 @@ static void nulterm(struct varbuf *vb)
 
 void varbuf_put(struct varbuf *vb, size_t size)
 {
-	if (vb->used + size > vb->actual) {
+	if (vb->used + size >= vb->actual) {	// we need one more byte for the nul
 		size_t inc = vb->used + size - vb->actual;
 		varbuf_make_room(vb, vb->actual + inc + (inc + 1)/2);	// will make room for one more byte
 		on_error return;
@@ -22,7 +22,8 @@
  * is reciprocal : any peer can send or receive data on a channel.
  * The only exception is that only the client can create a channel and is
  * required to auth. Also, the client asks for the transfert (write/read command).
- * Then, the transfert itself (copy, skip, miss) is reciprocal.
+ * Then, the transfert itself (copy, skip, miss) is reciprocal, except for the
+ * refs to a previous version of an uploaded file (delta, ref).
  * So the same parser can be used on the client (a plugin) than on the channel
  * server.
  */
@@ -55,8 +56,17 @@ struct chn_cnx {
 	pth_t reader;
 	LIST_HEAD(chn_txs, chn_tx) txs;
 	int status;
+	// Uploads : at most max_writes write commands/TXs may be in flight at the same time (SC_CHN_MAX_WRITES)
+	unsigned nb_writes, max_writes;
+	pth_cond_t writes_cond;	// signaled whenever a write completes
+	pth_mutex_t writes_mutex;
 };
 
+/* Called once a transfert is over, with its final status (200 if successfull).
+ * tx is NULL if the transfert could not even start.
+ */
+typedef void chn_tx_cb(struct chn_tx *tx, int status, void *data);
+
 void chn_cnx_ctor_outbound(struct chn_cnx *cnx, char const *host, char const *service, char const *username);
 void chn_cnx_ctor_inbound(struct chn_cnx *cnx, int fd);
 void chn_cnx_dtor(struct chn_cnx *cnx);
@@ -68,8 +78,9 @@ void chn_cnx_del(struct chn_cnx *cnx);
 /* Will return the name of a file containing the full content.
  * (taken from the file cache).
  * If the cache lacks the file, it's downloaded first.
- * TODO: The file might be removed by the cache cleaner after this call
- * and before a subsequent open. Its touched to lower the risks.
+ * The file might be removed by the cache cleaner after this call
+ * and before a subsequent open, although recently accessed files are
+ * never evicted (see SC_FILES_CACHE_SIZE).
  * localfile must be at least MAX_PATH chars long.
  * Return the associated chn_tx, or NULL if the file was already local.
  */
@@ -86,11 +97,57 @@ void chn_send_file_request(struct chn_cnx *cnx, char const *fname, char *resourc
  */
 struct chn_tx *chn_send_file(struct chn_cnx *cnx, char const *resource);
 
+/* Same as above, but do not wait for anything (unless there are already too many
+ * uploads in flight on this cnx). cb will be called (by the cnx reader thread)
+ * when the upload is over. cnx must not be NULL.
+ */
+void chn_send_file_request_async(struct chn_cnx *cnx, char const *fname, char *resource, chn_tx_cb *cb, void *cb_data);
+void chn_send_file_async(struct chn_cnx *cnx, char const *resource, chn_tx_cb *cb, void *cb_data);
+
+/* Same as chn_send_file_request_async(), for a new version of the file which
+ * previous version is the resource base. If base is still in the cache the file
+ * is sent as a delta against it (ie. only what's not in base is sent), and
+ * the file server rebuilds the new resource from its own copy of base.
+ * If the file server has no such base the whole file is sent.
+ * Beware that base must be the previous content as the file server knows it.
+ * If this upload fails, it will be retried by chn_send_all() as a whole file.
+ */
+void chn_send_delta_request_async(struct chn_cnx *cnx, char const *fname, char *resource, char const *base, chn_tx_cb *cb, void *cb_data);
+
+/* Create a new resource in the cache, and return a file descriptor opened
+ * for writing its content (so that producers do not need an intermediate file).
+ * Will fill resource with the resource name (up to PATH_MAX chars).
+ * The fd must then be given back to either chn_resource_close() or chn_resource_abort().
+ */
+int chn_resource_create(char *resource);
+
+/* Close the fd of a new resource, and register the resource in the putdir.
+ * If cnx is not NULL its upload is started at once (and it's removed from the
+ * putdir once uploaded), otherwise it's left for a later chn_send_all().
+ * cb (which may be NULL) is called when the upload is over, as for chn_send_file_async().
+ */
+void chn_resource_close(struct chn_cnx *cnx, int fd, char const *resource, chn_tx_cb *cb, void *cb_data);
+
+/* Close the fd of a new resource and remove it from the cache. Throws no error.
+ */
+void chn_resource_abort(int fd, char const *resource);
+
 /* Send all local files (in the cache) that were not already sent to the file server.
- * Returns the number of files uploaded.
+ * Uploads are pipelined : this returns once all of them are started, and each file
+ * is removed from the putdir once its upload is over.
+ * Returns the number of uploads started.
  */
 unsigned chn_send_all(struct chn_cnx *cnx);
 
+/* Client side file cache statistics.
+ * max_bytes is 0 if the cache size is not bounded.
+ */
+struct chn_cache_stats {
+	unsigned long long hits, misses, evictions;
+	long long evicted_bytes, used_bytes, max_bytes;
+};
+void chn_cache_stats(struct chn_cache_stats *stats);
+
 /* Low level API */
 
 /* Since there are retransmissions data may be required to be send more than once. But we do not want
@@ -130,7 +187,23 @@ static inline void *chn_box_unbox(struct chn_box *box) { return box->data; }
  * Notes for the receiving peer :
  *
  */
+/* Sets of byte ranges used by the TXs.
+ * chn_ranges is a set of disjoint ranges sorted by offset, adjacent or overlapping
+ * ranges being merged on insertion, so that lookups are done by binary search.
+ * chn_frags is a pool of sent fragments (with their data), ordered by offset,
+ * managed as a ring buffer since fragments are appended at the end and timeouted
+ * from the beginning.
+ */
+struct chn_range;
+struct chn_ranges {
+	unsigned nb, size;
+	struct chn_range *ranges;
+};
 struct fragment;
+struct chn_frags {
+	unsigned first, nb, size;
+	struct fragment *frags;
+};
 struct chn_tx {
 	struct chn_cnx *cnx;	// backlink
 	LIST_ENTRY(chn_tx) cnx_entry;
@@ -141,11 +214,18 @@ struct chn_tx {
 	struct stream *stream;	// the associated stream
 	LIST_ENTRY(chn_tx) reader_entry;	// if stream is set and this stream is a sender, then it's one of this stream readers.
 	// Fragments and misses are ordered by offset
-	TAILQ_HEAD(fragments_queue, fragment) out_frags;	// Fragments that goes out (ie for sender) 
-	struct fragments_queue in_frags;	// all received miss (for sender) of fragments (for receiver)
+	struct chn_frags out_frags;	// Fragments that goes out (ie for sender) 
+	struct chn_ranges in_frags;	// all received miss (for sender) of fragments (for receiver)
 	pth_t pth;	// a thread to check for missed data
 	uint_least64_t ts;	// reset at creation or when we ask for first fragment
 	struct mdir_sent_query sent_thx;
+	chn_tx_cb *cb;	// called when the status is set, if not NULL
+	void *cb_data;
+	bool async;	// nobody waits for this TX : the channel deletes it once its status is set
+	bool writing;	// a chn_tx_write() is in progress (so the TX must not be deleted yet)
+	chn_tx_cb *progress_cb;	// for receivers, called (with status 0) whenever chn_tx_received() grows, if not NULL
+	void *progress_data;
+	int base_fd;	// for receivers of a delta, the previous version the refs point into (-1 otherwise)
 };
 
 /* Start a new tx for sending data (once the read/write command have been acked)
@@ -168,6 +248,11 @@ void chn_tx_ctor_receiver(struct chn_tx *tx, struct chn_cnx *, long long id, str
  */
 void chn_tx_write(struct chn_tx *tx, size_t length, struct chn_box *box, bool eof);
 
+/* Same as above, but instead of data send a reference to the same amount of data
+ * found at base_offset in the base of this TX (see chn_send_delta_request_async()).
+ */
+void chn_tx_write_ref(struct chn_tx *tx, size_t length, off_t base_offset, bool eof);
+
 /* Return the next data block received (not necessarily in sequence).
  * This is allocated in a box so that you can rewrite it to another channel if you wish,
  * but when returned you own the only ref to it.
@@ -182,6 +267,11 @@ struct chn_box *chn_tx_read(struct chn_tx *tx, off_t *offset, size_t *length, bo
  */
 int chn_tx_status(struct chn_tx *tx);
 
+/* For a receiving TX, tells how many bytes from the beginning of the file
+ * were received so far (and are thus readable from the cache file).
+ */
+off_t chn_tx_received(struct chn_tx *tx);
+
 /* Once you are done with the transfert, free it
  */
 void chn_tx_dtor(struct chn_tx *tx);
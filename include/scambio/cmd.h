@@ -99,6 +99,12 @@ static inline void mdir_syntax_unregister(struct mdir_syntax *syntax, struct mdi
  */
 void mdir_cmd_read(struct mdir_syntax *syntax, int fd, void *user_data);
 
+/* Same as above, for a line that was already read by the caller (for
+ * instance from its own buffer). The line is modified in place.
+ */
+struct varbuf;
+void mdir_cmd_parse(struct mdir_syntax *syntax, struct varbuf *vb, void *user_data);
+
 #include <stdlib.h>
 static inline void mdir_cmd_dtor(struct mdir_cmd *cmd)
 {
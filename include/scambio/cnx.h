@@ -37,6 +37,8 @@ extern char const kw_copy[];
 extern char const kw_skip[];
 extern char const kw_miss[];
 extern char const kw_thx[];
+extern char const kw_delta[];
+extern char const kw_ref[];
 
 /* Struct mdir_cnx describe a connection following mdir protocol.
  * Client and server are assymetric but similar.
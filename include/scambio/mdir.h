@@ -129,9 +129,13 @@ mdir_version mdir_patch(struct mdir *, enum mdir_action, struct header *, unsign
 // client, since it still can add patches to this directory, even patches that
 // creates other directories, for patches are added to names and not to dirId.
 void mdir_patch_request(struct mdir *, enum mdir_action, struct header *);
+// Same as above for several patches at once, which is cheaper (transient versions
+// are reserved in one go). On error, the first patches may have been requested.
+void mdir_patch_request_many(struct mdir *, enum mdir_action, unsigned nb, struct header *const *headers);
 // This is a helper to request a patch that will remove the patch identified
 // with this version
 void mdir_del_request(struct mdir *mdir, mdir_version to_del);
+void mdir_del_request_many(struct mdir *mdir, unsigned nb, mdir_version const *to_del);
 
 // Returns the version of the patch that created this mountpoint on mdir.
 // (usefull to delete it).
@@ -159,6 +163,14 @@ void mdir_patch_list(
 	void (*err_cb)(struct mdir *, struct header *, mdir_version, void *),
 	void *data);
 
+// Same as above, but for synched patches only, and stops after max patches (if max > 0) ;
+// the cursor then tells where to resume. Returns the number of patches listed.
+unsigned mdir_patch_list_synched(
+	struct mdir *, struct mdir_cursor *, unsigned max,
+	void (*put_cb)(struct mdir *, struct header *, mdir_version, void *data),
+	void (*rem_cb)(struct mdir *, mdir_version, void *),
+	void *data);
+
 // Forget about previous lists to restart listing all available patches.
 void mdir_patch_reset(struct mdir *);
 
@@ -0,0 +1,461 @@
+/* Copyright 2008 Cedric Cellier.
+ *
+ * This file is part of Scambio.
+ *
+ * Scambio is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Scambio is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with Scambio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pth.h>
+#include "scambio.h"
+#include "misc.h"
+#include "varbuf.h"
+#include "scambio/channel.h"
+#include "stream.h"
+#include "cache.h"
+
+/*
+ * Data Definitions
+ */
+
+#define CACHE_HASH_SIZE 1024
+#define CACHE_EVICT_PERIOD 30	// check the cache size every 30s at least
+#define CACHE_MIN_AGE 60	// never evict a resource accessed less than a minute ago
+#define CACHE_LOG_SLACK 1000	// compact the log when it holds that many useless records
+
+struct cache_entry {
+	LIST_ENTRY(cache_entry) h_entry;	// in the hash
+	TAILQ_ENTRY(cache_entry) lru_entry;	// in the LRU list, most recently used first
+	off_t size;
+	time_t last_access;
+	bool pinned;	// used by the evictor
+	char name[];
+};
+
+static bool enabled;	// false if no size limit was set
+static off_t max_bytes, used_bytes;
+static unsigned nb_entries;
+static LIST_HEAD(cache_bucket, cache_entry) hash[CACHE_HASH_SIZE];
+static TAILQ_HEAD(cache_lru, cache_entry) lru;
+static unsigned long long nb_hits, nb_misses, nb_evictions;
+static off_t evicted_bytes;
+
+static char log_path[PATH_MAX];
+static int log_fd = -1;
+static ino_t log_ino;
+static off_t log_offset;	// how far we already replayed the log
+static unsigned nb_log_records;
+
+static pth_t evictor;
+static pth_cond_t evict_cond;
+static pth_mutex_t evict_mutex;
+
+/*
+ * Index
+ */
+
+static unsigned hash_name(char const *name)
+{
+	unsigned h = 2166136261U;
+	while (*name) h = (h ^ (unsigned char)*name++) * 16777619U;
+	return h % CACHE_HASH_SIZE;
+}
+
+static struct cache_entry *entry_lookup(char const *name)
+{
+	struct cache_entry *e;
+	LIST_FOREACH(e, hash+hash_name(name), h_entry) {
+		if (0 == strcmp(e->name, name)) return e;
+	}
+	return NULL;
+}
+
+static void entry_del(struct cache_entry *e)
+{
+	LIST_REMOVE(e, h_entry);
+	TAILQ_REMOVE(&lru, e, lru_entry);
+	used_bytes -= e->size;
+	nb_entries --;
+	free(e);
+}
+
+// Set the size and access time of this resource, and make it the most recently used.
+// A negative size means the resource is gone.
+static void entry_set(char const *name, off_t size, time_t last_access)
+{
+	struct cache_entry *e = entry_lookup(name);
+	if (size < 0) {
+		if (e) entry_del(e);
+		return;
+	}
+	if (e) {
+		TAILQ_REMOVE(&lru, e, lru_entry);
+		used_bytes -= e->size;
+	} else {
+		size_t len = strlen(name) + 1;
+		e = Malloc(sizeof(*e) + len);
+		memcpy(e->name, name, len);
+		e->pinned = false;
+		LIST_INSERT_HEAD(hash+hash_name(name), e, h_entry);
+		nb_entries ++;
+	}
+	e->size = size;
+	e->last_access = last_access;
+	used_bytes += size;
+	TAILQ_INSERT_HEAD(&lru, e, lru_entry);
+}
+
+static int entry_cmp(void const *a_, void const *b_)
+{
+	struct cache_entry const *const *a = a_, *const *b = b_;
+	if ((*a)->last_access == (*b)->last_access) return 0;
+	return (*a)->last_access > (*b)->last_access ? -1 : 1;
+}
+
+// Used after the initial scan, which adds entries in directory order
+static void lru_sort(void)
+{
+	if (nb_entries < 2) return;
+	struct cache_entry **array = Malloc(nb_entries * sizeof(*array));
+	unsigned n = 0;
+	struct cache_entry *e;
+	TAILQ_FOREACH(e, &lru, lru_entry) array[n++] = e;
+	assert(n == nb_entries);
+	qsort(array, n, sizeof(*array), entry_cmp);
+	TAILQ_INIT(&lru);
+	for (unsigned i = 0; i < n; i++) TAILQ_INSERT_TAIL(&lru, array[i], lru_entry);
+	free(array);
+}
+
+static void scan_rec(char path[PATH_MAX])
+{
+	DIR *dir = opendir(path);
+	if (! dir) with_error(errno, "opendir(%s)", path) return;
+	struct dirent *dirent;
+	while (NULL != (dirent = readdir(dir))) {
+		if (dirent->d_name[0] == '.') continue;	// skip ., .., .put, .cache...
+		path_push(path, dirent->d_name);
+		struct stat statbuf;
+		if (0 != lstat(path, &statbuf)) {
+			error_push(errno, "lstat(%s)", path);
+		} else if (S_ISDIR(statbuf.st_mode)) {
+			scan_rec(path);
+		} else if (S_ISREG(statbuf.st_mode)) {
+			entry_set(path + chn_files_root_len + 1, statbuf.st_size, statbuf.st_mtime);
+		}
+		path_pop(path);
+		on_error break;
+	}
+	(void)closedir(dir);
+}
+
+/*
+ * Access Log
+ *
+ * Each line is "last_access size name", with size = -1 for removed resources.
+ * All processes sharing the files directory append to it, so we replay what
+ * others wrote before taking any decision.
+ */
+
+static void log_append(char const *name, off_t size, time_t now)
+{
+	if (log_fd == -1) return;
+	char line[PATH_MAX+64];
+	int len = snprintf(line, sizeof(line), "%ld %lld %s\n", (long)now, (long long)size, name);
+	if (len >= (int)sizeof(line)) return;
+	Write(log_fd, line, len);	// records are counted when replayed
+}
+
+static void log_open(void)
+{
+	log_fd = open(log_path, O_WRONLY|O_APPEND|O_CREAT, 0644);
+	if (log_fd == -1) with_error(errno, "open(%s)", log_path) return;
+	struct stat statbuf;
+	if (0 != fstat(log_fd, &statbuf)) with_error(errno, "fstat(%s)", log_path) return;
+	log_ino = statbuf.st_ino;
+}
+
+static void log_replay(void)
+{
+	struct stat statbuf;
+	if (0 != stat(log_path, &statbuf)) {
+		if (errno == ENOENT) return;
+		with_error(errno, "stat(%s)", log_path) return;
+	}
+	if (statbuf.st_ino != log_ino) {	// compacted by someone else : replay it all
+		debug("access log was compacted, reopening");
+		if (log_fd != -1) (void)close(log_fd);
+		if_fail (log_open()) return;
+		log_offset = 0;
+		nb_log_records = 0;
+	}
+	if (statbuf.st_size <= log_offset) return;
+	FILE *file = fopen(log_path, "r");
+	if (! file) with_error(errno, "fopen(%s)", log_path) return;
+	if (0 != fseeko(file, log_offset, SEEK_SET)) with_error(errno, "fseeko(%s)", log_path) goto q;
+	char line[PATH_MAX+64];
+	while (fgets(line, sizeof(line), file)) {
+		size_t len = strlen(line);
+		if (len == 0 || line[len-1] != '\n') break;	// partial record being written
+		line[len-1] = '\0';
+		log_offset += len;
+		nb_log_records ++;
+		long last_access;
+		long long size;
+		int name_offset;
+		if (2 != sscanf(line, "%ld %lld %n", &last_access, &size, &name_offset)) {
+			warning("Skipping garbage in %s : '%s'", log_path, line);
+			continue;
+		}
+		entry_set(line + name_offset, size, last_access);
+	}
+q:
+	(void)fclose(file);
+}
+
+// Rewrite the log with one record per resource, from the least recently used
+static void log_compact(void)
+{
+	char tmp_path[PATH_MAX];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", log_path);
+	int fd = open(tmp_path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd == -1) with_error(errno, "open(%s)", tmp_path) return;
+	struct varbuf vb;
+	if_fail (varbuf_ctor(&vb, 10000, true)) goto q1;
+	struct cache_entry *e;
+	TAILQ_FOREACH_REVERSE(e, &lru, cache_lru, lru_entry) {
+		char line[PATH_MAX+64];
+		int len = snprintf(line, sizeof(line), "%ld %lld %s\n", (long)e->last_access, (long long)e->size, e->name);
+		if (len >= (int)sizeof(line)) continue;
+		if_fail (varbuf_append(&vb, len, line)) goto q2;
+	}
+	if_fail (Write(fd, vb.buf, vb.used)) goto q2;
+	if (0 != rename(tmp_path, log_path)) with_error(errno, "rename(%s, %s)", tmp_path, log_path) goto q2;
+	if (log_fd != -1) (void)close(log_fd);
+	if_fail (log_open()) goto q2;
+	log_offset = vb.used;
+	nb_log_records = nb_entries;
+	debug("access log compacted to %u records", nb_entries);
+q2:
+	varbuf_dtor(&vb);
+q1:
+	(void)close(fd);
+	on_error (void)unlink(tmp_path);
+}
+
+/*
+ * Eviction
+ */
+
+// Resources waiting in the putdir are not uploaded yet : we must keep them.
+static void pin_uploads(void)
+{
+	DIR *dir = opendir(chn_putdir);
+	if (! dir) {
+		if (errno != ENOENT) error_push(errno, "opendir(%s)", chn_putdir);
+		return;
+	}
+	struct dirent *dirent;
+	while (NULL != (dirent = readdir(dir))) {
+		if (dirent->d_name[0] == '.') continue;
+		char path[PATH_MAX], ref_path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s/%s", chn_putdir, dirent->d_name);
+		ssize_t len = readlink(path, ref_path, sizeof(ref_path)-1);
+		if (len <= (ssize_t)chn_files_root_len+1) continue;
+		ref_path[len] = '\0';
+		struct cache_entry *e = entry_lookup(ref_path + chn_files_root_len + 1);
+		if (e) e->pinned = true;
+	}
+	(void)closedir(dir);
+}
+
+static bool can_evict(struct cache_entry *e, time_t now)
+{
+	if (e->pinned) return false;
+	if (now - e->last_access < CACHE_MIN_AGE) return false;
+	if (stream_is_loaded(e->name)) return false;	// someone is reading or writing it
+	return true;
+}
+
+static void evict(void)
+{
+	if_fail (log_replay()) return;
+	if (used_bytes <= max_bytes) return;
+	debug("cache uses %lld bytes out of %lld", (long long)used_bytes, (long long)max_bytes);
+	if_fail (pin_uploads()) return;
+	time_t now = time(NULL);
+	struct cache_entry *e, *prev;
+	for (e = TAILQ_LAST(&lru, cache_lru); e && used_bytes > max_bytes; e = prev) {
+		prev = TAILQ_PREV(e, cache_lru, lru_entry);
+		if (! can_evict(e, now)) continue;
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s/%s", chn_files_root, e->name);
+		if (0 != unlink(path) && errno != ENOENT) {
+			warning("Cannot evict %s : %s", path, strerror(errno));
+			continue;
+		}
+		debug("evicted %s (%lld bytes)", e->name, (long long)e->size);
+		nb_evictions ++;
+		evicted_bytes += e->size;
+		log_append(e->name, -1, now);
+		entry_del(e);
+		on_error break;
+	}
+	TAILQ_FOREACH(e, &lru, lru_entry) e->pinned = false;
+	if (used_bytes > max_bytes) warning("Cannot shrink the file cache below %lld bytes", (long long)used_bytes);
+}
+
+static void *evictor_thread(void *arg)
+{
+	(void)arg;
+	while (1) {
+		pth_event_t ev = pth_event(PTH_EVENT_TIME, pth_timeout(CACHE_EVICT_PERIOD, 0));
+		(void)pth_mutex_acquire(&evict_mutex, FALSE, NULL);
+		(void)pth_cond_await(&evict_cond, &evict_mutex, ev);	// this is a cancel point
+		(void)pth_mutex_release(&evict_mutex);
+		pth_event_free(ev, PTH_FREE_THIS);
+		evict();
+		if (! is_error() && nb_log_records > nb_entries*2 + CACHE_LOG_SLACK) log_compact();
+		on_error {
+			error("Cannot evict from file cache : %s", error_str());
+			error_clear();
+		}
+	}
+	return NULL;
+}
+
+static void wakeup_evictor(void)
+{
+	if (used_bytes > max_bytes) (void)pth_cond_notify(&evict_cond, FALSE);
+}
+
+/*
+ * Public API
+ */
+
+void cache_hit(char const *name)
+{
+	nb_hits ++;
+	if (! enabled) return;
+	struct cache_entry *e = entry_lookup(name);
+	time_t now = time(NULL);
+	if (! e) {	// new to us (added by another process ?)
+		cache_update(name);
+		return;
+	}
+	entry_set(name, e->size, now);
+	log_append(name, e->size, now);
+	on_error {
+		warning("Cannot record access to %s : %s", name, error_str());
+		error_clear();
+	}
+}
+
+void cache_miss(char const *name)
+{
+	nb_misses ++;
+	(void)name;
+}
+
+void cache_update(char const *name)
+{
+	if (! enabled) return;
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", chn_files_root, name);
+	struct stat statbuf;
+	if (0 != stat(path, &statbuf)) return;
+	time_t now = time(NULL);
+	entry_set(name, statbuf.st_size, now);
+	log_append(name, statbuf.st_size, now);
+	on_error {
+		warning("Cannot record access to %s : %s", name, error_str());
+		error_clear();
+	}
+	wakeup_evictor();
+}
+
+void chn_cache_stats(struct chn_cache_stats *stats)
+{
+	stats->hits = nb_hits;
+	stats->misses = nb_misses;
+	stats->evictions = nb_evictions;
+	stats->evicted_bytes = evicted_bytes;
+	stats->used_bytes = used_bytes;
+	stats->max_bytes = max_bytes;
+}
+
+/*
+ * (De)Init
+ */
+
+void cache_begin(void)
+{
+	nb_hits = nb_misses = nb_evictions = 0;
+	evicted_bytes = used_bytes = 0;
+	nb_entries = 0;
+	TAILQ_INIT(&lru);
+	for (unsigned h = 0; h < sizeof_array(hash); h++) LIST_INIT(hash+h);
+	if_fail (conf_set_default_int("SC_FILES_CACHE_SIZE", 0)) return;
+	max_bytes = conf_get_int("SC_FILES_CACHE_SIZE");
+	enabled = max_bytes > 0;
+	if (! enabled) return;
+	// Build the index from the directory content, then from the access log
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s", chn_files_root);
+	if_fail (scan_rec(path)) return;
+	lru_sort();
+	snprintf(log_path, sizeof(log_path), "%s/.cache", chn_files_root);
+	log_ino = 0;
+	log_offset = 0;
+	nb_log_records = 0;
+	if_fail (log_replay()) return;
+	// Entries from the log that were not found in the directory are stale
+	struct cache_entry *e, *prev;
+	for (e = TAILQ_LAST(&lru, cache_lru); e; e = prev) {
+		prev = TAILQ_PREV(e, cache_lru, lru_entry);
+		snprintf(path, sizeof(path), "%s/%s", chn_files_root, e->name);
+		if (0 != access(path, F_OK)) entry_del(e);
+	}
+	if_fail (log_compact()) return;
+	debug("file cache : %u resources, %lld bytes out of %lld", nb_entries, (long long)used_bytes, (long long)max_bytes);
+	pth_cond_init(&evict_cond);
+	pth_mutex_init(&evict_mutex);
+	evictor = pth_spawn(PTH_ATTR_DEFAULT, evictor_thread, NULL);
+	if (! evictor) with_error(0, "pth_spawn(evictor)") return;
+	wakeup_evictor();
+}
+
+void cache_end(void)
+{
+	if (! enabled) return;
+	if (evictor) {
+		pth_cancel(evictor);
+		evictor = NULL;
+	}
+	if (log_fd != -1) {
+		(void)close(log_fd);
+		log_fd = -1;
+	}
+	struct cache_entry *e;
+	while (NULL != (e = TAILQ_FIRST(&lru))) entry_del(e);
+}
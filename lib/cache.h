@@ -0,0 +1,43 @@
+/* Copyright 2008 Cedric Cellier.
+ *
+ * This file is part of Scambio.
+ *
+ * Scambio is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Scambio is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with Scambio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef CACHE_H_090302
+#define CACHE_H_090302
+
+#include <stdbool.h>
+
+/* The client side file cache is the content of chn_files_root.
+ * We keep an in-memory index of its resources (name, size, last access),
+ * ordered from the most recently used to the least recently used one, and
+ * a background thread evicts the least recently used resources whenever
+ * the total size exceeds SC_FILES_CACHE_SIZE bytes (0 meaning no limit).
+ * Accesses are also appended to an access log (.cache in chn_files_root)
+ * so that the LRU order survives restarts and is shared among all the
+ * processes using the same cache. This log is compacted from time to time.
+ */
+
+void cache_begin(void);
+void cache_end(void);
+
+/* Record an access to a resource that was found in the cache. */
+void cache_hit(char const *name);
+/* Record that a resource had to be fetched. */
+void cache_miss(char const *name);
+/* The content of this resource was (re)written : update its size. */
+void cache_update(char const *name);
+
+#endif
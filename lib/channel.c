@@ -33,6 +33,7 @@
 #include "misc.h"
 #include "auth.h"
 #include "stream.h"
+#include "cache.h"
 #include "persist.h"
 
 /*
@@ -43,12 +44,13 @@ static struct mdir_syntax syntax;
 static bool server;
 static mdir_cmd_cb serve_copy, serve_skip, serve_miss, serve_thx, finalize_thx;	// used by client & server
 static mdir_cmd_cb finalize_txstart;	// used by client
-static mdir_cmd_cb serve_read, serve_write, serve_quit, serve_auth;	// used by server
+static mdir_cmd_cb serve_read, serve_write, serve_delta, serve_ref, serve_quit, serve_auth;	// used by server
 static struct persist putdir_seq;
 
 #define RETRANSM_TIMEOUT 2000000//400000	// .4s
 #define OUT_FRAGS_TIMEOUT 1000000	// timeout fragments after 1 second
 #define CHUNK_SIZE 1400
+#define REF_READ_BLOCK 65536
 
 /*
  * Init
@@ -56,6 +58,7 @@ static struct persist putdir_seq;
 
 static void chn_deinit(void)
 {
+	if (! server) cache_end();
 	stream_end();
 	persist_dtor(&putdir_seq);
 	mdir_syntax_dtor(&syntax);
@@ -65,6 +68,8 @@ void chn_init(bool server_)
 {
 	server = server_;
 	if_fail (stream_begin()) return;
+	if_fail (conf_set_default_int("SC_CHN_MAX_WRITES", 10)) return;
+	if (! server) if_fail (cache_begin()) return;
 	char putdir_seq_fname[PATH_MAX];
 	snprintf(putdir_seq_fname, sizeof(putdir_seq_fname), "%s/.seq", chn_putdir);
 	if_fail (persist_ctor_sequence(&putdir_seq, putdir_seq_fname, 0)) return;
@@ -82,11 +87,18 @@ void chn_init(bool server_)
 		}, {
 			.keyword = kw_auth,  .cb = serve_auth,  .nb_arg_min = 1, .nb_arg_max = 1,
 			.nb_types = 1, .types = { CMD_STRING }, .negseq = false,
+		}, {
+			.keyword = kw_delta, .cb = serve_delta, .nb_arg_min = 2, .nb_arg_max = 2,
+			.nb_types = 2, .types = { CMD_STRING, CMD_STRING }, .negseq = false,	/* resource, base */
+		}, {
+			.keyword = kw_ref,  .cb = serve_ref,   .nb_arg_min = 4, .nb_arg_max = 5,
+			.nb_types = 4, .types = { CMD_INTEGER, CMD_INTEGER, CMD_INTEGER, CMD_INTEGER, CMD_STRING }, .negseq = false,	/* seqnum of the delta, offset, length, base offset, [eof] */
 		}
 	};
 	static struct mdir_cmd_def def_client[] = {
 		MDIR_CNX_ANSW_REGISTER(kw_write, finalize_txstart),
 		MDIR_CNX_ANSW_REGISTER(kw_read,  finalize_txstart),
+		MDIR_CNX_ANSW_REGISTER(kw_delta, finalize_txstart),
 	};
 	static struct mdir_cmd_def def_common[] = {
 		{
@@ -94,10 +106,10 @@ void chn_init(bool server_)
 			.nb_types = 3, .types = { CMD_INTEGER, CMD_INTEGER, CMD_INTEGER, CMD_STRING }, .negseq = false,	/* seqnum of the read/write, offset, length, [eof] */
 		}, {
 			.keyword = kw_skip, .cb = serve_skip, .nb_arg_min = 3, .nb_arg_max = 4,
-			.nb_types = 2, .types = { CMD_INTEGER, CMD_INTEGER, CMD_INTEGER }, .negseq = false,	/* seqnum of the read/write, offset, length, [eof] */
+			.nb_types = 3, .types = { CMD_INTEGER, CMD_INTEGER, CMD_INTEGER, CMD_STRING }, .negseq = false,	/* seqnum of the read/write, offset, length, [eof] */
 		}, {
 			.keyword = kw_miss, .cb = serve_miss, .nb_arg_min = 3, .nb_arg_max = 3,
-			.nb_types = 2, .types = { CMD_INTEGER, CMD_INTEGER, CMD_INTEGER }, .negseq = false,	/* seqnum of the read/write, offset, length */
+			.nb_types = 3, .types = { CMD_INTEGER, CMD_INTEGER, CMD_INTEGER }, .negseq = false,	/* seqnum of the read/write, offset, length */
 		}, {
 			.keyword = kw_thx,  .cb = serve_thx,  .nb_arg_min = 1, .nb_arg_max = 1,
 			.nb_types = 1, .types = { CMD_INTEGER }, .negseq = false,	/* seqnum of the read/write */
@@ -130,6 +142,168 @@ extern inline struct chn_box *chn_box_ref(struct chn_box *box);
 extern inline void chn_box_unref(struct chn_box *box);
 extern inline void *chn_box_unbox(struct chn_box *box);
 
+// Ranges (received fragments or misses)
+
+struct chn_range {
+	off_t start, end;
+	uint_least64_t ts;	// time of reception (or of last retransmission request)
+	bool eof;
+};
+
+static void ranges_ctor(struct chn_ranges *rs)
+{
+	rs->nb = rs->size = 0;
+	rs->ranges = NULL;
+}
+
+static void ranges_dtor(struct chn_ranges *rs)
+{
+	free(rs->ranges);
+	rs->ranges = NULL;
+	rs->nb = rs->size = 0;
+}
+
+// Returns the index of the first range which ends at or after offset (nb if none)
+static unsigned ranges_find(struct chn_ranges const *rs, off_t offset)
+{
+	unsigned lo = 0, hi = rs->nb;
+	while (lo < hi) {
+		unsigned mid = lo + (hi - lo)/2;
+		if (rs->ranges[mid].end < offset) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+// Insert [start, end[ into the set, merging it with any range it touches.
+// Returns the index of the resulting range.
+static unsigned ranges_insert(struct chn_ranges *rs, off_t start, off_t end, uint_least64_t ts, bool eof)
+{
+	unsigned first = ranges_find(rs, start);
+	unsigned last = first;	// one past the last range to merge with
+	while (last < rs->nb && rs->ranges[last].start <= end) last ++;
+	if (first == last) {	// nothing to merge with : make room
+		if (rs->nb >= rs->size) {
+			rs->size = rs->size ? rs->size*2 : 8;
+			rs->ranges = realloc(rs->ranges, rs->size * sizeof(*rs->ranges));
+			if (! rs->ranges) fatal("Cannot realloc ranges");
+		}
+		memmove(rs->ranges+first+1, rs->ranges+first, (rs->nb-first) * sizeof(*rs->ranges));
+		rs->nb ++;
+		rs->ranges[first] = (struct chn_range){ .start = start, .end = end, .ts = ts, .eof = eof };
+		return first;
+	}
+	struct chn_range *r = rs->ranges+first, *l = rs->ranges+last-1;
+	if (start < r->start) {
+		r->start = start;
+		r->ts = ts;	// what preceeds this range is new
+	}
+	if (end > l->end) {
+		r->end = end;
+		r->eof = eof;
+	} else {
+		r->end = l->end;
+		r->eof = l->eof || (eof && end == l->end);
+	}
+	if (last > first+1) {
+		debug("merging %u ranges", last - first);
+		memmove(rs->ranges+first+1, rs->ranges+last, (rs->nb-last) * sizeof(*rs->ranges));
+		rs->nb -= last - first - 1;
+	}
+	return first;
+}
+
+static void ranges_remove(struct chn_ranges *rs, unsigned i)
+{
+	assert(i < rs->nb);
+	memmove(rs->ranges+i, rs->ranges+i+1, (rs->nb-i-1) * sizeof(*rs->ranges));
+	rs->nb --;
+}
+
+// Fragments (sent data, kept for retransmissions)
+
+struct fragment {
+	uint_least64_t ts;	// time of emmission
+	struct chn_box *box;	// if NULL, this is a skip or a ref
+	off_t base_offset;	// for a ref, where the data are to be found in the base (-1 otherwise)
+	off_t start, end;
+	bool eof;
+};
+
+static struct fragment *frags_get(struct chn_frags *fs, unsigned i)
+{
+	assert(i < fs->nb);
+	return fs->frags + (fs->first + i) % fs->size;
+}
+
+static void frags_ctor(struct chn_frags *fs)
+{
+	fs->first = fs->nb = fs->size = 0;
+	fs->frags = NULL;
+}
+
+static void frags_shift(struct chn_frags *fs)
+{
+	struct fragment *f = frags_get(fs, 0);
+	if (f->box) {
+		chn_box_unref(f->box);
+		f->box = NULL;
+	}
+	fs->first = (fs->first + 1) % fs->size;
+	fs->nb --;
+}
+
+static void frags_dtor(struct chn_frags *fs)
+{
+	while (fs->nb > 0) frags_shift(fs);
+	free(fs->frags);
+	fs->frags = NULL;
+	fs->size = 0;
+}
+
+// Returns a new fragment at the end of the pool
+static struct fragment *frags_push(struct chn_frags *fs)
+{
+	if (fs->nb >= fs->size) {	// grow the ring, keeping fragments in order
+		unsigned new_size = fs->size ? fs->size*2 : 16;
+		struct fragment *frags = Malloc(new_size * sizeof(*frags));
+		for (unsigned i = 0; i < fs->nb; i++) frags[i] = *frags_get(fs, i);
+		free(fs->frags);
+		fs->frags = frags;
+		fs->first = 0;
+		fs->size = new_size;
+	}
+	fs->nb ++;
+	return frags_get(fs, fs->nb-1);
+}
+
+// Returns the fragment that holds this offset, or NULL
+static struct fragment *frags_find(struct chn_frags *fs, off_t offset)
+{
+	unsigned lo = 0, hi = fs->nb;
+	while (lo < hi) {
+		unsigned mid = lo + (hi - lo)/2;
+		struct fragment *f = frags_get(fs, mid);
+		if (f->end <= offset) lo = mid + 1;
+		else if (f->start > offset) hi = mid;
+		else return f;
+	}
+	return NULL;
+}
+
+static struct fragment *out_frag_new(struct chn_tx *tx, uint_least64_t ts, size_t size, struct chn_box *box, off_t base_offset, bool eof)
+{
+	struct fragment *f = frags_push(&tx->out_frags);
+	f->start = tx->end_offset;
+	tx->end_offset += size;
+	f->end = tx->end_offset;
+	f->eof = eof;
+	f->ts = ts;
+	f->box = box ? chn_box_ref(box) : NULL;	// if no box, this is a skip or a ref
+	f->base_offset = base_offset;
+	return f;
+}
+
 // TX
 
 static uint_least64_t get_ts(void)
@@ -148,6 +322,13 @@ static void chn_tx_ctor(struct chn_tx *tx, struct chn_cnx *cnx, bool sender, lon
 	tx->id = id;
 	tx->pth = NULL;
 	tx->stream = stream;
+	tx->cb = NULL;
+	tx->cb_data = NULL;
+	tx->async = false;
+	tx->writing = false;
+	tx->progress_cb = NULL;
+	tx->progress_data = NULL;
+	tx->base_fd = -1;
 	mdir_sent_query_ctor(&tx->sent_thx);
 	if_fail (tx->ts = get_ts()) return;
 	if (stream) {
@@ -157,8 +338,8 @@ static void chn_tx_ctor(struct chn_tx *tx, struct chn_cnx *cnx, bool sender, lon
 			if_fail (stream_add_writer(stream)) return;
 		}
 	}
-	TAILQ_INIT(&tx->in_frags);
-	TAILQ_INIT(&tx->out_frags);
+	ranges_ctor(&tx->in_frags);
+	frags_ctor(&tx->out_frags);
 	LIST_INSERT_HEAD(&cnx->txs, tx, cnx_entry);
 }
 
@@ -171,19 +352,21 @@ static void chn_tx_release_stream(struct chn_tx *tx)
 	}
 }
 
-static void fragment_del(struct fragment *f, struct fragments_queue *q);
 void chn_tx_dtor(struct chn_tx *tx)
 {
 	LIST_REMOVE(tx, cnx_entry);
-	struct fragment *f;
-	while (NULL != (f = TAILQ_FIRST(&tx->in_frags)))  fragment_del(f, &tx->in_frags);
-	while (NULL != (f = TAILQ_FIRST(&tx->out_frags))) fragment_del(f, &tx->out_frags);
+	ranges_dtor(&tx->in_frags);
+	frags_dtor(&tx->out_frags);
 	mdir_sent_query_dtor(&tx->sent_thx);
 	if (tx->pth) {
 		pth_cancel(tx->pth);
 		tx->pth = NULL;
 	}
 	chn_tx_release_stream(tx);
+	if (tx->base_fd != -1) {
+		(void)close(tx->base_fd);
+		tx->base_fd = -1;
+	}
 }
 
 void chn_tx_del(struct chn_tx *tx)
@@ -192,118 +375,58 @@ void chn_tx_del(struct chn_tx *tx)
 	free(tx);
 }
 
+static void release_write_slot(struct chn_cnx *cnx)
+{
+	assert(cnx->nb_writes > 0);
+	cnx->nb_writes --;
+	(void)pth_cond_notify(&cnx->writes_cond, FALSE);
+}
+
 static void chn_tx_set_status(struct chn_tx *tx, int status)
 {
 	assert(tx->status == 0);
 	assert(status != 0);
 	tx->status = status;
 	chn_tx_release_stream(tx);
-}
-
-// Fragments (and misses)
-
-// misses are fragment with no ts, no box and no eof flag
-struct fragment {
-	TAILQ_ENTRY(fragment) tx_entry;
-	uint_least64_t ts;	// time of reception/emmission
-	struct chn_box *box;	// used only for emmitted fragments
-	off_t start, end;
-	bool eof;
-};
-
-static size_t fragment_size(struct fragment *f) { return f->end - f->start; }
-
-static void out_frag_ctor(struct fragment *f, struct chn_tx *tx, uint_least64_t ts, size_t size, struct chn_box *box, bool eof)
-{
-	f->start = tx->end_offset;
-	tx->end_offset += size;
-	f->end = tx->end_offset;
-	f->eof = eof;
-	f->ts = ts;
-	f->box = box ? chn_box_ref(box) : NULL;	// if no box, this is a skip
-	TAILQ_INSERT_TAIL(&tx->out_frags, f, tx_entry);
-}
-
-static struct fragment *out_frag_new(struct chn_tx *tx, uint_least64_t ts, size_t size, struct chn_box *box, bool eof)
-{
-	struct fragment *f = malloc(sizeof(*f));
-	if (! f) with_error(ENOMEM, "malloc(fragment)") return NULL;
-	if_fail (out_frag_ctor(f, tx, ts, size, box, eof)) {
-		free(f);
-		f = NULL;
-	}
-	return f;
-}
-
-static void insert_by_offset(struct fragments_queue *q, struct fragment *f)
-{
-	if (TAILQ_EMPTY(q)) {
-		TAILQ_INSERT_HEAD(q, f, tx_entry);
-		return;
+	if (tx->sender && !server) release_write_slot(tx->cnx);	// client side sending TXs are uploads
+	if (tx->cb) {
+		chn_tx_cb *cb = tx->cb;
+		tx->cb = NULL;
+		cb(tx, status, tx->cb_data);
 	}
-	struct fragment *ff;
-	TAILQ_FOREACH(ff, q, tx_entry) {
-		if (f->start < ff->start) {
-			if (f->end > ff->start) warning("fragments overlap");
-			TAILQ_INSERT_BEFORE(ff, f, tx_entry);
-			return;
-		}
-	}
-	TAILQ_INSERT_TAIL(q, f, tx_entry);
-}
-
-static void in_frag_ctor(struct fragment *f, struct chn_tx *tx, uint_least64_t ts, off_t offset, size_t size, bool eof)
-{
-	f->ts = ts;
-	f->start = offset;
-	f->end = offset + size;
-	f->eof = eof;
-	f->box = NULL;
-	insert_by_offset(&tx->in_frags, f);
+	if (tx->async && ! tx->writing) chn_tx_del(tx);	// otherwise the reader thread will
 }
 
-static struct fragment *in_frag_new(struct chn_tx *tx, uint_least64_t ts, off_t offset, size_t size, bool eof)
+// Delete the asynchronous TXs that are over, once nobody writes to them any more
+static void reap_txs(struct chn_cnx *cnx)
 {
-	struct fragment *f = malloc(sizeof(*f));
-	if (! f) with_error(ENOMEM, "malloc(fragment)") return NULL;
-	if_fail (in_frag_ctor(f, tx, ts, offset, size, eof)) {
-		free(f);
-		f = NULL;
+	struct chn_tx *tx, *next;
+	for (tx = LIST_FIRST(&cnx->txs); tx; tx = next) {
+		next = LIST_NEXT(tx, cnx_entry);
+		if (tx->async && tx->status != 0 && ! tx->writing) chn_tx_del(tx);
 	}
-	return f;
-}
-
-static void fragment_dtor(struct fragment *f, struct fragments_queue *q)
-{
-	if (f->box) {
-		chn_box_unref(f->box);
-		f->box = NULL;
-	}
-	TAILQ_REMOVE(q, f, tx_entry);
-}
-
-static void fragment_del(struct fragment *f, struct fragments_queue *q)
-{
-	fragment_dtor(f, q);
-	free(f);
 }
 
 // Commands
 
 struct command {
-	char const *keyword;	// read or write
+	char const *keyword;	// read, write or delta
 	char const *resource;	// read or write depending on keyword;
 	struct mdir_sent_query sq;
 	time_t sent;
 	int status;
 	struct stream *stream;	// NULL
 	struct chn_tx *tx;
+	// Synchronous commands are waited for, while asynchronous ones are deleted by the finalizer.
+	bool async;
+	chn_tx_cb *cb;	// for async commands
+	void *cb_data;
 	pth_cond_t cond;
 	pth_mutex_t condmut;
 };
 
 // FIXME: if we never have a response, the sent_query within the command will be destructed but the command will not be freed. Make command inherit from sent_query
-static void command_ctor(struct chn_cnx *cnx, struct command *command, char const *kw, char const *resource, struct stream *stream, bool rt)
+static void command_ctor(struct chn_cnx *cnx, struct command *command, char const *kw, char const *resource, char const *param, struct stream *stream, chn_tx_cb *cb, void *cb_data)
 {
 	command->keyword = kw;
 	command->resource = resource;
@@ -311,21 +434,30 @@ static void command_ctor(struct chn_cnx *cnx, struct command *command, char cons
 	command->status = 0;
 	command->stream = stream;
 	command->tx = NULL;
+	command->async = cb != NULL;
+	command->cb = cb;
+	command->cb_data = cb_data;
 	mdir_sent_query_ctor(&command->sq);
 	if (stream) stream_ref(stream);
-	if_succeed (mdir_cnx_query(&cnx->cnx, kw, NULL, &command->sq, resource, kw == kw_write && rt ? "*":NULL, NULL)) {
+	if (! command->async) {
 		pth_cond_init(&command->cond);
 		pth_mutex_init(&command->condmut);
 		(void)pth_mutex_acquire(&command->condmut, FALSE, NULL);
 	}
+	if_fail (mdir_cnx_query(&cnx->cnx, kw, NULL, &command->sq, resource, param, NULL)) {
+		if (! command->async) (void)pth_mutex_release(&command->condmut);
+		if (stream) stream_unref(stream);
+		mdir_sent_query_dtor(&command->sq);
+	}
 }
 
-// The command is returned with the lock taken, so that the condition cannot be signaled
+// A synchronous command is returned with the lock taken, so that the condition cannot be signaled
 // before the caller wait for it. It's thus the caller that must release it (by waiting).
-static struct command *command_new(struct chn_cnx *cnx, char const *kw, char const *resource, struct stream *stream, bool rt)
+// param is the optional second parameter of the command (the base of a delta).
+static struct command *command_new(struct chn_cnx *cnx, char const *kw, char const *resource, char const *param, struct stream *stream, chn_tx_cb *cb, void *cb_data)
 {
 	struct command *command = Malloc(sizeof(*command));
-	if_fail (command_ctor(cnx, command, kw, resource, stream, rt)) {
+	if_fail (command_ctor(cnx, command, kw, resource, param, stream, cb, cb_data)) {
 		free(command);
 		command = NULL;
 	}
@@ -378,14 +510,20 @@ static size_t send_chunk(struct chn_tx *tx, struct fragment *f, off_t offset)
 {
 	size_t sent = f->end - offset;
 	bool eof = f->eof;
-	if (sent > CHUNK_SIZE) {
+	if (f->box && sent > CHUNK_SIZE) {	// skips and refs carry no data, thus need not be split
 		sent = CHUNK_SIZE;
 		eof = false;
 	}
 	char params[256];
-	(void)snprintf(params, sizeof(params), "%lld %u %zu%s",
-		tx->id, (unsigned)offset, sent, eof ? " *":"");
-	if_fail (mdir_cnx_query(&tx->cnx->cnx, f->box ? kw_copy:kw_skip, NULL, NULL, params, NULL)) return 0;
+	char const *kw = f->box ? kw_copy : f->base_offset != -1 ? kw_ref : kw_skip;
+	if (kw == kw_ref) {
+		(void)snprintf(params, sizeof(params), "%lld %lld %zu %lld%s",
+			tx->id, (long long)offset, sent, (long long)(f->base_offset + (offset - f->start)), eof ? " *":"");
+	} else {
+		(void)snprintf(params, sizeof(params), "%lld %lld %zu%s",
+			tx->id, (long long)offset, sent, eof ? " *":"");
+	}
+	if_fail (mdir_cnx_query(&tx->cnx->cnx, kw, NULL, NULL, params, NULL)) return 0;
 	if (f->box) Write(tx->cnx->cnx.fd, f->box->data+(offset - f->start), sent);
 	return sent;
 }
@@ -400,36 +538,30 @@ static void send_all_chunks(struct chn_tx *tx, struct fragment *f)
 
 static void retransmit_missed(struct chn_tx *tx)
 {
-	struct fragment *miss, *f;
-	while (NULL != (miss = TAILQ_FIRST(&tx->in_frags))) {
-		// warning : a miss from offset X does not imply that all fragments before that
-		// were received ; we may miss a miss !
-		// look for this chunk
-		TAILQ_FOREACH(f, &tx->out_frags, tx_entry) {
-			if (miss->end <= f->start || miss->start >= f->end) continue;
-			// Send the first chunk from miss->offset
-			size_t sent;
-			if_fail (sent = send_chunk(tx, f, miss->start)) return;
-			if (sent >= fragment_size(miss)) {	// the miss is covered, delete it
-				fragment_del(miss, &tx->in_frags);
-			} else {
-				miss->start += sent;	// Lets go again
-			}
-			break;
+	// warning : a miss from offset X does not imply that all fragments before that
+	// were received ; we may miss a miss !
+	while (tx->in_frags.nb > 0) {
+		struct chn_range *miss = tx->in_frags.ranges;
+		struct fragment *f = frags_find(&tx->out_frags, miss->start);
+		if (! f) {
+			warning("Cannot retransmit from offset %lld : data is gone", (long long)miss->start);
+			ranges_remove(&tx->in_frags, 0);
+			continue;
 		}
+		// Send the first chunk from miss->offset
+		size_t sent;
+		if_fail (sent = send_chunk(tx, f, miss->start)) return;
+		miss->start += sent;
+		if (miss->start >= miss->end) ranges_remove(&tx->in_frags, 0);	// the miss is covered
 	}
 }
 
-static void timeout_fragments(struct fragments_queue *q, uint_least64_t now, uint_least64_t timeout)
+static void timeout_fragments(struct chn_frags *fs, uint_least64_t now, uint_least64_t timeout)
 {
-	struct fragment *f;
-	while (NULL != (f = TAILQ_FIRST(q))) {
-		if (f->ts + timeout > now) break;
-		fragment_del(f, q);
-	}
+	while (fs->nb > 0 && frags_get(fs, 0)->ts + timeout <= now) frags_shift(fs);
 }
 
-void chn_tx_write(struct chn_tx *tx, size_t length, struct chn_box *box, bool eof)
+static void tx_send(struct chn_tx *tx, size_t length, struct chn_box *box, off_t base_offset, bool eof)
 {
 	debug("length= %zu, eof= %c", length, eof ? 'y':'n');
 	assert(tx->sender == true);
@@ -437,7 +569,7 @@ void chn_tx_write(struct chn_tx *tx, size_t length, struct chn_box *box, bool eo
 	struct fragment *new_frag;
 	
 	if_fail (now = get_ts()) return;
-	if_fail (new_frag = out_frag_new(tx, now, length, box, eof)) return;
+	if_fail (new_frag = out_frag_new(tx, now, length, box, base_offset, eof)) return;
 	if_fail (retransmit_missed(tx)) return;
 	if_fail (send_all_chunks(tx, new_frag)) return;
 	if_fail (timeout_fragments(&tx->out_frags, now, OUT_FRAGS_TIMEOUT)) return;
@@ -450,6 +582,24 @@ void chn_tx_write(struct chn_tx *tx, size_t length, struct chn_box *box, bool eo
 	} while (tx->cnx->status == 0 && chn_tx_status(tx) == 0);
 }
 
+// An asynchronous TX which status is set meanwhile is not deleted before we return
+static void tx_write(struct chn_tx *tx, size_t length, struct chn_box *box, off_t base_offset, bool eof)
+{
+	tx->writing = true;
+	tx_send(tx, length, box, base_offset, eof);
+	tx->writing = false;
+}
+
+void chn_tx_write(struct chn_tx *tx, size_t length, struct chn_box *box, bool eof)
+{
+	tx_write(tx, length, box, -1, eof);
+}
+
+void chn_tx_write_ref(struct chn_tx *tx, size_t length, off_t base_offset, bool eof)
+{
+	tx_write(tx, length, NULL, base_offset, eof);
+}
+
 // Receiver
 
 static void *tx_checker(void *arg);
@@ -487,6 +637,13 @@ int chn_tx_status(struct chn_tx *tx)
 	return tx->status;
 }
 
+off_t chn_tx_received(struct chn_tx *tx)
+{
+	assert(! tx->sender);
+	if (tx->in_frags.nb == 0 || tx->in_frags.ranges[0].start > 0) return 0;
+	return tx->in_frags.ranges[0].end;
+}
+
 static void finalize_txstart(struct mdir_cmd *cmd, void *user_data)
 {
 	debug("finalizing for %s", cmd->def->keyword);
@@ -496,23 +653,42 @@ static void finalize_txstart(struct mdir_cmd *cmd, void *user_data)
 	struct chn_cnx *ccnx = DOWNCAST(cnx, cnx, chn_cnx);
 	struct command *command = DOWNCAST(sq, sq, command);
 	command->status = cmd->args[0].integer;
+	bool const upload = command->keyword != kw_read;
 	if (200 == command->status) {
-		if (command->keyword == kw_write) {
+		if (upload) {
 			command->tx = chn_tx_new_sender(ccnx, cmd->seq, command->stream);
 		} else {
 			command->tx = chn_tx_new_receiver(ccnx, cmd->seq, command->stream);
 		}
-		error_clear();
+		on_error {
+			error_clear();
+			command->status = 500;
+		}
+	}
+	if (upload && !command->tx) release_write_slot(ccnx);
+	if (! command->async) {
+		(void)pth_cond_notify(&command->cond, TRUE);
+		return;
 	}
-	(void)pth_cond_notify(&command->cond, TRUE);
+	if (command->tx) {
+		command->tx->cb = command->cb;
+		command->tx->cb_data = command->cb_data;
+		command->tx->async = true;
+	} else {
+		command->cb(NULL, command->status, command->cb_data);
+	}
+	command_del(command);
 }
 
+static void put_entries_fail(struct chn_cnx *cnx);
+
 static void *reader_thread(void *arg)
 {
 	debug("New reader thread");
 	struct chn_cnx *cnx = arg;
 	do {
 		pth_yield(NULL);
+		reap_txs(cnx);
 		/* The channel reader thread have callbacks that will receive incomming
 		 * datas and write it to the stream it's associated to (ie will perform
 		 * physical writes onto other TXs and/or file :
@@ -544,6 +720,7 @@ static void *reader_thread(void *arg)
 		if_fail (mdir_cnx_read(&cnx->cnx)) cnx->status = 500 + error_code();
 	} while (cnx->status == 0);
 	error_clear();
+	put_entries_fail(cnx);	// their answers will never come
 	return NULL;
 }
 
@@ -551,6 +728,11 @@ static void chn_cnx_ctor(struct chn_cnx *cnx)
 {
 	cnx->status = 0;
 	LIST_INIT(&cnx->txs);
+	cnx->nb_writes = 0;
+	cnx->max_writes = conf_get_int("SC_CHN_MAX_WRITES");
+	if (cnx->max_writes < 1) cnx->max_writes = 1;
+	pth_cond_init(&cnx->writes_cond);
+	pth_mutex_init(&cnx->writes_mutex);
 	cnx->reader = pth_spawn(PTH_ATTR_DEFAULT, reader_thread, cnx);
 	if (! cnx->reader) with_error(0, "pth_spawn(chn_cnx reader)") return;
 }
@@ -595,6 +777,7 @@ void chn_cnx_dtor(struct chn_cnx *cnx)
 		(void)pth_cancel(cnx->reader);
 		cnx->reader = NULL;
 	}
+	put_entries_fail(cnx);
 	struct chn_tx *tx;
 	while (NULL != (tx = LIST_FIRST(&cnx->txs))) {
 		chn_tx_del(tx);
@@ -635,7 +818,7 @@ static struct chn_tx *find_rtx(struct chn_cnx *cnx, long long id)
 static void ask_retransmit(struct chn_tx *tx, off_t offset, size_t size)
 {
 	char cmd[256];
-	int len = snprintf(cmd, sizeof(cmd), "%s %llu %u %zu\n", kw_miss, tx->id, (unsigned)offset, size);
+	int len = snprintf(cmd, sizeof(cmd), "%s %llu %lld %zu\n", kw_miss, tx->id, (long long)offset, size);
 	Write(tx->cnx->cnx.fd, cmd, len);
 }
 
@@ -644,38 +827,41 @@ static bool was_long_ago(uint_least64_t ts, uint_least64_t now)
 	return ts + RETRANSM_TIMEOUT < now;
 }
 
-static void check_in_frags(struct chn_tx *tx, uint_least64_t now)
+// Ask for the gap preceeding range i, if the range was received long ago
+static void check_gap_before(struct chn_tx *tx, unsigned i, uint_least64_t now)
 {
-	struct fragment *f, *tmp, *last_frag = NULL;
-	off_t last_end = 0;
-	TAILQ_FOREACH_SAFE(f, &tx->in_frags, tx_entry, tmp) {
-		if (f->start > last_end && was_long_ago(f->ts, now)) {
-			if_fail (ask_retransmit(tx, last_end, f->start - last_end)) return;
-			f->ts = now;
-		} else if (last_frag) {	// merge those two fragments
-			debug("merging fragment %p and %p", last_frag, f);
-			if (f->end >= last_frag->end) {
-				last_frag->end = f->end;
-				last_frag->eof = f->eof;
-			}
-			fragment_del(f, &tx->in_frags);
-			last_end = last_frag->end;
-			continue;
-		}
-		last_end = f->end;
-		last_frag = f;
+	struct chn_range *r = tx->in_frags.ranges+i;
+	off_t gap_start = i > 0 ? r[-1].end : 0;
+	if (r->start > gap_start && was_long_ago(r->ts, now)) {
+		if_fail (ask_retransmit(tx, gap_start, r->start - gap_start)) return;
+		r->ts = now;
 	}
-	if (last_frag) {
-		if (! last_frag->eof && was_long_ago(last_frag->ts, now)) {
-			if_fail (ask_retransmit(tx, last_frag->end, 1)) return;
-			last_frag->ts = now;
-		}
-	} else {	// not received anything yet
+}
+
+// Ask for what follows the last range if it's not the end and we wait for too long
+static void check_tail(struct chn_tx *tx, uint_least64_t now)
+{
+	if (tx->in_frags.nb == 0) {	// not received anything yet
 		if (was_long_ago(tx->ts, now)) {
 			if_fail (ask_retransmit(tx, 0, 1)) return;
 			tx->ts = now;
 		}
+		return;
+	}
+	struct chn_range *last = tx->in_frags.ranges + tx->in_frags.nb-1;
+	if (! last->eof && was_long_ago(last->ts, now)) {
+		if_fail (ask_retransmit(tx, last->end, 1)) return;
+		last->ts = now;
+	}
+}
+
+// Check all gaps (used periodically by the tx_checker)
+static void check_in_frags(struct chn_tx *tx, uint_least64_t now)
+{
+	for (unsigned i = 0; i < tx->in_frags.nb; i++) {
+		if_fail (check_gap_before(tx, i, now)) return;
 	}
+	check_tail(tx, now);
 }
 
 static char const *tx_id_str(struct chn_tx *tx)
@@ -696,6 +882,28 @@ static void finalize_thx(struct mdir_cmd *cmd, void *user_data)
 	chn_tx_set_status(tx, status);
 }
 
+// Register that we received this fragment (data or skip), and check weither the TX is over.
+static void register_in_frag(struct chn_tx *tx, off_t offset, size_t size, bool eof)
+{
+	uint_least64_t ts;
+	if_fail (ts = get_ts()) return;
+	off_t const received = chn_tx_received(tx);
+	unsigned i = ranges_insert(&tx->in_frags, offset, offset + size, ts, eof);
+	if (tx->progress_cb && chn_tx_received(tx) > received) tx->progress_cb(tx, 0, tx->progress_data);
+	// Only the gaps around this new range may have changed
+	if_fail (check_gap_before(tx, i, ts)) return;
+	if (i+1 < tx->in_frags.nb) {
+		if_fail (check_gap_before(tx, i+1, ts)) return;
+	}
+	if_fail (check_tail(tx, ts)) return;
+	struct chn_range *first = tx->in_frags.ranges;
+	debug("%u ranges, first is [%lld, %lld[ (eof=%c)", tx->in_frags.nb, (long long)first->start, (long long)first->end, first->eof ? 'y':'n');
+	if (tx->in_frags.nb == 1 && first->eof && first->start == 0) {
+		// Send the thanx message back to sender
+		if_fail (mdir_cnx_query(&tx->cnx->cnx, kw_thx, NULL, &tx->sent_thx, tx_id_str(tx), NULL)) return;
+	}
+}
+
 static void serve_copy(struct mdir_cmd *cmd, void *cnx_)
 {
 	struct chn_cnx *cnx = DOWNCAST(cnx_, cnx, chn_cnx);
@@ -732,22 +940,10 @@ static void serve_copy(struct mdir_cmd *cmd, void *cnx_)
 	chn_box_unref(box);
 	box = NULL;
 	mdir_cnx_answer(&cnx->cnx, cmd, 200, "OK");
-	// Register that we received this fragment.
-	uint_least64_t ts;
-	if_fail (ts = get_ts()) return;
-	if_fail ((void)in_frag_new(tx, ts, offset, size, eof)) return;
-	if_fail (check_in_frags(tx, ts)) return;
-	// Check weither the TX is over
-	struct fragment *first, *last;
-	first = TAILQ_FIRST(&tx->in_frags);
-	last = TAILQ_LAST(&tx->in_frags, fragments_queue);
-	debug("fragments : first=%p (offset=%u), last=%p (offset=%u, eof=%c)", first, (unsigned)first->start, last, (unsigned)last->start, last->eof ? 'y':'n');
-	if (first == last && last->eof && first->start == 0) {
-		// Send the thanx message back to sender
-		if_fail (mdir_cnx_query(&cnx->cnx, kw_thx, NULL, &tx->sent_thx, tx_id_str(tx), NULL)) return;
-	}
+	register_in_frag(tx, offset, size, eof);
 }
 
+// A skip is a fragment without data : the receiver must leave a hole there.
 static void serve_skip(struct mdir_cmd *cmd, void *cnx_)
 {
 	struct chn_cnx *cnx = DOWNCAST(cnx_, cnx, chn_cnx);
@@ -755,12 +951,62 @@ static void serve_skip(struct mdir_cmd *cmd, void *cnx_)
 	off_t offset  = cmd->args[1].integer;
 	size_t size = cmd->args[2].integer;
 	bool eof = cmd->nb_args == 4;
-	// TODO
-	(void)cnx;
-	(void)offset;
-	(void)size;
-	(void)eof;
-	(void)id;
+	debug("id=%lld, offset=%lld, size=%zu, eof=%s", id, (long long)offset, size, eof ? "y":"n");
+	struct chn_tx *tx = find_rtx(cnx, id);
+	if (! tx) {
+		mdir_cnx_answer(&cnx->cnx, cmd, 500, "No such receiving tx id");
+		return;
+	}
+	if_fail (stream_write(tx->stream, offset, size, NULL, eof)) {
+		mdir_cnx_answer(&cnx->cnx, cmd, 501, error_str());
+		error_clear();
+		chn_tx_set_status(tx, 501);
+		return;
+	}
+	mdir_cnx_answer(&cnx->cnx, cmd, 200, "OK");
+	register_in_frag(tx, offset, size, eof);
+}
+
+// Write the data found at base_offset in the base onto the stream, by blocks
+static void copy_from_base(struct chn_tx *tx, off_t offset, size_t size, off_t base_offset, bool eof)
+{
+	size_t done = 0;
+	do {
+		size_t const len = size - done < REF_READ_BLOCK ? size - done : REF_READ_BLOCK;
+		struct chn_box *box = chn_box_alloc(len);
+		if (! box) with_error(ENOMEM, "malloc(data)") return;
+		ReadFrom(box->data, tx->base_fd, base_offset + done, len);
+		unless_error stream_write(tx->stream, offset + done, len, box, eof && done + len >= size);
+		chn_box_unref(box);
+		on_error return;
+		done += len;
+		pth_yield(NULL);	// refs can be very large
+	} while (done < size);
+}
+
+// A ref is a fragment which data are to be found in the base of a delta.
+static void serve_ref(struct mdir_cmd *cmd, void *cnx_)
+{
+	struct chn_cnx *cnx = DOWNCAST(cnx_, cnx, chn_cnx);
+	long long id  = cmd->args[0].integer;
+	off_t offset  = cmd->args[1].integer;
+	size_t size = cmd->args[2].integer;
+	off_t base_offset = cmd->args[3].integer;
+	bool eof = cmd->nb_args == 5;
+	debug("id=%lld, offset=%lld, size=%zu, base_offset=%lld, eof=%s", id, (long long)offset, size, (long long)base_offset, eof ? "y":"n");
+	struct chn_tx *tx = find_rtx(cnx, id);
+	if (! tx || tx->base_fd == -1) {
+		mdir_cnx_answer(&cnx->cnx, cmd, 500, "No such receiving delta id");
+		return;
+	}
+	if_fail (copy_from_base(tx, offset, size, base_offset, eof)) {
+		mdir_cnx_answer(&cnx->cnx, cmd, 501, error_str());
+		error_clear();
+		chn_tx_set_status(tx, 501);
+		return;
+	}
+	mdir_cnx_answer(&cnx->cnx, cmd, 200, "OK");
+	register_in_frag(tx, offset, size, eof);
 }
 
 static void serve_miss(struct mdir_cmd *cmd, void *cnx_)
@@ -769,11 +1015,13 @@ static void serve_miss(struct mdir_cmd *cmd, void *cnx_)
 	long long id  = cmd->args[0].integer;
 	off_t offset  = cmd->args[1].integer;
 	size_t size = cmd->args[2].integer;
-	// TODO
-	(void)cnx;
-	(void)offset;
-	(void)size;
-	(void)id;
+	debug("id=%lld, offset=%lld, size=%zu", id, (long long)offset, size);
+	struct chn_tx *tx = find_wtx(cnx, id);
+	if (! tx) return;	// misses are not answered
+	uint_least64_t ts;
+	if_fail (ts = get_ts()) return;
+	// Will be retransmitted by the next chn_tx_write()
+	(void)ranges_insert(&tx->in_frags, offset, offset + size, ts, false);
 }
 
 static void serve_thx(struct mdir_cmd *cmd, void *cnx_)
@@ -790,23 +1038,23 @@ static void serve_thx(struct mdir_cmd *cmd, void *cnx_)
 	mdir_cnx_answer(&cnx->cnx, cmd, 200, "Ok");
 }
 
-static void serve_read_write(struct mdir_cmd *cmd, void *user_data, bool reader)	// reader = serve a read
+// Returns the new TX, or NULL if the command was answered with an error
+static struct chn_tx *serve_read_write(struct mdir_cmd *cmd, void *user_data, bool reader, bool rt)	// reader = serve a read
 {
 	struct mdir_cnx *cnx = user_data;
 	struct chn_cnx *ccnx = DOWNCAST(cnx, cnx, chn_cnx);
 	char const *name = cmd->args[0].string;
-	bool rt = cmd->nb_args > 1;
 	struct stream *stream;
 	struct chn_tx *tx;
 	
 	if (cmd->seq == -1) {
 		mdir_cnx_answer(cnx, cmd, 500, "Missing seqnum");
-		return;
+		return NULL;
 	}
 	if_fail (stream = stream_lookup(name, rt)) {
 		error_clear();
 		mdir_cnx_answer(cnx, cmd, 500, "Cannot lookup this name");
-		return;
+		return NULL;
 	}
 	if (reader) {
 		tx = chn_tx_new_sender(ccnx, cmd->seq, stream);
@@ -816,19 +1064,41 @@ static void serve_read_write(struct mdir_cmd *cmd, void *user_data, bool reader)
 	on_error {
 		error_clear();
 		mdir_cnx_answer(cnx, cmd, 500, "Cannot start transfert");
-		return;
+		return NULL;
 	}
 	mdir_cnx_answer(cnx, cmd, 200, "Ok");
+	return tx;
 }
 
 static void serve_write(struct mdir_cmd *cmd, void *user_data)
 {
-	serve_read_write(cmd, user_data, false);
+	(void)serve_read_write(cmd, user_data, false, cmd->nb_args > 1);
 }
 
 static void serve_read(struct mdir_cmd *cmd, void *user_data)
 {
-	serve_read_write(cmd, user_data, true);
+	(void)serve_read_write(cmd, user_data, true, false);
+}
+
+// A delta is a write which refs point into a previous version of the resource (the base).
+static void serve_delta(struct mdir_cmd *cmd, void *user_data)
+{
+	struct mdir_cnx *cnx = user_data;
+	char const *base = cmd->args[1].string;
+	if (strchr(base, '.')) {
+		mdir_cnx_answer(cnx, cmd, 500, "Base not allowed to use '.'");
+		return;
+	}
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", chn_files_root, base);
+	int base_fd = open(path, O_RDONLY);
+	if (base_fd < 0) {	// the client will send the whole file instead
+		mdir_cnx_answer(cnx, cmd, 404, "No such base");
+		return;
+	}
+	struct chn_tx *tx = serve_read_write(cmd, user_data, false, false);
+	if (tx) tx->base_fd = base_fd;
+	else (void)close(base_fd);
 }
 
 static void serve_quit(struct mdir_cmd *cmd, void *user_data)
@@ -867,7 +1137,7 @@ static struct chn_tx *fetch_file_with_cnx(struct chn_cnx *cnx, char *name, struc
 	assert(cnx && name && stream);
 	assert(! server);
 	struct command *command;
-	if_fail (command = command_new(cnx, kw_read, name, stream, false)) return NULL;
+	if_fail (command = command_new(cnx, kw_read, name, NULL, stream, NULL, NULL)) return NULL;
 	command_wait(command);
 	if (command->status != 200) error_push(0, "Cannot get file '%s'", name);
 	struct chn_tx *tx = command->tx;
@@ -885,13 +1155,14 @@ struct chn_tx *chn_get_file(struct chn_cnx *cnx, char *localfile, char const *na
 	int fd = open(localfile, O_RDONLY);
 	if (fd >= 0) {
 		debug("found in cache file '%s'", localfile);
-		// TODO: Touch it
 		(void)close(fd);
+		cache_hit(name);
 		return NULL;
 	}
 	if (errno != ENOENT) with_error(errno, "Cannot open(%s)", localfile) return NULL;
 	// So lets fetch it
 	debug("not in cache, need to fetch it");
+	cache_miss(name);
 	if (! cnx) with_error(0, "Cannot fetch and not local") return NULL;
 	struct stream *stream = stream_lookup(name, false);
 	on_error return NULL;
@@ -914,10 +1185,9 @@ struct chn_tx *chn_get_file(struct chn_cnx *cnx, char *localfile, char const *na
 // whenever possible, then create the symlink to this ref, then upload the content, then remove
 // the tag from the ".put" directory).
 
-static void add_resource_to_putdir(char const *ref_path)
+static void add_resource_to_putdir(char const *ref_path, char filename[PATH_MAX])
 {
-	char filename[PATH_MAX];
-	snprintf(filename, sizeof(filename), "%s/%"PRIu64, chn_putdir, persist_read_inc_sequence(&putdir_seq));
+	snprintf(filename, PATH_MAX, "%s/%"PRIu64, chn_putdir, persist_read_inc_sequence(&putdir_seq));
 	debug("storing file in %s -> %s", filename, ref_path);
 	if (0 != symlink(ref_path, filename)) with_error(errno, "symlink(%s, %s)", ref_path, filename) return;
 }
@@ -937,44 +1207,233 @@ static void chn_resource_name_new(char str[CHN_RESOURCE_LEN])
 	}
 }
 
-void chn_send_file_request(struct chn_cnx *cnx, char const *filename, char *resource_)
+static void resource_path(char path[PATH_MAX], char const *resource)
+{
+	snprintf(path, PATH_MAX, "%s/%s", chn_files_root, resource);
+}
+
+int chn_resource_create(char *resource)
+{
+	char path[PATH_MAX];
+	char name[CHN_RESOURCE_LEN];
+	chn_resource_name_new(name);
+	resource_path(path, name);
+	if_fail (Mkdir_for_file(path)) return -1;
+	int fd = open(path, O_WRONLY|O_CREAT|O_EXCL, 0644);
+	if (fd < 0) with_error(errno, "open(%s)", path) return -1;
+	debug("new resource %s", name);
+	snprintf(resource, PATH_MAX, "%s", name);
+	return fd;
+}
+
+void chn_resource_abort(int fd, char const *resource)
+{
+	char path[PATH_MAX];
+	resource_path(path, resource);
+	(void)close(fd);
+	if (0 != unlink(path)) warning("Cannot unlink(%s) : %s", path, strerror(errno));
+}
+
+// Files from the putdir which upload is in progress
+struct put_entry {
+	LIST_ENTRY(put_entry) entry;
+	char path[PATH_MAX];
+	struct chn_cnx *cnx;
+	char resource[PATH_MAX];
+	char base[PATH_MAX];	// if not empty, the resource is sent as a delta against this one
+	bool sent;	// once the command is sent, the entry is freed by put_done() only
+	chn_tx_cb *cb;
+	void *cb_data;
+};
+static LIST_HEAD(put_entries, put_entry) put_entries = LIST_HEAD_INITIALIZER(put_entries);
+
+static bool is_being_put(char const *path)
+{
+	struct put_entry *pe;
+	LIST_FOREACH(pe, &put_entries, entry) {
+		if (0 == strcmp(pe->path, path)) return true;
+	}
+	return false;
+}
+
+static void put_entry_write(struct put_entry *pe);
+
+static void put_done(struct chn_tx *tx, int status, void *data)
+{
+	struct put_entry *pe = data;
+	if (status == 404 && pe->base[0] != '\0') {	// the file server has no such base
+		debug("no base %s for %s, sending the whole file", pe->base, pe->resource);
+		pe->base[0] = '\0';
+		if_succeed (put_entry_write(pe)) return;
+		error_clear();
+	}
+	if (status == 200) {
+		debug("%s uploaded", pe->path);
+		if (0 != unlink(pe->path)) warning("Cannot unlink(%s) : %s", pe->path, strerror(errno));
+	} else {
+		warning("Cannot upload %s (status %d), will retry later", pe->path, status);
+	}
+	if (pe->cb) pe->cb(tx, status, pe->cb_data);
+	LIST_REMOVE(pe, entry);
+	free(pe);
+}
+
+static struct put_entry *put_entry_of_cnx(struct chn_cnx *cnx)
+{
+	struct put_entry *pe;
+	LIST_FOREACH(pe, &put_entries, entry) {
+		if (pe->cnx == cnx && pe->sent) return pe;
+	}
+	return NULL;
+}
+
+// The cnx is closed : fail all the uploads that are waiting for an answer on it
+static void put_entries_fail(struct chn_cnx *cnx)
+{
+	int const status = cnx->status != 0 ? cnx->status : 500;
+	struct put_entry *pe;
+	while (NULL != (pe = put_entry_of_cnx(cnx))) {	// callbacks may change the list
+		struct chn_tx *tx;
+		LIST_FOREACH(tx, &cnx->txs, cnx_entry) {
+			if (tx->cb == put_done && tx->cb_data == pe) tx->cb = NULL;
+		}
+		put_done(NULL, status, pe);
+	}
+}
+
+static struct command *write_command_new(struct chn_cnx *cnx, char const *resource, char const *base, chn_tx_cb *cb, void *cb_data);
+
+// Send the write (or delta) command for this entry. If this fails, the entry is still the caller's.
+static void put_entry_write(struct put_entry *pe)
+{
+	pe->sent = false;
+	if_fail ((void)write_command_new(pe->cnx, pe->resource, pe->base[0] != '\0' ? pe->base:NULL, put_done, pe)) return;
+	pe->sent = true;
+	if (pe->cnx->status != 0) put_entries_fail(pe->cnx);	// the cnx was closed while we were sending
+}
+
+// Start the upload of a resource which is tagged in the putdir (as a delta if base is not NULL)
+static void put_entry_send(struct chn_cnx *cnx, char const *putpath, char const *resource, char const *base, chn_tx_cb *cb, void *cb_data)
+{
+	struct put_entry *pe = Malloc(sizeof(*pe));
+	snprintf(pe->path, sizeof(pe->path), "%s", putpath);
+	pe->cnx = cnx;
+	snprintf(pe->resource, sizeof(pe->resource), "%s", resource);
+	snprintf(pe->base, sizeof(pe->base), "%s", base ? base : "");
+	pe->cb = cb;
+	pe->cb_data = cb_data;
+	LIST_INSERT_HEAD(&put_entries, pe, entry);
+	if_fail (put_entry_write(pe)) {
+		LIST_REMOVE(pe, entry);
+		free(pe);
+	}
+}
+
+static void resource_close(struct chn_cnx *cnx, int fd, char const *resource, char const *base, chn_tx_cb *cb, void *cb_data)
+{
+	char path[PATH_MAX];
+	resource_path(path, resource);
+	if (0 != close(fd)) with_error(errno, "close(%s)", path) return;
+	cache_update(resource);
+	char putpath[PATH_MAX];
+	if_fail (add_resource_to_putdir(path, putpath)) return;
+	if (cnx) put_entry_send(cnx, putpath, resource, base, cb, cb_data);
+}
+
+void chn_resource_close(struct chn_cnx *cnx, int fd, char const *resource, chn_tx_cb *cb, void *cb_data)
+{
+	resource_close(cnx, fd, resource, NULL, cb, cb_data);
+}
+
+// Copy the file into the cache under a new resource name.
+static int copy_to_cache(char *resource, char const *filename)
 {
-	debug("filename = '%s'", filename);
-	char path[chn_files_root_len+1+CHN_RESOURCE_LEN];
-	char *resource = path + snprintf(path, sizeof(path), "%s/", chn_files_root);
-	chn_resource_name_new(resource);
-	if_fail (Mkdir_for_file(path)) return;
 	int source_fd = open(filename, O_RDONLY);
-	if (source_fd < 0) with_error(errno, "open(%s)", filename) return;
-	int resource_fd = creat(path, 0644);
-	if (resource_fd < 0) with_error(errno, "creat(%s)", path) {
-		(void)close(source_fd);
-		return;
+	if (source_fd < 0) with_error(errno, "open(%s)", filename) return -1;
+	int resource_fd = chn_resource_create(resource);
+	unless_error {
+		Copy(resource_fd, source_fd);	// We must save the file from further modifications
+		on_error {
+			error_save();
+			chn_resource_abort(resource_fd, resource);
+			error_restore();
+			resource_fd = -1;
+		}
 	}
-	Copy(resource_fd, source_fd);	// We must save the file from further modifications
-	(void)close(resource_fd);
 	(void)close(source_fd);
-	on_error return;
+	return resource_fd;
+}
+
+void chn_send_file_request(struct chn_cnx *cnx, char const *filename, char *resource_)
+{
+	debug("filename = '%s'", filename);
+	char resource[PATH_MAX];
+	int fd;
+	if_fail (fd = copy_to_cache(resource, filename)) return;
 	if (resource_) snprintf(resource_, PATH_MAX, "%s", resource);
 	if (! cnx) {	// we have no connection : store it for later
-		add_resource_to_putdir(path);
+		chn_resource_close(NULL, fd, resource, NULL, NULL);
 		return;
 	}
 	// We have a connection : send at once !
+	(void)close(fd);
+	cache_update(resource);
 	(void)chn_send_file(cnx, resource);
 }
 
-struct chn_tx *chn_send_file(struct chn_cnx *cnx, char const *resource)
+void chn_send_file_request_async(struct chn_cnx *cnx, char const *filename, char *resource_, chn_tx_cb *cb, void *cb_data)
+{
+	debug("filename = '%s'", filename);
+	char resource[PATH_MAX];
+	int fd;
+	if_fail (fd = copy_to_cache(resource, filename)) return;
+	if (resource_) snprintf(resource_, PATH_MAX, "%s", resource);
+	chn_resource_close(cnx, fd, resource, cb, cb_data);
+}
+
+void chn_send_delta_request_async(struct chn_cnx *cnx, char const *filename, char *resource_, char const *base, chn_tx_cb *cb, void *cb_data)
+{
+	debug("filename = '%s', base = '%s'", filename, base);
+	char resource[PATH_MAX];
+	int fd;
+	if_fail (fd = copy_to_cache(resource, filename)) return;
+	if (resource_) snprintf(resource_, PATH_MAX, "%s", resource);
+	resource_close(cnx, fd, resource, base, cb, cb_data);
+}
+
+// Wait untill we are allowed to issue a new write on this cnx
+static void wait_write_slot(struct chn_cnx *cnx)
+{
+	while (cnx->nb_writes >= cnx->max_writes && cnx->status == 0) {
+		debug("waiting for one of the %u uploads to complete", cnx->nb_writes);
+		pth_event_t ev = pth_event(PTH_EVENT_TIME, pth_timeout(1, 0));
+		(void)pth_mutex_acquire(&cnx->writes_mutex, FALSE, NULL);
+		(void)pth_cond_await(&cnx->writes_cond, &cnx->writes_mutex, ev);
+		(void)pth_mutex_release(&cnx->writes_mutex);
+		pth_event_free(ev, PTH_FREE_THIS);
+	}
+	if (cnx->status != 0) with_error(0, "Connection is closed") return;
+}
+
+static struct command *write_command_new(struct chn_cnx *cnx, char const *resource, char const *base, chn_tx_cb *cb, void *cb_data)
 {
 	assert(cnx && resource);
 	assert(! server);
 	debug("sending file %s", resource);
-
+	if_fail (wait_write_slot(cnx)) return NULL;
 	struct stream *stream;
 	if_fail (stream = stream_new(resource, false)) return NULL;
-	struct command *command;
-	if_fail (command = command_new(cnx, kw_write, resource, stream, false)) return NULL;
+	if (base) stream_set_base(stream, base);
+	struct command *command = command_new(cnx, base ? kw_delta:kw_write, resource, base, stream, cb, cb_data);
 	stream_unref(stream);
+	unless_error cnx->nb_writes ++;
+	return command;
+}
+
+struct chn_tx *chn_send_file(struct chn_cnx *cnx, char const *resource)
+{
+	struct command *command;
+	if_fail (command = write_command_new(cnx, resource, NULL, NULL, NULL)) return NULL;
 	command_wait(command);
 	if (command->status != 200) error_push(0, "Cannot write to resource '%s'", resource);
 	struct chn_tx *tx = command->tx;
@@ -984,6 +1443,12 @@ struct chn_tx *chn_send_file(struct chn_cnx *cnx, char const *resource)
 	return tx;
 }
 
+void chn_send_file_async(struct chn_cnx *cnx, char const *resource, chn_tx_cb *cb, void *cb_data)
+{
+	assert(cb);
+	(void)write_command_new(cnx, resource, NULL, cb, cb_data);
+}
+
 unsigned chn_send_all(struct chn_cnx *cnx)
 {
 	unsigned ret = 0;
@@ -999,6 +1464,7 @@ unsigned chn_send_all(struct chn_cnx *cnx)
 		struct stat statbuf;
 		char path[PATH_MAX];
 		snprintf(path, sizeof(path), "%s/%s", chn_putdir, dirent->d_name);
+		if (is_being_put(path)) continue;
 		if (0 != lstat(path, &statbuf)) with_error(errno, "lstat(%s)", path) break;
 		if (! S_ISLNK(statbuf.st_mode)) continue;
 		char ref_path[PATH_MAX];
@@ -1009,8 +1475,7 @@ unsigned chn_send_all(struct chn_cnx *cnx)
 			warning("Dubious file in putdir : %s -> %s", path, ref_path);
 			continue;
 		}
-		(void)chn_send_file(cnx, ref_path + chn_files_root_len+1);
-		on_error break;
+		if_fail (put_entry_send(cnx, path, ref_path + chn_files_root_len+1, NULL, NULL, NULL)) break;
 		ret ++;
 	}
 	if (0 != closedir(dir)) error_push(errno, "closedir(%s)", chn_putdir);
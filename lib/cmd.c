@@ -120,10 +120,8 @@ static bool is_seq(char const *str)
 	return isdigit(str[0]) || (str[0] == '-' && isdigit(str[1]));
 }
 
-static void parse_line(struct mdir_syntax *syntax, struct mdir_cmd *cmd, struct varbuf *vb, int fd)
+static void parse_tokens(struct mdir_syntax *syntax, struct mdir_cmd *cmd, struct varbuf *vb)
 {
-	varbuf_clean(vb);
-	if_fail (varbuf_read_line(vb, fd, MAX_CMD_LINE, NULL)) return;
 	union mdir_cmd_arg tokens[1 + CMD_MAX_ARGS];	// will point into the varbuf
 	int nb_tokens = tokenize(vb, tokens);
 	on_error return;
@@ -147,6 +145,23 @@ static void parse_line(struct mdir_syntax *syntax, struct mdir_cmd *cmd, struct
 	with_error(ENOENT, "No such keyword '%s'", keyword) return;
 }
 
+static void parse_line(struct mdir_syntax *syntax, struct mdir_cmd *cmd, struct varbuf *vb, int fd)
+{
+	varbuf_clean(vb);
+	if_fail (varbuf_read_line(vb, fd, MAX_CMD_LINE, NULL)) return;
+	parse_tokens(syntax, cmd, vb);
+}
+
+static void exec_cmd(struct mdir_cmd *cmd, void *user_data)
+{
+	if (cmd->def->cb) {
+		cmd->def->cb(cmd, user_data);
+	} else {
+		debug("No handler for command '%s'", cmd->def->keyword);
+	}
+	mdir_cmd_dtor(cmd);
+}
+
 void mdir_cmd_read(struct mdir_syntax *syntax, int fd, void *user_data)
 {
 	debug("reading command on %d", fd);
@@ -159,14 +174,15 @@ void mdir_cmd_read(struct mdir_syntax *syntax, int fd, void *user_data)
 		if_fail (parse_line(syntax, &cmd, &vb, fd)) break;
 	} while (! cmd.def);
 	varbuf_dtor(&vb);	// TODO: keep this vb until after the cb(), then we could ue the original strings in it instead of strduping
-	unless_error {
-		if (cmd.def->cb) {
-			cmd.def->cb(&cmd, user_data);
-		} else {
-			debug("No handler for command '%s'", cmd.def->keyword);
-		}
-		mdir_cmd_dtor(&cmd);
-	}
+	unless_error exec_cmd(&cmd, user_data);
 	return;
 }
 
+void mdir_cmd_parse(struct mdir_syntax *syntax, struct varbuf *vb, void *user_data)
+{
+	struct mdir_cmd cmd;
+	cmd.def = NULL;
+	if_fail (parse_tokens(syntax, &cmd, vb)) return;
+	if (cmd.def) exec_cmd(&cmd, user_data);	// else empty line
+}
+
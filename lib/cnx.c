@@ -45,6 +45,8 @@ char const kw_copy[]  = "copy";
 char const kw_skip[]  = "skip";
 char const kw_miss[]  = "miss";
 char const kw_thx[]   = "thx";
+char const kw_delta[] = "delta";
+char const kw_ref[]   = "ref";
 
 /*
  * Constructors for mdir_sent_query
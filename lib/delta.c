@@ -0,0 +1,412 @@
+/* Copyright 2008 Cedric Cellier.
+ *
+ * This file is part of Scambio.
+ *
+ * Scambio is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Scambio is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with Scambio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * Delta between two versions of a file
+ *
+ * The base is cut into blocks of a size that grows with the square root of the
+ * file size (so that there are never too many of them), and the blocks are indexed
+ * by their weak checksum. The new version is then scanned with a rolling weak
+ * checksum, and the strong checksum (a digest) is computed only when the weak one
+ * matches. Consecutive matching blocks are merged, so that a mostly unchanged file
+ * is described by a few matches.
+ * Files are read with pread() rather than mapped, so that a file truncated while
+ * we read it is an error instead of a SIGBUS, and all this is done by a worker
+ * thread, since it's CPU bound.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <pth.h>
+#include "scambio.h"
+#include "misc.h"
+#include "digest.h"
+#include "delta.h"
+
+/*
+ * Data Definitions
+ */
+
+#define MIN_BLOCK_SIZE 1024
+#define MAX_BLOCK_SIZE 131072
+#define CHUNK_SIZE (1024*1024)	// files are read by chunks of 1MB (more than MAX_BLOCK_SIZE)
+#define NO_BLOCK UINT_MAX
+
+struct block {
+	uint32_t weak;
+	unsigned next;	// next block in the same hash bucket
+	char strong[MAX_DIGEST_STRLEN+1];
+};
+
+struct signatures {
+	size_t block_size;
+	unsigned nb_blocks, hash_mask;
+	struct block *blocks;
+	unsigned *heads;	// first block of each hash bucket
+};
+
+struct match {
+	off_t offset, base_offset, length;
+};
+
+struct delta {
+	off_t size;	// of the new version
+	unsigned nb_matches, size_matches;
+	struct match *matches;	// ordered by offset
+};
+
+// The part of a file we read last
+struct window {
+	int fd;
+	off_t file_size;
+	off_t start;	// file offset of buf[0]
+	size_t len;	// bytes available in buf
+	unsigned char *buf;	// CHUNK_SIZE bytes long
+};
+
+/* The worker thread runs outside of pth, so it must not use the error stack nor
+ * anything that may call fatal(). It returns an errno in err instead.
+ */
+struct delta_job {
+	struct delta *delta;
+	int base_fd, fd;
+	off_t base_size;
+	int err;
+	int done_fd;	// the worker writes one byte there when it's done
+};
+
+/*
+ * Checksums
+ */
+
+// The weak checksum of rsync, that can be rolled one byte at a time
+static uint32_t weak_sum(unsigned char const *data, size_t len)
+{
+	uint32_t a = 0, b = 0;
+	for (size_t i = 0; i < len; i++) {
+		a += data[i];
+		b += (len - i) * data[i];
+	}
+	return (a & 0xffff) | (b << 16);
+}
+
+// Move the window one byte further, out going out and in coming in
+static uint32_t weak_roll(uint32_t sum, size_t len, unsigned char out, unsigned char in)
+{
+	uint32_t a = sum & 0xffff, b = sum >> 16;
+	a = (a - out + in) & 0xffff;
+	b = (b - len * out + a) & 0xffff;
+	return a | (b << 16);
+}
+
+static unsigned hash_weak(struct signatures const *sigs, uint32_t weak)
+{
+	return (weak ^ (weak >> 15)) & sigs->hash_mask;
+}
+
+/*
+ * Reading files
+ */
+
+// Returns 0 or an errno
+static int read_at(int fd, unsigned char *buf, size_t len, off_t offset)
+{
+	while (len > 0) {
+		ssize_t ret = pread(fd, buf, len, offset);
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+			return errno;
+		}
+		if (ret == 0) return EIO;	// truncated since we got its size
+		buf += ret;
+		len -= ret;
+		offset += ret;
+	}
+	return 0;
+}
+
+static int window_ctor(struct window *w, int fd, off_t file_size)
+{
+	w->fd = fd;
+	w->file_size = file_size;
+	w->start = 0;
+	w->len = 0;
+	w->buf = malloc(CHUNK_SIZE);
+	if (! w->buf) return ENOMEM;
+#	ifdef POSIX_FADV_SEQUENTIAL
+	(void)posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#	endif
+	return 0;
+}
+
+static void window_dtor(struct window *w)
+{
+	free(w->buf);
+}
+
+/* Points data to the len bytes of the file at offset, which must be within the file.
+ * offset must not be before the offset of the previous call. Returns 0 or an errno.
+ */
+static int window_get(struct window *w, off_t offset, size_t len, unsigned char const **data)
+{
+	assert(offset >= w->start && len <= CHUNK_SIZE && offset + (off_t)len <= w->file_size);
+	if (offset + (off_t)len > w->start + (off_t)w->len) {
+		// Keep what we have from offset, and read as much as possible after it
+		size_t const keep = w->start + (off_t)w->len > offset ? w->start + w->len - offset : 0;
+		if (keep > 0) memmove(w->buf, w->buf + (offset - w->start), keep);
+		w->start = offset;
+		w->len = keep;
+		off_t const left = w->file_size - (offset + keep);
+		size_t const more = left < (off_t)(CHUNK_SIZE - keep) ? (size_t)left : CHUNK_SIZE - keep;
+		int err = read_at(w->fd, w->buf + keep, more, offset + keep);
+		if (err) return err;
+		w->len += more;
+	}
+	*data = w->buf + (offset - w->start);
+	return 0;
+}
+
+/*
+ * Signatures of the base
+ */
+
+static size_t block_size(off_t size)
+{
+	size_t bs = MIN_BLOCK_SIZE;
+	while (bs < MAX_BLOCK_SIZE && (off_t)bs * (off_t)bs < size) bs *= 2;
+	return bs;
+}
+
+// Returns 0 or an errno. signatures_dtor() must be called even on error.
+static int signatures_ctor(struct signatures *sigs, int base_fd, off_t base_size, size_t bs)
+{
+	sigs->block_size = bs;
+	sigs->nb_blocks = base_size / bs;	// a last partial block is not worth it
+	unsigned hash_size = 1;
+	while (hash_size < sigs->nb_blocks) hash_size *= 2;
+	sigs->hash_mask = hash_size - 1;
+	sigs->blocks = malloc(sigs->nb_blocks * sizeof(*sigs->blocks));
+	sigs->heads = malloc(hash_size * sizeof(*sigs->heads));
+	if (! sigs->blocks || ! sigs->heads) return ENOMEM;
+	struct window w;
+	int err = window_ctor(&w, base_fd, base_size);
+	if (err) return err;
+	for (unsigned b = 0; b < sigs->nb_blocks; b++) {
+		struct block *block = sigs->blocks + b;
+		unsigned char const *data;
+		if (0 != (err = window_get(&w, (off_t)b * bs, bs, &data))) break;
+		block->weak = weak_sum(data, bs);
+		(void)digest(block->strong, bs, (char const *)data);
+	}
+	window_dtor(&w);
+	if (err) return err;
+	// Insert the blocks from the last one, so that chains are ordered by offset
+	for (unsigned h = 0; h < hash_size; h++) sigs->heads[h] = NO_BLOCK;
+	for (unsigned b = sigs->nb_blocks; b-- > 0; ) {
+		unsigned const h = hash_weak(sigs, sigs->blocks[b].weak);
+		sigs->blocks[b].next = sigs->heads[h];
+		sigs->heads[h] = b;
+	}
+	return 0;
+}
+
+static void signatures_dtor(struct signatures *sigs)
+{
+	free(sigs->blocks);
+	free(sigs->heads);
+}
+
+static bool block_matches(struct signatures const *sigs, unsigned b, uint32_t weak, unsigned char const *data, char *strong)
+{
+	if (sigs->blocks[b].weak != weak) return false;
+	if (strong[0] == '\0') (void)digest(strong, sigs->block_size, (char const *)data);
+	return 0 == strcmp(strong, sigs->blocks[b].strong);
+}
+
+// Returns the block which content is at data, or NO_BLOCK. hint is checked first.
+static unsigned find_block(struct signatures const *sigs, uint32_t weak, unsigned char const *data, unsigned hint)
+{
+	char strong[MAX_DIGEST_STRLEN+1] = "";	// computed only once needed
+	if (hint < sigs->nb_blocks && block_matches(sigs, hint, weak, data, strong)) return hint;
+	for (unsigned b = sigs->heads[hash_weak(sigs, weak)]; b != NO_BLOCK; b = sigs->blocks[b].next) {
+		if (block_matches(sigs, b, weak, data, strong)) return b;
+	}
+	return NO_BLOCK;
+}
+
+/*
+ * Matches
+ */
+
+// Returns 0 or an errno
+static int add_match(struct delta *delta, off_t offset, off_t base_offset, off_t length)
+{
+	if (delta->nb_matches > 0) {
+		struct match *last = delta->matches + delta->nb_matches - 1;
+		if (last->offset + last->length == offset && last->base_offset + last->length == base_offset) {
+			last->length += length;
+			return 0;
+		}
+	}
+	if (delta->nb_matches >= delta->size_matches) {
+		unsigned const size = delta->size_matches ? delta->size_matches*2 : 16;
+		struct match *matches = realloc(delta->matches, size * sizeof(*matches));
+		if (! matches) return ENOMEM;
+		delta->matches = matches;
+		delta->size_matches = size;
+	}
+	delta->matches[delta->nb_matches++] = (struct match){ .offset = offset, .base_offset = base_offset, .length = length };
+	return 0;
+}
+
+// Returns 0 or an errno
+static int scan(struct delta *delta, struct signatures const *sigs, int fd)
+{
+	off_t const bs = sigs->block_size;
+	off_t offset = 0;
+	unsigned hint = NO_BLOCK;	// the block following the last match
+	struct window w;
+	int err = window_ctor(&w, fd, delta->size);
+	if (err) return err;
+	unsigned char const *data;
+	if (0 != (err = window_get(&w, 0, bs, &data))) goto quit;
+	uint32_t weak = weak_sum(data, bs);
+	while (1) {
+		// With the byte following the block, if any, to roll the checksum
+		if (0 != (err = window_get(&w, offset, offset + bs < delta->size ? bs+1 : bs, &data))) break;
+		unsigned const b = find_block(sigs, weak, data, hint);
+		if (b != NO_BLOCK) {
+			if (0 != (err = add_match(delta, offset, b * bs, bs))) break;
+			hint = b + 1;
+			offset += bs;
+			if (offset + bs > delta->size) break;
+			if (0 != (err = window_get(&w, offset, bs, &data))) break;
+			weak = weak_sum(data, bs);
+			continue;
+		}
+		if (offset + bs >= delta->size) break;
+		weak = weak_roll(weak, bs, data[0], data[bs]);
+		offset ++;
+	}
+quit:
+	window_dtor(&w);
+	return err;
+}
+
+static void *delta_worker(void *job_)
+{
+	struct delta_job *job = job_;
+	struct signatures sigs;
+	job->err = signatures_ctor(&sigs, job->base_fd, job->base_size, block_size(job->base_size));
+	if (! job->err) job->err = scan(job->delta, &sigs, job->fd);
+	signatures_dtor(&sigs);
+	char c = 0;
+	if (job->done_fd != -1) while (write(job->done_fd, &c, 1) < 0 && errno == EINTR) ;
+	return NULL;
+}
+
+// Run the job in a worker thread, while letting other pth threads run
+static void run_job(struct delta_job *job)
+{
+	int pipe_fds[2];
+	if (0 != pipe(pipe_fds)) {
+		(void)delta_worker(job);	// do it ourself then
+		return;
+	}
+	job->done_fd = pipe_fds[1];
+	pthread_t worker;
+	if (0 != pthread_create(&worker, NULL, delta_worker, job)) {
+		job->done_fd = -1;
+		(void)delta_worker(job);
+	} else {
+		char c;
+		while (pth_read(pipe_fds[0], &c, 1) < 0) {
+			if (errno != EINTR) fatal("Cannot wait for delta worker : %s", strerror(errno));
+		}
+		(void)pthread_join(worker, NULL);
+	}
+	(void)close(pipe_fds[0]);
+	(void)close(pipe_fds[1]);
+}
+
+/*
+ * Public Functions
+ */
+
+struct delta *delta_new(char const *base_path, int fd)
+{
+	int base_fd = open(base_path, O_RDONLY);
+	if (base_fd < 0) with_error(errno, "open(%s)", base_path) return NULL;
+	struct delta *delta = Malloc(sizeof(*delta));
+	delta->nb_matches = delta->size_matches = 0;
+	delta->matches = NULL;
+	struct delta_job job = { .delta = delta, .base_fd = base_fd, .fd = fd, .err = 0, .done_fd = -1 };
+	do {
+		if_fail (job.base_size = filesize(base_fd)) break;
+		if_fail (delta->size = filesize(fd)) break;
+		size_t const bs = block_size(job.base_size);
+		if (job.base_size < (off_t)bs || delta->size < (off_t)bs) break;	// nothing to look for
+		run_job(&job);
+		if (job.err) with_error(job.err, "Cannot compare with %s", base_path) break;
+	} while (0);
+	(void)close(base_fd);
+	on_error {
+		delta_del(delta);
+		return NULL;
+	}
+	off_t found = 0;
+	for (unsigned m = 0; m < delta->nb_matches; m++) found += delta->matches[m].length;
+	debug("%lld bytes out of %lld found in %s, in %u matches", (long long)found, (long long)delta->size, base_path, delta->nb_matches);
+	return delta;
+}
+
+void delta_del(struct delta *delta)
+{
+	free(delta->matches);
+	free(delta);
+}
+
+off_t delta_match(struct delta const *delta, off_t offset, off_t *base_offset, off_t *next)
+{
+	// Look for the first match that ends after offset
+	unsigned lo = 0, hi = delta->nb_matches;
+	while (lo < hi) {
+		unsigned mid = lo + (hi - lo)/2;
+		struct match const *m = delta->matches + mid;
+		if (m->offset + m->length <= offset) lo = mid + 1;
+		else hi = mid;
+	}
+	if (lo >= delta->nb_matches) {
+		*next = delta->size;
+		return 0;
+	}
+	struct match const *m = delta->matches + lo;
+	if (m->offset > offset) {
+		*next = m->offset;
+		return 0;
+	}
+	*base_offset = m->base_offset + (offset - m->offset);
+	return m->offset + m->length - offset;
+}
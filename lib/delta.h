@@ -0,0 +1,48 @@
+/* Copyright 2008 Cedric Cellier.
+ *
+ * This file is part of Scambio.
+ *
+ * Scambio is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Scambio is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with Scambio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef DELTA_H_261019
+#define DELTA_H_261019
+
+#include <sys/types.h>
+
+/* A delta tells which parts of a new version of a resource can be found in a
+ * previous version of it (its base), so that only the rest has to be sent.
+ * As in rsync, the base is cut into blocks which weak (rolling) and strong
+ * checksums are indexed, and the new version is scanned for these blocks at
+ * every byte offset. Since the client keeps the previous version in its cache
+ * (it downloaded or uploaded it), signatures are computed locally, and only
+ * the literal data and the references to the base go over the channel (see
+ * kw_delta and kw_ref).
+ */
+struct delta;
+
+/* Compare the content of fd to the base file.
+ * Beware that this reads both files entirely. This is done by a worker thread,
+ * while the calling pth thread waits without blocking the others.
+ */
+struct delta *delta_new(char const *base_path, int fd);
+void delta_del(struct delta *delta);
+
+/* Returns the length of the data found in the base at offset (setting
+ * base_offset to where it's found), or 0 if the data at offset must be sent,
+ * in which case next is set to the offset of the next data found in the base
+ * (or to the end of the file).
+ */
+off_t delta_match(struct delta const *delta, off_t offset, off_t *base_offset, off_t *next);
+
+#endif
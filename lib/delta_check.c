@@ -0,0 +1,177 @@
+/* Copyright 2008 Cedric Cellier.
+ *
+ * This file is part of Scambio.
+ *
+ * Scambio is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Scambio is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with Scambio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* Checks for the deltas.
+ * A random base file is modified in known ways (bytes changed, inserted, removed
+ * and appended), then the new version is rebuilt from the base using delta_match()
+ * only where it tells the data is in the base, and must be identical. The parts we
+ * did not modify must also be found in the base, at the offsets we expect.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include "scambio.h"
+#include "misc.h"
+#include "check.h"
+#include "delta.h"
+
+#define BASE_SIZE (1024*1024 - 123)
+#define BLOCK_SIZE 1024	// the block size delta.c uses for files of BASE_SIZE
+#define INSERT_AT 300000
+#define INSERT_LEN 100
+#define CHANGE_AT 600000
+#define REMOVE_AT 800000
+#define REMOVE_LEN 5000
+#define APPEND_LEN 3000
+
+static unsigned char base[BASE_SIZE];
+static unsigned char modified[BASE_SIZE + INSERT_LEN + APPEND_LEN];
+static unsigned char rebuilt[sizeof(modified)];
+static char const *tmpdir;
+
+// Write data into a new file of our temporary directory, which path is returned in path
+static int write_tmp(char path[PATH_MAX], unsigned char const *data, size_t len)
+{
+	snprintf(path, PATH_MAX, "%s/file.XXXXXX", tmpdir);
+	int fd = mkstemp(path);
+	if (fd < 0) with_error(errno, "mkstemp") return -1;
+	if_fail (Write(fd, data, len)) {
+		(void)close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// Build the new version from the base where delta_match() tells so, and from the data elsewhere
+static off_t rebuild(char const *what, struct delta const *delta, unsigned char const *data, size_t size)
+{
+	off_t found = 0;
+	for (off_t offset = 0; offset < (off_t)size; ) {
+		off_t base_offset, next;
+		off_t const len = delta_match(delta, offset, &base_offset, &next);
+		if (len > 0) {
+			if (base_offset < 0 || base_offset + len > BASE_SIZE || offset + len > (off_t)size) {
+				check_fail(what, "match out of bounds");
+				return found;
+			}
+			memcpy(rebuilt + offset, base + base_offset, len);
+			found += len;
+			offset += len;
+		} else {
+			if (next <= offset || next > (off_t)size) {
+				check_fail(what, "bad next match");
+				return found;
+			}
+			memcpy(rebuilt + offset, data + offset, next - offset);
+			offset = next;
+		}
+	}
+	if (0 != memcmp(rebuilt, data, size)) check_fail(what, "rebuilt data differs from the new version");
+	return found;
+}
+
+// Tells that the data at offset is found at base_offset, for at least len bytes
+static void expect_match(char const *what, struct delta const *delta, off_t offset, off_t base_offset, off_t len)
+{
+	off_t got_base, next;
+	off_t const got = delta_match(delta, offset, &got_base, &next);
+	if (got < len || got_base != base_offset) check_fail(what, "unmodified data not found in the base");
+}
+
+static struct delta *delta_of(char const *base_path, unsigned char const *data, size_t size)
+{
+	char path[PATH_MAX];
+	int fd;
+	if_fail (fd = write_tmp(path, data, size)) return NULL;
+	struct delta *delta = delta_new(base_path, fd);
+	(void)close(fd);
+	(void)unlink(path);
+	return delta;
+}
+
+int main(void)
+{
+	check_begin();
+	tmpdir = check_tmpdir("delta_check");
+
+	srand(42);
+	for (size_t i = 0; i < sizeof(base); i++) base[i] = rand();
+
+	// A new version with some modifications at known places
+	size_t size = 0;
+	memcpy(modified, base, INSERT_AT);
+	size += INSERT_AT;
+	for (unsigned i = 0; i < INSERT_LEN; i++) modified[size++] = rand();
+	memcpy(modified + size, base + INSERT_AT, REMOVE_AT - INSERT_AT);
+	size += REMOVE_AT - INSERT_AT;
+	modified[CHANGE_AT + INSERT_LEN] ^= 0xff;
+	memcpy(modified + size, base + REMOVE_AT + REMOVE_LEN, BASE_SIZE - REMOVE_AT - REMOVE_LEN);
+	size += BASE_SIZE - REMOVE_AT - REMOVE_LEN;
+	for (unsigned i = 0; i < APPEND_LEN; i++) modified[size++] = rand();
+
+	char base_path[PATH_MAX];
+	int base_fd;
+	if_fail (base_fd = write_tmp(base_path, base, sizeof(base))) {
+		check_fail("base", error_str());
+		return check_end();
+	}
+	(void)close(base_fd);
+
+	struct delta *delta;
+	if_fail (delta = delta_of(base_path, modified, size)) {
+		check_fail("modified version", error_str());
+		error_clear();
+	} else {
+		off_t const found = rebuild("modified version", delta, modified, size);
+		// Each modification may hide the blocks around it
+		off_t const unmodified = size - INSERT_LEN - APPEND_LEN - 1;
+		if (found < unmodified - 6*BLOCK_SIZE) check_fail("modified version", "too little data found in the base");
+		off_t const after_insert = (INSERT_AT/BLOCK_SIZE + 1) * BLOCK_SIZE;
+		off_t const after_remove = (REMOVE_AT + REMOVE_LEN + BLOCK_SIZE - 1)/BLOCK_SIZE * BLOCK_SIZE;
+		expect_match("before insertion", delta, 0, 0, INSERT_AT/BLOCK_SIZE * BLOCK_SIZE);
+		expect_match("middle of first match", delta, 12345, 12345, 1);
+		expect_match("after insertion", delta, after_insert + INSERT_LEN, after_insert, CHANGE_AT - after_insert - BLOCK_SIZE);
+		expect_match("after removal", delta, after_remove + INSERT_LEN - REMOVE_LEN, after_remove, BLOCK_SIZE);
+		off_t base_offset, next;
+		if (0 != delta_match(delta, size - 1, &base_offset, &next) || next != (off_t)size) check_fail("appended data", "found in the base");
+		delta_del(delta);
+	}
+
+	// The same file is a single match
+	if_fail (delta = delta_of(base_path, base, sizeof(base))) {
+		check_fail("same version", error_str());
+		error_clear();
+	} else {
+		off_t const found = rebuild("same version", delta, base, sizeof(base));
+		if (found != BASE_SIZE / BLOCK_SIZE * BLOCK_SIZE) check_fail("same version", "not entirely found in the base");
+		delta_del(delta);
+	}
+
+	// Small files have nothing in common with the base
+	if_fail (delta = delta_of(base_path, base, BLOCK_SIZE - 1)) {
+		check_fail("small version", error_str());
+		error_clear();
+	} else {
+		if (0 != rebuild("small version", delta, base, BLOCK_SIZE - 1)) check_fail("small version", "found in the base");
+		delta_del(delta);
+	}
+
+	return check_end();
+}
@@ -557,7 +557,7 @@ mdir_version mdir_patch(struct mdir *mdir, enum mdir_action action, struct heade
 	return version;
 }
 
-void mdir_patch_request(struct mdir *mdir, enum mdir_action action, struct header *header)
+static void transient_patch(struct mdir *mdir, enum mdir_action action, struct header *header, mdir_version tver)
 {
 	bool is_dir = header_is_directory(header);
 	struct header_field *dirId_field = is_dir ? header_find(header, SC_DIRID_FIELD, NULL) : NULL;
@@ -571,25 +571,52 @@ void mdir_patch_request(struct mdir *mdir, enum mdir_action action, struct heade
 	}
 	on_error return;
 	char temp[PATH_MAX];
-	int len = snprintf(temp, sizeof(temp), "%s/.tmp/", mdir->path);
-	if_fail (Mkdir(temp)) return;
-	mdir_version tver;
-	if_fail (tver = persist_read_inc_sequence(&transient_version)) return;
-	snprintf(temp+len, sizeof(temp)-len, "%c%"PRIversion, action == MDIR_ADD ? '+':'-', tver);
+	snprintf(temp, sizeof(temp), "%s/.tmp/%c%"PRIversion, mdir->path, action == MDIR_ADD ? '+':'-', tver);
 	int fd = open(temp, O_WRONLY|O_CREAT|O_EXCL, 0440);
 	if (fd < 0) with_error(errno, "Cannot create transient patch in %s", temp) return;
 	header_write(header, fd);
 	(void)close(fd);
 }
 
+void mdir_patch_request(struct mdir *mdir, enum mdir_action action, struct header *header)
+{
+	mdir_patch_request_many(mdir, action, 1, &header);
+}
+
+void mdir_patch_request_many(struct mdir *mdir, enum mdir_action action, unsigned nb, struct header *const *headers)
+{
+	if (nb == 0) return;
+	char temp[PATH_MAX];
+	snprintf(temp, sizeof(temp), "%s/.tmp", mdir->path);
+	if_fail (Mkdir(temp)) return;
+	mdir_version tver;
+	if_fail (tver = persist_read_add_sequence(&transient_version, nb)) return;
+	for (unsigned h = 0; h < nb; h++) {
+		if_fail (transient_patch(mdir, action, headers[h], tver + h)) return;
+	}
+}
+
 void mdir_del_request(struct mdir *mdir, mdir_version to_del)
 {
-	if (to_del <= 0) with_error(0, "Cannot delete transient patch") return;
-	struct header *h = header_new();
+	mdir_del_request_many(mdir, 1, &to_del);
+}
+
+void mdir_del_request_many(struct mdir *mdir, unsigned nb, mdir_version const *to_del)
+{
+	struct header **headers = Calloc(nb * sizeof(*headers) + 1);
 	on_error return;
-	(void)header_field_new(h, SC_TARGET_FIELD, mdir_version2str(to_del));
-	unless_error mdir_patch_request(mdir, MDIR_REM, h);
-	header_unref(h);
+	unsigned h;
+	for (h = 0; h < nb; h++) {
+		if (to_del[h] <= 0) with_error(0, "Cannot delete transient patch") break;
+		if_fail (headers[h] = header_new()) break;
+		if_fail ((void)header_field_new(headers[h], SC_TARGET_FIELD, mdir_version2str(to_del[h]))) {
+			header_unref(headers[h]);
+			break;
+		}
+	}
+	unless_error mdir_patch_request_many(mdir, MDIR_REM, nb, headers);
+	while (h > 0) header_unref(headers[--h]);
+	free(headers);
 }
 
 mdir_version mdir_get_folder_version(struct mdir *mdir, char const *name)
@@ -613,13 +640,15 @@ extern inline void mdir_cursor_dtor(struct mdir_cursor *);
 extern inline void mdir_cursor_reset(struct mdir_cursor *);
 static inline void mdir_cursor_seek(struct mdir_cursor *, mdir_version);
 
-static void synch_list(
-	struct mdir *mdir, struct mdir_cursor *cursor,
+// Stops after max patches if max > 0. Returns the number of patches listed.
+static unsigned synch_list(
+	struct mdir *mdir, struct mdir_cursor *cursor, unsigned max,
 	void (*put_cb)(struct mdir *, struct header *, mdir_version, void *),
 	void (*rem_cb)(struct mdir *, mdir_version, void *),
 	void *data)
 {
   	// List content of journals
+	unsigned nb_listed = 0;
 	struct jnl *jnl;
 	mdir_version from = cursor->last_listed_sync + 1;
 	debug("listing synched from version %"PRIversion, from);
@@ -630,9 +659,10 @@ static void synch_list(
 		}
 		if (from < jnl->version) from = jnl->version;	// a gap
 		for (unsigned index = from - jnl->version; index < jnl->nb_patches; index++) {
+			if (max > 0 && nb_listed >= max) return nb_listed;
 			enum mdir_action action;
 			struct header *h = jnl_read(jnl, index, &action);
-			on_error return;
+			on_error return nb_listed;
 			if (! h) continue;
 			if (action == MDIR_REM) {
 				if (rem_cb) {
@@ -656,9 +686,11 @@ static void synch_list(
 			}
 			header_unref(h);
 			cursor->last_listed_sync = jnl->version + index;
-			on_error return;
+			nb_listed ++;
+			on_error return nb_listed;
 		}
 	}
+	return nb_listed;
 }
 
 static void transient_list(
@@ -762,7 +794,7 @@ void mdir_patch_list(
 	mdir_reload(mdir);	// journals may have changed, other appended
 	if (put_cb || rem_cb) {
 		if (! unsync_only) {
-			if_fail (synch_list(mdir, cursor, put_cb, rem_cb, data)) return;
+			if_fail (synch_list(mdir, cursor, 0, put_cb, rem_cb, data)) return;
 		}
 		if_fail (transient_list(mdir, cursor, put_cb, rem_cb, data)) return;
 	}
@@ -771,6 +803,16 @@ void mdir_patch_list(
 	}
 }
 
+unsigned mdir_patch_list_synched(
+	struct mdir *mdir, struct mdir_cursor *cursor, unsigned max,
+	void (*put_cb)(struct mdir *, struct header *, mdir_version, void *),
+	void (*rem_cb)(struct mdir *, mdir_version, void *),
+	void *data)
+{
+	if_fail (mdir_reload(mdir)) return 0;
+	return synch_list(mdir, cursor, max, put_cb, rem_cb, data);
+}
+
 void mdir_folder_list(struct mdir *mdir, bool new_only, void (*cb)(struct mdir *, struct mdir *, bool, char const *, void *), void *data)
 {
 	DIR *d = opendir(mdir->path);
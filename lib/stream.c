@@ -28,6 +28,8 @@
 #include "scambio.h"
 #include "misc.h"
 #include "stream.h"
+#include "cache.h"
+#include "delta.h"
 
 /*
  * Data Definitions
@@ -43,24 +45,82 @@ unsigned chn_putdir_len;
  * Create/Delete
  */
 
+// Returns the size of the hole starting at offset (0 if there are data at offset)
+static off_t hole_size(int fd, off_t offset, off_t totsize)
+{
+#	ifdef SEEK_DATA
+	off_t data = lseek(fd, offset, SEEK_DATA);
+	if (data == (off_t)-1) {
+		if (errno == ENXIO) return totsize - offset;	// only a hole up to the end
+		return 0;	// the filesystem does not know about holes
+	}
+	return data - offset;
+#	else
+	(void)fd;
+	(void)offset;
+	(void)totsize;
+	return 0;
+#	endif
+}
+
+// Returns the size of the data starting at offset, up to the next hole
+static off_t data_size(int fd, off_t offset, off_t totsize)
+{
+#	ifdef SEEK_HOLE
+	off_t hole = lseek(fd, offset, SEEK_HOLE);
+	if (hole != (off_t)-1 && hole < totsize) return hole - offset;
+#	else
+	(void)fd;
+#	endif
+	return totsize - offset;
+}
+
 static void *stream_push(void *arg)
 {
 	struct stream *stream = arg;
 	struct chn_tx *tx;
 	while (1) {
 		while (LIST_EMPTY(&stream->readers)) pth_usleep(10000);	// FIXME
+		if (stream->base[0] != '\0') {	// before pushing anything, look for what the base already have
+			if_fail (stream->delta = delta_new(stream->base, stream->fd)) {
+				warning("Cannot compute delta against %s, sending the whole file : %s", stream->base, error_str());
+				error_clear();
+			}
+			stream->base[0] = '\0';
+		}
 		debug("for each reader...");
 		LIST_FOREACH(tx, &stream->readers, reader_entry) {
 			pth_cancel_point();
 #			define STREAM_READ_BLOCK 10000
 			bool eof = false;
 			off_t totsize = filesize(stream->fd);
+			off_t skip = tx->end_offset < totsize ? hole_size(stream->fd, tx->end_offset, totsize) : 0;
+			if (skip > 0) {	// sparse file : do not send the zeros
+				eof = tx->end_offset + skip >= totsize;
+				debug("skip %lld bytes / %lld", (long long)skip, (long long)totsize);
+				chn_tx_write(tx, skip, NULL, eof);
+				on_error return NULL;
+				continue;
+			}
 			size_t size = STREAM_READ_BLOCK;
-			if ((off_t)size + tx->end_offset >= totsize) {
-				size = totsize - tx->end_offset;
-				eof = true;
+			off_t avail = data_size(stream->fd, tx->end_offset, totsize);
+			if (stream->delta) {	// the base may have these data already
+				off_t base_offset, next;
+				off_t const found = delta_match(stream->delta, tx->end_offset, &base_offset, &next);
+				if (found > 0) {
+					eof = tx->end_offset + found >= totsize;
+					debug("ref %lld bytes from base offset %lld / %lld", (long long)found, (long long)base_offset, (long long)totsize);
+					chn_tx_write_ref(tx, found, base_offset, eof);
+					on_error return NULL;
+					continue;
+				}
+				if (next - tx->end_offset < avail) avail = next - tx->end_offset;
 			}
-			debug("write %zu bytes / %u", size, (unsigned)totsize);
+			if ((off_t)size >= avail) {
+				size = avail;
+				eof = tx->end_offset + avail >= totsize;
+			}
+			debug("write %zu bytes / %lld", size, (long long)totsize);
 			struct chn_box *box;
 			if_fail (box = chn_box_alloc(size)) return NULL;
 			if_fail (ReadFrom(box->data, stream->fd, tx->end_offset, size)) return NULL;
@@ -81,6 +141,8 @@ static void stream_ctor(struct stream *stream, char const *name, bool rt)
 	stream->count = 1;	// the one who asks
 	snprintf(stream->path, sizeof(stream->path), "%s/%s", chn_files_root, name);
 	stream->last_used = time(NULL);
+	stream->base[0] = '\0';
+	stream->delta = NULL;
 	if (rt) {
 		stream->fd = -1;
 		stream->pth = NULL;
@@ -130,6 +192,11 @@ static void stream_dtor(struct stream *stream)
 	if (stream->fd != -1) {
 		(void)close(stream->fd);
 		stream->fd = -1;
+		cache_update(stream->path + chn_files_root_len + 1);
+	}
+	if (stream->delta) {
+		delta_del(stream->delta);
+		stream->delta = NULL;
 	}
 }
 
@@ -139,6 +206,12 @@ void stream_del(struct stream *stream)
 	free(stream);
 }
 
+void stream_set_base(struct stream *stream, char const *base)
+{
+	assert(stream->fd != -1);
+	snprintf(stream->base, sizeof(stream->base), "%s/%s", chn_files_root, base);
+}
+
 extern inline struct stream *stream_ref(struct stream *stream);
 extern inline void stream_unref(struct stream *stream);
 
@@ -181,20 +254,60 @@ struct stream *stream_lookup(char const *name, bool rt)
 	return stream_new(name, rt);
 }
 
+bool stream_is_loaded(char const *name)
+{
+	struct stream *stream;
+	LIST_FOREACH(stream, &streams, entry) {
+		if (0 == strcmp(stream->path + chn_files_root_len + 1, name)) return true;
+	}
+	return false;
+}
+
 /*
  * Write
  *
  * Writing to a stream is writting to all its reading TXs, and optionaly to its backup file.
  */
 
+// Make the range [offset, offset+size[ of the file a hole
+static void write_hole(int fd, off_t offset, size_t size, bool eof)
+{
+	off_t cur_size = filesize(fd);
+	on_error return;
+	off_t end = offset + size;
+	if (offset < cur_size) {	// some data might be there already
+		off_t punch_end = end < cur_size ? end : cur_size;
+#		ifdef FALLOC_FL_PUNCH_HOLE
+		if (0 == fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, offset, punch_end - offset)) {
+			offset = punch_end;
+		} else if (errno != EOPNOTSUPP && errno != ENOSYS) {
+			with_error(errno, "fallocate(punch)") return;
+		}
+#		endif
+		static char const zeros[STREAM_READ_BLOCK];
+		while (offset < punch_end) {	// no way to punch : write zeros
+			size_t len = punch_end - offset < (off_t)sizeof(zeros) ? (size_t)(punch_end - offset) : sizeof(zeros);
+			if_fail (WriteTo(fd, offset, zeros, len)) return;
+			offset += len;
+		}
+	}
+	if (end > cur_size || eof) {	// extending a file leaves a hole
+		if (0 != ftruncate(fd, end)) with_error(errno, "ftruncate stream") return;
+	}
+}
+
 void stream_write(struct stream *stream, off_t offset, size_t size, struct chn_box *box, bool eof)
 {
 	assert(stream->has_writer);
 	debug("Writing to stream which fd = %d", stream->fd);
 	stream->last_used = time(NULL);
 	if (stream->fd != -1) {	// append to file
-		if_fail (WriteTo(stream->fd, offset, box->data, size)) return;
-		if (eof && 0 != ftruncate(stream->fd, offset + size)) with_error(errno, "truncate stream") return;
+		if (box) {
+			if_fail (WriteTo(stream->fd, offset, box->data, size)) return;
+			if (eof && 0 != ftruncate(stream->fd, offset + size)) with_error(errno, "truncate stream") return;
+		} else {
+			if_fail (write_hole(stream->fd, offset, size, eof)) return;
+		}
 	}
 	struct chn_tx *tx;
 	LIST_FOREACH(tx, &stream->readers, reader_entry) {
@@ -43,13 +43,22 @@ struct stream {
 	time_t last_used;	// usefull for RT streams
 	char path[PATH_MAX];
 	pth_t pth;	// thread that push file onto reading TXs
+	// For uploads sent as a delta against a previous version (see stream_set_base())
+	char base[PATH_MAX];	// path of the base, until the delta is computed
+	struct delta *delta;	// the delta, once computed (or NULL)
 };
 
 void stream_begin(void);
 void stream_end(void);
 struct stream *stream_lookup(char const *name, bool rt);	// will find an existing stream or load a new file backed stream.
 struct stream *stream_new(char const *name, bool rt);	// create a new stream for the given resource
+bool stream_is_loaded(char const *name);	// tells if someone is reading or writing this resource
 void stream_del(struct stream *stream);
+/* The file will be pushed as references into the base resource (see chn_tx_write_ref())
+ * wherever its content can be found there, and as data elsewhere.
+ * The delta is computed by the stream thread before it pushes anything.
+ */
+void stream_set_base(struct stream *stream, char const *base);
 static inline struct stream *stream_ref(struct stream *stream)
 {
 	stream->count++;
@@ -65,6 +74,7 @@ static inline void stream_unref(struct stream *stream)
 /* Will fail if there is already one writer */
 void stream_add_writer(struct stream *stream);
 void stream_remove_writer(struct stream *stream);
+/* A NULL box means that this range is a hole (see kw_skip). */
 void stream_write(struct stream *stream, off_t offset, size_t size, struct chn_box *box, bool eof);
 
 void stream_add_reader(struct stream *stream, struct chn_tx *tx);
@@ -16,13 +16,96 @@
  * along with Scambio.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "misc.h"
+#include "miscmac.h"
 #include "merefs.h"
 
 /*
- * File entry : a structure to cache info about local files or to keep what's on the mdir
+ * Interned strings
+ *
+ * Each distinct string is stored only once, with a count of its users.
  */
 
+#define INTERN_MIN_HASH_SIZE 1024
+
+struct istring {
+	LIST_ENTRY(istring) h_entry;
+	unsigned count;
+	unsigned hash;
+	char str[];
+};
+static LIST_HEAD(istring_bucket, istring) *istrings;
+static unsigned istrings_hash_size, nb_istrings;
+
+static unsigned hash_str(char const *str)
+{
+	unsigned h = 2166136261U;
+	while (*str) h = (h ^ (unsigned char)*str++) * 16777619U;
+	return h;
+}
+
+static void istrings_rehash(unsigned hash_size)
+{
+	struct istring_bucket *old = istrings;
+	unsigned const old_size = istrings_hash_size;
+	istrings = Malloc(hash_size * sizeof(*istrings));
+	istrings_hash_size = hash_size;
+	for (unsigned h = 0; h < hash_size; h++) LIST_INIT(istrings+h);
+	for (unsigned h = 0; h < old_size; h++) {
+		struct istring *is;
+		while (NULL != (is = LIST_FIRST(old+h))) {
+			LIST_REMOVE(is, h_entry);
+			LIST_INSERT_HEAD(istrings + is->hash % hash_size, is, h_entry);
+		}
+	}
+	free(old);
+}
+
+char const *intern(char const *str)
+{
+	unsigned const hash = hash_str(str);
+	struct istring *is;
+	LIST_FOREACH(is, istrings + hash % istrings_hash_size, h_entry) {
+		if (is->hash == hash && 0 == strcmp(is->str, str)) {
+			is->count ++;
+			return is->str;
+		}
+	}
+	if (nb_istrings >= 2 * istrings_hash_size) istrings_rehash(2 * istrings_hash_size);
+	size_t const len = strlen(str);
+	is = Malloc(sizeof(*is) + len + 1);
+	is->count = 1;
+	is->hash = hash;
+	memcpy(is->str, str, len+1);
+	LIST_INSERT_HEAD(istrings + hash % istrings_hash_size, is, h_entry);
+	nb_istrings ++;
+	return is->str;
+}
+
+void unintern(char const *str)
+{
+	struct istring *is = DOWNCAST(str, str, istring);
+	if (--is->count > 0) return;
+	LIST_REMOVE(is, h_entry);
+	nb_istrings --;
+	free(is);
+}
+
+static unsigned hash_of_interned(char const *str)
+{
+	return DOWNCAST(str, str, istring)->hash;
+}
+
+/*
+ * File entry : a structure to keep what's on the mdir
+ */
+
+#define FILES_MIN_HASH_SIZE 256
+
 struct files unmatched_files, matched_files, removed_files;
 
 static char const *sanitize(char const *name)
@@ -32,13 +115,70 @@ static char const *sanitize(char const *name)
 	return name;
 }
 
+static unsigned hash_version(mdir_version version)
+{
+	return (unsigned)version ^ (unsigned)(version >> 32);
+}
+
+static void files_ctor(struct files *list)
+{
+	TAILQ_INIT(&list->list);
+	list->hash_size = FILES_MIN_HASH_SIZE;
+	list->nb_files = 0;
+	list->by_name = Malloc(3 * list->hash_size * sizeof(*list->by_name));
+	list->by_digest = list->by_name + list->hash_size;
+	list->by_version = list->by_digest + list->hash_size;
+	for (unsigned h = 0; h < 3 * list->hash_size; h++) LIST_INIT(list->by_name+h);
+}
+
+static void index_file(struct files *list, struct file *file)
+{
+	LIST_INSERT_HEAD(list->by_name + hash_of_interned(file->name) % list->hash_size, file, name_entry);
+	LIST_INSERT_HEAD(list->by_digest + hash_of_interned(file->digest) % list->hash_size, file, digest_entry);
+	LIST_INSERT_HEAD(list->by_version + hash_version(file->version) % list->hash_size, file, version_entry);
+}
+
+static void unindex_file(struct file *file)
+{
+	LIST_REMOVE(file, name_entry);
+	LIST_REMOVE(file, digest_entry);
+	LIST_REMOVE(file, version_entry);
+}
+
+static void files_rehash(struct files *list, unsigned hash_size)
+{
+	free(list->by_name);
+	list->hash_size = hash_size;
+	list->by_name = Malloc(3 * hash_size * sizeof(*list->by_name));
+	list->by_digest = list->by_name + hash_size;
+	list->by_version = list->by_digest + hash_size;
+	for (unsigned h = 0; h < 3 * hash_size; h++) LIST_INIT(list->by_name+h);
+	struct file *file;
+	TAILQ_FOREACH(file, &list->list, entry) index_file(list, file);
+}
+
+static void files_insert(struct files *list, struct file *file)
+{
+	if (list->nb_files >= 2 * list->hash_size) files_rehash(list, 2 * list->hash_size);
+	TAILQ_INSERT_HEAD(&list->list, file, entry);
+	index_file(list, file);
+	list->nb_files ++;
+}
+
+static void files_remove(struct files *list, struct file *file)
+{
+	TAILQ_REMOVE(&list->list, file, entry);
+	unindex_file(file);
+	list->nb_files --;
+}
+
 static void file_ctor(struct file *file, struct files *list, char const *name, char const *digest, char const *resource, mdir_version version)
 {
-	snprintf(file->name, sizeof(file->name), "%s", sanitize(name));
-	snprintf(file->digest, sizeof(file->digest), "%s", digest);
-	snprintf(file->resource, sizeof(file->resource), "%s", resource ? resource : "");
+	file->name = intern(sanitize(name));
+	file->digest = intern(digest);
+	file->resource = intern(resource ? resource : "");
 	file->version = version;
-	STAILQ_INSERT_HEAD(list, file, entry);
+	files_insert(list, file);
 }
 
 struct file *file_new(struct files *list, char const *name, char const *digest, char const *resource, mdir_version version)
@@ -54,7 +194,10 @@ struct file *file_new(struct files *list, char const *name, char const *digest,
 
 static void file_dtor(struct file *file, struct files *list)
 {
-	STAILQ_REMOVE(list, file, file, entry);
+	files_remove(list, file);
+	unintern(file->name);
+	unintern(file->digest);
+	unintern(file->resource);
 }
 
 void file_del(struct file *file, struct files *list)
@@ -63,10 +206,22 @@ void file_del(struct file *file, struct files *list)
 	free(file);
 }
 
+void file_move(struct file *file, struct files *from, struct files *to)
+{
+	files_remove(from, file);
+	files_insert(to, file);
+}
+
+void files_move_all(struct files *from, struct files *to)
+{
+	struct file *file;
+	while (NULL != (file = TAILQ_FIRST(&from->list))) file_move(file, from, to);
+}
+
 void free_file_list(struct files *list)
 {
 	struct file *file;
-	while (NULL != (file = STAILQ_FIRST(list))) {
+	while (NULL != (file = TAILQ_FIRST(&list->list))) {
 		file_del(file, list);
 	}
 }
@@ -76,7 +231,7 @@ struct file *file_search(struct files *list, char const *name)
 	name = sanitize(name);
 
 	struct file *file;
-	STAILQ_FOREACH(file, list, entry) {
+	LIST_FOREACH(file, list->by_name + hash_str(name) % list->hash_size, name_entry) {
 		if (0 == strcmp(name, file->name)) return file;
 	}
 	return NULL;
@@ -85,7 +240,7 @@ struct file *file_search(struct files *list, char const *name)
 struct file *file_search_by_version(struct files *list, mdir_version version)
 {
 	struct file *file;
-	STAILQ_FOREACH(file, list, entry) {
+	LIST_FOREACH(file, list->by_version + hash_version(version) % list->hash_size, version_entry) {
 		if (file->version == version) return file;
 	}
 	return NULL;
@@ -94,33 +249,66 @@ struct file *file_search_by_version(struct files *list, mdir_version version)
 struct file *file_search_by_digest(struct files *list, char const *digest)
 {
 	struct file *file;
-	STAILQ_FOREACH(file, list, entry) {
+	LIST_FOREACH(file, list->by_digest + hash_str(digest) % list->hash_size, digest_entry) {
 		if (0 == strcmp(file->digest, digest)) return file;
 	}
 	return NULL;
 }
 
-void file_set_digest(struct file *file, char const *digest)
+/*
+ * File stats
+ */
+
+void file_stat_clear(struct file_stat *st)
+{
+	st->size = 0;
+	st->inode = 0;
+	st->mtime_ns = st->ctime_ns = 0;
+}
+
+void file_stat_load(struct file_stat *st, char const *path)
+{
+	struct stat statbuf;
+	if (0 != stat(path, &statbuf)) with_error(errno, "stat(%s)", path) return;
+	st->size = statbuf.st_size;
+	st->inode = statbuf.st_ino;
+	st->mtime_ns = statbuf.st_mtim.tv_sec * 1000000000LL + statbuf.st_mtim.tv_nsec;
+	st->ctime_ns = statbuf.st_ctim.tv_sec * 1000000000LL + statbuf.st_ctim.tv_nsec;
+}
+
+bool file_stat_eq(struct file_stat const *a, struct file_stat const *b)
 {
-	snprintf(file->digest, sizeof(file->digest), "%s", digest);
+	return
+		a->inode != 0 &&	// cleared stats are never equal
+		a->size == b->size && a->inode == b->inode &&
+		a->mtime_ns == b->mtime_ns && a->ctime_ns == b->ctime_ns;
 }
 
 /*
  * Init
  */
 
+static void files_dtor(struct files *list)
+{
+	free_file_list(list);
+	free(list->by_name);
+}
+
 static void files_end(void)
 {
-	free_file_list(&unmatched_files);
-	free_file_list(&matched_files);
-	free_file_list(&removed_files);
+	files_dtor(&unmatched_files);
+	files_dtor(&matched_files);
+	files_dtor(&removed_files);
+	free(istrings);
 }
 
 void files_begin(void)
 {
-	STAILQ_INIT(&unmatched_files);
-	STAILQ_INIT(&matched_files);
-	STAILQ_INIT(&removed_files);
+	istrings_hash_size = INTERN_MIN_HASH_SIZE;
+	istrings = Malloc(istrings_hash_size * sizeof(*istrings));
+	for (unsigned h = 0; h < istrings_hash_size; h++) LIST_INIT(istrings+h);
+	files_ctor(&unmatched_files);
+	files_ctor(&matched_files);
+	files_ctor(&removed_files);
 	atexit(files_end);
 }
-
@@ -18,27 +18,57 @@
 #ifndef FILE_H_081112
 #define FILE_H_081112
 
+#include <stdbool.h>
+#include <sys/types.h>
 #include "digest.h"
 #include "scambio/mdir.h"
 
+/* What we remember of a local file's inode when we digested it, so that we
+ * do not have to digest it again as long as it's unchanged.
+ * A cleared file_stat never matches any file.
+ */
+struct file_stat {
+	off_t size;
+	ino_t inode;
+	long long mtime_ns, ctime_ns;
+};
+
+/* Remote files are kept in several lists (see below), each one indexed by name,
+ * digest and version. Their strings are interned, since the same names and
+ * digests are met in several places.
+ */
 struct file {
-	STAILQ_ENTRY(file) entry;	// on the hash we use to cache local files attributes, or onto unmatched_files for remote files
-	char name[PATH_MAX];	// relative to local_path
-	char digest[MAX_DIGEST_STRLEN+1];
-	char resource[PATH_MAX];
-	mdir_version version;	// unset for local files
+	TAILQ_ENTRY(file) entry;	// onto unmatched_files for remote files, for instance
+	LIST_ENTRY(file) name_entry, digest_entry, version_entry;	// in the indexes of its list
+	char const *name;	// relative to local_path
+	char const *digest;
+	char const *resource;
+	mdir_version version;
 };
-extern STAILQ_HEAD(files, file) unmatched_files;	// remote files that have no local counterpart
+struct files {
+	TAILQ_HEAD(file_list, file) list;
+	LIST_HEAD(file_bucket, file) *by_name, *by_digest, *by_version;
+	unsigned hash_size, nb_files;
+};
+extern struct files unmatched_files;	// remote files that have no local counterpart
 extern struct files matched_files;	// remote files that was matched against a local file
 extern struct files removed_files;	// remote files that were removed (that we keep for their resource)
 
 void files_begin(void);
 struct file *file_new(struct files *list, char const *name, char const *digest, char const *resource, mdir_version version);
 void file_del(struct file *file, struct files *list);
+void file_move(struct file *file, struct files *from, struct files *to);
+void files_move_all(struct files *from, struct files *to);
 struct file *file_search(struct files *list, char const *name);
 struct file *file_search_by_version(struct files *list, mdir_version version);
 struct file *file_search_by_digest(struct files *list, char const *digest);
-void file_set_digest(struct file *, char const *digest);
 void free_file_list(struct files *);
 
+char const *intern(char const *str);
+void unintern(char const *str);
+
+void file_stat_clear(struct file_stat *);
+void file_stat_load(struct file_stat *, char const *path);
+bool file_stat_eq(struct file_stat const *, struct file_stat const *);
+
 #endif
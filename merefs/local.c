@@ -16,6 +16,7 @@
  * along with Scambio.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <string.h>
+#include <assert.h>
 #include <limits.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -23,22 +24,38 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <time.h>
 #include "scambio/channel.h"
 #include "scambio/header.h"
 #include "misc.h"
 #include "merefs.h"
 #include "map.h"
 
-static void wait_complete(void)
-{
-	debug("waiting...");
-	struct timespec ts = { .tv_sec = 0, .tv_nsec = 10000000 };
-	while (! chn_cnx_all_tx_done(&ccnx)) pth_nanosleep(&ts, NULL);
-}
+/* New local files are uploaded concurrently, and the corresponding mdir
+ * patches are all sent once the uploads are over (see flush_uploads()).
+ */
+struct upload {
+	STAILQ_ENTRY(upload) entry;
+	int status;	// 0 while uploading
+	bool replace;	// if set, old_version must be removed from the mdir
+	mdir_version old_version;
+	char fname[PATH_MAX];
+	char digest[MAX_DIGEST_STRLEN+1];
+	char map_digest[MAX_DIGEST_STRLEN+1];	// what to keep in the map if the upload fails
+	char resource[PATH_MAX];
+	struct file_stat stat;	// of the uploaded file, if it can be trusted
+	bool has_stat;
+};
+static STAILQ_HEAD(uploads, upload) uploads = STAILQ_HEAD_INITIALIZER(uploads);
+static unsigned nb_uploading;
+static pth_mutex_t uploads_mutex = PTH_MUTEX_INIT;
+static pth_cond_t uploads_cond = PTH_COND_INIT;	// signaled whenever an upload is over
 
-static void keep_map(char const *fname, char const *digest)
+#define DELTA_MIN_SIZE 65536	// smaller files are always uploaded whole
+
+static void keep_map(char const *fname, char const *digest, struct file_stat const *st)
 {
-	map_set(&next_map, fname, digest);
+	map_set(&sync_map, fname, digest, st);
 }
 
 static void remote_is_master(struct file *file, char const *fpath)
@@ -73,15 +90,56 @@ static void remote_is_master(struct file *file, char const *fpath)
 		with_error(errno, "link(%s <- %s)", cache_file, fpath) return;
 	}
 
-	// Now update the file map
-	map_set(&next_map, file->name, file->digest);
+	// Now update the file map (the new local file will be digested once more)
+	map_set(&sync_map, file->name, file->digest, NULL);
 }
 
-static void local_is_master(struct file *remote_file, char const *fpath, char const *fname, char const *digest)
+static void upload_done(struct chn_tx *tx, int status, void *data)
+{
+	(void)tx;
+	struct upload *upload = data;
+	debug("upload of '%s' is over with status %d", upload->fname, status);
+	upload->status = status;
+	assert(nb_uploading > 0);
+	nb_uploading --;
+	(void)pth_cond_notify(&uploads_cond, FALSE);
+}
+
+// Tells if the new version of remote_file, in fpath, can be sent as a delta
+// against the previous one, ie. if the latter is still intact in the cache.
+static bool can_send_delta(struct file const *remote_file, char const *fpath)
+{
+	if (! use_delta || ! remote_file) return false;
+	char cache_file[PATH_MAX];
+	if_fail (chn_get_file(NULL, cache_file, remote_file->resource)) {	// not in the cache any more
+		error_clear();
+		return false;
+	}
+	struct stat cache_stat, local_stat;
+	if (0 != stat(cache_file, &cache_stat) || 0 != stat(fpath, &local_stat)) return false;
+	if (cache_stat.st_size < DELTA_MIN_SIZE || local_stat.st_size < DELTA_MIN_SIZE) return false;
+	// If the local file is hardlinked to the cache (see remote_is_master()) it was modified along
+	if (cache_stat.st_dev == local_stat.st_dev && cache_stat.st_ino == local_stat.st_ino) return false;
+	char digest[MAX_DIGEST_STRLEN+1];
+	char const *path = cache_file;
+	int err;
+	if (1 != digest_files(1, &path, &digest, &err)) return false;
+	return 0 == strcmp(digest, remote_file->digest);
+}
+
+static void local_is_master(struct file *remote_file, char const *fpath, char const *fname, char const *digest, struct file_stat const *st)
 {
-	char resource[PATH_MAX];
-	
 	if (! background) printf("New local file : %s\n", fname);
+	struct upload *upload = Malloc(sizeof(*upload));
+	upload->status = 0;
+	upload->replace = remote_file != NULL;
+	upload->old_version = remote_file ? remote_file->version : 0;
+	snprintf(upload->fname, sizeof(upload->fname), "%s", fname);
+	snprintf(upload->digest, sizeof(upload->digest), "%s", digest);
+	upload->has_stat = st != NULL;
+	if (st) upload->stat = *st;
+	char const *map_digest = map_get_digest(&sync_map, fname);
+	snprintf(upload->map_digest, sizeof(upload->map_digest), "%s", map_digest ? map_digest : "");
 	// Send file contents for this resource,
 	// or reuse an existing resource if the content is already up there
 	// (for instance if we renamed the file)
@@ -90,31 +148,85 @@ static void local_is_master(struct file *remote_file, char const *fpath, char co
 	if (! remote) remote = file_search_by_digest(&removed_files, digest);
 	if (remote) {
 		debug("Content is already known remotely as content for file '%s'", remote->name);
-		snprintf(resource, sizeof(resource), "%s", remote->resource);
+		snprintf(upload->resource, sizeof(upload->resource), "%s", remote->resource);
+		upload->status = 200;
 	} else {
 		debug("New content, upload it");
 		if (! background) printf("   ...uploading\n");
-		if_fail (chn_send_file_request(&ccnx, fpath, resource)) return;
-		wait_complete();
+		nb_uploading ++;
+		if (can_send_delta(remote_file, fpath)) {
+			debug("Sending as a delta against resource '%s'", remote_file->resource);
+			chn_send_delta_request_async(&ccnx, fpath, upload->resource, remote_file->resource, upload_done, upload);
+		} else {
+			chn_send_file_request_async(&ccnx, fpath, upload->resource, upload_done, upload);
+		}
+		on_error {
+			nb_uploading --;
+			free(upload);
+			return;
+		}
 	}
+	STAILQ_INSERT_TAIL(&uploads, upload, entry);
+}
 
+static void publish_upload(struct upload *upload)
+{
 	// Now patch the mdir : send a patch to advertize the new file
 	struct header *header;
 	if_fail (header = header_new()) return;
 	(void)header_field_new(header, SC_TYPE_FIELD, SC_FILE_TYPE);
-	(void)header_field_new(header, SC_NAME_FIELD, fname);
-	(void)header_field_new(header, SC_DIGEST_FIELD, digest);
-	(void)header_field_new(header, SC_RESOURCE_FIELD, resource);
+	(void)header_field_new(header, SC_NAME_FIELD, upload->fname);
+	(void)header_field_new(header, SC_DIGEST_FIELD, upload->digest);
+	(void)header_field_new(header, SC_RESOURCE_FIELD, upload->resource);
 	mdir_patch_request(mdir, MDIR_ADD, header);
 	header_unref(header);
 	on_error return;
 
-	if (remote_file) {	// Remove old version from the mdir
-		if_fail (mdir_del_request(mdir, remote_file->version)) return;
+	if (upload->replace) {	// Remove old version from the mdir
+		if_fail (mdir_del_request(mdir, upload->old_version)) return;
 	}
 	
 	// Now update the file map
-	map_set(&next_map, fname, digest);
+	map_set(&sync_map, upload->fname, upload->digest, upload->has_stat ? &upload->stat : NULL);
+}
+
+// Wait for all uploads to complete, then send all the patches at once
+static void flush_uploads(void)
+{
+	debug("waiting for %u uploads...", nb_uploading);
+	(void)pth_mutex_acquire(&uploads_mutex, FALSE, NULL);
+	while (nb_uploading > 0 && ccnx.status == 0) {	// the cnx status is checked every second
+		pth_event_t ev = pth_event(PTH_EVENT_TIME, pth_timeout(1, 0));
+		(void)pth_cond_await(&uploads_cond, &uploads_mutex, ev);
+		pth_event_free(ev, PTH_FREE_THIS);
+	}
+	(void)pth_mutex_release(&uploads_mutex);
+	// The channel fails the pending uploads when the cnx is closed, but an upload
+	// which callback was not called yet is still referenced : keep it for later.
+	struct uploads pending = STAILQ_HEAD_INITIALIZER(pending);
+	struct upload *upload;
+	while (NULL != (upload = STAILQ_FIRST(&uploads))) {
+		STAILQ_REMOVE_HEAD(&uploads, entry);
+		if (upload->status == 0) {
+			STAILQ_INSERT_TAIL(&pending, upload, entry);
+			continue;
+		}
+		if (upload->status == 200) {
+			if_fail (publish_upload(upload)) {
+				error("Cannot publish '%s' : %s", upload->fname, error_str());
+				error_clear();
+				upload->status = 0;
+			}
+		} else {
+			error("Cannot upload '%s' (status %d)", upload->fname, upload->status);
+		}
+		if (upload->status != 200 && upload->map_digest[0] != '\0') {
+			// So that we will retry next time (with no stat, so that the file is digested again)
+			map_set(&sync_map, upload->fname, upload->map_digest, NULL);
+		}
+		free(upload);
+	}
+	STAILQ_CONCAT(&uploads, &pending);
 }
 
 static void conflict(char const *fpath)
@@ -143,17 +255,17 @@ static void remove_local_file(char const *fpath)
 	if (0 != unlink(fpath)) with_error(errno, "unlink(%s)", fpath) return;
 }
 
-static void match_local_file(char const *fpath, char const *fname, char const *digest)
+// st is the stat of the local file when it was digested, or NULL if it can't be trusted
+static void match_local_file(char const *fpath, char const *fname, char const *digest, struct file_stat const *st)
 {
 	debug("Working on local file '%s' with digest '%s'", fname, digest);
 	// Look for corresponding R and M files
 	struct file *remote_file = file_search(&unmatched_files, fname);
-	char const *map_digest = map_get_digest(&current_map, fname);
+	char const *map_digest = map_get_digest(&sync_map, fname);
 
 	if (remote_file) {	// Remove from the unmatched list
 		debug("Found a remote file with digest '%s'", remote_file->digest);
-		STAILQ_REMOVE(&unmatched_files, remote_file, file, entry);
-		STAILQ_INSERT_HEAD(&matched_files, remote_file, entry);
+		file_move(remote_file, &unmatched_files, &matched_files);
 	}
 
 	if (remote_file && map_digest) {
@@ -161,7 +273,7 @@ static void match_local_file(char const *fpath, char const *fname, char const *d
 			debug("...in synch with map record");
 			if (0 == strcmp(digest, remote_file->digest)) {
 				debug("...and the remote file");
-				keep_map(fname, map_digest);
+				keep_map(fname, map_digest, st);
 			} else {
 				debug("...but remote file was changed");
 				remote_is_master(remote_file, fpath);
@@ -170,7 +282,7 @@ static void match_local_file(char const *fpath, char const *fname, char const *d
 			debug("...local file was changed");
 			if (0 == strcmp(map_digest, remote_file->digest)) {
 				debug("...but not remote file");
-				local_is_master(remote_file, fpath, fname, digest);
+				local_is_master(remote_file, fpath, fname, digest, st);
 			} else {
 				debug("...and so do remote file !");
 				conflict(fpath);
@@ -181,7 +293,7 @@ static void match_local_file(char const *fpath, char const *fname, char const *d
 		debug("...which just appeared under the same name than a remote file !");
 		if (0 == strcmp(digest, remote_file->digest)) {
 			debug("...and they are the same ! (map file was lost ?)");
-			keep_map(fname, digest);
+			keep_map(fname, digest, st);
 		} else {
 			conflict(fpath);
 			remote_is_master(remote_file, fpath);
@@ -197,13 +309,80 @@ static void match_local_file(char const *fpath, char const *fname, char const *d
 		}
 	} else {	// not in map nor remote
 		debug("...wich is a new file");
-		local_is_master(NULL, fpath, fname, digest);
+		local_is_master(NULL, fpath, fname, digest, st);
 	}
 }
 
 static void traverse_dir_rec(char *dirpath, int dirlen);
+
+/* Digest all plain files of a directory at once, then match them.
+ * Files which stat did not change since they were last digested are not digested
+ * again (but for a few of them if we are paranoid).
+ */
+static void match_files(unsigned nb_files, char **paths)
+{
+	if (nb_files == 0) return;
+	char (*digests)[MAX_DIGEST_STRLEN+1] = Malloc(nb_files * sizeof(*digests));
+	int *errs = Malloc(nb_files * sizeof(*errs));
+	struct file_stat *stats = Malloc(nb_files * sizeof(*stats));
+	char const **to_digest = Malloc(nb_files * sizeof(*to_digest));
+	unsigned *to_digest_idx = Malloc(nb_files * sizeof(*to_digest_idx));
+	unsigned nb_to_digest = 0;
+	for (unsigned f = 0; f < nb_files; f++) {
+		errs[f] = 0;
+		if_fail (file_stat_load(stats+f, paths[f])) {
+			errs[f] = error_code();
+			error_clear();
+			continue;
+		}
+		char const *map_digest = map_get_unchanged_digest(&sync_map, paths[f]+local_path_len, stats+f);
+		if (map_digest && (paranoia == 0 || 0 != rand() % paranoia)) {
+			snprintf(digests[f], sizeof(digests[f]), "%s", map_digest);
+			continue;
+		}
+		if (map_digest) debug("Digesting unchanged file %s anyway", paths[f]);
+		to_digest[nb_to_digest] = paths[f];
+		to_digest_idx[nb_to_digest++] = f;
+	}
+	debug("%u/%u files to digest", nb_to_digest, nb_files);
+	char (*new_digests)[MAX_DIGEST_STRLEN+1] = Malloc((nb_to_digest+1) * sizeof(*new_digests));
+	int *new_errs = Malloc((nb_to_digest+1) * sizeof(*new_errs));
+	(void)digest_files(nb_to_digest, to_digest, new_digests, new_errs);
+	for (unsigned d = 0; d < nb_to_digest; d++) {
+		unsigned const f = to_digest_idx[d];
+		errs[f] = new_errs[d];
+		if (errs[f]) continue;
+		char const *map_digest = map_get_unchanged_digest(&sync_map, paths[f]+local_path_len, stats+f);
+		if (map_digest && 0 != strcmp(map_digest, new_digests[d])) {
+			warning("File %s changed but its stat did not", paths[f]);
+		}
+		snprintf(digests[f], sizeof(digests[f]), "%s", new_digests[d]);
+	}
+	// A file that's modified in the same clock tick than we stat it may change again
+	// without its stat changing, so we cannot trust the stats of recently modified files.
+	long long const racy_ns = (time(NULL) - 1) * 1000000000LL;
+	for (unsigned f = 0; f < nb_files; f++) {
+		if (errs[f]) {
+			error("Cannot digest %s : %s", paths[f], strerror(errs[f]));
+			continue;
+		}
+		bool const racy = stats[f].mtime_ns >= racy_ns || stats[f].ctime_ns >= racy_ns;
+		match_local_file(paths[f], paths[f]+local_path_len, digests[f], racy ? NULL : stats+f);
+		on_error break;
+	}
+	free(new_errs);
+	free(new_digests);
+	free(to_digest_idx);
+	free(to_digest);
+	free(stats);
+	free(errs);
+	free(digests);
+}
+
 static void scan_opened_dir(DIR *dir, char *dirpath, int dirlen)
 {
+	unsigned nb_files = 0, max_files = 0;
+	char **paths = NULL;
 	struct dirent *dirent;
 	while (NULL != (dirent = readdir(dir))) {
 		debug("Dir entry '%s' of type %d", dirent->d_name, dirent->d_type);
@@ -215,23 +394,27 @@ static void scan_opened_dir(DIR *dir, char *dirpath, int dirlen)
 		}
 		if (dirent->d_type == DT_DIR) {	// recurse
 			debug("...recurse");
-			int new_dirlen = dirlen + snprintf(dirpath+dirlen, sizeof(dirpath)-dirlen, "/%s", dirent->d_name);
+			int new_dirlen = dirlen + snprintf(dirpath+dirlen, PATH_MAX-dirlen, "/%s", dirent->d_name);
 			traverse_dir_rec(dirpath, new_dirlen);
 			dirpath[dirlen] = '\0';
-			on_error return;
+			on_error break;
 		} else if (dirent->d_type == DT_REG) {
 			debug("...plain file");
-			snprintf(dirpath+dirlen, sizeof(dirpath)-dirlen, "/%s", dirent->d_name);
-			char digest[MAX_DIGEST_STRLEN+1];
-			if_succeed (digest_file(digest, dirpath)) {
-				match_local_file(dirpath, dirpath+local_path_len, digest);
+			if (nb_files >= max_files) {
+				max_files = max_files ? max_files*2 : 64;
+				paths = realloc(paths, max_files * sizeof(*paths));
+				if (! paths) fatal("Cannot alloc file list");
 			}
+			snprintf(dirpath+dirlen, PATH_MAX-dirlen, "/%s", dirent->d_name);
+			paths[nb_files++] = Strdup(dirpath);
 			dirpath[dirlen] = '\0';
-			on_error return;
 		} else {
 			debug("...ignoring");
 		}
 	}
+	unless_error match_files(nb_files, paths);
+	while (nb_files--) free(paths[nb_files]);
+	free(paths);
 }
 
 static void traverse_dir_rec(char *dirpath, int dirlen)
@@ -248,7 +431,67 @@ void traverse_local_path(void)
 	char dirpath[PATH_MAX];
 	int len = snprintf(dirpath, sizeof(dirpath), "%s", local_path);
 	while (len > 0 && dirpath[len-1] == '/') len--;
-	if_fail (traverse_dir_rec(dirpath, len)) return;
+	if_fail (traverse_dir_rec(dirpath, len)) {
+		// Uploads may be in progress nonetheless
+		error_save();
+		flush_uploads();
+		error_restore();
+		return;
+	}
+	flush_uploads();
+}
+
+/* Match only the local files which names were changed (and those of the remote
+ * files that were added or removed since last run) against their mdir entries.
+ * This is traverse_local_path() and create_unmatched_files() restricted to these
+ * names, and the map entries of the other names are kept as they are (see
+ * map_commit()).
+ */
+void match_changed_files(void)
+{
+	// Remote files that are not matched yet must be checked as well
+	struct file *file;
+	TAILQ_FOREACH(file, &unmatched_files.list, entry) change_add(file->name);
+
+	unsigned nb_names = 0, max_names = 0, nb_files = 0;
+	char **names = NULL, **paths = NULL;
+	char *name;
+	while (NULL != (name = change_pop())) {
+		if (nb_names >= max_names) {
+			max_names = max_names ? max_names*2 : 64;
+			names = realloc(names, max_names * sizeof(*names));
+			paths = realloc(paths, max_names * sizeof(*paths));
+			if (! names || ! paths) fatal("Cannot alloc file list");
+		}
+		names[nb_names++] = name;
+		map_forget(&sync_map, name);	// unless it's set again
+		// If the remote file was already matched, match it again
+		struct file *remote_file = file_search(&matched_files, name);
+		if (remote_file) {
+			file_move(remote_file, &matched_files, &unmatched_files);
+		}
+		char fpath[PATH_MAX];
+		snprintf(fpath, sizeof(fpath), "%.*s/%s", (int)local_path_len, local_path, name);
+		struct stat statbuf;
+		if (0 == lstat(fpath, &statbuf) && S_ISREG(statbuf.st_mode)) {
+			paths[nb_files++] = Strdup(fpath);
+		}
+	}
+	debug("%u names changed, %u are local files", nb_names, nb_files);
+
+	if_fail (match_files(nb_files, paths)) {
+		error_save();
+		flush_uploads();
+		error_restore();
+	} else {
+		flush_uploads();
+		unless_error create_unmatched_files();
+	}
+
+	while (nb_files--) free(paths[nb_files]);
+	while (nb_names--) free(names[nb_names]);
+	free(paths);
+	free(names);
 }
 
 // If some remote files are still unmatched, create them
@@ -257,15 +500,14 @@ void create_unmatched_files(void)
 	debug("Create all files still not matched");
 	char fpath[PATH_MAX];
 	struct file *file, *tmp;
-	STAILQ_FOREACH_SAFE(file, &unmatched_files, entry, tmp) {
+	TAILQ_FOREACH_SAFE(file, &unmatched_files.list, entry, tmp) {
 		snprintf(fpath, sizeof(fpath), "%s/%s", local_path, file->name);
-		char const *map_digest = map_get_digest(&current_map, file->name);
+		char const *map_digest = map_get_digest(&sync_map, file->name);
 		
 		if (! map_digest) {
 			debug("Remote file '%s' is a new file", file->name);
 			if_fail (remote_is_master(file, fpath)) return;
-			STAILQ_REMOVE(&unmatched_files, file, file, entry);
-			STAILQ_INSERT_HEAD(&matched_files, file, entry);
+			file_move(file, &unmatched_files, &matched_files);
 		} else {
 			debug("Local file '%s' was deliberately removed", file->name);
 			if_fail (mdir_del_request(mdir, file->version)) return;
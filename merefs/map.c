@@ -15,8 +15,27 @@
  * You should have received a copy of the GNU Affero General Public License
  * along with Scambio.  If not, see <http://www.gnu.org/licenses/>.
  */
+/*
+ * The map of synched files
+ *
+ * The map file starts with MAP_MAGIC and is then a log of records, each being :
+ * - the length of the payload (4 bytes),
+ * - the payload : a type (MAP_SET or MAP_DEL), followed for MAP_SET by the size,
+ *   inode, mtime and ctime of the local file (8 bytes each) and the digest (nul
+ *   terminated), and finally the name (up to the end of the payload),
+ * - a checksum of the payload (4 bytes).
+ * Numbers are in host byte order.
+ * Each run appends the records of the names that changed, and when there are too
+ * many records for the number of names the whole map is rewritten (see compact()).
+ * A record that's truncated or that fails its checksum (because we were interrupted
+ * while writing it) ends the log.
+ * Maps from the former formats (fixed size records) are converted.
+ */
+#include <stdlib.h>
+#include <stdint.h>
 #include <limits.h>
 #include <stdio.h>
+#include <string.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -24,73 +43,433 @@
 #include <unistd.h>
 #include "scambio.h"
 #include "misc.h"
+#include "varbuf.h"
 #include "merefs.h"
 #include "file.h"
 #include "map.h"
 
-void map_load(struct files *files)
+/*
+ * Data Definitions
+ */
+
+#define MAP_MAGIC "scmap-3\n"
+#define MAP_SET 'S'
+#define MAP_DEL 'D'
+#define MAP_LEGACY_V2_MARK ".map-v2"	// first name of the former format with stats
+#define MAP_MIN_HASH_SIZE 1024
+#define MAP_MIN_RECORDS 1024	// never compact a map with less records than that
+#define MAP_WRITE_CHUNK 65536
+
+struct map_entry {
+	LIST_ENTRY(map_entry) h_entry;
+	STAILQ_ENTRY(map_entry) t_entry;	// on the touched list
+	bool exists;	// false if it was created during this run
+	bool touched;	// set or forgotten during this run
+	bool has_next;	// if touched, tells if it will still exist after this run
+	char digest[MAX_DIGEST_STRLEN+1];
+	struct file_stat stat;
+	char next_digest[MAX_DIGEST_STRLEN+1];
+	struct file_stat next_stat;
+	char name[];
+};
+
+/*
+ * Index
+ */
+
+static uint32_t fnv(void const *data_, size_t len)
 {
-	char map_fname[PATH_MAX];
-	snprintf(map_fname, sizeof(map_fname), "%s/.map", local_path);
-	debug("Loading sync map from '%s'", map_fname);
-	
-	int fd = open(map_fname, O_RDONLY|O_CREAT, 0640);
-	if (fd < 0) with_error(errno, "open(%s)", map_fname) return;
+	unsigned char const *data = data_;
+	uint32_t h = 2166136261U;
+	while (len--) h = (h ^ *data++) * 16777619U;
+	return h;
+}
 
-	STAILQ_INIT(files);
-	do {
-		char path[PATH_MAX], digest[MAX_DIGEST_STRLEN+1];
-		if_fail (Read(path, fd, sizeof(path))) {
-			if (error_code() == 0) {	// EOF
-				error_clear();
-			}
+static char const *sanitize(char const *name)
+{
+	// We store the name without the leading slash
+	while (*name == '/') name++;
+	return name;
+}
+
+static struct map_bucket *bucket_of(struct map *map, char const *name)
+{
+	return map->hash + fnv(name, strlen(name)) % map->hash_size;
+}
+
+static struct map_entry *entry_lookup(struct map *map, char const *name)
+{
+	struct map_entry *e;
+	LIST_FOREACH(e, bucket_of(map, name), h_entry) {
+		if (0 == strcmp(e->name, name)) return e;
+	}
+	return NULL;
+}
+
+static void rehash(struct map *map, unsigned hash_size)
+{
+	struct map_bucket *old_hash = map->hash;
+	unsigned const old_size = map->hash_size;
+	map->hash = Malloc(hash_size * sizeof(*map->hash));
+	map->hash_size = hash_size;
+	for (unsigned h = 0; h < hash_size; h++) LIST_INIT(map->hash+h);
+	for (unsigned h = 0; h < old_size; h++) {
+		struct map_entry *e;
+		while (NULL != (e = LIST_FIRST(old_hash+h))) {
+			LIST_REMOVE(e, h_entry);
+			LIST_INSERT_HEAD(bucket_of(map, e->name), e, h_entry);
+		}
+	}
+	free(old_hash);
+}
+
+static struct map_entry *entry_new(struct map *map, char const *name)
+{
+	if (map->nb_entries >= 2 * map->hash_size) rehash(map, 2 * map->hash_size);
+	size_t const len = strlen(name);
+	struct map_entry *e = Malloc(sizeof(*e) + len + 1);
+	e->exists = e->touched = e->has_next = false;
+	e->digest[0] = e->next_digest[0] = '\0';
+	file_stat_clear(&e->stat);
+	file_stat_clear(&e->next_stat);
+	memcpy(e->name, name, len+1);
+	LIST_INSERT_HEAD(bucket_of(map, name), e, h_entry);
+	map->nb_entries ++;
+	return e;
+}
+
+static void entry_del(struct map *map, struct map_entry *e)
+{
+	LIST_REMOVE(e, h_entry);
+	map->nb_entries --;
+	free(e);
+}
+
+/*
+ * Records
+ */
+
+static void put_record(struct varbuf *vb, struct map_entry const *e, char type)
+{
+	size_t const name_len = strlen(e->name);
+	size_t const digest_len = strlen(e->digest);
+	int64_t const nums[4] = { e->stat.size, e->stat.inode, e->stat.mtime_ns, e->stat.ctime_ns };
+	uint32_t len = 1 + name_len;
+	if (type == MAP_SET) len += sizeof(nums) + digest_len + 1;
+	size_t const start = vb->used + sizeof(len);
+	if_fail (varbuf_append(vb, sizeof(len), &len)) return;
+	if_fail (varbuf_append(vb, 1, &type)) return;
+	if (type == MAP_SET) {
+		if_fail (varbuf_append(vb, sizeof(nums), nums)) return;
+		if_fail (varbuf_append(vb, digest_len+1, e->digest)) return;
+	}
+	if_fail (varbuf_append(vb, name_len, e->name)) return;
+	uint32_t const sum = fnv(vb->buf + start, len);
+	(void)varbuf_append(vb, sizeof(sum), &sum);
+}
+
+// Write the buffered records once there are enough of them
+static void append_record(int fd, struct varbuf *vb, struct map_entry const *e, char type)
+{
+	if_fail (put_record(vb, e, type)) return;
+	if (vb->used < MAP_WRITE_CHUNK) return;
+	if_fail (Write(fd, vb->buf, vb->used)) return;
+	varbuf_clean(vb);
+}
+
+// Returns the size of the record, or 0 if it's not valid
+static size_t apply_record(struct map *map, char const *rec, size_t size)
+{
+	uint32_t len, sum;
+	if (size < sizeof(len)) return 0;
+	memcpy(&len, rec, sizeof(len));
+	if (len < 2 || size - sizeof(len) < (size_t)len + sizeof(sum)) return 0;
+	char const *p = rec + sizeof(len), *const end = p + len;
+	memcpy(&sum, end, sizeof(sum));
+	if (sum != fnv(p, len)) return 0;
+	char const type = *p++;
+	int64_t nums[4];
+	char const *digest = NULL;
+	if (type == MAP_SET) {
+		if (end - p < (ptrdiff_t)sizeof(nums)) return 0;
+		memcpy(nums, p, sizeof(nums));
+		p += sizeof(nums);
+		digest = p;
+		if (NULL == (p = memchr(p, '\0', end - p)) || p - digest > MAX_DIGEST_STRLEN) return 0;
+		p ++;
+	} else if (type != MAP_DEL) {
+		return 0;
+	}
+	size_t const name_len = end - p;
+	if (name_len == 0 || name_len >= PATH_MAX) return 0;
+	char name[PATH_MAX];
+	memcpy(name, p, name_len);
+	name[name_len] = '\0';
+
+	struct map_entry *e = entry_lookup(map, name);
+	if (type == MAP_DEL) {
+		if (e) entry_del(map, e);
+	} else {
+		if (! e) e = entry_new(map, name);
+		e->exists = true;
+		snprintf(e->digest, sizeof(e->digest), "%s", digest);
+		e->stat.size = nums[0];
+		e->stat.inode = nums[1];
+		e->stat.mtime_ns = nums[2];
+		e->stat.ctime_ns = nums[3];
+	}
+	map->nb_records ++;
+	return sizeof(len) + len + sizeof(sum);
+}
+
+static void load_records(struct map *map, char const *buf, size_t size, char const *path)
+{
+	for (size_t off = sizeof(MAP_MAGIC)-1; off < size; ) {
+		size_t const len = apply_record(map, buf + off, size - off);
+		if (len == 0) {
+			warning("Sync map %s is corrupted after offset %zu, ignoring the rest", path, off);
+			if (0 != ftruncate(map->fd, off)) with_error(errno, "ftruncate(%s)", path) return;
 			break;
 		}
-		if_fail (Read(digest, fd, sizeof(digest))) break;
-		(void)file_new(files, path, digest, NULL, 0);
-	} while (! is_error());
+		off += len;
+	}
+}
 
-	(void)close(fd);
+// Former formats : fixed size name and digest, then the file_stat if we met MAP_LEGACY_V2_MARK
+static void load_legacy(struct map *map, char const *buf, size_t size)
+{
+	size_t const name_size = PATH_MAX, digest_size = MAX_DIGEST_STRLEN+1;
+	bool v2 = false;
+	for (size_t off = 0; off + name_size + digest_size <= size; ) {
+		char const *name = buf + off, *digest = name + name_size;
+		off += name_size + digest_size;
+		if (strnlen(name, name_size) == name_size || strnlen(digest, digest_size) == digest_size) break;
+		if (! v2 && 0 == strcmp(name, MAP_LEGACY_V2_MARK)) {
+			v2 = true;
+			continue;
+		}
+		name = sanitize(name);
+		struct map_entry *e = entry_lookup(map, name);
+		if (! e) e = entry_new(map, name);
+		e->exists = true;
+		snprintf(e->digest, sizeof(e->digest), "%s", digest);
+		if (v2) {
+			if (off + sizeof(e->stat) > size) break;
+			memcpy(&e->stat, buf + off, sizeof(e->stat));
+			off += sizeof(e->stat);
+		}
+	}
 }
 
-void map_save(struct files *files)
+static void map_path(char *path, size_t size, char const *suffix)
 {
-	char map_fname[PATH_MAX];
-	snprintf(map_fname, sizeof(map_fname), "%s/.map", local_path);
-	debug("Saving sync map to '%s'", map_fname);
+	snprintf(path, size, "%s/.map%s", local_path, suffix);
+}
 
-	int fd = open(map_fname, O_WRONLY, 0640);
-	if (fd < 0) with_error(errno, "open(%s)", map_fname) return;
+// Rewrite the whole map, with one record per name
+static void compact(struct map *map)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	map_path(path, sizeof(path), "");
+	map_path(tmp, sizeof(tmp), ".tmp");
+	debug("Compacting sync map %s (%u records for %u names)", path, map->nb_records, map->nb_entries);
 
-	struct file *file;
-	STAILQ_FOREACH(file, files, entry) {
-		if_fail (Write(fd, file->name, sizeof(file->name))) break;
-		if_fail (Write(fd, file->digest, sizeof(file->digest))) break;
+	int fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0640);
+	if (fd < 0) with_error(errno, "open(%s)", tmp) return;
+	struct varbuf vb;
+	unsigned nb_records = 0;
+	if_succeed (varbuf_ctor(&vb, MAP_WRITE_CHUNK, true)) {
+		do {
+			if_fail (varbuf_append(&vb, sizeof(MAP_MAGIC)-1, MAP_MAGIC)) break;
+			for (unsigned h = 0; h < map->hash_size && ! is_error(); h++) {
+				struct map_entry *e;
+				LIST_FOREACH(e, map->hash+h, h_entry) {
+					if_fail (append_record(fd, &vb, e, MAP_SET)) break;
+					nb_records ++;
+				}
+			}
+			on_error break;
+			if_fail (Write(fd, vb.buf, vb.used)) break;
+			if (0 != fsync(fd)) with_error(errno, "fsync(%s)", tmp) break;
+			if (0 != rename(tmp, path)) with_error(errno, "rename(%s, %s)", tmp, path) break;
+		} while (0);
+		varbuf_dtor(&vb);
+	}
+	on_error {
+		(void)close(fd);
+		(void)unlink(tmp);
+		return;
 	}
+	(void)close(map->fd);
+	map->fd = fd;	// we are at its end
+	map->nb_records = nb_records;
+}
 
-	(void)close(fd);
+static bool too_many_records(struct map *map)
+{
+	return map->nb_records > MAP_MIN_RECORDS && map->nb_records > 2 * map->nb_entries;
 }
 
-char const *map_get_digest(struct files *files, char const *fname)
+/*
+ * Public Functions
+ */
+
+void map_load(struct map *map)
 {
-	struct file *file = file_search(files, fname);
-	return file ? file->digest : NULL;
+	map->hash_size = MAP_MIN_HASH_SIZE;
+	map->hash = Malloc(map->hash_size * sizeof(*map->hash));
+	for (unsigned h = 0; h < map->hash_size; h++) LIST_INIT(map->hash+h);
+	map->nb_entries = 0;
+	STAILQ_INIT(&map->touched);
+	map->nb_records = 0;
+
+	char path[PATH_MAX];
+	map_path(path, sizeof(path), "");
+	debug("Loading sync map from '%s'", path);
+	map->fd = open(path, O_RDWR|O_CREAT, 0640);
+	if (map->fd < 0) with_error(errno, "open(%s)", path) return;
+
+	off_t size;
+	if_fail (size = filesize(map->fd)) return;
+	char *buf = Malloc(size+1);
+	bool convert = false;
+	do {
+		if_fail (Read(buf, map->fd, size)) break;
+		size_t const magic_len = sizeof(MAP_MAGIC)-1;
+		if (size == 0) {
+			if_fail (Write(map->fd, MAP_MAGIC, magic_len)) break;
+		} else if ((size_t)size >= magic_len && 0 == memcmp(buf, MAP_MAGIC, magic_len)) {
+			if_fail (load_records(map, buf, size, path)) break;
+		} else {
+			info("Converting sync map %s to the new format", path);
+			load_legacy(map, buf, size);
+			convert = true;
+		}
+	} while (0);
+	free(buf);
+	on_error return;
+	debug("%u names in the sync map", map->nb_entries);
+	if (convert || too_many_records(map)) {
+		compact(map);
+	} else if ((off_t)-1 == lseek(map->fd, 0, SEEK_END)) {
+		with_error(errno, "lseek(%s)", path) return;
+	}
 }
 
-void map_set(struct files *files, char const *fname, char const *digest)
+void map_close(struct map *map)
 {
-	struct file *file = file_search(files, fname);
-	if (file) {
-		file_set_digest(file, digest);
-	} else {
-		(void)file_new(files, fname, digest, NULL, 0);
+	if (map->fd >= 0) (void)close(map->fd);
+	map->fd = -1;
+	for (unsigned h = 0; h < map->hash_size; h++) {
+		struct map_entry *e;
+		while (NULL != (e = LIST_FIRST(map->hash+h))) entry_del(map, e);
 	}
+	free(map->hash);
+	map->hash = NULL;
+	map->hash_size = 0;
+}
+
+char const *map_get_digest(struct map *map, char const *fname)
+{
+	struct map_entry *e = entry_lookup(map, sanitize(fname));
+	return e && e->exists ? e->digest : NULL;
+}
+
+// Returns the digest only if the local file is known to be unchanged since then
+char const *map_get_unchanged_digest(struct map *map, char const *fname, struct file_stat const *st)
+{
+	struct map_entry *e = entry_lookup(map, sanitize(fname));
+	return e && e->exists && file_stat_eq(&e->stat, st) ? e->digest : NULL;
 }
 
-void map_del(struct files *files, char const *fname)
+static void touch(struct map *map, struct map_entry *e)
 {
-	struct file *file = file_search(files, fname);
-	if (! file) return;
-	file_del(file, files);
+	if (e->touched) return;
+	e->touched = true;
+	STAILQ_INSERT_TAIL(&map->touched, e, t_entry);
 }
 
+void map_set(struct map *map, char const *fname, char const *digest, struct file_stat const *st)
+{
+	fname = sanitize(fname);
+	struct map_entry *e = entry_lookup(map, fname);
+	if (! e) e = entry_new(map, fname);
+	touch(map, e);
+	e->has_next = true;
+	snprintf(e->next_digest, sizeof(e->next_digest), "%s", digest);
+	if (st) e->next_stat = *st;
+	else file_stat_clear(&e->next_stat);
+}
+
+void map_forget(struct map *map, char const *fname)
+{
+	struct map_entry *e = entry_lookup(map, sanitize(fname));
+	if (! e || e->touched) return;
+	touch(map, e);
+	e->has_next = false;
+}
+
+static bool same_stat(struct file_stat const *a, struct file_stat const *b)
+{
+	return a->size == b->size && a->inode == b->inode && a->mtime_ns == b->mtime_ns && a->ctime_ns == b->ctime_ns;
+}
+
+/* The map is updated in memory even if the records cannot be written, since the
+ * map file is then merely late (at worst some files will be digested again).
+ */
+void map_commit(struct map *map, bool full)
+{
+	struct varbuf vb;
+	if_fail (varbuf_ctor(&vb, MAP_WRITE_CHUNK, true)) return;
+	unsigned nb_records = 0;
+	if (full) {
+		for (unsigned h = 0; h < map->hash_size; h++) {
+			struct map_entry *e, *tmp;
+			LIST_FOREACH_SAFE(e, map->hash+h, h_entry, tmp) {
+				if (e->touched) continue;
+				unless_error {
+					append_record(map->fd, &vb, e, MAP_DEL);
+					nb_records ++;
+				}
+				entry_del(map, e);
+			}
+		}
+	}
+	struct map_entry *e;
+	while (NULL != (e = STAILQ_FIRST(&map->touched))) {
+		STAILQ_REMOVE_HEAD(&map->touched, t_entry);
+		e->touched = false;
+		if (! e->has_next) {
+			if (e->exists) unless_error {
+				append_record(map->fd, &vb, e, MAP_DEL);
+				nb_records ++;
+			}
+			entry_del(map, e);
+			continue;
+		}
+		if (e->exists && 0 == strcmp(e->digest, e->next_digest) && same_stat(&e->stat, &e->next_stat)) continue;
+		e->exists = true;
+		memcpy(e->digest, e->next_digest, sizeof(e->digest));
+		e->stat = e->next_stat;
+		unless_error {
+			append_record(map->fd, &vb, e, MAP_SET);
+			nb_records ++;
+		}
+	}
+	unless_error if (vb.used > 0) Write(map->fd, vb.buf, vb.used);
+	varbuf_dtor(&vb);
+	on_error return;
+	if (nb_records > 0) debug("%u records appended to the sync map", nb_records);
+	map->nb_records += nb_records;
+	if (too_many_records(map)) compact(map);
+}
+
+void map_foreach(struct map *map, void (*cb)(char const *fname, void *data), void *data)
+{
+	for (unsigned h = 0; h < map->hash_size; h++) {
+		struct map_entry *e;
+		LIST_FOREACH(e, map->hash+h, h_entry) {
+			if (e->exists) cb(e->name, data);
+		}
+	}
+}
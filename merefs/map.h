@@ -15,11 +15,37 @@
  * You should have received a copy of the GNU Affero General Public License
  * along with Scambio.  If not, see <http://www.gnu.org/licenses/>.
  */
-struct files;
+#ifndef MAP_H_081112
+#define MAP_H_081112
 
-void map_load(struct files *);
-void map_save(struct files *);
-char const *map_get_digest(struct files *, char const *fname);
-void map_set(struct files *, char const *fname, char const *digest);
-void map_del(struct files *, char const *fname);
+#include <stdbool.h>
+#include "scambio/queue.h"
+#include "file.h"
 
+/* The map of synched files : for each name, the digest it had when it was last
+ * synched (and the stat of the local file with that digest).
+ * During a run, what's read is the map of the previous run, while what's set is
+ * kept aside until the run is over and map_commit() is called.
+ */
+struct map_entry;
+struct map {
+	LIST_HEAD(map_bucket, map_entry) *hash;
+	unsigned hash_size, nb_entries;
+	STAILQ_HEAD(map_entries, map_entry) touched;	// entries that were set or forgotten during this run
+	int fd;	// the map file, opened for appending
+	unsigned nb_records;	// in the map file
+};
+
+void map_load(struct map *);
+void map_close(struct map *);
+char const *map_get_digest(struct map *, char const *fname);
+char const *map_get_unchanged_digest(struct map *, char const *fname, struct file_stat const *);
+// st is the stat of the local file which digest is digest, or NULL if unknown
+void map_set(struct map *, char const *fname, char const *digest, struct file_stat const *st);
+// The name will not be in the map after this run, unless it's set
+void map_forget(struct map *, char const *fname);
+// If full, all names that were not set during this run are forgotten
+void map_commit(struct map *, bool full);
+void map_foreach(struct map *, void (*cb)(char const *fname, void *data), void *data);
+
+#endif
@@ -0,0 +1,138 @@
+/* Copyright 2008 Cedric Cellier.
+ *
+ * This file is part of Scambio.
+ *
+ * Scambio is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Scambio is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with Scambio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* Checks for the sync map.
+ * Many runs set, change and forget names, so that the map log grows until it's
+ * compacted. After each run, and once loaded again, the map must give the same
+ * digests and stats than the ones we expect.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include "scambio.h"
+#include "misc.h"
+#include "check.h"
+#include "merefs.h"
+#include "map.h"
+
+#define NB_NAMES 300
+#define NB_RUNS 12
+#define RUNS_PER_LOAD 3
+
+char const *local_path;
+unsigned local_path_len;
+struct map sync_map;
+
+static struct expected {
+	bool present;
+	char digest[MAX_DIGEST_STRLEN+1];
+	struct file_stat stat;
+} expected[NB_NAMES];
+
+static void name_of(char *name, size_t size, unsigned n)
+{
+	snprintf(name, size, "dir%u/file%u", n % 10, n);
+}
+
+// Each name is forgotten from time to time, and its content changes every 3 runs
+static void run(unsigned r)
+{
+	for (unsigned n = 0; n < NB_NAMES; n++) {
+		struct expected *e = expected + n;
+		if ((n + r) % 7 == 0) {
+			e->present = false;
+			continue;
+		}
+		if (! e->present || n % 3 == r % 3) {
+			e->present = true;
+			snprintf(e->digest, sizeof(e->digest), "%08X%08X", r, n);
+			e->stat = (struct file_stat){ .size = r * 1000 + n, .inode = n + 1, .mtime_ns = r, .ctime_ns = r };
+		}
+		char name[PATH_MAX];
+		name_of(name, sizeof(name), n);
+		map_set(&sync_map, name, e->digest, &e->stat);
+	}
+	map_commit(&sync_map, true);
+}
+
+static unsigned nb_names;
+static void count_name(char const *fname, void *data)
+{
+	(void)fname;
+	(void)data;
+	nb_names ++;
+}
+
+static void check_map(char const *what)
+{
+	unsigned nb_present = 0;
+	for (unsigned n = 0; n < NB_NAMES; n++) {
+		struct expected const *e = expected + n;
+		char name[PATH_MAX];
+		name_of(name, sizeof(name), n);
+		char const *digest = map_get_digest(&sync_map, name);
+		if (! e->present) {
+			if (digest) check_fail(what, "a forgotten name is still there");
+			continue;
+		}
+		nb_present ++;
+		if (! digest || 0 != strcmp(digest, e->digest)) check_fail(what, "wrong digest");
+		else if (! map_get_unchanged_digest(&sync_map, name, &e->stat)) check_fail(what, "wrong stat");
+	}
+	nb_names = 0;
+	map_foreach(&sync_map, count_name, NULL);
+	if (nb_names != nb_present) check_fail(what, "wrong number of names");
+}
+
+int main(void)
+{
+	check_begin();
+	local_path = check_tmpdir("map_check");
+	local_path_len = strlen(local_path);
+
+	// The map is loaded again every few runs only, so that records are also appended
+	// to a map that was just compacted
+	bool compacted = false;
+	if_succeed (map_load(&sync_map)) for (unsigned r = 0; r < NB_RUNS && check_nb_failures == 0; r++) {
+		char what[64];
+		snprintf(what, sizeof(what), "run %u", r);
+		unsigned const nb_records = sync_map.nb_records;
+		if_fail (run(r)) break;
+		if (sync_map.nb_records < nb_records) compacted = true;
+		check_map(what);
+		if (r % RUNS_PER_LOAD == RUNS_PER_LOAD-1 || r == NB_RUNS-1) {
+			map_close(&sync_map);
+			snprintf(what, sizeof(what), "reload after run %u", r);
+			if_fail (map_load(&sync_map)) break;
+			check_map(what);
+		}
+	}
+	map_close(&sync_map);
+	on_error {
+		check_fail("map", error_str());
+		error_clear();
+	} else if (! compacted) {
+		check_fail("map", "never compacted");
+	}
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/.map.tmp", local_path);
+	if (0 == access(path, F_OK)) check_fail("map", "temporary file left behind");
+
+	return check_end();
+}
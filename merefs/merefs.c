@@ -44,8 +44,10 @@ struct mdir_cursor mdir_cursor = MDIR_CURSOR_INITIALIZER;
 struct mdir_user *user;
 bool quit = false;
 struct chn_cnx ccnx;
-struct files current_map, next_map;
+struct map sync_map;
 bool background = false;
+unsigned paranoia;
+bool use_delta;
 
 /*
  * Init
@@ -57,6 +59,9 @@ static void init_conf(void)
 	conf_set_default_int("SC_LOG_LEVEL", 3);
 	conf_set_default_str("SC_FILED_HOST", "localhost");
 	conf_set_default_str("SC_FILED_PORT", DEFAULT_FILED_PORT);
+	conf_set_default_int("SC_MEREFS_PARANOIA", 0);
+	conf_set_default_int("SC_MEREFS_WATCH", 1);
+	conf_set_default_int("SC_MEREFS_DELTA", 1);
 }
 
 static void init_log(void)
@@ -87,6 +92,11 @@ static void init(void)
 	if (0 != atexit(error_end)) with_error(0, "atexit") return;
 	if_fail (init_conf()) return;
 	if_fail (init_log()) return;
+	long long const p = conf_get_int("SC_MEREFS_PARANOIA");
+	if (p < 0) with_error(0, "SC_MEREFS_PARANOIA must not be negative") return;
+	paranoia = p;
+	use_delta = conf_get_int("SC_MEREFS_DELTA");
+	srand(time(NULL));
 	if_fail (mdir_init()) return;
 	if_fail (files_begin()) return;
 	if_fail (auth_init()) return;
@@ -98,22 +108,51 @@ static void init(void)
  * Go
  */
 
+static void full_run(void)
+{
+	changes_clear();	// changes from now on will be checked at next run
+	unmatch_all();	// all remote files are on unmatched_list
+	if_fail (read_mdir()) return;	// Will append to unmatched list the new entry
+	if_fail (traverse_local_path()) return;	// Will match each local file against its mdir entry
+	if_fail (create_unmatched_files()) return;	// Will add to local tree the new entries
+	map_commit(&sync_map, true);
+}
+
+static void changes_run(void)
+{
+	if_fail (read_mdir()) return;	// Will append to unmatched list the new entry
+	if_fail (match_changed_files()) return;	// Will match the changed files only
+	map_commit(&sync_map, false);
+}
+
 static void loop(void)
 {
-	if_fail (map_load(&current_map)) return;
+	if_fail (map_load(&sync_map)) return;
 	if_fail (read_mdir()) return;	// Will read the whole mdir and create an entry (on unmatched list) for each file
+	if (background && conf_get_int("SC_MEREFS_WATCH")) {
+		if_fail (watch_begin()) {
+			warning("Cannot watch local files (%s), will scan them", error_str());
+			error_clear();
+		}
+	}
+	bool full = true;
 	do {
-		unmatch_all();	// all remote files are on unmatched_list
-		if_fail (read_mdir()) return;	// Will append to unmatched list the new entry
-		STAILQ_INIT(&next_map);
-		if_fail (traverse_local_path()) return;	// Will match each local file against its mdir entry
-		if_fail (create_unmatched_files()) return;	// Will add to local tree the new entries
-		free_file_list(&current_map);
-		current_map = next_map;
+		if (full) {
+			if_fail (full_run()) return;
+		} else {
+			if_fail (changes_run()) return;
+		}
 		if (! background) break;
-		pth_sleep(5);	// will schedule other threads and prevent us from eating the CPU
+		if (watching) {
+			full = watch_wait(5);	// wait for local changes, but read the mdir from time to time
+		} else {
+			watch_end();	// if the watcher gave up, release what's left of it
+			pth_sleep(5);	// will schedule other threads and prevent us from eating the CPU
+			full = true;	// no changes are recorded any more
+		}
 	} while (! quit);
-	map_save(&current_map);
+	watch_end();
+	map_close(&sync_map);
 }
 
 int main(int nb_args, char const **args)
@@ -24,6 +24,7 @@
 #include "scambio/mdir.h"
 #include "scambio/channel.h"
 #include "file.h"
+#include "map.h"
 
 extern char const *tracked_mdir_name;
 extern char const *local_path;
@@ -32,8 +33,10 @@ extern struct mdir *mdir;
 extern struct mdir_cursor mdir_cursor;
 extern struct mdir_user *user;
 extern bool quit, background;
+extern unsigned paranoia;	// if not 0, one in paranoia unchanged files is digested nonetheless
+extern bool use_delta;	// send only what changed in large files
 extern struct chn_cnx ccnx;
-extern struct files current_map, next_map;
+extern struct map sync_map;
 
 time_t last_run_start(void);
 void read_mdir(void);
@@ -41,5 +44,14 @@ void unmatch_all(void);
 void traverse_local_path(void);
 void create_unmatched_files(void);
 void create_local_file(struct file *file);
+void match_changed_files(void);
+
+extern bool watching;
+void watch_begin(void);
+void watch_end(void);
+bool watch_wait(unsigned timeout);
+void change_add(char const *name);
+char *change_pop(void);
+void changes_clear(void);
 
 #endif
@@ -42,9 +42,12 @@ static void remove_remote_file(mdir_version to_del)
 	on_error return;
 	if (file) {
 		// We do not delete remote files but kept them in a special list so that we can still use their resource
-		STAILQ_REMOVE(&unmatched_files, file, file, entry);
-		STAILQ_INSERT_HEAD(&removed_files, file, entry);
-	};
+		file_move(file, &unmatched_files, &removed_files);
+	} else if (NULL != (file = file_search_by_version(&matched_files, to_del))) {
+		// Only when matching changed files, since otherwise all files were unmatched
+		file_move(file, &matched_files, &removed_files);
+		change_add(file->name);	// so that the local file is checked
+	}
 }
 
 static void rem_remote_file(struct mdir *mdir, mdir_version version, void *data)
@@ -75,6 +78,10 @@ static void add_remote_file(struct mdir *mdir, struct header *header, mdir_versi
 		debug("...we already had a file for that name (resource was '%s') : delete it", file->resource);
 		file_del(file, &unmatched_files);
 		file = NULL;
+	} else if (NULL != (file = file_search(&matched_files, name))) {
+		debug("...we already matched a file for that name (resource was '%s') : delete it", file->resource);
+		file_del(file, &matched_files);
+		file = NULL;
 	} else {
 		debug("...this name is new");
 	}
@@ -93,6 +100,6 @@ void read_mdir(void)
 void unmatch_all(void)
 {
 	debug("Unmatching all matched files");
-	STAILQ_CONCAT(&unmatched_files, &matched_files);
+	files_move_all(&matched_files, &unmatched_files);
 }
 
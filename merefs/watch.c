@@ -0,0 +1,327 @@
+/* Copyright 2008 Cedric Cellier.
+ *
+ * This file is part of Scambio.
+ *
+ * Scambio is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Scambio is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with Scambio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * Watch the local tree
+ *
+ * Instead of traversing the whole local tree at every run, all its directories
+ * are watched with inotify and the names of the files that changed are kept in
+ * a set, so that only those are matched at next run (see match_changed_files()).
+ * When some events are lost (or when a watch cannot be set) a full traversal is
+ * asked for instead.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <pth.h>
+#include "scambio.h"
+#include "misc.h"
+#include "merefs.h"
+
+/*
+ * Data Definitions
+ */
+
+#define HASH_SIZE 1024
+#define EVENTS_BUF_SIZE (64 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+#define WATCHED_EVENTS (IN_CLOSE_WRITE|IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO)
+#define QUIET_DELAY_NS 50000000	// wait for this long after a change for more changes to come
+
+bool watching = false;
+
+struct change {
+	LIST_ENTRY(change) h_entry;
+	STAILQ_ENTRY(change) entry;
+	char name[];	// relative to local_path
+};
+static LIST_HEAD(changes_hash, change) changes_hash[HASH_SIZE];
+static STAILQ_HEAD(changes, change) changes = STAILQ_HEAD_INITIALIZER(changes);
+static bool full_scan = false;	// set if some changes were lost
+static pth_mutex_t changes_mutex;	// protects the above
+static pth_cond_t changes_cond;	// signaled when something changed
+
+struct watched_dir {
+	LIST_ENTRY(watched_dir) h_entry;
+	int wd;
+	char path[];	// relative to local_path ("" for local_path itself)
+};
+static LIST_HEAD(watched_dirs, watched_dir) watched_dirs[HASH_SIZE];
+static int inotify_fd = -1;
+static pth_t watcher;
+
+/*
+ * Set of changed names
+ */
+
+static unsigned hash_name(char const *name)
+{
+	unsigned h = 2166136261U;
+	while (*name) h = (h ^ (unsigned char)*name++) * 16777619U;
+	return h % HASH_SIZE;
+}
+
+static void changed(void)
+{
+	(void)pth_cond_notify(&changes_cond, FALSE);
+}
+
+void change_add(char const *name)
+{
+	while (*name == '/') name++;
+	unsigned const h = hash_name(name);
+	struct change *c;
+	LIST_FOREACH(c, changes_hash+h, h_entry) {
+		if (0 == strcmp(c->name, name)) return;
+	}
+	size_t const len = strlen(name);
+	c = Malloc(sizeof(*c) + len + 1);
+	memcpy(c->name, name, len+1);
+	LIST_INSERT_HEAD(changes_hash+h, c, h_entry);
+	STAILQ_INSERT_TAIL(&changes, c, entry);
+	changed();
+}
+
+// Returns the name of a changed file, that the caller must free, or NULL
+char *change_pop(void)
+{
+	struct change *c = STAILQ_FIRST(&changes);
+	if (! c) return NULL;
+	STAILQ_REMOVE_HEAD(&changes, entry);
+	LIST_REMOVE(c, h_entry);
+	char *name = Strdup(c->name);
+	free(c);
+	return name;
+}
+
+void changes_clear(void)
+{
+	char *name;
+	while (NULL != (name = change_pop())) free(name);
+	full_scan = false;
+}
+
+static void ask_full_scan(void)
+{
+	full_scan = true;
+	changed();
+}
+
+/*
+ * Watches
+ */
+
+static struct watched_dir *dir_of_wd(int wd)
+{
+	struct watched_dir *w;
+	LIST_FOREACH(w, watched_dirs + wd % HASH_SIZE, h_entry) {
+		if (w->wd == wd) return w;
+	}
+	return NULL;
+}
+
+static void unwatch(struct watched_dir *w)
+{
+	LIST_REMOVE(w, h_entry);
+	free(w);
+}
+
+static void watch_rec(char const *path, bool new);
+
+// Scan a new directory for subdirectories to watch, and files that were created before it was watched
+static void watch_subdirs(char const *path, char const *fpath, bool new)
+{
+	DIR *dir = opendir(fpath);
+	if (! dir) {
+		if (errno != ENOENT) warning("Cannot opendir(%s) : %s", fpath, strerror(errno));
+		return;
+	}
+	struct dirent *dirent;
+	while (NULL != (dirent = readdir(dir))) {
+		if (dirent->d_name[0] == '.' || dirent->d_type == DT_LNK) continue;	// as in scan_opened_dir()
+		char sub[PATH_MAX];
+		snprintf(sub, sizeof(sub), "%s%s%s", path, path[0] ? "/":"", dirent->d_name);
+		if (dirent->d_type == DT_DIR) watch_rec(sub, new);
+		else if (new && dirent->d_type == DT_REG) change_add(sub);
+	}
+	(void)closedir(dir);
+}
+
+static void watch_rec(char const *path, bool new)
+{
+	if (! watching) return;
+	char fpath[PATH_MAX];
+	snprintf(fpath, sizeof(fpath), "%.*s/%s", (int)local_path_len, local_path, path);
+	int const wd = inotify_add_watch(inotify_fd, fpath, WATCHED_EVENTS|IN_ONLYDIR);
+	if (wd < 0) {
+		if (errno == ENOENT || errno == ENOTDIR) return;	// already gone
+		warning("Cannot watch %s (%s), back to full scans", fpath, strerror(errno));
+		watching = false;
+		ask_full_scan();
+		return;
+	}
+	struct watched_dir *w = dir_of_wd(wd);	// same directory under another name ?
+	if (w) unwatch(w);
+	size_t const len = strlen(path);
+	w = Malloc(sizeof(*w) + len + 1);
+	w->wd = wd;
+	memcpy(w->path, path, len+1);
+	LIST_INSERT_HEAD(watched_dirs + wd % HASH_SIZE, w, h_entry);
+	watch_subdirs(path, fpath, new);
+}
+
+static void change_if_under(char const *fname, void *path_)
+{
+	char const *path = path_;
+	size_t const len = strlen(path);
+	if (0 == strncmp(fname, path, len) && fname[len] == '/') change_add(fname);
+}
+
+// A directory was moved away : stop watching it and check all the files we had there
+static void unwatch_rec(char const *path)
+{
+	size_t const len = strlen(path);
+	for (unsigned h = 0; h < HASH_SIZE; h++) {
+		struct watched_dir *w, *tmp;
+		LIST_FOREACH_SAFE(w, watched_dirs+h, h_entry, tmp) {
+			if (0 != strncmp(w->path, path, len) || (w->path[len] != '\0' && w->path[len] != '/')) continue;
+			(void)inotify_rm_watch(inotify_fd, w->wd);
+			unwatch(w);
+		}
+	}
+	map_foreach(&sync_map, change_if_under, (void *)path);
+}
+
+static void handle_event(struct inotify_event const *ev)
+{
+	if (ev->mask & IN_Q_OVERFLOW) {
+		warning("Some local events were lost, will scan the whole tree");
+		ask_full_scan();
+		return;
+	}
+	struct watched_dir *w = dir_of_wd(ev->wd);
+	if (! w) return;
+	if (ev->mask & IN_IGNORED) {	// the directory is gone
+		unwatch(w);
+		return;
+	}
+	if (ev->len == 0 || ev->name[0] == '.') return;	// hidden files (such as our map or backups) are not synched
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s%s%s", w->path, w->path[0] ? "/":"", ev->name);
+	if (ev->mask & IN_ISDIR) {
+		if (ev->mask & (IN_CREATE|IN_MOVED_TO)) watch_rec(path, true);
+		else if (ev->mask & IN_MOVED_FROM) unwatch_rec(path);
+		return;	// deleted directories were emptied first
+	}
+	if (ev->mask & IN_CREATE) {
+		// Wait for the file to be closed, unless it's a new hard link
+		char fpath[PATH_MAX];
+		snprintf(fpath, sizeof(fpath), "%.*s/%s", (int)local_path_len, local_path, path);
+		struct stat statbuf;
+		if (0 != lstat(fpath, &statbuf) || statbuf.st_nlink < 2) return;
+	}
+	change_add(path);
+}
+
+static void *watcher_thread(void *buf)
+{
+	while (1) {
+		ssize_t len = pth_read(inotify_fd, buf, EVENTS_BUF_SIZE);
+		if (len < 0) {
+			if (errno == EINTR || errno == EAGAIN) continue;
+			error("Cannot read local events (%s), back to full scans", strerror(errno));
+			break;
+		}
+		(void)pth_mutex_acquire(&changes_mutex, FALSE, NULL);
+		for (char *ev = buf; ev < (char *)buf + len; ev += sizeof(struct inotify_event) + ((struct inotify_event *)ev)->len) {
+			handle_event((struct inotify_event *)ev);
+		}
+		(void)pth_mutex_release(&changes_mutex);
+	}
+	watching = false;
+	ask_full_scan();
+	free(buf);
+	return NULL;
+}
+
+/*
+ * Public Functions
+ */
+
+// Returns true if the whole tree must be scanned
+bool watch_wait(unsigned timeout)
+{
+	(void)pth_mutex_acquire(&changes_mutex, FALSE, NULL);
+	if (STAILQ_EMPTY(&changes) && ! full_scan) {
+		pth_event_t ev = pth_event(PTH_EVENT_TIME, pth_timeout(timeout, 0));
+		(void)pth_cond_await(&changes_cond, &changes_mutex, ev);
+		pth_event_free(ev, PTH_FREE_THIS);
+	}
+	(void)pth_mutex_release(&changes_mutex);
+	if (! STAILQ_EMPTY(&changes)) {	// a file is rarely changed alone
+		struct timespec ts = { .tv_sec = 0, .tv_nsec = QUIET_DELAY_NS };
+		(void)pth_nanosleep(&ts, NULL);
+	}
+	return full_scan || ! watching;
+}
+
+void watch_begin(void)
+{
+	pth_mutex_init(&changes_mutex);
+	pth_cond_init(&changes_cond);
+	for (unsigned h = 0; h < HASH_SIZE; h++) {
+		LIST_INIT(changes_hash+h);
+		LIST_INIT(watched_dirs+h);
+	}
+	inotify_fd = inotify_init();
+	if (inotify_fd < 0) with_error(errno, "inotify_init") return;
+	watching = true;
+	watch_rec("", false);	// the first run is a full scan anyway
+	if (! watching) {
+		watch_end();
+		with_error(0, "Cannot watch %s", local_path) return;
+	}
+	void *buf = Malloc(EVENTS_BUF_SIZE);
+	watcher = pth_spawn(PTH_ATTR_DEFAULT, watcher_thread, buf);
+	if (! watcher) {
+		free(buf);
+		watch_end();
+		with_error(0, "Cannot spawn watcher") return;
+	}
+}
+
+void watch_end(void)
+{
+	watching = false;
+	if (watcher) {
+		(void)pth_abort(watcher);
+		watcher = NULL;
+	}
+	if (inotify_fd >= 0) {
+		(void)close(inotify_fd);
+		inotify_fd = -1;
+	}
+	for (unsigned h = 0; h < HASH_SIZE; h++) {
+		struct watched_dir *w;
+		while (NULL != (w = LIST_FIRST(watched_dirs+h))) unwatch(w);
+	}
+}
@@ -21,6 +21,7 @@
 #include <unistd.h>
 #include <time.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -29,6 +30,7 @@
 #include "scambio/header.h"
 #include "misc.h"
 #include "varbuf.h"
+#include "codec.h"
 #include "sendmail.h"
 
 /*
@@ -38,14 +40,30 @@
 static pth_mutex_t list_mutex;	// protect the following lists (and the entry field of forwards when they are in)
 // Oldest forwards first
 static struct forwards waiting_forwards;
+static struct forwards sending_forwards;	// the ones a relay is currently delivering
 static struct forwards delivered_forwards;	// not necessarily successfully of course
+static pth_cond_t forwards_cond;	// signaled whenever a waiting forward may have become deliverable
+static pth_cond_t progress_cond;	// broadcasted whenever some part received more data
+static pth_mutex_t progress_mutex;
 
 #define CNX_IDLE_TIMEOUT 15	// close useless SMTP cnx after this delay in secs.
-static int sock_fd;
-static time_t sock_last_used;
+#define RETRY_DELAY 10	// when a forward cannot be delivered for some local reason, retry after this delay in secs.
 static char my_hostname[256];
 
-static pth_t forwarder_thread;
+/* Each relay is a thread with its own connection to the SMTP relay, that
+ * delivers whatever forwards are ready. So a slow delivery only blocks its
+ * own connection.
+ */
+struct relay {
+	pth_t thread;
+	int fd;	// -1 when not connected
+	time_t last_used;
+	bool pipelining;	// the SMTP relay supports it
+	struct varbuf out;	// commands not sent yet
+	struct varbuf in;
+};
+static unsigned nb_relays;
+static struct relay *relays;
 
 /*
  * List manipulation
@@ -72,18 +90,66 @@ static void list_empty(struct forwards *list)
 	list_unlock();
 }
 
-static void list_move_to(struct forwards *list, struct forward *fwd)
+static void list_move_to_locked(struct forwards *list, struct forward *fwd)
 {
-	// Lock is not necessary here because the thread scheduler is not called here.
-	list_lock();
 	if (fwd->list) {
 		TAILQ_REMOVE(fwd->list, fwd, entry);
 	}
 	TAILQ_INSERT_TAIL(list, fwd, entry);
 	fwd->list = list;
+}
+
+static void list_move_to(struct forwards *list, struct forward *fwd)
+{
+	// Lock is not necessary here because the thread scheduler is not called here.
+	list_lock();
+	list_move_to_locked(list, fwd);
 	list_unlock();
 }
 
+static void wakeup_relays(void)
+{
+	(void)pth_cond_notify(&forwards_cond, FALSE);
+}
+
+/*
+ * Parts are sent while they are downloaded
+ */
+
+#define PROGRESS_TIMEOUT 1	// check the download status at least every so many secs
+#define STALL_TIMEOUT 60	// give up a download that received nothing for so many secs
+
+// Returns how many bytes of the part can be read from offset (waiting for some if none is available yet).
+// Returns 0 at the end of the part, and -1 if the download is over (so that the file can be read up to its end).
+// Fails if the download is stalled, so that the forward is delivered later.
+static off_t part_available(struct part *part, off_t offset)
+{
+	time_t const waiting_since = time(NULL);
+	while (1) {
+		int const status = chn_tx_status(part->tx);
+		if (status == 200) return -1;
+		if (status != 0) with_error(0, "Cannot fetch %s (status %d)", part->filename, status) return 0;
+		off_t const received = chn_tx_received(part->tx);
+		if (received > offset) return received - offset;
+		if (time(NULL) >= waiting_since + STALL_TIMEOUT) {
+			with_error(0, "Download of %s is stalled at offset %lld", part->filename, (long long)received) return 0;
+		}
+		pth_event_t ev = pth_event(PTH_EVENT_TIME, pth_timeout(PROGRESS_TIMEOUT, 0));
+		(void)pth_mutex_acquire(&progress_mutex, FALSE, NULL);
+		(void)pth_cond_await(&progress_cond, &progress_mutex, ev);	// this is a cancel point
+		(void)pth_mutex_release(&progress_mutex);
+		pth_event_free(ev, PTH_FREE_THIS);
+	}
+}
+
+static void part_progress(struct chn_tx *tx, int status, void *data)
+{
+	(void)tx;
+	(void)status;
+	(void)data;
+	(void)pth_cond_notify(&progress_cond, TRUE);
+}
+
 /*
  * Dealing with connection to SMTP relay
  */
@@ -95,7 +161,15 @@ static void list_move_to(struct forwards *list, struct forward *fwd)
 #define MAX_SMTP_LINE 512
 #define CRLF "\r\n"
 
-static void send_smtp_nstrs(int fd, va_list ap)
+// Commands are buffered until we wait for an answer (or send a file)
+static void relay_flush(struct relay *relay)
+{
+	if (relay->out.used == 0) return;
+	Write(relay->fd, relay->out.buf, relay->out.used);
+	varbuf_clean(&relay->out);
+}
+
+static void send_smtp_nstrs(struct relay *relay, va_list ap)
 {
 	char cmd[MAX_SMTP_LINE];
 	unsigned len = 0;
@@ -105,32 +179,35 @@ static void send_smtp_nstrs(int fd, va_list ap)
 	}
 	if (len < sizeof(cmd)) len += snprintf(cmd+len, sizeof(cmd)-len, CRLF);
 	if (len >= sizeof(cmd)) with_error(0, "Command too long : '%s...'", cmd) return;
-	Write(fd, cmd, len);
+	varbuf_append(&relay->out, len, cmd);
 }
 
 static void
 #ifdef __GNUC__
 	__attribute__ ((sentinel))
 #endif
-send_smtp_strs(int fd, ...)
+send_smtp_strs(struct relay *relay, ...)
 {
 	va_list ap;
-	va_start(ap, fd);
-	send_smtp_nstrs(fd, ap);
+	va_start(ap, relay);
+	send_smtp_nstrs(relay, ap);
 	va_end(ap);
 }
 
-static int read_smtp_status(int fd, struct varbuf *vb)
+// If capa is set, tells if one of the lines advertises it (for EHLO)
+static int read_smtp_status(struct relay *relay, char const *capa, bool *has_capa)
 {
+	if_fail (relay_flush(relay)) return -1;
 	int status = -1;
-	varbuf_clean(vb);
+	varbuf_clean(&relay->in);
 	char *new, *end;
 	do {
-		if_fail (varbuf_read_line(vb, fd, MAX_SMTP_LINE*2 /* don't be pedantic */, &new)) return -1;
+		if_fail (varbuf_read_line(&relay->in, relay->fd, MAX_SMTP_LINE*2 /* don't be pedantic */, &new)) return -1;
 		int s = strtoul(new, &end, 10);
 		if (end != new+3) warning("Suspicious SMTP status (%d)", s);
 		if (status != -1 && s != status) warning("Status change in multiline response, from %d to %d", status, s);
 		status = s;
+		if (capa && (*end == '-' || *end == ' ') && 0 == strncasecmp(end+1, capa, strlen(capa))) *has_capa = true;
 	} while (*end == '-');
 	if (*end != ' ') with_error(0, "Cannot get status from SMTP answer") return 0;
 	return status;
@@ -140,193 +217,271 @@ static int
 #ifdef __GNUC__
 	__attribute__ ((sentinel))
 #endif
-smtp_cmd(int fd, ...)
+smtp_cmd(struct relay *relay, ...)
 {
-	struct varbuf vb;
-	if_fail (varbuf_ctor(&vb, MAX_SMTP_LINE*5, true)) return 0;	// make room for a multiline answer
 	int status = 0;
 	va_list ap;
-	va_start(ap, fd);
-	if_succeed (send_smtp_nstrs(fd, ap)) {
-		status = read_smtp_status(fd, &vb);
+	va_start(ap, relay);
+	if_succeed (send_smtp_nstrs(relay, ap)) {
+		status = read_smtp_status(relay, NULL, NULL);
 	}
 	va_end(ap);
-	error_save();
-	varbuf_dtor(&vb);
-	error_restore();
 	return status;
 }
 
-static void may_open_connection(void)
+static void close_connection(struct relay *relay)
+{
+	(void)close(relay->fd);
+	relay->fd = -1;
+	varbuf_clean(&relay->out);
+}
+
+static void may_open_connection(struct relay *relay)
 {
-	if (sock_fd != -1) return;
-	if_fail (sock_fd = Connect(conf_get_str("SC_SMTP_RELAY_HOST"), conf_get_str("SC_SMTP_RELAY_PORT"))) return;
+	if (relay->fd != -1) return;
+	if_fail (relay->fd = Connect(conf_get_str("SC_SMTP_RELAY_HOST"), conf_get_str("SC_SMTP_RELAY_PORT"))) {
+		relay->fd = -1;
+		return;
+	}
 	// Welcome message
-	struct varbuf vb;
-	if_fail (varbuf_ctor(&vb, MAX_SMTP_LINE, true)) return;
-	int status = read_smtp_status(sock_fd, &vb);
-	varbuf_dtor(&vb);
+	int status = read_smtp_status(relay, NULL, NULL);
 	if (is_error() || status != 220) {
-		(void)close(sock_fd);
-		sock_fd = -1;
+		close_connection(relay);
 		with_error(0, "Welcome message is not welcoming (status %d)", status) return;
 	}
-	// HELO
-	status = smtp_cmd(sock_fd, "HELO ", my_hostname, NULL);
+	// EHLO, or HELO if the relay does not know better
+	relay->pipelining = false;
+	if_succeed (send_smtp_strs(relay, "EHLO ", my_hostname, NULL)) {
+		status = read_smtp_status(relay, "PIPELINING", &relay->pipelining);
+	}
+	if (! is_error() && status != 250) {
+		status = smtp_cmd(relay, "HELO ", my_hostname, NULL);
+	}
 	if (is_error() || status != 250) {
-		(void)close(sock_fd);
-		sock_fd = -1;
+		close_connection(relay);
 		with_error(0, "Cannot HELO to SMTP relay : status %d", status) return;
 	}
-	sock_last_used = time(NULL);
+	debug("Connected to SMTP relay%s", relay->pipelining ? " (with pipelining)":"");
+	relay->last_used = time(NULL);
 }
 
-static void may_close_connection(void)
+static void may_close_connection(struct relay *relay)
 {
-	if (sock_fd == -1) return;
-	unsigned delay = time(NULL) - sock_last_used;
+	if (relay->fd == -1) return;
+	unsigned delay = time(NULL) - relay->last_used;
 	if (delay > CNX_IDLE_TIMEOUT) {
 		debug("Closing idle SMTP cnx");
-		(void)smtp_cmd(sock_fd, "QUIT", NULL);
+		(void)smtp_cmd(relay, "QUIT", NULL);
 		error_clear();
-		(void)close(sock_fd);
-		sock_fd = -1;
-	}
-}
-
-static void send_file(int out, char const *filename)
-{
-	static const unsigned char b64[64] = {
-		[0] = 'A',  [1] = 'B',  [2] = 'C',  [3] = 'D',  [4] = 'E',  [5] = 'F', 
-		[6] = 'G',  [7] = 'H',  [8] = 'I',  [9] = 'J',  [10] = 'K', [11] = 'L',
-		[12] = 'M', [13] = 'N', [14] = 'O', [15] = 'P', [16] = 'Q', [17] = 'R',
-		[18] = 'S', [19] = 'T', [20] = 'U', [21] = 'V', [22] = 'W', [23] = 'X',
-		[24] = 'Y', [25] = 'Z', [26] = 'a', [27] = 'b', [28] = 'c', [29] = 'd',
-		[30] = 'e', [31] = 'f', [32] = 'g', [33] = 'h', [34] = 'i', [35] = 'j',
-		[36] = 'k', [37] = 'l', [38] = 'm', [39] = 'n', [40] = 'o', [41] = 'p',
-		[42] = 'q', [43] = 'r', [44] = 's', [45] = 't', [46] = 'u', [47] = 'v',
-		[48] = 'w', [49] = 'x', [50] = 'y', [51] = 'z', [52] = '0', [53] = '1',
-		[54] = '2', [55] = '3', [56] = '4', [57] = '5', [58] = '6', [59] = '7',
-		[60] = '8', [61] = '9', [62] = '+', [63] = '/',
-  	};
-	ssize_t len;
-	unsigned width = 0;
-	int in = open(filename, O_RDONLY);
-	if (in < 0) with_error(errno, "open(%s)", filename) return;
+		close_connection(relay);
+	}
+}
+
+// Read the file by whole lines worth of input, and send each encoded chunk at once
+#define SEND_CHUNK_SIZE (57*1024)	// 57 bytes = one line of base64
+
+static void send_file(int out, struct part *part)
+{
+	int in = open(part->filename, O_RDONLY);
+	if (in < 0) with_error(errno, "open(%s)", part->filename) return;
+	unsigned char *inbuf = Malloc(SEND_CHUNK_SIZE);
+	char *outbuf = Malloc(BASE64_ENCODE_MAX(SEND_CHUNK_SIZE));
+	struct base64_enc enc;
+	base64_enc_ctor(&enc, CODEC_LINE_LENGTH);
+	off_t offset = 0;
+	size_t len;
 	do {
-		unsigned char inbuf[3];
-		memset(inbuf, 0, sizeof(inbuf));
-		len = pth_read(in, inbuf, sizeof(inbuf));
-		if (len < 0) with_error(errno, "read(%s)", filename) break;
-		if (len == 0) break;
-		unsigned char outbuf[4] = {
-			b64[inbuf[0] >> 2],
-			b64[((inbuf[0] & 0x3) << 4) | (inbuf[1] >> 4)],
-			len > 1 ? b64[((inbuf[1] & 0xF) << 2) | (inbuf[2] >> 6)] : '=',
-			len == 3 ? b64[inbuf[2] & 0x3F] : '=',
-		};
-		width += 4;
-		if (width >= 76) {
-			if_fail (Write(out, CRLF, 2)) break;
-			width = 0;
+		// Fill the whole chunk unless EOF is reached
+		len = 0;
+		while (len < SEND_CHUNK_SIZE) {
+			size_t want = SEND_CHUNK_SIZE - len;
+			off_t avail = -1;
+			if (part->tx) {	// still downloading ?
+				if_fail (avail = part_available(part, offset)) break;
+				if (avail == 0) break;
+				if (avail > 0 && (off_t)want > avail) want = avail;
+			}
+			ssize_t ret = pth_pread(in, inbuf + len, want, offset);
+			if (ret < 0) {
+				if (errno == EINTR) continue;
+				with_error(errno, "read(%s)", part->filename) break;
+			}
+			if (ret == 0) {
+				if (avail <= 0) break;
+				// Received but not in the file : a hole that's not written yet
+				memset(inbuf + len, 0, want);
+				ret = want;
+			}
+			len += ret;
+			offset += ret;
 		}
-		if_fail (Write(out, outbuf, sizeof(outbuf))) break;
-	} while (len == 3);
+		on_error break;
+		size_t outlen = base64_encode(&enc, outbuf, inbuf, len);
+		if (len < SEND_CHUNK_SIZE) outlen += base64_encode_finish(&enc, outbuf + outlen);
+		if_fail (Write(out, outbuf, outlen)) break;
+	} while (len == SEND_CHUNK_SIZE);
+	free(outbuf);
+	free(inbuf);
 	(void)close(in);
 }
 
-static void send_part(int fd, struct part *part)
+static void send_part(struct relay *relay, struct part *part)
 {
-	if_fail (send_smtp_strs(fd, "Content-Transfer-Encoding: base64", NULL)) return;
+	if_fail (send_smtp_strs(relay, "Content-Transfer-Encoding: base64", NULL)) return;
 	if (part->type) {
-		if_fail (send_smtp_strs(fd, "Content-Type: ", part->type, ";", NULL)) return;
+		if_fail (send_smtp_strs(relay, "Content-Type: ", part->type, ";", NULL)) return;
 		if (part->name) {
-			if_fail (send_smtp_strs(fd, "\tname=\"", part->name, "\"", NULL)) return;
+			if_fail (send_smtp_strs(relay, "\tname=\"", part->name, "\"", NULL)) return;
 		}
 	}
-	if_fail (send_smtp_strs(fd, "", NULL)) return;
-	if_fail (send_file(fd, part->filename)) return;
+	if_fail (send_smtp_strs(relay, "", NULL)) return;
+	if_fail (relay_flush(relay)) return;
+	if_fail (send_file(relay->fd, part)) return;
 }
 
-static int send_forward(int fd, struct forward *fwd)
+// Returns the status of the DATA command, or of the first command that failed
+static int send_envelope(struct relay *relay, struct forward *fwd)
 {
 	int status;
-	if_fail (status = smtp_cmd(fd, "MAIL FROM:<", header_find(fwd->header, SC_FROM_FIELD, NULL)->value, ">", NULL)) return 0;
-	if (status != 250) return status;
 	struct header_field *hf = NULL;
+	if (! relay->pipelining) {
+		if_fail (status = smtp_cmd(relay, "MAIL FROM:<", header_find(fwd->header, SC_FROM_FIELD, NULL)->value, ">", NULL)) return 0;
+		if (status != 250) return status;
+		while (NULL != (hf = header_find(fwd->header, SC_TO_FIELD, hf))) {
+			if_fail (status = smtp_cmd(relay, "RCPT TO:<", hf->value, ">", NULL)) return 0;
+			if (status < 250 || status > 252) return status;
+		}
+		return smtp_cmd(relay, "DATA", NULL);
+	}
+	// Send all commands at once, then read all answers
+	if_fail (send_smtp_strs(relay, "MAIL FROM:<", header_find(fwd->header, SC_FROM_FIELD, NULL)->value, ">", NULL)) return 0;
+	unsigned nb_rcpts = 0;
 	while (NULL != (hf = header_find(fwd->header, SC_TO_FIELD, hf))) {
-		if_fail (status = smtp_cmd(fd, "RCPT TO:<", hf->value, ">", NULL)) return 0;
-		if (status < 250 || status > 252) return status;
+		if_fail (send_smtp_strs(relay, "RCPT TO:<", hf->value, ">", NULL)) return 0;
+		nb_rcpts ++;
+	}
+	if_fail (send_smtp_strs(relay, "DATA", NULL)) return 0;
+	int s;
+	if_fail (s = read_smtp_status(relay, NULL, NULL)) return 0;
+	status = s != 250 ? s : 0;
+	while (nb_rcpts--) {
+		if_fail (s = read_smtp_status(relay, NULL, NULL)) return 0;
+		if (status == 0 && (s < 250 || s > 252)) status = s;
+	}
+	if_fail (s = read_smtp_status(relay, NULL, NULL)) return 0;
+	if (status == 0) return s;
+	if (s == 354) {
+		// The relay waits for a message we do not want to send any more. Closing the cnx aborts the transaction.
+		close_connection(relay);
 	}
-	if_fail (status = smtp_cmd(fd, "DATA", NULL)) return 0;
+	return status;
+}
+
+static int send_forward(struct relay *relay, struct forward *fwd)
+{
+	int status;
+	if_fail (status = send_envelope(relay, fwd)) return 0;
 	if (status != 354) return status;
-	if_fail (send_smtp_strs(fd, "From: ", header_find(fwd->header, SC_FROM_FIELD, NULL)->value, NULL)) return 0;
+	if_fail (send_smtp_strs(relay, "From: ", header_find(fwd->header, SC_FROM_FIELD, NULL)->value, NULL)) return 0;
 	bool first = true;
+	struct header_field *hf = NULL;
 	while (NULL != (hf = header_find(fwd->header, SC_TO_FIELD, hf))) {
-		if_fail (send_smtp_strs(fd, first ? "To: ":" , ", hf->value, NULL)) return 0;
+		if_fail (send_smtp_strs(relay, first ? "To: ":" , ", hf->value, NULL)) return 0;
 		first = false;
 	}
-	if_fail (send_smtp_strs(fd, "Subject: ", header_find(fwd->header, SC_DESCR_FIELD, NULL)->value, NULL)) return 0;
-	if_fail (send_smtp_strs(fd, "Message-Id: <", mdir_version2str(fwd->version), "@", my_hostname, ">", NULL)) return 0;
+	if_fail (send_smtp_strs(relay, "Subject: ", header_find(fwd->header, SC_DESCR_FIELD, NULL)->value, NULL)) return 0;
+	if_fail (send_smtp_strs(relay, "Message-Id: <", mdir_version2str(fwd->version), "@", my_hostname, ">", NULL)) return 0;
 	if (NULL != (hf = header_find(fwd->header, SC_EXTID_FIELD, NULL))) {
-		if_fail (send_smtp_strs(fd, "In-Reply-To: ", hf->value, NULL)) return 0;
+		if_fail (send_smtp_strs(relay, "In-Reply-To: ", hf->value, NULL)) return 0;
 	}
-	if_fail (send_smtp_strs(fd, "Mime-Version: 1.0", NULL)) return 0;
+	if_fail (send_smtp_strs(relay, "Mime-Version: 1.0", NULL)) return 0;
 	char const *boundary = "Do-Noy-Cross-Criminal-Scene";
-	if_fail (send_smtp_strs(fd, "Content-Type: multipart/mixed; boundary=", boundary, NULL)) return 0;
+	if_fail (send_smtp_strs(relay, "Content-Type: multipart/mixed; boundary=", boundary, NULL)) return 0;
 	struct part *part;
 	TAILQ_FOREACH(part, &fwd->parts, entry) {
-		if_fail (send_smtp_strs(fd, "", NULL)) return 0;
-		if_fail (send_smtp_strs(fd, "--", boundary, NULL)) return 0;
-		if_fail (send_part(fd, part)) break;
+		if_fail (send_smtp_strs(relay, "", NULL)) return 0;
+		if_fail (send_smtp_strs(relay, "--", boundary, NULL)) return 0;
+		if_fail (send_part(relay, part)) return 0;
 	}
-	if_fail (send_smtp_strs(fd, "", NULL)) return 0;
-	if_fail (send_smtp_strs(fd, "--", boundary, "--", NULL)) return 0;
-	if_fail (status = smtp_cmd(fd, ".", NULL)) return 0;
+	if_fail (send_smtp_strs(relay, "", NULL)) return 0;
+	if_fail (send_smtp_strs(relay, "--", boundary, "--", NULL)) return 0;
+	if_fail (status = smtp_cmd(relay, ".", NULL)) return 0;
 	return status;
 }
 
 /*
- * Forwarder thread
+ * Relay threads
  */
 
-static bool transfers_done(struct forward *fwd)
+// We do not wait for the downloads to complete, but if one failed the forward fails
+static void check_transfers(struct forward *fwd)
 {
 	struct part *part;
 	TAILQ_FOREACH(part, &fwd->parts, entry) {
 		if (! part->tx) continue;
 		int tx_status = chn_tx_status(part->tx);
-		if (tx_status == 0) return false;
-		if (tx_status != 200) {
+		if (tx_status != 0 && tx_status != 200) {
 			fwd->status = tx_status;
-			return true;	// no need to wait further
+			return;
 		}
 	}
-	return true;
 }
 
-static void *forwarder(void *dummy)
+// Returns the next forward to deliver, or NULL if none became ready for a while.
+static struct forward *next_forward(void)
+{
+	struct forward *fwd;
+	bool deferred = false;
+	time_t const now = time(NULL);
+	list_lock();
+	TAILQ_FOREACH(fwd, &waiting_forwards, entry) {
+		debug("considering waiting forward@%p", fwd);
+		if (fwd->retry_after <= now) break;
+		deferred = true;
+	}
+	if (fwd) {
+		check_transfers(fwd);	// may set fwd->status in case of error
+		list_move_to_locked(&sending_forwards, fwd);
+	} else {	// wait for a submission
+		pth_event_t ev = pth_event(PTH_EVENT_TIME, pth_timeout(deferred ? RETRY_DELAY : CNX_IDLE_TIMEOUT, 0));
+		(void)pth_cond_await(&forwards_cond, &list_mutex, ev);	// this is a cancel point
+		pth_event_free(ev, PTH_FREE_THIS);
+	}
+	list_unlock();
+	return fwd;
+}
+
+static void deliver(struct relay *relay, struct forward *fwd)
 {
-	(void)dummy;
-	struct forward *fwd, *tmp;
+	if (fwd->status == 0) {
+		do {
+			if_fail (may_open_connection(relay)) break;	// if not already connected
+			if_fail (fwd->status = send_forward(relay, fwd)) close_connection(relay);
+		} while (0);
+		on_error {	// will try later
+			error("Cannot deliver forward@%p : %s", fwd, error_str());
+			error_clear();
+			fwd->retry_after = time(NULL) + RETRY_DELAY;
+			list_move_to(&waiting_forwards, fwd);
+			return;
+		}
+		relay->last_used = time(NULL);
+	}
+	list_move_to(&delivered_forwards, fwd);
+}
+
+static void *relay_thread(void *relay_)
+{
+	struct relay *relay = relay_;
 	while (! is_error() && ! terminate) {
-		TAILQ_FOREACH_SAFE(fwd, &waiting_forwards, entry, tmp) {
-			debug("considering waiting forward@%p", fwd);
-			if (! transfers_done(fwd)) continue;	// may set fwd->status in case of error
-			if (fwd->status == 0) {
-				if_fail (may_open_connection()) goto q;	// if not already connected
-				if_fail (fwd->status = send_forward(sock_fd, fwd)) {
-					error_clear();	// will try later
-					break;
-				}
-			}
-			list_move_to(&delivered_forwards, fwd);
-			sock_last_used = time(NULL);
+		struct forward *fwd = next_forward();
+		if (fwd) {
+			deliver(relay, fwd);
+		} else {
+			may_close_connection(relay);
 		}
-		may_close_connection();
-		pth_sleep(1);	// TODO: a signal when this list becomes non empty
 	}
-q:	debug("Exiting forwarder thread");
+	debug("Exiting relay thread");
 	return NULL;
 }
 
@@ -334,32 +489,69 @@ q:	debug("Exiting forwarder thread");
  * Init
  */
 
+static void relay_ctor(struct relay *relay)
+{
+	relay->fd = -1;
+	relay->pipelining = false;
+	relay->thread = NULL;
+	if_fail (varbuf_ctor(&relay->out, MAX_SMTP_LINE*4, true)) return;
+	if_fail (varbuf_ctor(&relay->in, MAX_SMTP_LINE*5, true)) {	// make room for a multiline answer
+		varbuf_dtor(&relay->out);
+		return;
+	}
+	varbuf_clean(&relay->out);
+	relay->thread = pth_spawn(PTH_ATTR_DEFAULT, relay_thread, relay);
+	if (relay->thread == NULL) {
+		varbuf_dtor(&relay->in);
+		varbuf_dtor(&relay->out);
+		with_error(0, "Cannot spawn relay thread") return;
+	}
+}
+
+static void relay_dtor(struct relay *relay)
+{
+	if (relay->thread != NULL) {
+		pth_abort(relay->thread);
+		relay->thread = NULL;
+	}
+	if (relay->fd != -1) close_connection(relay);
+	varbuf_dtor(&relay->in);
+	varbuf_dtor(&relay->out);
+}
+
 void forwarder_begin(void)
 {
 	conf_set_default_str("SC_SMTP_RELAY_HOST", "localhost");
 	conf_set_default_str("SC_SMTP_RELAY_PORT", "smtp");
+	conf_set_default_int("SC_SMTP_RELAY_CNX", 4);
 	pth_mutex_init(&list_mutex);
+	pth_cond_init(&forwards_cond);
+	pth_cond_init(&progress_cond);
+	pth_mutex_init(&progress_mutex);
 	TAILQ_INIT(&waiting_forwards);
+	TAILQ_INIT(&sending_forwards);
 	TAILQ_INIT(&delivered_forwards);
-	sock_fd = -1;
 	if (0 != gethostname(my_hostname, sizeof(my_hostname))) with_error(errno, "gethostname") return;
 	my_hostname[sizeof(my_hostname)-1] = '\0';
-	forwarder_thread = pth_spawn(PTH_ATTR_DEFAULT, forwarder, NULL);
-	if (forwarder_thread == NULL) with_error(0, "Cannot spawn forwarder") return;
+	long long const nb = conf_get_int("SC_SMTP_RELAY_CNX");
+	if (nb < 1) with_error(0, "SC_SMTP_RELAY_CNX must be at least 1") return;
+	relays = Calloc(nb * sizeof(*relays));
+	on_error return;
+	for (nb_relays = 0; nb_relays < nb; nb_relays++) {
+		if_fail (relay_ctor(relays + nb_relays)) return;
+	}
 }
 
 void forwarder_end(void)
 {
-	if (forwarder_thread != NULL) {
-		pth_abort(forwarder_thread);
-		forwarder_thread = NULL;
+	while (nb_relays > 0) relay_dtor(relays + --nb_relays);
+	if (relays) {
+		free(relays);
+		relays = NULL;
 	}
 	list_empty(&waiting_forwards);
+	list_empty(&sending_forwards);
 	list_empty(&delivered_forwards);
-	if (sock_fd != -1) {
-		(void)close(sock_fd);
-		sock_fd = -1;
-	}
 }
 
 /*
@@ -376,6 +568,10 @@ static void part_ctor(struct part *part, struct forward *fwd, char const *resour
 		if_fail (part->name = parameter_extract(resource, "name")) break;
 		if_fail (part->type = parameter_extract(resource, "type")) break;
 		if_fail (part->tx = chn_get_file(&ccnx, part->filename, resource_stripped)) break;
+		if (part->tx && 0 == chn_tx_status(part->tx)) {	// let the relays know when more data is available
+			if (! part->tx->cb) part->tx->cb = part_progress;
+			part->tx->progress_cb = part_progress;
+		}
 	} while (0);
 	free(resource_stripped);
 	on_error {
@@ -383,7 +579,7 @@ static void part_ctor(struct part *part, struct forward *fwd, char const *resour
 		FreeIfSet(&part->type);
 		return;
 	}
-	// we do not wait here for the transfert to complete, but will skip the delivery while the transfert is ongoing
+	// we do not wait here for the transfert to complete, the part will be sent while it's received
 	TAILQ_INSERT_TAIL(&fwd->parts, part, entry);
 	fwd->nb_parts++;
 }
@@ -419,6 +615,7 @@ static void forward_ctor(struct forward *fwd, mdir_version version, struct heade
 	fwd->nb_parts = 0;
 	fwd->list = NULL;
 	fwd->status = 0;
+	fwd->retry_after = 0;
 	fwd->version = version;
 	struct header_field *hf = NULL;
 	while (NULL != (hf = header_find(header, SC_RESOURCE_FIELD, hf))) {
@@ -468,6 +665,7 @@ void forward_submit(struct forward *fwd)
 {
 	list_move_to(&waiting_forwards, fwd);
 	fwd->submited = time(NULL);
+	wakeup_relays();
 }
 
 // Querrying
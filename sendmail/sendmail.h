@@ -52,6 +52,7 @@ struct forward {
 	int status;	// 0 if still unknown
 	mdir_version version;
 	time_t submited;
+	time_t retry_after;	// do not try to deliver before that time
 };
 
 struct forward *forward_new(mdir_version version, struct header *header);
@@ -0,0 +1,250 @@
+/* Copyright 2008 Cedric Cellier.
+ *
+ * This file is part of Scambio.
+ *
+ * Scambio is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Scambio is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with Scambio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* Checks for the BDAT state machine.
+ * The commands are executed on a connection which other end is played by the
+ * test, and the spool is replaced by a fake one that merely keeps what's
+ * written into it (and that can be told to fail).
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "scambio.h"
+#include "smtpd.h"
+#include "misc.h"
+#include "check.h"
+
+char my_hostname[256] = "localhost";
+off_t max_msg_size;
+struct chn_cnx ccnx;
+struct mdir_user *user;
+
+/*
+ * Fake spool
+ */
+
+static struct varbuf spooled;	// what was written into the last spool file
+static char committed[256];	// the last committed message
+static unsigned nb_committed;
+static bool spool_fails;	// the next spool_file_new() fails
+
+struct spool_file *spool_file_new(char const *reverse_path, struct recipients *recipients)
+{
+	(void)reverse_path;
+	(void)recipients;
+	if (spool_fails) {
+		spool_fails = false;
+		with_error(ENOSPC, "Cannot create spool file") return NULL;
+	}
+	varbuf_clean(&spooled);
+	return Calloc(sizeof(struct spool_file));
+}
+
+void spool_file_del(struct spool_file *sf)
+{
+	free(sf);
+}
+
+void spool_file_write(struct spool_file *sf, void const *data, size_t len)
+{
+	sf->size += len;
+	(void)varbuf_append(&spooled, len, data);
+}
+
+void spool_file_commit(struct spool_file *sf)
+{
+	snprintf(committed, sizeof(committed), "%s", spooled.buf);
+	nb_committed ++;
+	free(sf);
+}
+
+/*
+ * Client side
+ */
+
+static struct cnx_env env;
+static int client_fd;
+
+static void add_recipient(void)
+{
+	struct recipient *rcpt = Calloc(sizeof(*rcpt));
+	rcpt->forward_path = Strdup("bench");
+	STAILQ_INSERT_TAIL(&env.recipients, rcpt, entry);
+	env.nb_recipients ++;
+}
+
+// Execute a command, and returns the status of its last answer (0 on error)
+static int execute_n(mdir_cmd_cb *exec, struct mdir_cmd *cmd, unsigned nb_answers)
+{
+	exec(cmd, &env.cnx);
+	unless_error smtp_io_flush(&env.io);
+	on_error {
+		check_fail("execute", error_str());
+		error_clear();
+		return 0;
+	}
+	char answer[200];
+	size_t len = 0;
+	char const *last = answer;
+	while (nb_answers > 0) {
+		ssize_t const ret = read(client_fd, answer + len, sizeof(answer)-1 - len);
+		if (ret <= 0) return 0;
+		len += ret;
+		answer[len] = '\0';
+		char const *eol;
+		while (nb_answers > 0 && NULL != (eol = strchr(last, '\n'))) {
+			if (--nb_answers > 0) last = eol + 1;
+		}
+	}
+	return strtol(last, NULL, 10);
+}
+
+static int execute(mdir_cmd_cb *exec, struct mdir_cmd *cmd)
+{
+	return execute_n(exec, cmd, 1);
+}
+
+// Send a chunk, as the client would
+static int bdat(char const *data, bool last)
+{
+	char size[32], last_str[] = "LAST";
+	snprintf(size, sizeof(size), "%zu", strlen(data));
+	struct mdir_cmd cmd = { .nb_args = last ? 2:1 };
+	cmd.args[0].string = size;
+	cmd.args[1].string = last_str;
+	if_fail (Write(client_fd, data, strlen(data))) {
+		check_fail("bdat", error_str());
+		error_clear();
+		return 0;
+	}
+	return execute(exec_bdat, &cmd);
+}
+
+static int simple_cmd(mdir_cmd_cb *exec, char *arg)
+{
+	struct mdir_cmd cmd = { .nb_args = arg ? 1:0 };
+	cmd.args[0].string = arg;
+	return execute(exec, &cmd);
+}
+
+// Send a whole message with DATA, and returns the status of the answer after the final dot
+static int data(char const *msg)
+{
+	if_fail (Write(client_fd, msg, strlen(msg))) {
+		check_fail("data", error_str());
+		error_clear();
+		return 0;
+	}
+	struct mdir_cmd cmd = { .nb_args = 0 };
+	return execute_n(exec_data, &cmd, 2);
+}
+
+static void expect(char const *what, int status, int expected)
+{
+	if (status == expected) return;
+	char how[64];
+	snprintf(how, sizeof(how), "answered %d instead of %d", status, expected);
+	check_fail(what, how);
+}
+
+static void expect_committed(char const *what, unsigned nb, char const *msg)
+{
+	if (nb_committed != nb) check_fail(what, "wrong number of messages queued");
+	else if (msg && 0 != strcmp(committed, msg)) check_fail(what, "queued message differs from what was sent");
+}
+
+/*
+ * Scenarios
+ */
+
+static void new_transaction(void)
+{
+	if (! env.domain) env.domain = Strdup("localhost");
+	char from[] = "FROM:<bench@localhost>";
+	expect("MAIL", simple_cmd(exec_mail, from), 250);
+	add_recipient();
+}
+
+int main(void)
+{
+	check_begin();
+
+	int fds[2];
+	if (0 != socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+		perror("socketpair");
+		return EXIT_FAILURE;
+	}
+	client_fd = fds[1];
+	if_fail (smtp_io_ctor(&env.io, fds[0])) return EXIT_FAILURE;
+	if_fail (varbuf_ctor(&spooled, 1024, true)) return EXIT_FAILURE;
+	STAILQ_INIT(&env.recipients);
+
+	// Without recipient
+	env.domain = Strdup("localhost");
+	expect("BDAT without recipient", bdat("nobody\n", true), 503);
+
+	// A message in several chunks
+	new_transaction();
+	expect("first BDAT", bdat("Hello ", false), 250);
+	expect("empty BDAT", bdat("", false), 250);
+	expect("BDAT LAST", bdat("world\n", true), 250);
+	expect_committed("chunked message", 1, "Hello world\n");
+
+	// The spool cannot be created : all chunks are rejected until RSET
+	new_transaction();
+	spool_fails = true;
+	expect("BDAT with no spool", bdat("lost ", false), 451);
+	expect("BDAT after a failure", bdat("middle ", false), 554);
+	expect("DATA after a failure", simple_cmd(exec_data, NULL), 503);
+	expect("BDAT LAST after a failure", bdat("end\n", true), 554);
+	expect_committed("failed transaction", 1, NULL);
+	expect("RSET", simple_cmd(exec_rset, NULL), 250);
+	new_transaction();
+	expect("BDAT LAST after RSET", bdat("again\n", true), 250);
+	expect_committed("message after RSET", 2, "again\n");
+
+	// The spool cannot be created for a DATA : the message must not be acknowledged
+	new_transaction();
+	spool_fails = true;
+	expect("DATA with no spool", data("Subject: lost\r\n\r\nlost\r\n.\r\n"), 451);
+	expect_committed("DATA with no spool", 2, NULL);
+	expect("RSET after DATA", simple_cmd(exec_rset, NULL), 250);
+	new_transaction();
+	expect("DATA after a failure", data("kept\r\n.\r\n"), 250);
+	expect_committed("DATA after a failure", 3, "kept\n");
+
+	// Same, with a new MAIL
+	new_transaction();
+	spool_fails = true;
+	expect("BDAT with no spool", bdat("lost\n", false), 451);
+	expect("BDAT LAST after a failure", bdat("end\n", true), 554);
+	new_transaction();
+	expect("BDAT after MAIL", bdat("new ", false), 250);
+	expect("BDAT LAST after MAIL", bdat("message\n", true), 250);
+	expect_committed("message after MAIL", 4, "new message\n");
+
+	(void)simple_cmd(exec_rset, NULL);
+	smtp_io_dtor(&env.io);
+	(void)close(fds[0]);
+	(void)close(fds[1]);
+	varbuf_dtor(&spooled);
+	return check_end();
+}
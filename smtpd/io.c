@@ -0,0 +1,123 @@
+/* Copyright 2008 Cedric Cellier.
+ *
+ * This file is part of Scambio.
+ *
+ * Scambio is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Scambio is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with Scambio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * Buffered SMTP connection
+ *
+ * Everything received is read by large chunks, and commands are then parsed
+ * from this buffer. Answers are appended to an output buffer that's only
+ * written when we are about to wait for more input (or when it's getting big).
+ * So that a client that pipelines its commands receives all the answers at once.
+ */
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <pth.h>
+#include "scambio.h"
+#include "smtpd.h"
+#include "misc.h"
+
+#define SMTP_OUT_MAX 8192	// flush answers when we have that much
+
+void smtp_io_ctor(struct smtp_io *io, int fd)
+{
+	io->fd = fd;
+	io->start = io->end = 0;
+	io->broken = false;
+	if_fail (varbuf_ctor(&io->out, 1024, true)) return;
+	varbuf_clean(&io->out);
+}
+
+void smtp_io_dtor(struct smtp_io *io)
+{
+	varbuf_dtor(&io->out);
+}
+
+void smtp_io_flush(struct smtp_io *io)
+{
+	if (io->out.used == 0) return;
+	Write(io->fd, io->out.buf, io->out.used);
+	varbuf_clean(&io->out);
+	on_error io->broken = true;
+}
+
+void smtp_io_write(struct smtp_io *io, void const *data, size_t len)
+{
+	if_fail (varbuf_append(&io->out, len, data)) return;
+	if (io->out.used >= SMTP_OUT_MAX) smtp_io_flush(io);
+}
+
+// Wait for more input, once everything we have to say is said
+static void fill(struct smtp_io *io)
+{
+	if_fail (smtp_io_flush(io)) return;
+	if (io->start == io->end) io->start = io->end = 0;
+	if (io->end == sizeof(io->in)) {	// make room
+		memmove(io->in, io->in + io->start, io->end - io->start);
+		io->end -= io->start;
+		io->start = 0;
+	}
+	do {
+		ssize_t ret = pth_read(io->fd, io->in + io->end, sizeof(io->in) - io->end);
+		if (ret < 0) {
+			if (errno == EINTR || errno == EAGAIN) continue;
+			io->broken = true;
+			with_error(errno, "Cannot pth_read") return;
+		}
+		if (ret == 0) {
+			io->broken = true;
+			with_error(ENOENT, "End of file") return;
+		}
+		io->end += ret;
+	} while (0);
+}
+
+size_t smtp_io_peek(struct smtp_io *io, char const **data)
+{
+	if (io->start == io->end) if_fail (fill(io)) return 0;
+	*data = io->in + io->start;
+	return io->end - io->start;
+}
+
+void smtp_io_consume(struct smtp_io *io, size_t len)
+{
+	assert(io->start + len <= io->end);
+	io->start += len;
+}
+
+void smtp_io_read_line(struct smtp_io *io, struct varbuf *vb, size_t maxlen)
+{
+	size_t got = 0;
+	while (got < maxlen) {
+		char const *data;
+		size_t len;
+		if_fail (len = smtp_io_peek(io, &data)) return;
+		if (len > maxlen - got) len = maxlen - got;
+		char const *nl = memchr(data, '\n', len);
+		if (nl) len = nl - data + 1;
+		if_fail (varbuf_append(vb, len, data)) return;
+		smtp_io_consume(io, len);
+		got += len;
+		if (nl) {
+			if (vb->used >= 2 && vb->buf[vb->used-2] == '\r') {	// CRLF -> LF
+				vb->buf[vb->used-2] = '\n';
+				varbuf_chop(vb, 1);
+			}
+			break;
+		}
+	}
+}
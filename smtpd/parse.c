@@ -25,167 +25,161 @@
 #include "misc.h"
 #include "scambio/header.h"
 #include "mime.h"
+#include "codec.h"
 
-#ifndef HAVE_STRNSTR
-static char *strnstr(const char *big_, const char *little, size_t max_len)
-{
-	char *big = (char *)big_;	// here we have non-const strings
-	assert(max_len <= strlen(big));
-	char old_val = big[max_len];
-	big[max_len] = '\0';
-	debug("looking for %s in %s", little, big);
-	char *ret = strstr(big, little);
-	debug("found @ %p", ret);
-	big[max_len] = old_val;
-	return ret;
-}
-#endif
+/*
+ * Parse a mail into a struct msg_tree
+ *
+ * The message is parsed line by line as it's read : we track the
+ * multipart boundaries of all the enclosing parts, and decode the body
+ * of the current leaf part on the fly into a new resource of the file
+ * cache, which is uploaded as soon as the part is over. So the memory used does not depend on the
+ * message size (only on the size of the headers).
+ */
+
+#define MAX_MIME_DEPTH 16
+#define MAX_HEADER_SIZE 65536
+#define DECODE_BUF_SIZE 65536
+
+struct decoder {
+	enum { ENC_NONE, ENC_QUOTED, ENC_BASE64 } encoding;
+	union {
+		struct qp_dec qp;
+		struct base64_dec b64;
+	} u;
+};
+
+// Where the body of the current leaf is decoded to
+struct part_output {
+	int fd;
+	char resource[PATH_MAX];	// the output is written directly into this new resource
+	off_t size;
+	size_t used;
+	unsigned char buf[DECODE_BUF_SIZE];
+};
+
+struct level {
+	struct msg_tree *node;
+	enum { LV_HEADER, LV_BODY, LV_PREAMBLE, LV_PARTS, LV_EPILOGUE } state;
+	struct varbuf header;	// while in LV_HEADER
+	char boundary[2+MAX_BOUNDARY_LENGTH+1];	// with the leading "--", if multipart
+	size_t boundary_len;
+	bool pending_nl;	// the last line break of a body belongs to the next boundary
+};
+
+struct msg_parser {
+	struct msg_tree *root;
+	unsigned depth;
+	struct level levels[MAX_MIME_DEPTH];
+	struct decoder dec;
+	struct part_output out;
+	bool line_start;	// next chunk starts a new line
+	bool failed;	// then we merely skip the remaining of the message
+	off_t size, max_size;	// max_size = 0 for no limit
+	// When fed with raw data
+	struct varbuf line;
+	bool pending_cr;
+};
 
 /*
- * Parse a mail from a file descriptor into a struct msg_tree
+ * Output
  */
 
-static struct msg_tree *parse_mail_rec(char *msg, size_t size);
+static void output_open(struct part_output *out)
+{
+	if_fail (out->fd = chn_resource_create(out->resource)) return;
+	out->size = 0;
+	out->used = 0;
+}
 
-// We ignore preamble and epilogue.
-static void parse_multipart(struct msg_tree *node, char *msg, size_t size, char *boundary)
+static void output_flush(struct part_output *out)
 {
-	char *msg_end = msg+size;
-	node->type = CT_MULTIPART;
-	SLIST_INIT(&node->content.parts);
-	size_t const boundary_len = strlen(boundary);
-	bool last_boundary = false;
-	bool first_boundary = true;
-	// Go straight to the first boundary for first component
-	do {
-		char *delim_pos = strnstr(msg, boundary, msg_end-msg);
-		if (! delim_pos) {
-			with_error(0, "multipart boundary not found (%s)", boundary) return;
-		}
-		assert(delim_pos < msg_end);
-		if (! first_boundary) {
-			struct msg_tree *part = parse_mail_rec(msg, delim_pos - msg);
-			unless_error SLIST_INSERT_HEAD(&node->content.parts, part, entry);
-			error_clear();
-		}
-		first_boundary = false;
-		msg = delim_pos + boundary_len;
-		// boundary may be followed by "--" if it's the last one, then some optional spaces then CRLF.
-		if (msg[0] == '-' && msg[1] == '-') {
-			msg += 2;
-			last_boundary = true;
-		}
-		while (isblank(*msg)) msg++;
-		if (*msg != '\n') {	// CRLF are converted to '\n' by varbuf_read_line()
-			with_error(0, "Badly formated multipart message : boundary not followed by new line (%s)", boundary) return;
-		}
-		msg ++;	// skip NL
-	} while (msg < msg_end && !last_boundary);
+	if (out->used == 0) return;
+	if_fail (Write(out->fd, out->buf, out->used)) return;
+	out->size += out->used;
+	out->used = 0;
 }
 
-static void decode_quoted(struct varbuf *vb, size_t size, char *msg)
+// Drop the output resource
+static void output_abort(struct part_output *out)
 {
-	unsigned char quoted = 0;
-	enum { READ_UNQUOTED, READ_QUOTE1, READ_QUOTE2 } state = READ_UNQUOTED;
-	while (size > 0) {
-		if (state == READ_UNQUOTED) {
-			if (*msg == '=') {
-				state = READ_QUOTE1;
-				quoted = 0;
-			} else {
-				if_fail (varbuf_append(vb, 1, msg)) return;
-			}
-		} else {
-			if (*msg >= '0' && *msg <= '9') {
-				quoted = quoted*16 + *msg - '0';
-			} else if (*msg >= 'A' && *msg <= 'F') {
-				quoted = quoted*16 + 10 + *msg - 'A';
-			} else {
-				// Either a soft break or an error. In both cases, ignore.
-				state = READ_UNQUOTED;
-			}
-			if (state == READ_QUOTE1) {
-				state = READ_QUOTE2;
-			} else if (state == READ_QUOTE2) {
-				if_fail (varbuf_append(vb, 1, (char *)&quoted)) return;
-				state = READ_UNQUOTED;
-			}
-		}
-		msg++;
-		size--;
-	}
+	chn_resource_abort(out->fd, out->resource);
+	out->fd = -1;
 }
 
-static void decode_base64(struct varbuf *vb, size_t size, char *msg)
+// Close the output resource, and upload it if not empty
+static void output_close(struct part_output *out, char resource[PATH_MAX])
 {
-	static const unsigned char b64[] = {
-		['A'] = 0,  ['B'] = 1,  ['C'] = 2,  ['D'] = 3,  ['E'] = 4,  ['F'] = 5, 
-		['G'] = 6,  ['H'] = 7,  ['I'] = 8,  ['J'] = 9,  ['K'] = 10, ['L'] = 11,
-		['M'] = 12, ['N'] = 13, ['O'] = 14, ['P'] = 15, ['Q'] = 16, ['R'] = 17,
-		['S'] = 18, ['T'] = 19, ['U'] = 20, ['V'] = 21, ['W'] = 22, ['X'] = 23,
-		['Y'] = 24, ['Z'] = 25, ['a'] = 26, ['b'] = 27, ['c'] = 28, ['d'] = 29,
-		['e'] = 30, ['f'] = 31, ['g'] = 32, ['h'] = 33, ['i'] = 34, ['j'] = 35,
-		['k'] = 36, ['l'] = 37, ['m'] = 38, ['n'] = 39, ['o'] = 40, ['p'] = 41,
-		['q'] = 42, ['r'] = 43, ['s'] = 44, ['t'] = 45, ['u'] = 46, ['v'] = 47,
-		['w'] = 48, ['x'] = 49, ['y'] = 50, ['z'] = 51, ['0'] = 52, ['1'] = 53,
-		['2'] = 54, ['3'] = 55, ['4'] = 56, ['5'] = 57, ['6'] = 58, ['7'] = 59,
-		['8'] = 60, ['9'] = 61, ['+'] = 62, ['/'] = 63,
-  	};
-	unsigned nb_vals = 0;
-	unsigned nb_pads = 0;
-	unsigned vals[4];
-	while (size > 0) {
-		unsigned const c = *msg;
-		if (c == '=') {
-			nb_pads ++;
-			if (nb_pads > 2) with_error(0, "Invalid base64 encoding : too many padding") return;
-		} else if (c > sizeof_array(b64)) {	// ignore
-			debug("Invalid char '%c' in base64 encoding", c);
-		} else {
-			unsigned char val = b64[c];
-			if (val == 0 && c != 'A') {	// ignore
-				debug("Invalid char '%c' in base64 encoding", c);
-			} else {
-				if (nb_pads > 0) with_error(0, "Invalid base64 encoding : padding chars within body") return;
-				vals[nb_vals++] = val;
-			}
-		}
-		if (nb_vals + nb_pads >= sizeof_array(vals)) {	// output the result
-			unsigned char output[3] = {
-				(vals[0] << 2) | (vals[1] >> 4),
-				(vals[1] << 4) | (vals[2] >> 2),
-				(vals[2] << 6) | vals[3],
-			};
-			if_fail (varbuf_append(vb, sizeof(output)-nb_pads, output)) return;
-			nb_vals = 0;
-		}
-		msg++;
-		size--;
+	resource[0] = '\0';
+	output_flush(out);
+	if (is_error() || out->size == 0) {	// Many mailers add useless empty parts
+		error_save();
+		output_abort(out);
+		error_restore();
+		return;
 	}
+	chn_resource_close(&ccnx, out->fd, out->resource, NULL, NULL);
+	out->fd = -1;
+	unless_error snprintf(resource, PATH_MAX, "%s", out->resource);
 }
 
-static void decode_in_varbuf(struct varbuf *vb, size_t size, char *msg, struct header *header)
+/*
+ * Decoders
+ */
+
+static void decoder_ctor(struct decoder *dec, struct header *header)
 {
+	dec->encoding = ENC_NONE;
 	struct header_field *encoding = header_find(header, "content-transfer-encoding", NULL);
-	on_error return;
-	if (encoding) {
-		static const struct {
-			char const *name;
-			void (*decode)(struct varbuf *, size_t, char *);
-		} possible_encodings[] = {
-			{ "quoted-printable", decode_quoted },
-			{ "base64", decode_base64 },
-		};
-		for (unsigned e=0; e<sizeof_array(possible_encodings); e++) {
-			if (0 != strcasecmp(encoding->value, possible_encodings[e].name)) continue;
-			debug("decoding %s, size = %zu", encoding->value, size);
-			possible_encodings[e].decode(vb, size, msg);
-			debug("output size : %zu", vb->used);
-			return;
-		}
+	if (! encoding) return;
+	if (0 == strcasecmp(encoding->value, "quoted-printable")) {
+		dec->encoding = ENC_QUOTED;
+		qp_dec_ctor(&dec->u.qp);
+	} else if (0 == strcasecmp(encoding->value, "base64")) {
+		dec->encoding = ENC_BASE64;
+		base64_dec_ctor(&dec->u.b64);
 	}
 	// Nothing found, or no encoding : just copy
-	varbuf_append(vb, size, msg);
+}
+
+// Decode directly into the output buffer, by chunks small enough to always fit
+#define DECODE_CHUNK_SIZE 4096
+
+// How many bytes decoding len chars may output at most
+static size_t decode_max(struct decoder const *dec, size_t len)
+{
+	switch (dec->encoding) {
+		case ENC_QUOTED: return QP_DECODE_MAX(len);
+		case ENC_BASE64: return BASE64_DECODE_MAX(len);
+		case ENC_NONE: break;
+	}
+	return len;
+}
+
+static void decode(struct decoder *dec, struct part_output *out, size_t size, char const *msg)
+{
+	while (size > 0) {
+		size_t const len = size < DECODE_CHUNK_SIZE ? size : DECODE_CHUNK_SIZE;
+		if (out->used + decode_max(dec, len) > sizeof(out->buf)) {
+			if_fail (output_flush(out)) return;
+		}
+		unsigned char *const dst = out->buf + out->used;
+		switch (dec->encoding) {
+			case ENC_QUOTED:
+				out->used += qp_decode(&dec->u.qp, dst, msg, len);
+				break;
+			case ENC_BASE64:
+				out->used += base64_decode(&dec->u.b64, dst, msg, len);
+				break;
+			case ENC_NONE:
+				memcpy(dst, msg, len);
+				out->used += len;
+				break;
+		}
+		on_error return;
+		msg += len;
+		size -= len;
+	}
 }
 
 static size_t append_param(char *params, size_t maxlen, size_t len, char const *pname, char const *pval, size_t plen)
@@ -239,27 +233,83 @@ static void build_params(char *params, size_t maxlen, struct header *header)
 	}
 }
 
-static void parse_mail_node(struct msg_tree *node, char *msg, size_t size)
+/*
+ * Parser
+ */
+
+static struct msg_tree *msg_tree_new(void)
+{
+	struct msg_tree *node = Calloc(sizeof(*node));
+	node->type = CT_NONE;
+	return node;
+}
+
+static void msg_tree_dtor(struct msg_tree *node)
+{
+	if (node->header) {
+		header_unref(node->header);
+		node->header = NULL;
+	}
+	if (node->type == CT_MULTIPART) {
+		struct msg_tree *sub;
+		while (NULL != (sub = STAILQ_FIRST(&node->content.parts))) {
+			STAILQ_REMOVE_HEAD(&node->content.parts, entry);
+			msg_tree_del(sub);
+		}
+	}
+	node->type = CT_NONE;
+}
+
+void msg_tree_del(struct msg_tree *node)
+{
+	msg_tree_dtor(node);
+	free(node);
+}
+
+static struct level *top_level(struct msg_parser *parser)
+{
+	assert(parser->depth > 0);
+	return parser->levels + parser->depth - 1;
+}
+
+// Start a new part, which header will follow
+static void level_push(struct msg_parser *parser, struct msg_tree *node)
 {
-	// First read the header
+	if (parser->depth >= sizeof_array(parser->levels)) with_error(0, "Too many nested parts") return;
+	struct level *lv = parser->levels + parser->depth;
 	if_fail (node->header = header_new()) return;
-	size_t header_size;
-	if_fail (header_size = header_parse(node->header, msg)) return;
-	assert(header_size <= size);
+	if_fail (varbuf_ctor(&lv->header, 1024, true)) return;
+	varbuf_clean(&lv->header);
+	lv->node = node;
+	lv->state = LV_HEADER;
+	lv->boundary_len = 0;
+	lv->pending_nl = false;
+	parser->depth ++;
+}
+
+// The header of the current part is complete : see what follows
+static void header_complete(struct msg_parser *parser)
+{
+	struct level *lv = top_level(parser);
+	struct msg_tree *node = lv->node;
+	varbuf_append(&lv->header, 1, "\n");	// the empty line ending the header
+	unless_error (void)header_parse(node->header, lv->header.buf);
+	varbuf_dtor(&lv->header);
+	on_error return;
 	// Find out weither the body is total with a decoding method, or
 	// is another message up to a given boundary.
 	struct header_field *content_type = header_find(node->header, "content-type", NULL);
 	if (content_type && 0 == strncasecmp(content_type->value, "multipart/", 10)) {
 		debug("message is multipart");
-#		define PREFIX "\n--"
-#		define PREFIX_LENGTH 3
-		char boundary[PREFIX_LENGTH+MAX_BOUNDARY_LENGTH] = PREFIX;
 		char *b = parameter_extract(content_type->value, "boundary");
 		on_error return;
 		if (b) {
-			snprintf(boundary+PREFIX_LENGTH, sizeof(boundary)-PREFIX_LENGTH, "%s", b);
+			lv->boundary_len = snprintf(lv->boundary, sizeof(lv->boundary), "--%s", b);
+			if (lv->boundary_len >= sizeof(lv->boundary)) lv->boundary_len = sizeof(lv->boundary)-1;
 			free(b);
-			parse_multipart(node, msg, size, boundary);
+			node->type = CT_MULTIPART;
+			STAILQ_INIT(&node->content.parts);
+			lv->state = LV_PREAMBLE;	// We ignore preamble and epilogue.
 			return;
 		} else {
 			warning("multipart message without boundary ?");	// proceed as a single file
@@ -267,78 +317,261 @@ static void parse_mail_node(struct msg_tree *node, char *msg, size_t size)
 	}
 	// Process mail as a single file
 	debug("message is a single file");
-	// read the file in node->content.file
 	build_params(node->content.file.params, sizeof(node->content.file.params), node->header);
-	if_fail (varbuf_ctor(&node->content.file.data, 1024, true)) return;
+	node->content.file.resource[0] = '\0';
 	node->type = CT_FILE;
-	if (msg[header_size] == '\n') header_size++;	// A SMTP header is supposed to be ended because of en empty line that we dont want on the file
-	if_fail (decode_in_varbuf(&node->content.file.data, size-header_size, msg+header_size, node->header)) return;
+	decoder_ctor(&parser->dec, node->header);
+	if_fail (output_open(&parser->out)) return;
+	lv->state = LV_BODY;
 }
 
-static void msg_tree_dtor(struct msg_tree *node)
+// End the current part
+static void level_pop(struct msg_parser *parser)
 {
-	if (node->header) {
-		header_unref(node->header);
-		node->header = NULL;
+	struct level *lv = top_level(parser);
+	if (lv->state == LV_HEADER) {	// no body at all
+		header_complete(parser);
 	}
-	switch (node->type) {
-		case CT_NONE:
-			break;
-		case CT_FILE:
-			varbuf_dtor(&node->content.file.data);
+	if (lv->state == LV_BODY) {
+		output_close(&parser->out, lv->node->content.file.resource);
+	}
+	parser->depth --;
+}
+
+// Tells if the line is the boundary of this level (and if it's the last one)
+static bool is_boundary(struct level *lv, char const *line, size_t len, bool *last)
+{
+	if (lv->boundary_len == 0 || lv->state == LV_EPILOGUE) return false;
+	if (len < lv->boundary_len || 0 != memcmp(line, lv->boundary, lv->boundary_len)) return false;
+	line += lv->boundary_len;
+	len -= lv->boundary_len;
+	// boundary may be followed by "--" if it's the last one, then some optional spaces then CRLF.
+	*last = len >= 2 && line[0] == '-' && line[1] == '-';
+	if (*last) {
+		line += 2;
+		len -= 2;
+	}
+	while (len > 0 && isspace(*line)) {
+		line ++;
+		len --;
+	}
+	return len == 0;
+}
+
+static bool check_boundaries(struct msg_parser *parser, char const *line, size_t len)
+{
+	for (unsigned l = parser->depth; l-- > 0; ) {
+		struct level *lv = parser->levels + l;
+		bool last;
+		if (! is_boundary(lv, line, len, &last)) continue;
+		// Terminate all parts within this multipart
+		while (parser->depth > l+1) {
+			if_fail (level_pop(parser)) return true;
+		}
+		if (last) {
+			lv->state = LV_EPILOGUE;
+		} else {
+			lv->state = LV_PARTS;
+			struct msg_tree *part = msg_tree_new();
+			STAILQ_INSERT_TAIL(&lv->node->content.parts, part, entry);
+			level_push(parser, part);
+		}
+		return true;
+	}
+	return false;
+}
+
+// Process a chunk of the message (a whole line, with its '\n', or the beginning of a line that's too long)
+static void parse_chunk(struct msg_parser *parser, char const *line, size_t len, bool line_start)
+{
+	if (line_start && check_boundaries(parser, line, len)) return;
+	on_error return;
+	struct level *lv = top_level(parser);
+	switch (lv->state) {
+		case LV_HEADER:
+			if (line_start && (len == 0 || line[0] == '\n')) {	// end of header
+				header_complete(parser);
+				return;
+			}
+			if (lv->header.used + len > MAX_HEADER_SIZE) with_error(0, "Header too long") return;
+			varbuf_append(&lv->header, len, line);
 			break;
-		case CT_MULTIPART:
-			{
-				struct msg_tree *sub, *tmp;
-				SLIST_FOREACH_SAFE(sub, &node->content.parts, entry, tmp) {
-					msg_tree_del(sub);
-				}
+		case LV_BODY:
+			if (lv->pending_nl) {
+				if_fail (decode(&parser->dec, &parser->out, 1, "\n")) return;
+				lv->pending_nl = false;
 			}
+			if (len > 0 && line[len-1] == '\n') {
+				len --;
+				lv->pending_nl = true;
+			}
+			decode(&parser->dec, &parser->out, len, line);
+			break;
+		case LV_PREAMBLE:
+		case LV_PARTS:
+		case LV_EPILOGUE:
 			break;
 	}
-	node->type = CT_NONE;
 }
 
-void msg_tree_del(struct msg_tree *node)
+// Terminates all parts (dropping their content unless store is set)
+static void close_levels(struct msg_parser *parser, bool store)
 {
-	msg_tree_dtor(node);
-	free(node);
+	while (parser->depth > 0) {
+		struct level *lv = top_level(parser);
+		if (!store && lv->state == LV_BODY) {	// do not upload anything
+			output_abort(&parser->out);
+			lv->state = LV_PREAMBLE;
+		}
+		if_fail (level_pop(parser)) store = false;
+	}
 }
 
-// do not look msg after size
-static struct msg_tree *parse_mail_rec(char *msg, size_t size)
+static void msg_parser_ctor(struct msg_parser *parser, off_t max_size)
 {
-	struct msg_tree *node = calloc(1, sizeof(*node));
-	if (! node) with_error(ENOMEM, "calloc mail") return NULL;
-	if_fail (parse_mail_node(node, msg, size)) {
-		msg_tree_del(node);
-		node = NULL;
+	parser->depth = 0;
+	parser->out.fd = -1;
+	parser->line_start = true;
+	parser->failed = false;
+	parser->size = 0;
+	parser->max_size = max_size;
+	parser->pending_cr = false;
+	parser->root = msg_tree_new();
+	if_fail (varbuf_ctor(&parser->line, MAX_MAILLINE_LENGTH+10, true)) goto q0;
+	varbuf_clean(&parser->line);
+	if_fail (level_push(parser, parser->root)) goto q1;
+	return;
+q1:
+	varbuf_dtor(&parser->line);
+q0:
+	msg_tree_del(parser->root);
+}
+
+static void msg_parser_dtor(struct msg_parser *parser)
+{
+	varbuf_dtor(&parser->line);
+	if (parser->root) msg_tree_del(parser->root);
+}
+
+struct msg_parser *msg_parser_new(off_t max_size)
+{
+	struct msg_parser *parser = Malloc(sizeof(*parser));	// too big for a pth stack
+	if_fail (msg_parser_ctor(parser, max_size)) {
+		free(parser);
+		return NULL;
 	}
-	return node;
+	return parser;
 }
 
-static void read_whole_mail(struct varbuf *vb, int fd)
+void msg_parser_del(struct msg_parser *parser)
 {
-	debug("read_whole_mail(vb=%p, fd=%d)", vb, fd);
-	char *line;
-	do {
-		varbuf_read_line(vb, fd, MAX_MAILLINE_LENGTH, &line);
-		on_error break;
-		if (line_match(line, ".")) {	// chop this line
-			varbuf_cut(vb, line);
-			break;
+	close_levels(parser, false);
+	error_clear();
+	msg_parser_dtor(parser);
+	free(parser);
+}
+
+void msg_parser_line(struct msg_parser *parser, char const *line, size_t len)
+{
+	parser->size += len;
+	if (parser->failed || parser->depth == 0) return;
+	if (parser->max_size > 0 && parser->size > parser->max_size) {
+		error("Message too big (more than %lld bytes)", (long long)parser->max_size);
+		parser->failed = true;
+		return;
+	}
+	parse_chunk(parser, line, len, parser->line_start);
+	on_error {	// keep reading until the end of the message
+		error("Cannot parse mail : %s", error_str());
+		error_clear();
+		parser->failed = true;
+	}
+	parser->line_start = len > 0 && line[len-1] == '\n';
+}
+
+// Tells if we are in a body that can only end with the message
+static bool in_final_body(struct msg_parser *parser)
+{
+	return parser->depth == 1 && top_level(parser)->state == LV_BODY;
+}
+
+// Pass everything to the body, but CRs from CRLFs
+static void feed_body(struct msg_parser *parser, char const *data, size_t len)
+{
+	while (len > 0) {
+		if (parser->pending_cr) {
+			parser->pending_cr = false;
+			if (data[0] != '\n') msg_parser_line(parser, "\r", 1);
 		}
-	} while (1);
+		char const *cr = memchr(data, '\r', len);
+		size_t const l = cr ? (size_t)(cr - data) : len;
+		if (l > 0) msg_parser_line(parser, data, l);
+		if (! cr) break;
+		parser->pending_cr = true;	// will know what to do with it with the next char
+		data += l + 1;
+		len -= l + 1;
+	}
 }
 
-struct msg_tree *msg_tree_read(int fd)
+static void flush_line(struct msg_parser *parser)
 {
+	size_t len = parser->line.used;
+	if (len >= 2 && parser->line.buf[len-1] == '\n' && parser->line.buf[len-2] == '\r') {	// CRLF -> LF
+		parser->line.buf[len-2] = '\n';
+		len --;
+	}
+	msg_parser_line(parser, parser->line.buf, len);
+	varbuf_clean(&parser->line);
+}
+
+void msg_parser_feed(struct msg_parser *parser, char const *data, size_t len)
+{
+	while (len > 0) {
+		if (parser->failed) {
+			parser->size += len;
+			return;
+		}
+		if (parser->line.used == 0 && parser->depth > 0 && in_final_body(parser)) {
+			// No boundary to look for : no need to split lines
+			feed_body(parser, data, len);
+			return;
+		}
+		char const *nl = memchr(data, '\n', len);
+		size_t l = nl ? (size_t)(nl - data) + 1 : len;
+		size_t const room = MAX_MAILLINE_LENGTH - parser->line.used;
+		if (l > room) {
+			l = room;
+			nl = NULL;
+		}
+		if_fail (varbuf_append(&parser->line, l, data)) {
+			error_clear();
+			parser->failed = true;
+			continue;
+		}
+		if (nl || parser->line.used >= MAX_MAILLINE_LENGTH) flush_line(parser);
+		data += l;
+		len -= l;
+	}
+}
+
+struct msg_tree *msg_parser_finish(struct msg_parser *parser)
+{
+	if (parser->pending_cr) msg_parser_line(parser, "\r", 1);
+	if (parser->line.used > 0) flush_line(parser);
 	struct msg_tree *root = NULL;
-	struct varbuf vb;
-	if_fail (varbuf_ctor(&vb, 10240, true)) return NULL;
-	read_whole_mail(&vb, fd);
-	unless_error root = parse_mail_rec(vb.buf, vb.used);
-	varbuf_dtor(&vb);
+	if (parser->failed) {
+		bool const too_big = parser->max_size > 0 && parser->size > parser->max_size;
+		msg_parser_del(parser);
+		with_error(too_big ? EFBIG:EINVAL, "Cannot parse mail") return NULL;
+	}
+	close_levels(parser, true);
+	unless_error {
+		root = parser->root;
+		parser->root = NULL;
+	}
+	error_save();
+	msg_parser_dtor(parser);
+	free(parser);
+	error_restore();
 	return root;
 }
-
@@ -0,0 +1,138 @@
+/* Copyright 2008 Cedric Cellier.
+ *
+ * This file is part of Scambio.
+ *
+ * Scambio is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Scambio is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with Scambio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* Checks for the body decoders of the mail parser.
+ * Some data is encoded (with no encoding, quoted-printable and base64), then fed
+ * to the parser's decode() by chunks of various sizes, so that the decoder states
+ * and the output buffer are exercised across chunk boundaries, and the result is
+ * compared with the original data. The data is several times larger than the
+ * output buffer, which must never overflow.
+ */
+#include <stdio.h>
+#include "check.h"
+#include "parse.c"
+
+struct chn_cnx ccnx;	// parse.c uploads the parts there
+
+#define DATA_SIZE (5*DECODE_BUF_SIZE + 123)
+
+static size_t const feed_sizes[] = { 1, 3, 77, 4095, 4096, 4097, 9000, DECODE_BUF_SIZE };
+
+// The output buffer, with some guard bytes behind
+static struct {
+	struct part_output out;
+	unsigned char guard[DECODE_CHUNK_SIZE];
+} sink;
+
+// The parser reads lines with CRLF converted to LF
+static size_t crlf_to_lf(char *text, size_t len)
+{
+	size_t o = 0;
+	for (size_t i = 0; i < len; i++) {
+		if (text[i] == '\r' && i + 1 < len && text[i+1] == '\n') continue;
+		text[o++] = text[i];
+	}
+	return o;
+}
+
+static void check_decode(char const *what, struct decoder *dec, char const *encoded, size_t len, unsigned char const *expected, size_t expected_len)
+{
+	FILE *tmp = tmpfile();
+	if (! tmp) {
+		check_fail(what, "cannot create temporary file");
+		return;
+	}
+	sink.out.fd = fileno(tmp);
+	sink.out.size = 0;
+	sink.out.used = 0;
+	memset(sink.guard, 0x5a, sizeof(sink.guard));
+	size_t i = 0;
+	for (unsigned f = 0; i < len; f++) {
+		size_t chunk = feed_sizes[f % sizeof_array(feed_sizes)];
+		if (chunk > len - i) chunk = len - i;
+		if_fail (decode(dec, &sink.out, chunk, encoded + i)) break;
+		i += chunk;
+	}
+	unless_error output_flush(&sink.out);
+	on_error {
+		check_fail(what, error_str());
+		error_clear();
+		fclose(tmp);
+		return;
+	}
+	for (size_t g = 0; g < sizeof(sink.guard); g++) {
+		if (sink.guard[g] != 0x5a) {
+			check_fail(what, "output buffer overflow");
+			break;
+		}
+	}
+	unsigned char *decoded = Malloc(expected_len + 1);
+	rewind(tmp);
+	size_t const decoded_len = fread(decoded, 1, expected_len + 1, tmp);
+	if ((off_t)decoded_len != sink.out.size || decoded_len != expected_len || 0 != memcmp(decoded, expected, expected_len)) {
+		check_fail(what, "decoded data differs from the original");
+	}
+	free(decoded);
+	fclose(tmp);
+}
+
+int main(void)
+{
+	check_begin();
+
+	unsigned char *data = Malloc(DATA_SIZE);
+	char *text = Malloc(DATA_SIZE);
+	char *encoded = Malloc(BASE64_ENCODE_MAX(DATA_SIZE) + QP_ENCODE_MAX(DATA_SIZE));
+	srand(42);
+	for (size_t i = 0; i < DATA_SIZE; i++) {
+		data[i] = rand();
+		// Mostly printable text, with a few blanks, lines and accents
+		int const r = rand() % 100;
+		text[i] = r < 2 ? '\n' : r < 15 ? ' ' : r < 17 ? (char)0xe9 : 'a' + r % 26;
+	}
+
+	struct decoder dec = { .encoding = ENC_NONE };
+	check_decode("plain text", &dec, text, DATA_SIZE, (unsigned char *)text, DATA_SIZE);
+
+	struct qp_enc qp;
+	qp_enc_ctor(&qp);
+	size_t len = qp_encode(&qp, encoded, text, DATA_SIZE);
+	len += qp_encode_finish(&qp, encoded + len);
+	len = crlf_to_lf(encoded, len);
+	dec.encoding = ENC_QUOTED;
+	qp_dec_ctor(&dec.u.qp);
+	check_decode("quoted-printable text", &dec, encoded, len, (unsigned char *)text, DATA_SIZE);
+
+	for (enum codec_impl impl = CODEC_SCALAR; impl <= CODEC_AVX2; impl++) {
+		if (codec_set_impl(impl) != impl) continue;
+		struct base64_enc b64;
+		base64_enc_ctor(&b64, CODEC_LINE_LENGTH);
+		len = base64_encode(&b64, encoded, data, DATA_SIZE);
+		len += base64_encode_finish(&b64, encoded + len);
+		len = crlf_to_lf(encoded, len);
+		dec.encoding = ENC_BASE64;
+		base64_dec_ctor(&dec.u.b64);
+		char what[64];
+		snprintf(what, sizeof(what), "%s base64 data", codec_impl_name(impl));
+		check_decode(what, &dec, encoded, len, data, DATA_SIZE);
+	}
+
+	free(data);
+	free(text);
+	free(encoded);
+	return check_end();
+}
@@ -16,8 +16,10 @@
  * along with Scambio.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <unistd.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
@@ -71,19 +73,19 @@ void exec_end(void) {
  * Answers
  */
 
+// Answers are buffered until we wait for the next command (so that pipelined commands are answered at once)
 static void answer_gen(struct mdir_cnx *cnx, int status, char const *cmpl, char sep)
 {
+	struct cnx_env *env = DOWNCAST(cnx, cnx, cnx_env);
 	char line[100];
 	size_t len = snprintf(line, sizeof(line), "%03d%c%s"CRLF, status, sep, cmpl);
 	assert(len < sizeof(line));
-	Write(cnx->fd, line, len);
+	smtp_io_write(&env->io, line, len);
 }
-#if 0
-static void answer_cont(struct cnx_env *env, int status, char *cmpl)
+static void answer_cont(struct mdir_cnx *cnx, int status, char const *cmpl)
 {
-	answer_gen(env, status, cmpl, '-');
+	answer_gen(cnx, status, cmpl, '-');
 }
-#endif
 void answer(struct mdir_cnx *cnx, int status, char const *cmpl)
 {
 	answer_gen(cnx, status, cmpl, ' ');
@@ -100,11 +102,30 @@ static void unset_address(char **addr)
 		*addr = NULL;
 	}
 }
+static void reset_spool(struct cnx_env *env)
+{
+	if (env->spool) {
+		spool_file_del(env->spool);
+		env->spool = NULL;
+	}
+	env->failed = false;
+}
+void reset_recipients(struct cnx_env *env)
+{
+	struct recipient *rcpt;
+	while (NULL != (rcpt = STAILQ_FIRST(&env->recipients))) {
+		STAILQ_REMOVE_HEAD(&env->recipients, entry);
+		free(rcpt->forward_path);
+		free(rcpt);
+	}
+	env->nb_recipients = 0;
+}
 static void reset_state(struct cnx_env *env)
 {
+	reset_spool(env);
 	unset_address(&env->domain);
 	unset_address(&env->reverse_path);
-	unset_address(&env->forward_path);
+	reset_recipients(env);
 }
 static void set_domain(struct cnx_env *env, char const *id)
 {
@@ -130,13 +151,30 @@ static void set_reverse_path(struct cnx_env *env, char const *reverse_path)
 {
 	set_address(&env->reverse_path, reverse_path);
 }
-static void set_forward_path(struct cnx_env *env, char const *forward_path)
+static struct mdir *mailbox_lookup(char const *forward_path)
 {
-	if_fail (set_address(&env->forward_path, forward_path)) return;
-	// Check the mailbox exists
 	char folder[PATH_MAX];
-	snprintf(folder, sizeof(folder), "/mailboxes/Incoming/%s", env->forward_path);
-	if_fail (env->mailbox = mdir_lookup(folder)) unset_address(&env->forward_path);
+	snprintf(folder, sizeof(folder), "/mailboxes/Incoming/%s", forward_path);
+	return mdir_lookup(folder);
+}
+static void add_forward_path(struct cnx_env *env, char const *forward_path)
+{
+	struct recipient *rcpt = Malloc(sizeof(*rcpt));
+	on_error return;
+	rcpt->forward_path = NULL;
+	if_fail (set_address(&rcpt->forward_path, forward_path)) goto q;
+	struct recipient *other;
+	STAILQ_FOREACH(other, &env->recipients, entry) {
+		if (0 == strcasecmp(other->forward_path, rcpt->forward_path)) goto q;	// already there
+	}
+	// Check the mailbox exists
+	if_fail (rcpt->mailbox = mailbox_lookup(rcpt->forward_path)) goto q;
+	STAILQ_INSERT_TAIL(&env->recipients, rcpt, entry);
+	env->nb_recipients ++;
+	return;
+q:
+	unset_address(&rcpt->forward_path);
+	free(rcpt);
 }
 void exec_helo(struct mdir_cmd *cmd, void *user_data)
 {
@@ -146,6 +184,20 @@ void exec_helo(struct mdir_cmd *cmd, void *user_data)
 	answer(cnx, OK, my_hostname);
 }
 
+void exec_ehlo(struct mdir_cmd *cmd, void *user_data)
+{
+	struct mdir_cnx *const cnx = user_data;
+	struct cnx_env *env = DOWNCAST(cnx, cnx, cnx_env);
+	set_domain(env, cmd->args[0].string);
+	char size[40];
+	snprintf(size, sizeof(size), "SIZE %lld", (long long)max_msg_size);	// 0 means no limit
+	answer_cont(cnx, OK, my_hostname);
+	answer_cont(cnx, OK, "PIPELINING");
+	answer_cont(cnx, OK, "8BITMIME");
+	answer_cont(cnx, OK, "CHUNKING");
+	answer(cnx, OK, size);
+}
+
 /*
  * MAIL/RCPT
  */
@@ -162,6 +214,17 @@ void exec_mail(struct mdir_cmd *cmd, void *user_data)
 	} else if (0 != strncasecmp("FROM:", from, FROM_LEN)) {
 		answer(cnx, SYNTAX_ERR, "I remember RFC mentioning 'MAIL FROM:...'");
 	} else {
+		// Look for the SIZE parameter (other parameters, such as BODY, are ignored)
+		for (unsigned a = 1; a < cmd->nb_args; a++) {
+			if (0 != strncasecmp("SIZE=", cmd->args[a].string, 5)) continue;
+			long long const size = strtoll(cmd->args[a].string + 5, NULL, 10);
+			if (max_msg_size > 0 && size > max_msg_size) {
+				answer(cnx, NO_MORE_STORAGE, "Message too big");
+				return;
+			}
+		}
+		reset_spool(env);
+		reset_recipients(env);	// a new transaction
 		set_reverse_path(env, from + FROM_LEN);
 		answer(&env->cnx, OK, "Ok");
 	}
@@ -177,10 +240,12 @@ void exec_rcpt(struct mdir_cmd *cmd, void *user_data)
 		answer(cnx, BAD_SEQUENCE, "No MAIL command ?");
 	} else if (0 != strncasecmp("TO:", to, TO_LEN)) {
 		answer(cnx, SYNTAX_ERR, "It should be 'RCPT TO:...', shouldn't it ?");
+	} else if (env->nb_recipients >= MAX_RECIPIENTS) {
+		answer(cnx, SHORT_STORAGE, "Too many recipients");
 	} else {
 		char const *name = to + TO_LEN;
 		while (*name != '\0' && *name == ' ') name++;	// some client may insert blank spaces here, although it's forbidden
-		set_forward_path(env, name);
+		add_forward_path(env, name);
 		on_error {
 			answer(cnx, MBOX_UNAVAIL_2, "Bad guess");	// TODO: take action against this client ?
 			error_clear();
@@ -196,22 +261,20 @@ void exec_rcpt(struct mdir_cmd *cmd, void *user_data)
 
 static void send_varbuf(struct chn_cnx *cnx, char ref[PATH_MAX], struct varbuf *vb)
 {
-	// Do it a temp file, sends the file, removes the file !
-	char tmpfile[PATH_MAX] = "/tmp/vbXXXXXX";	// FIXME
-	int fd = mkstemp(tmpfile);
-	if (fd == -1) with_error(errno, "mkstemp(%s)", tmpfile) return;
-	debug("Using temp file '%s'", tmpfile);
+	int fd;
+	if_fail (fd = chn_resource_create(ref)) return;
 	varbuf_write(vb, fd);
-	(void)close(fd);
-	unless_error chn_send_file_request(cnx, tmpfile, ref);
-	(void)unlink(tmpfile);
+	on_error {
+		error_save();
+		chn_resource_abort(fd, ref);
+		error_restore();
+		return;
+	}
+	chn_resource_close(cnx, fd, ref, NULL, NULL);
 }
 
-static void store_file(struct varbuf *vb, char const *params, struct header *global_header)
+static void add_resource(char const *ref, char const *params, struct header *global_header)
 {
-	// TODO: Instead of sending it to another file server, be our own file server ?
-	char ref[PATH_MAX];
-	if_fail (send_varbuf(&ccnx, ref, vb)) return;
 	debug("Adding this resource info onto the env header");
 	struct varbuf res_vb;
 	if_fail (varbuf_ctor(&res_vb, MAX_HEADLINE_LENGTH, false)) return;
@@ -224,17 +287,27 @@ static void store_file(struct varbuf *vb, char const *params, struct header *glo
 	varbuf_dtor(&res_vb);
 }
 
+static void store_file(struct varbuf *vb, char const *params, struct header *global_header)
+{
+	// TODO: Instead of sending it to another file server, be our own file server ?
+	char ref[PATH_MAX];
+	if_fail (send_varbuf(&ccnx, ref, vb)) return;
+	add_resource(ref, params, global_header);
+}
+
+// Files were already uploaded while the mail was parsed
 static void store_file_rec(struct msg_tree *const tree, struct header *global_header)
 {
 	if (tree->type == CT_FILE) {
-		if (tree->content.file.data.used > 0) {	// Many mailers add useless empty parts
-			store_file(&tree->content.file.data, tree->content.file.params, global_header);
+		if (tree->content.file.resource[0] != '\0') {	// Many mailers add useless empty parts
+			add_resource(tree->content.file.resource, tree->content.file.params, global_header);
 		}
 		return;
 	}
+	if (tree->type == CT_NONE) return;
 	assert(tree->type == CT_MULTIPART);
 	struct msg_tree *subtree;
-	SLIST_FOREACH(subtree, &tree->content.parts, entry) {
+	STAILQ_FOREACH(subtree, &tree->content.parts, entry) {
 		if_fail (store_file_rec(subtree, global_header)) return;
 	}
 }
@@ -252,17 +325,14 @@ static void store_header(struct header *to_save, struct header *global_header)
 	error_restore();
 }
 
-static void process_mail(struct cnx_env *env)
+void process_mail(struct header *envelope, struct msg_tree *msg_tree)
 {
-	// First parse the data into a mail tree
-	struct msg_tree *msg_tree = msg_tree_read(env->cnx.fd);
-	on_error return;
 	do {
 		struct header *h = header_new();
 		on_error break;
 		do {
 			if_fail ((void)header_field_new(h, SC_TYPE_FIELD, SC_MAIL_TYPE)) break;
-			if_fail ((void)header_field_new(h, SC_FROM_FIELD, env->reverse_path)) break;
+			if_fail ((void)header_field_new(h, SC_FROM_FIELD, header_find(envelope, SC_FROM_FIELD, NULL)->value)) break;
 			// Store the upper header in the filed
 			if_fail (store_header(msg_tree->header, h)) break;
 			// Store each file in the filed
@@ -275,29 +345,152 @@ static void process_mail(struct cnx_env *env)
 			on_error break;
 			time_t now = time(NULL);
 			(void)header_field_new(h, SC_START_FIELD, sc_tm2gmfield(localtime(&now), true));
-			// submit the header
-			if_fail (mdir_patch_request(env->mailbox, MDIR_ADD, h)) break;
+			// submit the header to every recipient (they all share the same resources)
+			unsigned nb_ok = 0;
+			struct header_field *to = NULL;
+			while (NULL != (to = header_find(envelope, SC_TO_FIELD, to))) {
+				struct mdir *mailbox = mailbox_lookup(to->value);
+				unless_error mdir_patch_request(mailbox, MDIR_ADD, h);
+				on_error {
+					// Do not fail now, or the message would be processed again for the other recipients
+					error("Cannot deliver to %s : %s", to->value, error_str());
+					error_clear();
+				} else nb_ok ++;
+			}
+			if (nb_ok == 0) with_error(0, "Cannot deliver to any recipient") break;
 		} while (0);
 		header_unref(h);
 	} while (0);
 	msg_tree_del(msg_tree);
 }
 
+// Queue the received message (if it was spooled) and answer the client
+static void conclude_mail(struct cnx_env *env, struct spool_file *sf)
+{
+	if (! sf) {	// the data was read but not stored
+		answer(&env->cnx, LOCAL_ERROR, "Cannot spool message");
+		return;
+	}
+	spool_file_commit(sf);
+	on_error {
+		bool const too_big = error_code() == EFBIG;
+		error_clear();
+		if (env->io.broken) return;
+		if (too_big) {
+			answer(&env->cnx, NO_MORE_STORAGE, "Message too big");
+		} else {
+			answer(&env->cnx, LOCAL_ERROR, "Something bad happened at some point");
+		}
+	} else {
+		answer(&env->cnx, OK, "Queued");
+	}
+}
+
+// Reads the message up to the final dot into the spool (if any)
+static void read_data(struct cnx_env *env, struct spool_file *sf)
+{
+	struct varbuf vb;
+	if_fail (varbuf_ctor(&vb, MAX_MAILLINE_LENGTH+10, true)) return;
+	bool line_start = true;
+	while (1) {
+		varbuf_clean(&vb);
+		if_fail (smtp_io_read_line(&env->io, &vb, MAX_MAILLINE_LENGTH)) break;
+		char *line = vb.buf;
+		size_t len = vb.used;
+		if (line_start) {
+			if (line_match(line, ".")) break;	// end of mail
+			if (line[0] == '.') {	// dot-unstuffing
+				line ++;
+				len --;
+			}
+		}
+		line_start = len > 0 && line[len-1] == '\n';
+		if (sf) spool_file_write(sf, line, len);
+	}
+	varbuf_dtor(&vb);
+}
+
 void exec_data(struct mdir_cmd *cmd, void *user_data)
 {
 	(void)cmd;
 	struct mdir_cnx *const cnx = user_data;
 	struct cnx_env *env = DOWNCAST(cnx, cnx, cnx_env);
-	if (! env->forward_path) {
+	if (STAILQ_EMPTY(&env->recipients) || env->spool || env->failed) {
 		answer(cnx, BAD_SEQUENCE, "What recipient, again ?");
 	} else {
 		if_fail (answer(cnx, START_MAIL, "Go ahaid, end with a single dot")) return;
-		if_succeed (process_mail(env)) {
-			answer(cnx, OK, "Ok");
-		} else {
-			answer(cnx, LOCAL_ERROR, "Something bad happened at some point");
+		struct spool_file *sf = spool_file_new(env->reverse_path, &env->recipients);
+		on_error {	// we must read the message anyway
+			error("Cannot spool message : %s", error_str());
+			error_clear();
+		}
+		read_data(env, sf);
+		on_error {
+			if (sf) spool_file_del(sf);
+			return;
+		}
+		conclude_mail(env, sf);
+	}
+}
+
+// Reads size bytes of message, written to the spool if there is one
+static void read_chunk(struct cnx_env *env, long long size)
+{
+	while (size > 0) {
+		char const *data;
+		size_t len;
+		if_fail (len = smtp_io_peek(&env->io, &data)) return;
+		if ((long long)len > size) len = size;
+		if (env->spool) spool_file_write(env->spool, data, len);
+		smtp_io_consume(&env->io, len);
+		size -= len;
+	}
+}
+
+void exec_bdat(struct mdir_cmd *cmd, void *user_data)
+{
+	struct mdir_cnx *const cnx = user_data;
+	struct cnx_env *env = DOWNCAST(cnx, cnx, cnx_env);
+	char *end;
+	long long const size = strtoll(cmd->args[0].string, &end, 10);
+	bool const last = cmd->nb_args > 1 && 0 == strcasecmp(cmd->args[1].string, "LAST");
+	if (*end != '\0' || size < 0 || (cmd->nb_args > 1 && !last)) {
+		// We can't tell where the chunk ends, thus where the next command starts
+		answer(cnx, SYNTAX_ERR_PARM, "Syntax is BDAT <size> [LAST]");
+		env->quit = true;
+		return;
+	}
+	if (STAILQ_EMPTY(&env->recipients)) {
+		if_fail (read_chunk(env, size)) return;
+		answer(cnx, BAD_SEQUENCE, "What recipient, again ?");
+		return;
+	}
+	if (env->failed) {	// the message would miss some chunks
+		if_fail (read_chunk(env, size)) return;
+		answer(cnx, TRANSAC_FAILED, "Transaction failed, send RSET");
+		return;
+	}
+	if (! env->spool) {
+		env->spool = spool_file_new(env->reverse_path, &env->recipients);
+		on_error {
+			error("Cannot spool message : %s", error_str());
+			error_clear();
+			env->failed = true;
+			if_fail (read_chunk(env, size)) return;
+			answer(cnx, LOCAL_ERROR, "Cannot spool message");
+			return;
 		}
 	}
+	if_fail (read_chunk(env, size)) return;
+	if (last) {
+		struct spool_file *sf = env->spool;
+		env->spool = NULL;
+		conclude_mail(env, sf);
+	} else {
+		char msg[60];
+		snprintf(msg, sizeof(msg), "%lld octets received", size);
+		answer(cnx, OK, msg);
+	}
 }
 
 /*
@@ -41,12 +41,14 @@ static sig_atomic_t terminate = 0;
 char my_hostname[256];
 struct chn_cnx ccnx;
 struct mdir_user *user;
+off_t max_msg_size;
 
 char const kw_ehlo[] = "ehlo";
 char const kw_helo[] = "helo";
 char const kw_mail[] = "mail";
 char const kw_rcpt[] = "rcpt";
 char const kw_data[] = "data";
+char const kw_bdat[] = "bdat";
 char const kw_rset[] = "rset";
 char const kw_vrfy[] = "vrfy";
 char const kw_expn[] = "expn";
@@ -66,6 +68,9 @@ static void init_conf(void)
 	conf_set_default_str("SC_FILED_HOST", "localhost");
 	conf_set_default_str("SC_FILED_PORT", DEFAULT_FILED_PORT);
 	conf_set_default_str("SC_USERNAME", "smtpd");
+	conf_set_default_int("SC_SMTPD_MAX_MSG_SIZE", 0);
+	conf_set_default_str("SC_SMTPD_SPOOL_DIR", "/var/lib/scambio/smtpd/spool");
+	conf_set_default_int("SC_SMTPD_WORKERS", 4);
 }
 
 static void init_log(void)
@@ -89,7 +94,7 @@ static void init_syntax(void)
 	// Register all services
 	static struct mdir_cmd_def services[] = {
 		{
-			.keyword = kw_ehlo, .cb = exec_helo, .nb_arg_min = 1, .nb_arg_max = 1,
+			.keyword = kw_ehlo, .cb = exec_ehlo, .nb_arg_min = 1, .nb_arg_max = 1,
 			.nb_types = 1, .types = { CMD_STRING }, .negseq = false,
 		}, {
 			.keyword = kw_helo, .cb = exec_helo, .nb_arg_min = 1, .nb_arg_max = 1,
@@ -104,6 +109,9 @@ static void init_syntax(void)
 		}, {
 			.keyword = kw_data, .cb = exec_data, .nb_arg_min = 0, .nb_arg_max = 0,
 			.nb_types = 0, .types = {}, .negseq = false,
+		}, {
+			.keyword = kw_bdat, .cb = exec_bdat, .nb_arg_min = 1, .nb_arg_max = 2,
+			.nb_types = 2, .types = { CMD_STRING, CMD_STRING }, .negseq = false,
 		}, {
 			.keyword = kw_rset, .cb = exec_rset, .nb_arg_min = 0, .nb_arg_max = 0,
 			.nb_types = 0, .types = {}, .negseq = false,
@@ -138,6 +146,7 @@ static void init_server(void)
 {
 	debug("init server");
 	if (0 != gethostname(my_hostname, sizeof(my_hostname))) with_error(errno, "gethostbyname") return;
+	max_msg_size = conf_get_int("SC_SMTPD_MAX_MSG_SIZE");
 	if_fail (server_ctor(&server, conf_get_int("SC_SMTPD_PORT"))) return;
 	if (0 != atexit(deinit_server)) with_error(0, "atexit") return;
 	if_fail (exec_begin()) return;
@@ -174,6 +183,8 @@ static void init(void)
 	if_fail (daemonize("sc_smtpd")) return;
 	if_fail (mdir_init()) return;
 	if_fail (init_filed()) return;
+	if_fail (spool_begin()) return;
+	if (0 != atexit(spool_end)) with_error(0, "atexit") return;
 }
 
 /*
@@ -183,10 +194,12 @@ static void init(void)
 static void cnx_env_del(void *env_)
 {
 	struct cnx_env *env = env_;
+	if (env->spool) spool_file_del(env->spool);
+	smtp_io_dtor(&env->io);
 	mdir_cnx_dtor(&env->cnx);
 	if (env->domain) free(env->domain);
 	if (env->reverse_path) free(env->reverse_path);
-	if (env->forward_path) free(env->forward_path);
+	reset_recipients(env);
 	free(env);
 }
 
@@ -198,6 +211,14 @@ static char *client_host(void)
 static void cnx_env_ctor(struct cnx_env *env, int fd)
 {
 	if_fail (mdir_cnx_ctor_inbound(&env->cnx, &syntax, fd)) return;
+	if_fail (smtp_io_ctor(&env->io, fd)) {
+		mdir_cnx_dtor(&env->cnx);
+		return;
+	}
+	env->spool = NULL;
+	env->failed = false;
+	STAILQ_INIT(&env->recipients);
+	env->nb_recipients = 0;
 	time_t const now = time(NULL);
 	struct tm *tm = localtime(&now);
 	snprintf(env->client_address, sizeof(env->client_address), "%s", client_host());
@@ -228,10 +249,21 @@ static void *serve_cnx(void *arg)
 		cnx_env_del(env);
 		return NULL;
 	}
-	if_fail (Write_strs(env->cnx.fd, "220 ", my_hostname, "\n", NULL)) return NULL;
-	while (!env->quit && !is_error()) {	// read a command and exec it
-		if_fail (mdir_cnx_read(&env->cnx)) break;
+	struct varbuf vb;
+	if_fail (varbuf_ctor(&vb, MAX_MAILLINE_LENGTH+10, true)) return NULL;
+	answer(&env->cnx, 220, my_hostname);
+	while (!env->quit && !env->io.broken) {	// read a command (from the buffer if already received) and exec it
+		varbuf_clean(&vb);
+		if_fail (smtp_io_read_line(&env->io, &vb, MAX_MAILLINE_LENGTH)) break;
+		mdir_cmd_parse(&syntax, &vb, &env->cnx);
+		on_error {
+			if (env->io.broken) break;
+			error_clear();
+			answer(&env->cnx, 500, "Syntax error, command unrecognized");
+		}
 	}
+	varbuf_dtor(&vb);
+	smtp_io_flush(&env->io);
 	return NULL;
 }
 
@@ -18,6 +18,8 @@
 #ifndef SMTPD_H_080623
 #define SMTPD_H_080623
 
+#include <limits.h>
+#include <sys/types.h>
 #include <pth.h>
 #include "scambio/queue.h"
 #include "scambio/cnx.h"
@@ -31,19 +33,57 @@
  * hyphens. -- RFC 2046
  */
 #define MAX_BOUNDARY_LENGTH 70
+/* The minimum total number of recipients that must be buffered is 100
+ * recipients. -- RFC 2821
+ */
+#define MAX_RECIPIENTS 100
+
+#define SMTP_IO_BUF_SIZE 16384
 
 extern char my_hostname[256];
+extern off_t max_msg_size;
 extern struct chn_cnx ccnx;
 extern struct mdir_user *user;
 
+// From io.c
+
+struct smtp_io {
+	int fd;
+	size_t start, end;	// what's left to parse in in
+	bool broken;	// set once the client is gone
+	char in[SMTP_IO_BUF_SIZE];
+	struct varbuf out;	// answers not sent yet
+};
+
+void smtp_io_ctor(struct smtp_io *, int fd);
+void smtp_io_dtor(struct smtp_io *);
+// Queue some output (which will be sent before we wait for more input)
+void smtp_io_write(struct smtp_io *, void const *data, size_t len);
+void smtp_io_flush(struct smtp_io *);
+// Returns the amount of buffered data (waiting for some if needed)
+size_t smtp_io_peek(struct smtp_io *, char const **data);
+void smtp_io_consume(struct smtp_io *, size_t len);
+// Appends a line (or the first maxlen bytes of it) to vb, converting CRLF to LF
+void smtp_io_read_line(struct smtp_io *, struct varbuf *vb, size_t maxlen);
+
 struct mdir;
+struct recipient {
+	STAILQ_ENTRY(recipient) entry;
+	char *forward_path;
+	struct mdir *mailbox;	// associated to the forward path
+};
+
+struct spool_file;
 struct cnx_env {
 	struct mdir_cnx cnx;
+	struct smtp_io io;
+	struct spool_file *spool;	// when receiving a message in several BDAT chunks
+	bool failed;	// the current transaction failed : its remaining chunks are rejected until RSET or MAIL
 	bool quit;
 	char *domain;	// stores the last received helo information
 	char *reverse_path;
-	char *forward_path;
-	struct mdir *mailbox;	// associated to the forward path
+	STAILQ_HEAD(recipients, recipient) recipients;	// the message will be delivered to all of them
+	unsigned nb_recipients;
 	char client_address[100];
 	char reception_date[10+1];
 	char reception_time[8+1];
@@ -53,7 +93,13 @@ struct cnx_env {
 
 void exec_begin(void);
 void exec_end(void);
-mdir_cmd_cb exec_helo, exec_mail, exec_rcpt, exec_data, exec_rset, exec_vrfy, exec_expn, exec_help, exec_noop, exec_quit;
+void answer(struct mdir_cnx *cnx, int status, char const *cmpl);
+void reset_recipients(struct cnx_env *);
+struct header;
+struct msg_tree;
+// Store the message parts and patch the mailboxes of all recipients found in the envelope
+void process_mail(struct header *envelope, struct msg_tree *);
+mdir_cmd_cb exec_helo, exec_ehlo, exec_bdat, exec_mail, exec_rcpt, exec_data, exec_rset, exec_vrfy, exec_expn, exec_help, exec_noop, exec_quit;
 
 // From parse.c
 
@@ -63,16 +109,47 @@ struct msg_tree {
 	enum msg_tree_type { CT_NONE=0, CT_FILE, CT_MULTIPART } type;
 	union {
 		struct {
-			struct varbuf data;
+			char resource[PATH_MAX];	// where the decoded content was uploaded (empty if no content)
 			char params[128];	// wild guess
 		} file;
-		SLIST_HEAD(subtrees, msg_tree) parts;
+		STAILQ_HEAD(subtrees, msg_tree) parts;
 	} content;
-	SLIST_ENTRY(msg_tree) entry;
+	STAILQ_ENTRY(msg_tree) entry;
 };
 
-struct msg_tree;
-struct msg_tree *msg_tree_read(int fd);
 void msg_tree_del(struct msg_tree *);
 
+/* The message is parsed incrementally.
+ * max_size is the maximum size of the message (0 for no limit).
+ */
+struct msg_parser *msg_parser_new(off_t max_size);
+// Aborts the parse
+void msg_parser_del(struct msg_parser *);
+// Feed the parser with one line (CRLF already converted to LF)
+void msg_parser_line(struct msg_parser *, char const *line, size_t len);
+// Feed the parser with raw message data
+void msg_parser_feed(struct msg_parser *, char const *data, size_t len);
+// Returns the parsed message and deletes the parser (with EFBIG error if the message is too big)
+struct msg_tree *msg_parser_finish(struct msg_parser *);
+
+// From spool.c
+
+struct spool_file {
+	int fd;
+	char name[NAME_MAX+1];
+	char path[PATH_MAX];	// while it's written
+	off_t size;
+	bool failed;	// then we merely skip the remaining of the message
+};
+
+void spool_begin(void);
+void spool_end(void);
+// Creates a new spool file, and writes the envelope in it
+struct spool_file *spool_file_new(char const *reverse_path, struct recipients *);
+// Aborts the reception
+void spool_file_del(struct spool_file *);
+void spool_file_write(struct spool_file *, void const *data, size_t len);
+// Syncs the message and queues it for processing (with EFBIG error if the message is too big)
+void spool_file_commit(struct spool_file *);
+
 #endif
@@ -0,0 +1,292 @@
+/* Copyright 2008 Cedric Cellier.
+ *
+ * This file is part of Scambio.
+ *
+ * Scambio is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Scambio is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with Scambio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* Load generator for sc_smtpd : run "make bench" in smtpd once sc_filed,
+ * sc_mdsyncd and sc_smtpd are running on this host.
+ * Opens several SMTP sessions at once, each one sending a number of messages
+ * taken from a generated corpus of MIME messages (some text and a few base64
+ * attachments), then reports the throughput, the latency between the end of
+ * the message and its acceptance, and the peak RSS of sc_smtpd.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pth.h>
+#include "scambio.h"
+#include "options.h"
+#include "misc.h"
+#include "varbuf.h"
+#include "codec.h"
+
+#define CRLF "\r\n"
+#define CORPUS_SIZE 16	// distinct messages
+#define BOUNDARY "bench-boundary"
+
+static char const *port = "25";
+static int nb_sessions = 8;
+static int nb_msgs = 100;	// per session
+static int att_size = 65536;	// average size of attachments
+static int nb_atts = 2;	// attachments per message
+static char const *rcpt = "bench";
+static int smtpd_pid = 0;
+static bool use_bdat = false;
+
+static struct varbuf corpus[CORPUS_SIZE];
+static double *latencies;	// one per message
+static unsigned nb_latencies;
+static unsigned long long nb_bytes;
+static unsigned nb_failed;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Corpus
+ */
+
+static void make_text(struct varbuf *vb, size_t size)
+{
+	static char const *const words[] = { "scambio ", "message ", "mail ", "part ", "text ", "with ", "some ", "words " };
+	size_t col = 0;
+	for (size_t len = 0; len < size; ) {
+		char const *w = words[rand() % sizeof_array(words)];
+		size_t const wlen = strlen(w);
+		if_fail (varbuf_append(vb, wlen, w)) return;
+		len += wlen;
+		col += wlen;
+		if (col > 70) {
+			if_fail (varbuf_append(vb, 2, CRLF)) return;
+			col = 0;
+		}
+	}
+	(void)varbuf_append(vb, 2, CRLF);
+}
+
+static void make_attachment(struct varbuf *vb, size_t size)
+{
+	unsigned char *data = Malloc(size);
+	char *encoded = Malloc(BASE64_ENCODE_MAX(size));
+	for (size_t i = 0; i < size; i++) data[i] = rand();
+	struct base64_enc enc;
+	base64_enc_ctor(&enc, CODEC_LINE_LENGTH);
+	size_t len = base64_encode(&enc, encoded, data, size);
+	len += base64_encode_finish(&enc, encoded + len);
+	do {
+		if_fail (varbuf_append_strs(vb, "Content-Type: application/octet-stream; name=\"att.bin\""CRLF, "Content-Transfer-Encoding: base64"CRLF CRLF, NULL)) break;
+		if_fail (varbuf_append(vb, len, encoded)) break;
+		(void)varbuf_append(vb, 2, CRLF);
+	} while (0);
+	free(encoded);
+	free(data);
+}
+
+static void make_message(struct varbuf *vb, unsigned n)
+{
+	char subject[64];
+	snprintf(subject, sizeof(subject), "Subject: bench message %u"CRLF, n);
+	if_fail (varbuf_ctor(vb, att_size * (nb_atts + 1) + 4096, true)) return;
+	varbuf_clean(vb);
+	if_fail (varbuf_append_strs(vb, "From: bench@localhost"CRLF, subject,
+		"Mime-Version: 1.0"CRLF, "Content-Type: multipart/mixed; boundary="BOUNDARY CRLF CRLF,
+		"--"BOUNDARY CRLF, "Content-Type: text/plain"CRLF CRLF, NULL)) return;
+	if_fail (make_text(vb, 1024)) return;
+	for (int a = 0; a < nb_atts; a++) {
+		if_fail (varbuf_append_strs(vb, "--"BOUNDARY CRLF, NULL)) return;
+		size_t const size = att_size/2 + (att_size > 0 ? rand() % (att_size+1) : 0);	// from half to one and a half the average
+		if_fail (make_attachment(vb, size)) return;
+	}
+	(void)varbuf_append_strs(vb, "--"BOUNDARY"--"CRLF, NULL);
+}
+
+/*
+ * SMTP sessions
+ */
+
+struct session {
+	int fd;
+	struct varbuf in;
+};
+
+static int read_status(struct session *s)
+{
+	char *line, *end;
+	int status;
+	do {
+		varbuf_clean(&s->in);
+		if_fail (varbuf_read_line(&s->in, s->fd, 1000, &line)) return 0;
+		status = strtol(line, &end, 10);
+	} while (*end == '-');
+	return status;
+}
+
+static int cmd(struct session *s, char const *c1, char const *c2)
+{
+	if_fail (Write_strs(s->fd, c1, c2, CRLF, NULL)) return 0;
+	return read_status(s);
+}
+
+static void send_message(struct session *s, struct varbuf *msg)
+{
+	int status;
+	if_fail (status = cmd(s, "MAIL FROM:<bench@localhost>", "")) return;
+	if (status != 250) with_error(0, "MAIL : %d", status) return;
+	char to[256];
+	snprintf(to, sizeof(to), "RCPT TO:<%s>", rcpt);
+	if_fail (status = cmd(s, to, "")) return;
+	if (status != 250) with_error(0, "RCPT : %d", status) return;
+	double start;
+	if (use_bdat) {
+		char bdat[64];
+		snprintf(bdat, sizeof(bdat), "BDAT %zu LAST"CRLF, msg->used);
+		if_fail (Write_strs(s->fd, bdat, NULL)) return;
+		if_fail (Write(s->fd, msg->buf, msg->used)) return;
+		start = now();
+	} else {
+		if_fail (status = cmd(s, "DATA", "")) return;
+		if (status != 354) with_error(0, "DATA : %d", status) return;
+		if_fail (Write(s->fd, msg->buf, msg->used)) return;
+		if_fail (Write_strs(s->fd, "."CRLF, NULL)) return;
+		start = now();
+	}
+	if_fail (status = read_status(s)) return;
+	if (status != 250) with_error(0, "End of message : %d", status) return;
+	latencies[nb_latencies++] = now() - start;
+	nb_bytes += msg->used;
+}
+
+static void *session_thread(void *arg)
+{
+	unsigned const n = (unsigned)(intptr_t)arg;
+	struct session s;
+	if_fail (varbuf_ctor(&s.in, 1024, true)) return NULL;
+	do {
+		if_fail (s.fd = Connect("localhost", port)) break;
+		if_fail (read_status(&s)) break;
+		if_fail (cmd(&s, "EHLO ", "localhost")) break;
+		for (int m = 0; m < nb_msgs; m++) {
+			if_fail (send_message(&s, corpus + (n + m) % CORPUS_SIZE)) {
+				error("Session %u : %s", n, error_str());
+				error_clear();
+				nb_failed ++;
+			}
+		}
+		(void)cmd(&s, "QUIT", "");
+		(void)close(s.fd);
+	} while (0);
+	on_error {
+		error("Session %u : %s", n, error_str());
+		error_clear();
+	}
+	varbuf_dtor(&s.in);
+	return NULL;
+}
+
+/*
+ * Report
+ */
+
+static int cmp_double(void const *a_, void const *b_)
+{
+	double const *a = a_, *b = b_;
+	return *a < *b ? -1 : *a > *b ? 1 : 0;
+}
+
+static long peak_rss(int pid)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+	FILE *f = fopen(path, "r");
+	if (! f) return -1;
+	char line[256];
+	long kb = -1;
+	while (fgets(line, sizeof(line), f)) {
+		if (0 == strncmp(line, "VmHWM:", 6)) kb = strtol(line + 6, NULL, 10);
+	}
+	fclose(f);
+	return kb;
+}
+
+int main(int nb_args, char const **args)
+{
+	log_begin(NULL, NULL);
+	atexit(log_end);
+	if (! pth_init()) return EXIT_FAILURE;
+	error_begin();
+	atexit(error_end);
+	log_level = 1;
+
+	struct option options[] = {
+		{ 'p', "port",        OPT_STRING, &port,        "port sc_smtpd listens at (on localhost)", {} },
+		{ 'n', "sessions",    OPT_INT,    &nb_sessions, "number of simultaneous SMTP sessions", {} },
+		{ 'm', "messages",    OPT_INT,    &nb_msgs,     "number of messages sent per session", {} },
+		{ 's', "size",        OPT_INT,    &att_size,    "average size of attachments, in bytes", {} },
+		{ 'a', "attachments", OPT_INT,    &nb_atts,     "number of attachments per message", {} },
+		{ 't', "to",          OPT_STRING, &rcpt,        "recipient (must have an Incoming mailbox)", {} },
+		{ 'P', "pid",         OPT_INT,    &smtpd_pid,   "pid of sc_smtpd, to report its memory usage", {} },
+		{ 'b', "bdat",        OPT_FLAG,   &use_bdat,    "send messages with BDAT instead of DATA", {} },
+	};
+	if_fail (option_parse(nb_args, args, options, sizeof_array(options))) return EXIT_FAILURE;
+	if (nb_sessions < 1 || nb_msgs < 1 || att_size < 0 || nb_atts < 0) {
+		fprintf(stderr, "Bad parameters\n");
+		return EXIT_FAILURE;
+	}
+
+	srand(42);
+	for (unsigned c = 0; c < CORPUS_SIZE; c++) {
+		if_fail (make_message(corpus + c, c)) return EXIT_FAILURE;
+	}
+	latencies = Malloc(nb_sessions * nb_msgs * sizeof(*latencies));
+	pth_t *sessions = Malloc(nb_sessions * sizeof(*sessions));
+
+	double const start = now();
+	for (int s = 0; s < nb_sessions; s++) {
+		sessions[s] = pth_spawn(PTH_ATTR_DEFAULT, session_thread, (void *)(intptr_t)s);
+		if (! sessions[s]) {
+			fprintf(stderr, "Cannot spawn session %d\n", s);
+			return EXIT_FAILURE;
+		}
+	}
+	for (int s = 0; s < nb_sessions; s++) (void)pth_join(sessions[s], NULL);
+	double const duration = now() - start;
+
+	printf("sessions      %d\n", nb_sessions);
+	printf("messages      %u sent, %u failed\n", nb_latencies, nb_failed);
+	printf("duration      %.2f s\n", duration);
+	printf("throughput    %.1f msgs/s, %.2f MB/s\n", nb_latencies / duration, nb_bytes / duration / (1024*1024));
+	if (nb_latencies > 0) {
+		qsort(latencies, nb_latencies, sizeof(*latencies), cmp_double);
+		printf("latency       p50 %.2f ms, p99 %.2f ms\n", latencies[nb_latencies/2] * 1000., latencies[(nb_latencies*99)/100] * 1000.);
+	}
+	if (smtpd_pid > 0) {
+		long const kb = peak_rss(smtpd_pid);
+		if (kb >= 0) printf("smtpd peak RSS %ld kB\n", kb);
+		else printf("smtpd peak RSS unknown (no process %d ?)\n", smtpd_pid);
+	}
+
+	free(sessions);
+	free(latencies);
+	for (unsigned c = 0; c < CORPUS_SIZE; c++) varbuf_dtor(corpus + c);
+	return nb_failed > 0 || nb_latencies == 0 ? EXIT_FAILURE:EXIT_SUCCESS;
+}
@@ -0,0 +1,322 @@
+/* Copyright 2008 Cedric Cellier.
+ *
+ * This file is part of Scambio.
+ *
+ * Scambio is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Scambio is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with Scambio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * Spool of received messages
+ *
+ * Received messages are written into a spool file (after their envelope, stored as a
+ * header), which is synced before the message is acknowledged. A pool of workers then
+ * parse the spooled messages, store their parts and patch the mailboxes, and finally
+ * delete the spool files. Whatever is found in the spool at startup is processed again.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <pth.h>
+#include "scambio.h"
+#include "smtpd.h"
+#include "misc.h"
+#include "scambio/header.h"
+
+/*
+ * Data Definitions
+ */
+
+#define TMP_PREFIX ".tmp-"	// files that are still written to
+#define FAILED_DIR "failed"	// where to keep the messages we could not process
+#define READ_CHUNK_SIZE 65536
+
+struct spool_entry {
+	STAILQ_ENTRY(spool_entry) entry;
+	char name[NAME_MAX+1];
+};
+
+static char spool_dir[PATH_MAX];
+static STAILQ_HEAD(spool_entries, spool_entry) ready_entries = STAILQ_HEAD_INITIALIZER(ready_entries);
+static pth_mutex_t ready_mutex;	// protects the above list
+static pth_cond_t ready_cond;	// signaled when a new entry is ready
+static unsigned nb_workers;
+static pth_t *workers;
+
+/*
+ * Ready list
+ */
+
+static void entry_push(char const *name)
+{
+	struct spool_entry *se = Malloc(sizeof(*se));
+	on_error return;
+	snprintf(se->name, sizeof(se->name), "%s", name);
+	(void)pth_mutex_acquire(&ready_mutex, FALSE, NULL);
+	STAILQ_INSERT_TAIL(&ready_entries, se, entry);
+	(void)pth_mutex_release(&ready_mutex);
+	(void)pth_cond_notify(&ready_cond, FALSE);
+}
+
+static struct spool_entry *entry_pop(void)
+{
+	struct spool_entry *se;
+	(void)pth_mutex_acquire(&ready_mutex, FALSE, NULL);
+	while (NULL == (se = STAILQ_FIRST(&ready_entries))) {
+		(void)pth_cond_await(&ready_cond, &ready_mutex, NULL);	// this is a cancel point
+	}
+	STAILQ_REMOVE_HEAD(&ready_entries, entry);
+	(void)pth_mutex_release(&ready_mutex);
+	return se;
+}
+
+/*
+ * Spool files (stage 1)
+ */
+
+static void sync_dir(void)
+{
+	int fd = open(spool_dir, O_RDONLY);
+	if (fd < 0) with_error(errno, "open(%s)", spool_dir) return;
+	if (0 != fsync(fd)) error_push(errno, "fsync(%s)", spool_dir);
+	(void)close(fd);
+}
+
+static void spool_file_ctor(struct spool_file *sf, char const *reverse_path, struct recipients *recipients)
+{
+	static unsigned seq = 0;
+	sf->size = 0;
+	sf->failed = false;
+	// Find an unused name
+	do {
+		snprintf(sf->name, sizeof(sf->name), "%ld-%d-%u", (long)time(NULL), (int)getpid(), seq++);
+		snprintf(sf->path, sizeof(sf->path), "%s/"TMP_PREFIX"%s", spool_dir, sf->name);
+		sf->fd = open(sf->path, O_WRONLY|O_CREAT|O_EXCL, 0640);
+	} while (sf->fd < 0 && errno == EEXIST);
+	if (sf->fd < 0) with_error(errno, "open(%s)", sf->path) return;
+	// Write the envelope
+	struct header *envelope = header_new();
+	do {
+		if_fail ((void)header_field_new(envelope, SC_FROM_FIELD, reverse_path)) break;
+		struct recipient *rcpt;
+		STAILQ_FOREACH(rcpt, recipients, entry) {
+			if_fail ((void)header_field_new(envelope, SC_TO_FIELD, rcpt->forward_path)) break;
+		}
+		on_error break;
+		header_write(envelope, sf->fd);
+	} while (0);
+	header_unref(envelope);
+	on_error {
+		(void)close(sf->fd);
+		(void)unlink(sf->path);
+	}
+}
+
+struct spool_file *spool_file_new(char const *reverse_path, struct recipients *recipients)
+{
+	struct spool_file *sf = Malloc(sizeof(*sf));
+	on_error return NULL;
+	if_fail (spool_file_ctor(sf, reverse_path, recipients)) {
+		free(sf);
+		return NULL;
+	}
+	return sf;
+}
+
+void spool_file_del(struct spool_file *sf)
+{
+	(void)close(sf->fd);
+	if (0 != unlink(sf->path)) error("Cannot unlink(%s) : %s", sf->path, strerror(errno));
+	free(sf);
+}
+
+void spool_file_write(struct spool_file *sf, void const *data, size_t len)
+{
+	sf->size += len;
+	if (sf->failed) return;
+	if (max_msg_size > 0 && sf->size > max_msg_size) {
+		error("Message too big (more than %lld bytes)", (long long)max_msg_size);
+		sf->failed = true;
+		return;
+	}
+	if_fail (Write(sf->fd, data, len)) {	// keep reading until the end of the message
+		error("Cannot spool message : %s", error_str());
+		error_clear();
+		sf->failed = true;
+	}
+}
+
+void spool_file_commit(struct spool_file *sf)
+{
+	bool const too_big = max_msg_size > 0 && sf->size > max_msg_size;
+	if (sf->failed) {
+		spool_file_del(sf);
+		with_error(too_big ? EFBIG:EIO, "Cannot spool message") return;
+	}
+	if (0 != fsync(sf->fd)) {
+		error_push(errno, "fsync(%s)", sf->path);
+		spool_file_del(sf);
+		return;
+	}
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", spool_dir, sf->name);
+	if (0 != rename(sf->path, path)) {
+		error_push(errno, "rename(%s)", path);
+		spool_file_del(sf);
+		return;
+	}
+	(void)close(sf->fd);
+	do {
+		if_fail (sync_dir()) break;
+		if_fail (entry_push(sf->name)) break;
+	} while (0);
+	on_error {	// the client will be told the message was rejected, so recover() must not deliver it
+		if (0 != unlink(path)) warning("Cannot unlink(%s) : %s", path, strerror(errno));
+	}
+	free(sf);
+}
+
+/*
+ * Workers (stage 2)
+ */
+
+static struct msg_tree *parse_spooled(int fd)
+{
+	struct msg_parser *parser;
+	if_fail (parser = msg_parser_new(0)) return NULL;	// size was checked while spooling
+	char *buf = Malloc(READ_CHUNK_SIZE);
+	unless_error while (1) {
+		ssize_t ret = pth_read(fd, buf, READ_CHUNK_SIZE);
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+			with_error(errno, "read(spool)") break;
+		}
+		if (ret == 0) break;
+		msg_parser_feed(parser, buf, ret);
+	}
+	if (buf) free(buf);
+	on_error {
+		error_save();
+		msg_parser_del(parser);
+		error_restore();
+		return NULL;
+	}
+	return msg_parser_finish(parser);
+}
+
+static void process_spooled(char const *name)
+{
+	debug("Processing spooled message %s", name);
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", spool_dir, name);
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) with_error(errno, "open(%s)", path) return;
+	struct header *envelope = header_new();
+	do {
+		if_fail (header_read(envelope, fd)) break;
+		struct msg_tree *msg_tree;
+		if_fail (msg_tree = parse_spooled(fd)) break;
+		process_mail(envelope, msg_tree);
+	} while (0);
+	header_unref(envelope);
+	(void)close(fd);
+	unless_error {
+		if (0 != unlink(path)) error_push(errno, "unlink(%s)", path);
+		return;
+	}
+	// Keep the message aside, for the postmaster to have a look
+	error_save();
+	char failed[PATH_MAX];
+	snprintf(failed, sizeof(failed), "%s/"FAILED_DIR"/%s", spool_dir, name);
+	if (0 != rename(path, failed)) error("Cannot rename(%s, %s) : %s", path, failed, strerror(errno));
+	error_restore();
+}
+
+static void *worker_thread(void *dummy)
+{
+	(void)dummy;
+	while (1) {
+		struct spool_entry *se = entry_pop();
+		if_fail (process_spooled(se->name)) {
+			error("Cannot process spooled message %s : %s", se->name, error_str());
+			error_clear();
+		}
+		free(se);
+	}
+	return NULL;
+}
+
+/*
+ * Init
+ */
+
+// Look for the messages that were not processed (or not even entirely received) before we stopped
+static void recover(void)
+{
+	DIR *dir = opendir(spool_dir);
+	if (! dir) with_error(errno, "opendir(%s)", spool_dir) return;
+	struct dirent *dirent;
+	unsigned nb_recovered = 0;
+	while (NULL != (dirent = readdir(dir))) {
+		char const *const name = dirent->d_name;
+		if (0 == strncmp(name, TMP_PREFIX, sizeof(TMP_PREFIX)-1)) {	// never acknowledged
+			char path[PATH_MAX];
+			snprintf(path, sizeof(path), "%s/%s", spool_dir, name);
+			if (0 != unlink(path)) warning("Cannot unlink(%s) : %s", path, strerror(errno));
+			continue;
+		}
+		if (name[0] == '.' || 0 == strcmp(name, FAILED_DIR)) continue;
+		if_fail (entry_push(name)) break;
+		nb_recovered ++;
+	}
+	(void)closedir(dir);
+	if (nb_recovered > 0) info("Recovered %u messages from the spool", nb_recovered);
+}
+
+void spool_begin(void)
+{
+	snprintf(spool_dir, sizeof(spool_dir), "%s", conf_get_str("SC_SMTPD_SPOOL_DIR"));
+	char failed[PATH_MAX];
+	snprintf(failed, sizeof(failed), "%s/"FAILED_DIR, spool_dir);
+	if_fail (Mkdir(failed)) return;
+	pth_mutex_init(&ready_mutex);
+	pth_cond_init(&ready_cond);
+	if_fail (recover()) return;
+	long long const nb = conf_get_int("SC_SMTPD_WORKERS");
+	if (nb < 1) with_error(0, "SC_SMTPD_WORKERS must be at least 1") return;
+	workers = Calloc(nb * sizeof(*workers));
+	on_error return;
+	for (nb_workers = 0; nb_workers < nb; nb_workers++) {
+		workers[nb_workers] = pth_spawn(PTH_ATTR_DEFAULT, worker_thread, NULL);
+		if (! workers[nb_workers]) with_error(0, "Cannot spawn spool worker") return;
+	}
+}
+
+void spool_end(void)
+{
+	while (nb_workers > 0) (void)pth_abort(workers[--nb_workers]);
+	if (workers) {
+		free(workers);
+		workers = NULL;
+	}
+	// Spooled messages that were not processed will be recovered at next startup
+	struct spool_entry *se;
+	while (NULL != (se = STAILQ_FIRST(&ready_entries))) {
+		STAILQ_REMOVE_HEAD(&ready_entries, entry);
+		free(se);
+	}
+}
@@ -0,0 +1,192 @@
+/* Copyright 2008 Cedric Cellier.
+ *
+ * This file is part of Scambio.
+ *
+ * Scambio is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Scambio is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with Scambio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * Batches of actions
+ *
+ * Actions are not performed as soon as a message is stributed. Instead, while a batch
+ * of patches is processed, copies are accumulated per destination folder and deletions
+ * for the stributed folder, and all are requested together at the end of the batch.
+ * So that each destination is looked up (and created) only once per batch.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include "scambio.h"
+#include "scambio/header.h"
+#include "misc.h"
+#include "main.h"
+
+/*
+ * Data Definitions
+ */
+
+struct dest {
+	STAILQ_ENTRY(dest) entry;
+	char relname[PATH_MAX];	// relative to the stributed folder
+	unsigned nb_copies;
+	struct header **copies;
+	unsigned nb_moves;
+	mdir_version *moves;	// to delete from the stributed folder once copied
+};
+
+// Make room for one more item in this array
+static void *grow(void *array, unsigned nb, size_t size)
+{
+	void *new = realloc(array, (nb+1) * size);
+	if (! new) with_error(ENOMEM, "Cannot realloc batch") return NULL;
+	return new;
+}
+
+static void add_version(mdir_version **versions, unsigned *nb, mdir_version version)
+{
+	mdir_version *new;
+	if_fail (new = grow(*versions, *nb, sizeof(*new))) return;
+	*versions = new;
+	new[(*nb)++] = version;
+}
+
+void batch_ctor(struct batch *batch, struct strib_mdir *smdir)
+{
+	batch->smdir = smdir;
+	STAILQ_INIT(&batch->dests);
+	batch->nb_deletes = 0;
+	batch->deletes = NULL;
+	batch->done_version = smdir->last_done_version;
+	batch->failed = false;
+}
+
+static void dest_del(struct dest *dest)
+{
+	for (unsigned c = 0; c < dest->nb_copies; c++) header_unref(dest->copies[c]);
+	free(dest->copies);
+	free(dest->moves);
+	free(dest);
+}
+
+void batch_dtor(struct batch *batch)
+{
+	struct dest *dest;
+	while (NULL != (dest = STAILQ_FIRST(&batch->dests))) {
+		STAILQ_REMOVE_HEAD(&batch->dests, entry);
+		dest_del(dest);
+	}
+	free(batch->deletes);
+}
+
+static struct dest *batch_dest(struct batch *batch, char const *relname)
+{
+	struct dest *dest;
+	STAILQ_FOREACH(dest, &batch->dests, entry) {
+		if (0 == strcmp(dest->relname, relname)) return dest;
+	}
+	dest = Calloc(sizeof(*dest));
+	on_error return NULL;
+	snprintf(dest->relname, sizeof(dest->relname), "%s", relname);
+	STAILQ_INSERT_TAIL(&batch->dests, dest, entry);
+	return dest;
+}
+
+void batch_copy(struct batch *batch, char const *relname, struct header *object, mdir_version version, bool move)
+{
+	struct dest *dest;
+	if_fail (dest = batch_dest(batch, relname)) return;
+	struct header **copies;
+	if_fail (copies = grow(dest->copies, dest->nb_copies, sizeof(*copies))) return;
+	dest->copies = copies;
+	copies[dest->nb_copies++] = header_ref(object);
+	if (move) add_version(&dest->moves, &dest->nb_moves, version);
+}
+
+void batch_delete(struct batch *batch, mdir_version version)
+{
+	add_version(&batch->deletes, &batch->nb_deletes, version);
+}
+
+static void create_folder(struct mdir *parent, char const *relname)
+{
+	struct header *h = header_new();
+	(void)header_field_new(h, SC_TYPE_FIELD, SC_DIR_TYPE);
+	(void)header_field_new(h, SC_NAME_FIELD, relname);
+	mdir_patch_request(parent, MDIR_ADD, h);
+	header_unref(h);
+}
+
+static void flush_dest(struct batch *batch, struct dest *dest)
+{
+	struct mdir *parent = &batch->smdir->mdir;
+	// Name is relative to parent
+	char absname[PATH_MAX];
+	snprintf(absname, sizeof(absname), "%s/%s", mdir_name(parent), dest->relname);
+
+	struct mdir *destdir = mdir_lookup(absname);
+	on_error {	// create it then
+		error_clear();
+		if_fail (create_folder(parent, dest->relname)) return;
+		if_fail (destdir = mdir_lookup(absname)) return;
+	}
+
+	if_fail (mdir_patch_request_many(destdir, MDIR_ADD, dest->nb_copies, dest->copies)) return;
+	// Now that they are copied, moved messages can be deleted
+	for (unsigned m = 0; m < dest->nb_moves; m++) {
+		if_fail (add_version(&batch->deletes, &batch->nb_deletes, dest->moves[m])) return;
+	}
+}
+
+static int version_cmp(void const *a_, void const *b_)
+{
+	mdir_version const *a = a_, *b = b_;
+	return *a < *b ? -1 : *a > *b ? 1 : 0;
+}
+
+void batch_flush(struct batch *batch)
+{
+	unsigned nb_failed = 0;
+	struct dest *dest;
+	STAILQ_FOREACH(dest, &batch->dests, entry) {
+		if_fail (flush_dest(batch, dest)) {
+			error("Cannot copy %u messages to %s : %s", dest->nb_copies, dest->relname, error_str());
+			error_clear();
+			nb_failed ++;
+		}
+	}
+	if (batch->nb_deletes > 0) {
+		// A message may have been deleted by several actions
+		qsort(batch->deletes, batch->nb_deletes, sizeof(*batch->deletes), version_cmp);
+		unsigned nb = 1;
+		for (unsigned d = 1; d < batch->nb_deletes; d++) {
+			if (batch->deletes[d] != batch->deletes[nb-1]) batch->deletes[nb++] = batch->deletes[d];
+		}
+		if_fail (mdir_del_request_many(&batch->smdir->mdir, nb, batch->deletes)) {
+			error("Cannot delete %u messages from %s : %s", nb, batch->smdir->mdir.path, error_str());
+			error_clear();
+			nb_failed ++;
+		}
+	}
+	// Empty the batch
+	struct strib_mdir *smdir = batch->smdir;
+	mdir_version const done_version = batch->done_version;
+	bool const failed = batch->failed || nb_failed > 0;
+	batch_dtor(batch);
+	batch_ctor(batch, smdir);	// which tells that all the patches so far are done
+	if (failed) {
+		batch->done_version = done_version;
+		batch->failed = true;
+	}
+	if (nb_failed > 0) with_error(0, "Cannot perform all the actions for %s", smdir->mdir.path) return;
+}
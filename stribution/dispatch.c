@@ -0,0 +1,281 @@
+/* Copyright 2008 Cedric Cellier.
+ *
+ * This file is part of Scambio.
+ *
+ * Scambio is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Scambio is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with Scambio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * Dispatch folders to process
+ *
+ * Instead of a thread per folder, folders are watched with inotify (their journals
+ * are appended to by mdsyncc) and put onto a ready list when they change. A single
+ * thread then processes the ready folders by batches of at most STRIB_BATCH_SIZE
+ * patches, putting a folder back at the end of the list when it has more, so that
+ * a large backlog in one folder does not starve the others. Idle folders cost nothing.
+ * Folders that cannot be watched are checked every STRIB_POLL_PERIOD seconds, and
+ * all folders are checked when some events were lost.
+ * New folders are discovered when their symlink appears in a watched folder (or when
+ * a directory patch is stributed in a folder that's not watched).
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "scambio.h"
+#include "misc.h"
+#include "main.h"
+
+/*
+ * Data Definitions
+ */
+
+#define WD_HASH_SIZE 1024
+#define EVENTS_BUF_SIZE (64 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+#define WATCHED_EVENTS (IN_MODIFY|IN_CREATE|IN_MOVED_TO)
+
+static int inotify_fd = -1;
+static pth_t watcher;
+static LIST_HEAD(smdirs, strib_mdir) smdirs = LIST_HEAD_INITIALIZER(smdirs);
+static LIST_HEAD(smdirs_by_wd, strib_mdir) smdirs_by_wd[WD_HASH_SIZE];
+static STAILQ_HEAD(ready_smdirs, strib_mdir) ready_smdirs = STAILQ_HEAD_INITIALIZER(ready_smdirs);
+static pth_mutex_t ready_mutex;	// protects the above list
+static pth_cond_t ready_cond;	// signaled when a folder is made ready
+static unsigned batch_size;
+static unsigned poll_period;
+
+/*
+ * Ready list
+ */
+
+static void make_ready(struct strib_mdir *smdir)
+{
+	if (smdir->ready) return;
+	smdir->ready = true;
+	(void)pth_mutex_acquire(&ready_mutex, FALSE, NULL);
+	STAILQ_INSERT_TAIL(&ready_smdirs, smdir, ready_entry);
+	(void)pth_mutex_release(&ready_mutex);
+	(void)pth_cond_notify(&ready_cond, FALSE);
+}
+
+static void make_all_ready(bool unwatched_only)
+{
+	struct strib_mdir *smdir;
+	LIST_FOREACH(smdir, &smdirs, entry) {
+		if (! unwatched_only || smdir->wd < 0) make_ready(smdir);
+	}
+}
+
+// Returns NULL if nothing became ready for timeout seconds
+static struct strib_mdir *next_ready(unsigned timeout)
+{
+	struct strib_mdir *smdir;
+	(void)pth_mutex_acquire(&ready_mutex, FALSE, NULL);
+	if (NULL == (smdir = STAILQ_FIRST(&ready_smdirs))) {
+		pth_event_t ev = pth_event(PTH_EVENT_TIME, pth_timeout(timeout, 0));
+		(void)pth_cond_await(&ready_cond, &ready_mutex, ev);
+		pth_event_free(ev, PTH_FREE_THIS);
+		smdir = STAILQ_FIRST(&ready_smdirs);
+	}
+	if (smdir) {
+		STAILQ_REMOVE_HEAD(&ready_smdirs, ready_entry);
+		smdir->ready = false;	// so that changes from now on make it ready again
+	}
+	(void)pth_mutex_release(&ready_mutex);
+	return smdir;
+}
+
+/*
+ * Watcher
+ */
+
+static struct strib_mdir *smdir_of_wd(int wd)
+{
+	struct strib_mdir *smdir;
+	LIST_FOREACH(smdir, smdirs_by_wd + wd % WD_HASH_SIZE, wd_entry) {
+		if (smdir->wd == wd) return smdir;
+	}
+	return NULL;
+}
+
+static void unwatch(struct strib_mdir *smdir)
+{
+	if (smdir->wd < 0) return;
+	LIST_REMOVE(smdir, wd_entry);
+	smdir->wd = -1;
+}
+
+static void watch(struct strib_mdir *smdir)
+{
+	if (inotify_fd < 0) return;
+	smdir->wd = inotify_add_watch(inotify_fd, smdir->mdir.path, WATCHED_EVENTS);
+	if (smdir->wd < 0) {
+		warning("Cannot watch %s (%s), will poll it", smdir->mdir.path, strerror(errno));
+		return;
+	}
+	LIST_INSERT_HEAD(smdirs_by_wd + smdir->wd % WD_HASH_SIZE, smdir, wd_entry);
+}
+
+static bool is_folder_link(struct strib_mdir *smdir, char const *name)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", smdir->mdir.path, name);
+	struct stat statbuf;
+	return 0 == lstat(path, &statbuf) && S_ISLNK(statbuf.st_mode);
+}
+
+static void handle_event(struct inotify_event const *ev)
+{
+	if (ev->mask & IN_Q_OVERFLOW) {
+		warning("Some folder events were lost, checking all folders");
+		make_all_ready(false);
+		return;
+	}
+	struct strib_mdir *smdir = smdir_of_wd(ev->wd);
+	if (! smdir) return;
+	if (ev->mask & IN_IGNORED) {	// the folder is gone
+		unwatch(smdir);
+		return;
+	}
+	if (ev->len > 0 && ev->name[0] == '.') return;	// our own secret file, or transient patches
+	if ((ev->mask & (IN_CREATE|IN_MOVED_TO)) && ev->len > 0 && is_folder_link(smdir, ev->name)) {
+		if_fail (dispatch_discover(smdir)) {
+			error("Cannot discover new folders in %s : %s", smdir->mdir.path, error_str());
+			error_clear();
+		}
+		return;
+	}
+	make_ready(smdir);
+}
+
+static void *watcher_thread(void *buf)
+{
+	while (1) {
+		ssize_t len = pth_read(inotify_fd, buf, EVENTS_BUF_SIZE);
+		if (len < 0) {
+			if (errno == EINTR || errno == EAGAIN) continue;
+			error("Cannot read folder events (%s), polling all folders from now on", strerror(errno));
+			break;
+		}
+		for (char *ev = buf; ev < (char *)buf + len; ev += sizeof(struct inotify_event) + ((struct inotify_event *)ev)->len) {
+			handle_event((struct inotify_event *)ev);
+		}
+	}
+	struct strib_mdir *smdir;
+	LIST_FOREACH(smdir, &smdirs, entry) unwatch(smdir);
+	(void)close(inotify_fd);
+	inotify_fd = -1;
+	free(buf);
+	return NULL;
+}
+
+/*
+ * Public Functions
+ */
+
+void dispatch_register(struct strib_mdir *smdir)
+{
+	if (smdir->registered) return;
+	smdir->registered = true;
+	LIST_INSERT_HEAD(&smdirs, smdir, entry);
+	watch(smdir);
+	make_ready(smdir);	// for what was received while we were not watching
+}
+
+static void register_rec(struct mdir *parent, struct mdir *mdir, bool new, char const *name, void *data)
+{
+	(void)parent;
+	(void)new;
+	(void)data;
+	struct strib_mdir *smdir = DOWNCAST(mdir, mdir, strib_mdir);
+	if (smdir->registered) return;	// and so are its subfolders
+	debug("Registering folder %s (%s)", name, mdir->path);
+	dispatch_register(smdir);
+	mdir_folder_list(mdir, false, register_rec, NULL);
+}
+
+void dispatch_register_rec(struct strib_mdir *smdir, char const *name)
+{
+	register_rec(NULL, &smdir->mdir, false, name, NULL);
+}
+
+void dispatch_discover(struct strib_mdir *smdir)
+{
+	mdir_folder_list(&smdir->mdir, false, register_rec, NULL);
+}
+
+void dispatch_run(void)
+{
+	time_t next_poll = time(NULL) + poll_period;
+	while (1) {
+		time_t const now = time(NULL);
+		if (now >= next_poll) {
+			make_all_ready(true);
+			next_poll = now + poll_period;
+		}
+		struct strib_mdir *smdir = next_ready(next_poll - now);
+		if (! smdir) continue;
+		unsigned nb_done;
+		if_fail (nb_done = smdir_process(smdir, batch_size)) {
+			error("Cannot process folder %s : %s", smdir->mdir.path, error_str());
+			error_clear();
+			continue;	// until it changes again
+		}
+		if (nb_done >= batch_size) make_ready(smdir);	// there is more, but let the others have their turn
+	}
+}
+
+void dispatch_begin(void)
+{
+	long long const batch = conf_get_int("STRIB_BATCH_SIZE");
+	if (batch < 1) with_error(0, "STRIB_BATCH_SIZE must be at least 1") return;
+	batch_size = batch;
+	long long const period = conf_get_int("STRIB_POLL_PERIOD");
+	if (period < 1) with_error(0, "STRIB_POLL_PERIOD must be at least 1") return;
+	poll_period = period;
+	pth_mutex_init(&ready_mutex);
+	pth_cond_init(&ready_cond);
+	for (unsigned h = 0; h < WD_HASH_SIZE; h++) LIST_INIT(smdirs_by_wd+h);
+
+	inotify_fd = inotify_init();
+	if (inotify_fd < 0) {
+		warning("Cannot use inotify (%s), will poll all folders", strerror(errno));
+		return;
+	}
+	void *buf = Malloc(EVENTS_BUF_SIZE);
+	on_error return;
+	watcher = pth_spawn(PTH_ATTR_DEFAULT, watcher_thread, buf);
+	if (! watcher) {
+		free(buf);
+		(void)close(inotify_fd);
+		inotify_fd = -1;
+		with_error(0, "Cannot spawn watcher") return;
+	}
+}
+
+void dispatch_end(void)
+{
+	if (watcher) {
+		(void)pth_abort(watcher);
+		watcher = NULL;
+	}
+	if (inotify_fd >= 0) {
+		(void)close(inotify_fd);
+		inotify_fd = -1;
+	}
+}
@@ -1,6 +1,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <errno.h>
+#include <time.h>
 #include <assert.h>
 #include "scambio/header.h"
 #include "misc.h"
@@ -31,6 +33,8 @@
  *
  */
 
+static time_t checkpoint_period;
+
 /*
  * Stribution Mdir
  */
@@ -39,8 +43,11 @@ static struct mdir *smdir_alloc(char const *path)
 {
 	struct strib_mdir *smdir = Malloc(sizeof(*smdir));
 	smdir->conf = NULL;
-	smdir->thread = NULL;
 	smdir->stribution = NULL;
+	smdir->registered = false;
+	smdir->last_saved = time(NULL);
+	smdir->wd = -1;
+	smdir->ready = false;
 
 	// First, read the secret header file
 	char filename[PATH_MAX];
@@ -61,6 +68,8 @@ static struct mdir *smdir_alloc(char const *path)
 	if (NULL != (hf = header_find(smdir->conf, STRIB_LAST_DONE_VERSION, NULL))) {
 		if_fail (smdir->last_done_version = mdir_str2version(hf->value)) goto fail;
 	}
+	mdir_cursor_ctor(&smdir->cursor);
+	mdir_cursor_seek(&smdir->cursor, smdir->last_done_version);
 
 	return &smdir->mdir;
 
@@ -84,10 +93,8 @@ static void replace_header_field(struct header *h, char const *name, char const
 	(void)header_field_new(h, name, value);
 }
 
-static void smdir_free(struct mdir *mdir)
+static void smdir_save(struct strib_mdir *smdir)
 {
-	struct strib_mdir *smdir = DOWNCAST(mdir, mdir, strib_mdir);
-
 	// Update the conf with last versions processed
 	replace_header_field(smdir->conf, STRIB_LAST_CONF_VERSION, mdir_version2str(smdir->last_conf_version));
 	replace_header_field(smdir->conf, STRIB_LAST_DONE_VERSION, mdir_version2str(smdir->last_done_version));
@@ -96,8 +103,17 @@ static void smdir_free(struct mdir *mdir)
 	char filename[PATH_MAX];
 	snprintf(filename, sizeof(filename), "%s/"STRIB_SECRET_FILE, smdir->mdir.path);
 	if_fail (header_to_file(smdir->conf, filename)) {
+		error("Cannot save %s : %s", filename, error_str());
 		error_clear();	// show must go on
 	}
+	smdir->last_saved = time(NULL);
+}
+
+static void smdir_free(struct mdir *mdir)
+{
+	struct strib_mdir *smdir = DOWNCAST(mdir, mdir, strib_mdir);
+
+	smdir_save(smdir);
 
 	// Free the stribution
 	if (smdir->stribution) {
@@ -110,84 +126,61 @@ static void smdir_free(struct mdir *mdir)
 }
 
 /*
- * MDIR thread
+ * Processing of patches
  */
 
 struct action_param {
-	struct mdir *mdir;
+	struct batch *batch;
 	mdir_version version;
 	struct header *object, *subject;
 };
 
-static void do_delete(struct action_param const *param)
-{
-	mdir_del_request(param->mdir, param->version);
-}
-
-static void create_folder(struct mdir *parent, char const *relname)
-{
-	struct header *h = header_new();
-	(void)header_field_new(h, SC_TYPE_FIELD, SC_DIR_TYPE);
-	(void)header_field_new(h, SC_NAME_FIELD, relname);
-	if_fail (mdir_patch_request(parent, MDIR_ADD, h)) return;
-}
-
-static void do_copy_string(struct action_param const *param, char const *relname)
-{
-	// Name is relative to parent
-	char absname[PATH_MAX];
-	snprintf(absname, sizeof(absname), "%s/%s", mdir_name(param->mdir), relname);
-
-	struct mdir *destdir = mdir_lookup(absname);
-	on_error {	// create it then
-		error_clear();
-		if_fail (create_folder(param->mdir, relname)) return;
-		if_fail (destdir = mdir_lookup(absname)) return;
-	}
-
-	mdir_patch_request(destdir, MDIR_ADD, param->object);
-}
-
-static void do_copy_deref(struct action_param const *param, struct strib_deref const *deref)
+char const *action_dest_name(struct header const *subject, struct strib_action const *action)
 {
+	if (action->dest_type == DEST_STRING) return action->dest.string;
+	assert(action->dest_type == DEST_DEREF);
 	// We take the subfolder's name from on of the subject header fields
-	struct header_field *hf = header_find(param->subject, deref->name, NULL);
+	struct header_field *hf = header_find(subject, action->dest.deref.name, NULL);
 	if (! hf) {
-		with_error(0, "Should use subfolder name from message field '%s' which is unset!", deref->name)
-			return;
-	}
-	do_copy_string(param, hf->value);
-}
-
-static void do_copy(struct action_param const *param, struct strib_action const *action)
-{
-	switch (action->dest_type) {
-		case DEST_STRING: do_copy_string(param, action->dest.string); break;
-		case DEST_DEREF:  do_copy_deref(param, &action->dest.deref); break;
-		default:          assert(0);
+		with_error(0, "Should use subfolder name from message field '%s' which is unset!", action->dest.deref.name)
+			return NULL;
 	}
+	return hf->value;
 }
 
 static void action_cb(struct header const *subject, struct strib_action const *action, void *data)
 {
 	(void)subject;
 	struct action_param const *param = data;
+	struct batch *batch = param->batch;
+	char const *relname;
 
 	switch (action->type) {
-		case ACTION_DELETE: do_delete(param); break;
-		case ACTION_COPY:   do_copy(param, action); break;
-		case ACTION_MOVE:   if_succeed (do_copy(param, action)) { do_delete(param); } break;
-		default:            assert(0);
+		case ACTION_DELETE:
+			batch_delete(batch, param->version);
+			break;
+		case ACTION_COPY:
+		case ACTION_MOVE:
+			if_fail (relname = action_dest_name(param->subject, action)) break;
+			batch_copy(batch, relname, param->object, param->version, action->type == ACTION_MOVE);
+			break;
+		default:
+			assert(0);
+	}
+	on_error {	// skip this action only
+		error("Cannot stribute message %"PRIversion" : %s", param->version, error_str());
+		error_clear();
 	}
 }
 
-static void process_message(struct strib_mdir *smdir, struct header *subject, struct header *object, mdir_version version)
+static void process_message(struct batch *batch, struct header *subject, struct header *object, mdir_version version)
 {
+	struct strib_mdir *smdir = batch->smdir;
 	assert(smdir->conf);
 	if (! smdir->stribution) return;
 
 	struct action_param param = {
-		.mdir = &smdir->mdir,
+		.batch = batch,
 		.version = version,
 		.object = object,
 		.subject = subject
@@ -195,12 +188,21 @@ static void process_message(struct strib_mdir *smdir, struct header *subject, st
 	strib_eval(smdir->stribution, subject, action_cb, &param);
 }
 
-static void process_put_rec(struct strib_mdir *smdir, struct header *subject, struct header *object, mdir_version object_version)
+static void process_put_rec(struct batch *batch, struct header *subject, struct header *object, mdir_version object_version)
 {
+	struct strib_mdir *smdir = batch->smdir;
 	// Find out message's type
 	struct header_field *hf_type = header_find(subject, SC_TYPE_FIELD, NULL);
 	if (hf_type) {
-		if (0 == strcmp(hf_type->value, SC_DIR_TYPE)) return;	// Skip directories
+		if (0 == strcmp(hf_type->value, SC_DIR_TYPE)) {	// Skip directories
+			if (smdir->wd < 0 && object == subject) {	// but we won't be told about new ones
+				if_fail (dispatch_discover(smdir)) {
+					error("Cannot discover new folders in %s : %s", smdir->mdir.path, error_str());
+					error_clear();
+				}
+			}
+			return;
+		}
 		if (0 == strcmp(hf_type->value, SC_STRIB_TYPE)) {
 			if (object != subject) {
 				// when dealing with a mark, just skip everything if the original message
@@ -214,78 +216,79 @@ static void process_put_rec(struct strib_mdir *smdir, struct header *subject, st
 				mdir_mark_error(&smdir->mdir, object_version, "Cannot parse strib config");
 				return;	// just ignore this msg
 			}
+			// Maybe the new rules must be applied to past messages as well (but only once)
+			struct header_field *hf_rerun = NULL;
+			mdir_version from = 0;
+			if (object_version > smdir->last_conf_version) hf_rerun = header_find(subject, STRIB_RERUN_FROM, NULL);
+			if (hf_rerun) if_fail (from = mdir_str2version(hf_rerun->value)) {
+				error_clear();
+				mdir_mark_error(&smdir->mdir, object_version, "Cannot parse "STRIB_RERUN_FROM);
+				hf_rerun = NULL;
+			}
+			if (hf_rerun) if_fail (batch_flush(batch)) {	// actions of previous patches come first
+				strib_del(strib);	// this conf will be read again
+				return;
+			}
 			smdir->last_conf_version = object_version;
 			header_unref(smdir->conf);
 			smdir->conf = header_ref(subject);
-			if (smdir->stribution) strib_del(smdir->stribution);
+			struct stribution *previous = smdir->stribution;
 			smdir->stribution = strib;
+			if (hf_rerun) {
+				smdir_save(smdir);	// so that this conf is not replayed once stributed again
+				batch->done_version = object_version;
+				if_fail (rerun(smdir, previous, from, object_version)) {
+					error("%s", error_str());
+					error_clear();
+				}
+			}
+			if (previous) strib_del(previous);
 			return;
 		}
 		if (0 == strcmp(hf_type->value, SC_MARK_TYPE)) {
 			struct header *alt_subject = mdir_get_targeted_header(&smdir->mdir, subject);	// FIXME: change this to return even deleted messages
 			on_error return;
-			process_put_rec(smdir, alt_subject, object, object_version);
+			process_put_rec(batch, alt_subject, object, object_version);
 			header_unref(alt_subject);
 			return;
 		}
 	}
 	
-	process_message(smdir, subject, object, object_version);
+	process_message(batch, subject, object, object_version);
 }
 
 static void process_put(struct mdir *mdir, struct header *h, mdir_version version, void *data)
 {
-	(void)data;
+	struct batch *batch = data;
 	struct strib_mdir *smdir = DOWNCAST(mdir, mdir, strib_mdir);
-	/* FIXME: we will not see transient msg again, so we can not reliably process locally generated
-	 *        messages. To fix this, we could add a flag to mdir_path_list() to list only synched msgs.
-	 */
-	if (version < 0) return;
+	assert(version > 0);	// we list only synched patches
 
 	debug("Stributing message %"PRIversion, version);
 	smdir->last_done_version = version;
 	
-	process_put_rec(smdir, h, h, version);
-}
-
-static void *smdir_thread(void *arg)
-{
-	struct strib_mdir *smdir = arg;
-	mdir_cursor_ctor(&smdir->cursor);
-	mdir_cursor_seek(&smdir->cursor, smdir->last_done_version);
-	while (! is_error()) {
-		mdir_patch_list(&smdir->mdir, &smdir->cursor, false, process_put, NULL, NULL, NULL);
-	}
-	error_clear();
-	return NULL;
-}
-
-static void smdir_start_thread(struct strib_mdir *smdir)
-{
-	assert(! smdir->thread);
-	smdir->thread = pth_spawn(PTH_ATTR_DEFAULT, smdir_thread, smdir);
-	// we don't care of failure since it will automaticaly be retried later.
+	process_put_rec(batch, h, h, version);
 }
 
-/*
- * Walk through folders
- */
-
-static void start_dir_thread_rec(struct mdir *parent, struct mdir *mdir, bool new, char const *name, void *data)
+unsigned smdir_process(struct strib_mdir *smdir, unsigned max)
 {
-	(void)parent;
-	(void)new;
-	(void)data;
-	debug("Walking through folder %s (%s)", name, mdir->path);
-
-	// Start a thread on this directory
-	struct strib_mdir *smdir = DOWNCAST(mdir, mdir, strib_mdir);
-	if (! smdir->thread) {
-		smdir_start_thread(smdir);
+	struct batch batch;
+	batch_ctor(&batch, smdir);
+	unsigned const nb_done = mdir_patch_list_synched(&smdir->mdir, &smdir->cursor, max, process_put, NULL, &batch);
+	// Even if we stopped on error, perform the actions of the patches we went through
+	error_save();
+	batch_flush(&batch);
+	bool const failed = batch.failed;
+	mdir_version const done_version = batch.done_version;
+	batch_dtor(&batch);
+	error_restore();
+	if (failed) {	// stribute again the patches which actions were not all requested
+		smdir->last_done_version = done_version;
+		mdir_cursor_seek(&smdir->cursor, done_version);
+		with_error(0, "Will stribute %s again from version %"PRIversion, smdir->mdir.path, done_version+1) return 0;
 	}
-
-	// Recurse
-	mdir_folder_list(mdir, false, start_dir_thread_rec, NULL);
+	// Once the actions are requested, we can remember these patches are done
+	if (nb_done > 0 && time(NULL) >= smdir->last_saved + checkpoint_period) smdir_save(smdir);
+	return nb_done;
 }
 
 /*
@@ -297,6 +300,10 @@ static void init_conf(void)
 	conf_set_default_str("SC_LOG_DIR", "/var/log/scambio");
 	conf_set_default_int("SC_LOG_LEVEL", 3);
 	conf_set_default_str("STRIB_ROOT", "root");
+	conf_set_default_int("STRIB_BATCH_SIZE", 100);	// patches processed at once in a folder
+	conf_set_default_int("STRIB_POLL_PERIOD", 60);	// for the folders we cannot watch
+	conf_set_default_int("STRIB_CHECKPOINT_PERIOD", 10);	// save last processed versions that often
+	conf_set_default_int("STRIB_RERUN_WORKERS", 4);	// processes used to stribute past messages again
 }
 
 static void init_log(void)
@@ -311,11 +318,15 @@ static void init(void)
 {
 	if_fail (init_conf()) return;
 	if_fail (init_log()) return;
+	checkpoint_period = conf_get_int("STRIB_CHECKPOINT_PERIOD");
 	if_fail (daemonize("sc_stribution")) return;
 	if_fail (mdir_init()) return;
 	if_fail (auth_init()) return;
 	mdir_alloc = smdir_alloc;
 	mdir_free = smdir_free;
+	if_fail (rerun_begin()) return;
+	if_fail (dispatch_begin()) return;
+	if (0 != atexit(dispatch_end)) with_error(0, "atexit") return;
 }
 
 int main(void)
@@ -329,11 +340,11 @@ int main(void)
 	struct mdir *root = mdir_lookup(root_name);
 	on_error return EXIT_FAILURE;
 
-	// FIXME: to discover new folders, do this from time to time
-	if_fail (start_dir_thread_rec(NULL, root, false, root_name, NULL)) {
+	// New folders will then be discovered as they are created
+	if_fail (dispatch_register_rec(DOWNCAST(root, mdir, strib_mdir), root_name)) {
 		return EXIT_FAILURE;
 	}
 
-	pth_exit(NULL);
+	dispatch_run();
 	return EXIT_SUCCESS;
 }
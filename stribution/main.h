@@ -1,7 +1,10 @@
 #ifndef MAIN_H_090509
 #define MAIN_H_090509
 
+#include <stdbool.h>
+#include <time.h>
 #include <pth.h>
+#include "scambio/queue.h"
 #include "scambio/mdir.h"
 
 struct strib_mdir {
@@ -9,9 +12,16 @@ struct strib_mdir {
 	struct header *conf;	// secret message with last conf, last conf version, and last processed version
 	mdir_version last_conf_version;
 	mdir_version last_done_version;
-	pth_t thread;	// may be NULL
 	struct mdir_cursor cursor;
 	struct stribution *stribution;	// may be NULL at start
+	time_t last_saved;	// when the conf was last saved in STRIB_SECRET_FILE
+	// Used by the dispatcher
+	bool registered;
+	LIST_ENTRY(strib_mdir) entry;	// in the list of all registered folders
+	int wd;	// inotify watch descriptor, or -1 if this folder must be polled
+	LIST_ENTRY(strib_mdir) wd_entry;	// in the hash of watched folders
+	bool ready;	// have (or may have) new patches
+	STAILQ_ENTRY(strib_mdir) ready_entry;
 };
 
 #define STRIB_SECRET_FILE ".stribution"
@@ -20,5 +30,47 @@ struct strib_mdir {
 #define STRIB_LAST_CONF_VERSION "strib-last-conf-version"
 #define STRIB_LAST_DONE_VERSION "strib-last-done-version"
 #define STRIB_STANZA "strib-stanza"
+#define STRIB_RERUN_FROM "strib-rerun-from"	// stribute again the messages from this version with the new rules
+
+/* A batch of actions to perform on behalf of a folder (see batch.c)
+ */
+struct batch {
+	struct strib_mdir *smdir;
+	STAILQ_HEAD(dests, dest) dests;
+	unsigned nb_deletes;
+	mdir_version *deletes;
+	mdir_version done_version;	// the actions of the patches up to this one were all requested
+	bool failed;	// some actions could not be requested (then done_version stays where it was)
+};
+
+void batch_ctor(struct batch *, struct strib_mdir *);
+void batch_dtor(struct batch *);
+// Copy object (which is patch version) into this subfolder, then delete it if move
+void batch_copy(struct batch *, char const *relname, struct header *object, mdir_version version, bool move);
+void batch_delete(struct batch *, mdir_version version);
+// Request all the actions, and empty the batch. Fails if some could not be requested (they are logged).
+void batch_flush(struct batch *);
+
+struct strib_action;
+// Returns the name of the subfolder a copy/move action targets, for this message
+char const *action_dest_name(struct header const *subject, struct strib_action const *);
+
+// Process at most max new patches of this folder, returning how many were processed
+unsigned smdir_process(struct strib_mdir *, unsigned max);
+
+void rerun_begin(void);
+// Stribute again the patches from version from to version to (excluded), with the rules that are not in previous
+void rerun(struct strib_mdir *, struct stribution const *previous, mdir_version from, mdir_version to);
+
+void dispatch_begin(void);
+void dispatch_end(void);
+// Start watching this folder, and process what it already has
+void dispatch_register(struct strib_mdir *);
+// Same for this folder and all its subfolders
+void dispatch_register_rec(struct strib_mdir *, char const *name);
+// Register the subfolders of this folder that are not registered yet
+void dispatch_discover(struct strib_mdir *);
+// Process folders as they change. Never returns.
+void dispatch_run(void);
 
 #endif
@@ -0,0 +1,285 @@
+/* Copyright 2008 Cedric Cellier.
+ *
+ * This file is part of Scambio.
+ *
+ * Scambio is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Scambio is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with Scambio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * Stribute past messages again
+ *
+ * A stribution message may ask, with a STRIB_RERUN_FROM field, that the messages
+ * received since a given version be stributed again with its rules. Only the rules
+ * that were not in the previous configuration are applied, since the messages were
+ * already stributed with the others.
+ * These past patches are split into STRIB_RERUN_WORKERS ranges of versions, each one
+ * evaluated by a forked process that only reads the journal and writes the resulting
+ * actions into a temporary file. Once all are done, the files are read in version
+ * order and the actions performed, so that the outcome is the same as if the patches
+ * were stributed one after the other.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "scambio.h"
+#include "scambio/header.h"
+#include "misc.h"
+#include "main.h"
+#include "stribution.h"
+
+/*
+ * Data Definitions
+ */
+
+#define RECORD_MAX (PATH_MAX + 32)
+
+struct shard {
+	mdir_version from, to;	// to is excluded
+	bool const *changed;	// which tests of the stribution to apply (see strib_diff())
+	pid_t pid;
+	FILE *results;
+};
+
+static unsigned nb_workers;
+static unsigned batch_size;
+
+/*
+ * Workers
+ */
+
+struct record_param {
+	FILE *out;
+	mdir_version version;
+	struct stribution const *stribution;
+	bool const *changed;
+};
+
+// Actions are written as "version -" for deletions and "version c|m relname" for copies and moves
+static void record_cb(struct header const *subject, struct strib_action const *action, void *data)
+{
+	struct record_param const *param = data;
+	unsigned const t = DOWNCAST(action, action, strib_test) - param->stribution->tests;
+	if (! param->changed[t]) return;	// already performed with the previous configuration
+	char const *relname;
+	switch (action->type) {
+		case ACTION_DELETE:
+			fprintf(param->out, "%"PRIversion" -\n", param->version);
+			break;
+		case ACTION_COPY:
+		case ACTION_MOVE:
+			if_fail (relname = action_dest_name(subject, action)) {	// skip this action only
+				error("Cannot stribute message %"PRIversion" : %s", param->version, error_str());
+				error_clear();
+				break;
+			}
+			fprintf(param->out, "%"PRIversion" %c %s\n", param->version, action->type == ACTION_MOVE ? 'm':'c', relname);
+			break;
+	}
+}
+
+// Same as process_put_rec(), but configurations are skipped and actions recorded
+static void record_rec(struct strib_mdir *smdir, struct header *subject, mdir_version version, struct shard const *shard)
+{
+	struct header_field *hf_type = header_find(subject, SC_TYPE_FIELD, NULL);
+	if (hf_type) {
+		if (0 == strcmp(hf_type->value, SC_DIR_TYPE)) return;
+		if (0 == strcmp(hf_type->value, SC_STRIB_TYPE)) return;
+		if (0 == strcmp(hf_type->value, SC_MARK_TYPE)) {
+			struct header *alt_subject;
+			if_fail (alt_subject = mdir_get_targeted_header(&smdir->mdir, subject)) return;
+			record_rec(smdir, alt_subject, version, shard);
+			header_unref(alt_subject);
+			return;
+		}
+	}
+	struct record_param param = {
+		.out = shard->results,
+		.version = version,
+		.stribution = smdir->stribution,
+		.changed = shard->changed,
+	};
+	strib_eval(smdir->stribution, subject, record_cb, &param);
+}
+
+static void run_shard(struct strib_mdir *smdir, struct shard const *shard)
+{
+	mdir_version version = shard->from - 1;
+	enum mdir_action action;
+	struct header *h;
+	while (NULL != (h = mdir_read_next(&smdir->mdir, &version, &action))) {
+		if (version >= shard->to) {
+			header_unref(h);
+			break;
+		}
+		if (action == MDIR_ADD) if_fail (record_rec(smdir, h, version, shard)) {
+			error("Cannot stribute message %"PRIversion" : %s", version, error_str());
+			error_clear();
+		}
+		header_unref(h);
+	}
+}
+
+// Split the versions from from to to (excluded) into nb_shards consecutive ranges
+static void plan_shards(struct shard *shards, unsigned nb_shards, mdir_version from, mdir_version to, bool const *changed)
+{
+	mdir_version const shard_len = (to - from + nb_shards - 1) / nb_shards;
+	for (unsigned s = 0; s < nb_shards; s++) {
+		shards[s].changed = changed;
+		shards[s].from = from + s * shard_len < to ? from + s * shard_len : to;
+		shards[s].to = shards[s].from + shard_len < to ? shards[s].from + shard_len : to;
+	}
+}
+
+static void shard_start(struct strib_mdir *smdir, struct shard *shard)
+{
+	shard->results = tmpfile();
+	if (! shard->results) with_error(errno, "tmpfile") return;
+	shard->pid = pth_fork();
+	if (shard->pid < 0) with_error(errno, "fork") return;
+	if (shard->pid > 0) return;
+	// We are the worker. Do not run any atexit handler, we own nothing.
+	run_shard(smdir, shard);
+	on_error {
+		error("Cannot stribute versions %"PRIversion" to %"PRIversion" : %s", shard->from, shard->to, error_str());
+		_exit(EXIT_FAILURE);
+	}
+	_exit(0 == fflush(shard->results) ? EXIT_SUCCESS:EXIT_FAILURE);
+}
+
+static void shard_wait(struct shard *shard)
+{
+	if (shard->pid <= 0) return;
+	int status;
+	if (pth_waitpid(shard->pid, &status, 0) < 0) with_error(errno, "waitpid(%d)", (int)shard->pid) return;
+	if (! WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+		with_error(0, "Worker for versions %"PRIversion" to %"PRIversion" failed", shard->from, shard->to) return;
+	}
+}
+
+/*
+ * Merge
+ */
+
+static void apply_shard(struct strib_mdir *smdir, struct shard *shard, struct batch *batch, unsigned *nb_pending)
+{
+	rewind(shard->results);
+	char line[RECORD_MAX];
+	while (fgets(line, sizeof(line), shard->results)) {
+		char *end;
+		mdir_version const version = strtoll(line, &end, 10);
+		size_t len = strlen(end);
+		if (len < 3 || end[0] != ' ' || end[len-1] != '\n') with_error(0, "Bad action record : %s", line) return;
+		end[len-1] = '\0';
+		if (end[1] == '-') {
+			batch_delete(batch, version);
+		} else {
+			if (len < 5 || end[2] != ' ') with_error(0, "Bad action record : %s", line) return;
+			struct header *object;
+			if_fail (object = mdir_read(&smdir->mdir, version, NULL)) return;
+			if (! object) continue;	// deleted since the worker read it
+			batch_copy(batch, end+3, object, version, end[1] == 'm');
+			header_unref(object);
+		}
+		on_error return;
+		if (++ *nb_pending >= batch_size) {
+			if_fail (batch_flush(batch)) return;
+			*nb_pending = 0;
+		}
+	}
+	if (ferror(shard->results)) with_error(errno, "Cannot read actions") return;
+}
+
+/*
+ * Public Functions
+ */
+
+void rerun(struct strib_mdir *smdir, struct stribution const *previous, mdir_version from, mdir_version to)
+{
+	if (from < 1) from = 1;
+	if (from >= to || ! smdir->stribution) return;
+	bool *changed = Calloc((smdir->stribution->nb_tests + 1) * sizeof(*changed));
+	on_error return;
+	strib_diff(smdir->stribution, previous, changed);
+	unsigned nb_changed = 0;
+	for (unsigned t = 0; t < smdir->stribution->nb_tests; t++) if (changed[t]) nb_changed ++;
+	if (nb_changed == 0) {
+		free(changed);
+		return;
+	}
+	unsigned nb_shards = to - from < nb_workers ? (unsigned)(to - from) : nb_workers;
+	info("Stributing again %s from version %"PRIversion" to %"PRIversion" with %u new rules and %u workers", smdir->mdir.path, from, to, nb_changed, nb_shards);
+	struct shard *shards = Calloc(nb_shards * sizeof(*shards));
+	on_error {
+		free(changed);
+		return;
+	}
+	plan_shards(shards, nb_shards, from, to, changed);
+
+	unsigned nb_started;
+	for (nb_started = 0; nb_started < nb_shards; nb_started++) {
+		if_fail (shard_start(smdir, shards + nb_started)) {
+			nb_started ++;	// may need cleanup
+			break;
+		}
+	}
+	// Wait for all the workers we started, even on error
+	bool failed = is_error();
+	error_save();
+	for (unsigned s = 0; s < nb_started; s++) {
+		if_fail (shard_wait(shards+s)) {
+			error("%s", error_str());
+			error_clear();
+			failed = true;
+		}
+	}
+	// Merge the results in version order
+	if (! failed) {
+		struct batch batch;
+		batch_ctor(&batch, smdir);
+		unsigned nb_pending = 0;
+		for (unsigned s = 0; s < nb_shards; s++) {
+			if_fail (apply_shard(smdir, shards+s, &batch, &nb_pending)) break;
+		}
+		on_error {	// still perform what was merged so far, which is a prefix of the sequential outcome
+			error("Cannot merge actions : %s", error_str());
+			error_clear();
+			failed = true;
+		}
+		if_fail (batch_flush(&batch)) {
+			error_clear();	// already logged
+			failed = true;
+		}
+		batch_dtor(&batch);
+	}
+	for (unsigned s = 0; s < nb_started; s++) {
+		if (shards[s].results) (void)fclose(shards[s].results);
+	}
+	free(shards);
+	free(changed);
+	error_restore();
+	if (failed) with_error(0, "Cannot stribute %s again", smdir->mdir.path) return;
+}
+
+void rerun_begin(void)
+{
+	long long const nb = conf_get_int("STRIB_RERUN_WORKERS");
+	if (nb < 1) with_error(0, "STRIB_RERUN_WORKERS must be at least 1") return;
+	nb_workers = nb;
+	batch_size = conf_get_int("STRIB_BATCH_SIZE");
+	if (batch_size < 1) batch_size = 1;
+}
@@ -0,0 +1,302 @@
+/* Copyright 2008 Cedric Cellier.
+ *
+ * This file is part of Scambio.
+ *
+ * Scambio is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * Scambio is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with Scambio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* Checks for the rerun.
+ * A folder is filled with some messages (spread over several journals), which are
+ * then stributed again by rerun() with any number of workers, for a configuration
+ * that adds some rules to a previous one. The requested patches must be those of
+ * the added rules only, in the order a sequential evaluation of the messages gives.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include "scambio.h"
+#include "scambio/header.h"
+#include "misc.h"
+#include "check.h"
+#include "main.h"
+#include "stribution.h"
+
+#define NB_MESSAGES 211
+#define MAX_WORKERS 9
+#define NUMBER_FIELD "check-number"
+
+// The first ones are added to the previous configuration, which had the others
+static char const *const stanzas[] = {
+	"subject =~ \"^(re|fwd):\" : copyto \"replies\"",
+	"size > 5000 : moveto \"big\"",
+	"priority set : copyto \"urgent\"",
+	"always : copyto \"all\"",
+};
+static char const *const dests[] = { "replies", "big", "urgent", "all" };
+#define NB_ADDED 2
+
+// What was requested : copies of message numbers into each destination, and deletions
+struct outcome {
+	unsigned nb_copies[sizeof_array(dests)];
+	unsigned copies[sizeof_array(dests)][NB_MESSAGES];
+	unsigned nb_deletes;
+	mdir_version deletes[NB_MESSAGES];	// sorted
+};
+
+// Only used by main.c for the destinations given by a field value, which we do not use
+char const *action_dest_name(struct header const *subject, struct strib_action const *action)
+{
+	(void)subject;
+	if (action->dest_type != DEST_STRING) with_error(0, "No dereferenced destinations here") return NULL;
+	return action->dest.string;
+}
+
+static struct mdir *smdir_alloc(char const *path)
+{
+	(void)path;
+	struct strib_mdir *smdir = Calloc(sizeof(*smdir));
+	smdir->wd = -1;
+	return &smdir->mdir;
+}
+
+static void smdir_free(struct mdir *mdir)
+{
+	free(DOWNCAST(mdir, mdir, strib_mdir));
+}
+
+static struct stribution *strib_of(unsigned first, unsigned last)
+{
+	struct header *conf = header_new();
+	for (unsigned s = first; s < last; s++) {
+		if_fail ((void)header_field_new(conf, STRIB_STANZA, stanzas[s])) break;
+	}
+	struct stribution *strib = NULL;
+	unless_error strib = strib_new(conf);
+	header_unref(conf);
+	return strib;
+}
+
+static void fill(struct mdir *mdir, mdir_version *from, mdir_version *to)
+{
+	static char const *const subjects[] = { "hello", "re: hello", "Fwd: news", "meeting", "RE: meeting" };
+	static char const *const froms[] = { "alice@example.com", "bob@example.com", "spam@example.com" };
+	for (unsigned m = 0; m < NB_MESSAGES; m++) {
+		struct header *h = header_new();
+		char size[16], number[16];
+		snprintf(size, sizeof(size), "%u", (m * 7919) % 10000);
+		snprintf(number, sizeof(number), "%u", m);
+		(void)header_field_new(h, "subject", subjects[m % sizeof_array(subjects)]);
+		(void)header_field_new(h, "from", froms[m % sizeof_array(froms)]);
+		(void)header_field_new(h, "size", size);
+		(void)header_field_new(h, NUMBER_FIELD, number);
+		if (m % 11 == 0) (void)header_field_new(h, "priority", "high");
+		mdir_version version;
+		unless_error version = mdir_patch(mdir, MDIR_ADD, h, 0);
+		header_unref(h);
+		on_error return;
+		if (m == 0) *from = version;
+		*to = version + 1;
+	}
+}
+
+static unsigned number_of(struct header const *h)
+{
+	struct header_field *hf = header_find(h, NUMBER_FIELD, NULL);
+	return hf ? strtoul(hf->value, NULL, 10) : NB_MESSAGES;
+}
+
+static int version_cmp(void const *a_, void const *b_)
+{
+	mdir_version const *a = a_, *b = b_;
+	return *a < *b ? -1 : *a > *b ? 1 : 0;
+}
+
+/*
+ * The sequential outcome
+ */
+
+struct expect_param {
+	struct outcome *outcome;
+	mdir_version version;
+};
+
+static void expect_cb(struct header const *subject, struct strib_action const *action, void *data)
+{
+	struct expect_param *param = data;
+	struct outcome *outcome = param->outcome;
+	if (action->type == ACTION_DELETE || action->type == ACTION_MOVE) {
+		outcome->deletes[outcome->nb_deletes++] = param->version;
+	}
+	if (action->type == ACTION_DELETE) return;
+	for (unsigned d = 0; d < sizeof_array(dests); d++) {
+		if (0 == strcmp(dests[d], action->dest.string)) {
+			outcome->copies[d][outcome->nb_copies[d]++] = number_of(subject);
+		}
+	}
+}
+
+// Evaluate the added rules on each message, one after the other
+static void expect(struct outcome *outcome, struct mdir *mdir, struct stribution *added, mdir_version from, mdir_version to)
+{
+	memset(outcome, 0, sizeof(*outcome));
+	struct expect_param param = { .outcome = outcome, .version = from - 1 };
+	enum mdir_action action;
+	struct header *h;
+	while (NULL != (h = mdir_read_next(mdir, &param.version, &action))) {
+		if (param.version >= to) {
+			header_unref(h);
+			break;
+		}
+		if (action == MDIR_ADD) strib_eval(added, h, expect_cb, &param);
+		header_unref(h);
+	}
+}
+
+/*
+ * The requested outcome
+ */
+
+// The patches requested in each folder since the previous rerun
+static struct mdir_cursor cursors[sizeof_array(dests) + 1];
+
+struct listed {
+	mdir_version version;	// transient, the order in which they were requested
+	unsigned number;
+};
+
+struct list_param {
+	struct outcome *outcome;
+	unsigned nb_listed;
+	struct listed listed[NB_MESSAGES];
+};
+
+static int listed_cmp(void const *a_, void const *b_)
+{
+	struct listed const *a = a_, *b = b_;
+	return version_cmp(&a->version, &b->version);
+}
+
+static void listed_put(struct mdir *mdir, struct header *h, mdir_version version, void *data)
+{
+	(void)mdir;
+	struct list_param *param = data;
+	if (header_is_directory(h) || param->nb_listed >= NB_MESSAGES) return;
+	param->listed[param->nb_listed++] = (struct listed){ .version = -version, .number = number_of(h) };
+}
+
+static void listed_rem(struct mdir *mdir, mdir_version target, void *data)
+{
+	(void)mdir;
+	struct outcome *outcome = ((struct list_param *)data)->outcome;
+	if (outcome->nb_deletes < NB_MESSAGES) outcome->deletes[outcome->nb_deletes++] = target;
+}
+
+static void list(struct outcome *outcome)
+{
+	memset(outcome, 0, sizeof(*outcome));
+	struct list_param param = { .outcome = outcome };
+	for (unsigned d = 0; d < sizeof_array(dests); d++) {
+		struct mdir *dest = mdir_lookup(dests[d]);
+		on_error {	// never created
+			error_clear();
+			continue;
+		}
+		param.nb_listed = 0;
+		if_fail (mdir_patch_list(dest, cursors + d, true, listed_put, NULL, NULL, &param)) return;
+		qsort(param.listed, param.nb_listed, sizeof(*param.listed), listed_cmp);
+		for (unsigned l = 0; l < param.nb_listed; l++) outcome->copies[d][l] = param.listed[l].number;
+		outcome->nb_copies[d] = param.nb_listed;
+	}
+	struct mdir *root;
+	if_fail (root = mdir_lookup("/")) return;
+	if_fail (mdir_patch_list(root, cursors + sizeof_array(dests), true, NULL, listed_rem, NULL, &param)) return;
+	qsort(outcome->deletes, outcome->nb_deletes, sizeof(*outcome->deletes), version_cmp);
+}
+
+static void check_rerun(char const *what, struct strib_mdir *smdir, struct stribution const *previous, mdir_version from, mdir_version to, struct outcome const *expected)
+{
+	struct outcome got;
+	rerun(smdir, previous, from, to);
+	unless_error list(&got);
+	on_error {
+		check_fail(what, error_str());
+		error_clear();
+		return;
+	}
+	for (unsigned d = 0; d < sizeof_array(dests); d++) {
+		if (got.nb_copies[d] != expected->nb_copies[d] || 0 != memcmp(got.copies[d], expected->copies[d], got.nb_copies[d] * sizeof(*got.copies[d]))) {
+			check_fail(what, "copies differ from the sequential run");
+		}
+	}
+	if (got.nb_deletes != expected->nb_deletes || 0 != memcmp(got.deletes, expected->deletes, got.nb_deletes * sizeof(*got.deletes))) {
+		check_fail(what, "deletions differ from the sequential run");
+	}
+}
+
+int main(void)
+{
+	check_begin();
+	char const *root = check_tmpdir("rerun_check");
+	char path[PATH_MAX];
+	setenv("SC_MDIR_ROOT_DIR", root, 1);
+	snprintf(path, sizeof(path), "%s/.dirid.seq", root);
+	setenv("SC_MDIR_DIRSEQ", path, 1);
+	snprintf(path, sizeof(path), "%s/.transient.seq", root);
+	setenv("SC_MDIR_TRANSIENTSEQ", path, 1);
+	setenv("SC_MDIR_MAX_JNL_SIZE", "32", 1);	// so that workers span several journals
+	setenv("STRIB_BATCH_SIZE", "7", 1);	// so that actions are requested in several batches
+	if_fail (mdir_init()) return check_end();
+	mdir_alloc = smdir_alloc;
+	mdir_free = smdir_free;
+	for (unsigned c = 0; c < sizeof_array(cursors); c++) mdir_cursor_ctor(cursors + c);
+
+	struct stribution *previous = NULL, *added = NULL;
+	do {
+		struct mdir *mdir;
+		if_fail (mdir = mdir_lookup("/")) break;
+		struct strib_mdir *smdir = DOWNCAST(mdir, mdir, strib_mdir);
+		if_fail (smdir->stribution = strib_of(0, sizeof_array(stanzas))) break;
+		if_fail (previous = strib_of(NB_ADDED, sizeof_array(stanzas))) break;
+		if_fail (added = strib_of(0, NB_ADDED)) break;
+		mdir_version from, to;
+		if_fail (fill(mdir, &from, &to)) break;
+
+		struct outcome expected;
+		if_fail (expect(&expected, mdir, added, from, to)) break;
+		if (expected.nb_copies[0] == 0 || expected.nb_deletes == 0) check_fail("sequential run", "not all actions are exercised");
+		for (unsigned nb_workers = 1; nb_workers <= MAX_WORKERS; nb_workers++) {
+			char what[64];
+			snprintf(what, sizeof(what), "%u workers", nb_workers);
+			snprintf(path, sizeof(path), "%u", nb_workers);
+			setenv("STRIB_RERUN_WORKERS", path, 1);
+			if_fail (rerun_begin()) break;
+			check_rerun(what, smdir, previous, from, to, &expected);
+		}
+
+		// Nothing to do again when no rules were added
+		struct outcome nothing;
+		memset(&nothing, 0, sizeof(nothing));
+		check_rerun("same configuration", smdir, smdir->stribution, from, to, &nothing);
+		strib_del(smdir->stribution);
+		smdir->stribution = NULL;
+	} while (0);
+	on_error {
+		check_fail("setup", error_str());
+		error_clear();
+	}
+	if (previous) strib_del(previous);
+	if (added) strib_del(added);
+
+	return check_end();
+}
@@ -96,6 +96,7 @@ tests:
 			return -1;
 		}
 	} |
+	tests EOL |	/* blank lines, such as the one conf_write() ends with */
 	;
 
 test:
@@ -18,10 +18,14 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
 #include <log.h>
 #include <assert.h>
 #include "scambio/header.h"
 #include "misc.h"
+#include "varbuf.h"
 #include "stribution.h"
 
 /*
@@ -30,6 +34,60 @@
 
 void strib_parse(struct header const *, struct stribution *);
 
+/* Rather than evaluating each test in turn, the tests are compiled into a plan :
+ * - all fields used by the tests are located once per message ;
+ * - equality tests against constant strings are hashed by (field, value) ;
+ * - numeric tests are sorted by threshold, so that all the tests matching a
+ *   field value are found by bisection ;
+ * - regular expressions on the same field are first tried as a single one
+ *   (see merge_res()).
+ * The other tests are evaluated one by one. Actions are then performed in the
+ * order of the tests, as before.
+ */
+
+#define FIELD_HASH_SIZE 64
+#define EQ_HASH_SIZE 256
+
+enum num_op { NUM_GT, NUM_GE, NUM_LT, NUM_LE, NUM_EQ, NB_NUM_OPS };
+
+struct threshold {
+	long long value;
+	unsigned test;
+};
+
+struct plan_field {
+	LIST_ENTRY(plan_field) h_entry;	// in plan->fields_hash
+	char const *name;	// belongs to a test
+	struct num_tests {
+		unsigned nb;
+		struct threshold *thresholds;	// sorted by value
+	} num[NB_NUM_OPS];
+	bool has_eq;	// some equality tests are hashed for this field
+	unsigned nb_res;
+	unsigned *re_tests;	// tests with a regular expression on this field
+	bool re_merged_set;
+	regex_t re_merged;	// matches if any of re_tests does
+};
+
+struct eq_test {
+	LIST_ENTRY(eq_test) h_entry;
+	unsigned field;
+	char const *value;	// belongs to the test
+	unsigned test;
+};
+
+struct strib_plan {
+	unsigned nb_fields;
+	struct plan_field *fields;	// never reallocated, since the hash points into it
+	LIST_HEAD(plan_fields, plan_field) fields_hash[FIELD_HASH_SIZE];
+	LIST_HEAD(eq_tests, eq_test) eq_hash[EQ_HASH_SIZE];
+	struct plan_test {
+		unsigned field, deref;	// indexes in fields
+	} *tests;
+	unsigned nb_generics;
+	unsigned *generics;	// tests that are evaluated one by one
+};
+
 /*
  * Private Functions
  */
@@ -161,13 +219,6 @@ static void test_dtor(struct strib_test *t)
 	strib_action_dtor(&t->action);
 }
 
-static void strib_dtor(struct stribution *c)
-{
-	for (unsigned t=0; t<c->nb_tests; t++) {
-		test_dtor(c->tests+t);
-	}
-}
-
 static bool binary_op_num(enum strib_op op, long long a, long long b)
 {
 	switch (op) {
@@ -197,7 +248,7 @@ static bool binary_op_str(enum strib_op op, char const *a, char const *b)
 	return false;
 }
 
-static bool re_match_str(char const *a, regex_t *re)
+static bool re_match_str(char const *a, regex_t const *re)
 {
 	return 0 == regexec(re, a, 0, NULL, 0);
 }
@@ -209,31 +260,19 @@ static int str2num(long long *num, char const *str)
 	return *end == '\0' ? 0:-1;
 }
 
-static char const *header_search(struct header const *h, char const *name)
-{
-	struct header_field *hf = header_find(h, name, NULL);
-	if (! hf) return NULL;
-	return hf->value;
-}
-
-static bool field_is_set(char const *field_name, struct header const *head)
-{
-	return NULL != header_search(head, field_name);
-}
-
-static bool condition_eval(struct strib_condition *cond, struct header const *head)
+// field_value and deref_value are the values of the fields named in the condition, or NULL
+static bool condition_eval(struct strib_condition const *cond, char const *field_value, char const *deref_value)
 {
 	switch (cond->op) {
 		case OP_ALWAYS: return true;
 		// Unary opes
-		case OP_SET:    return field_is_set(cond->field_name, head);
-		case OP_UNSET:  return !field_is_set(cond->field_name, head);
+		case OP_SET:    return field_value != NULL;
+		case OP_UNSET:  return field_value == NULL;
 		// Binary ops
 		default:        break;
 	}
 	assert(is_binary(cond->op));
 	// We need the field value
-	char const *field_value = header_search(head, cond->field_name);
 	long long field_num;
 	if (! field_value) return false;
 	// We need value for binary ops
@@ -249,7 +288,7 @@ static bool condition_eval(struct strib_condition *cond, struct header const *he
 			has_num = true;
 			break;
 		case TYPE_DEREF:
-			str_value = header_search(head, cond->value.deref.name);
+			str_value = deref_value;
 			break;
 	}
 	// Now cast field value to what we need
@@ -261,9 +300,325 @@ static bool condition_eval(struct strib_condition *cond, struct header const *he
 		return binary_op_num(cond->op, field_num, num_value);
 	}
 	if (cond->op == OP_RE) return re_match_str(field_value, &cond->re_match);
+	if (! str_value) return false;
 	return binary_op_str(cond->op, field_value, str_value);
 }
 
+static bool condition_eq(struct strib_condition const *a, struct strib_condition const *b)
+{
+	if (a->op != b->op) return false;
+	if (is_constant(a->op)) return true;
+	if (0 != strcasecmp(a->field_name, b->field_name)) return false;
+	if (is_unary(a->op)) return true;
+	if (a->value_type != b->value_type) return false;
+	switch (a->value_type) {
+		case TYPE_STRING: return 0 == strcmp(a->value.string, b->value.string);
+		case TYPE_NUMBER: return a->value.number == b->value.number;
+		case TYPE_DEREF:  return 0 == strcasecmp(a->value.deref.name, b->value.deref.name);
+	}
+	return false;
+}
+
+static bool action_eq(struct strib_action const *a, struct strib_action const *b)
+{
+	if (a->type != b->type) return false;
+	if (! has_dest(a->type)) return true;
+	if (a->dest_type != b->dest_type) return false;
+	switch (a->dest_type) {
+		case DEST_STRING: return 0 == strcmp(a->dest.string, b->dest.string);
+		case DEST_DEREF:  return 0 == strcasecmp(a->dest.deref.name, b->dest.deref.name);
+	}
+	return false;
+}
+
+static bool test_eq(struct strib_test const *a, struct strib_test const *b)
+{
+	return condition_eq(&a->condition, &b->condition) && action_eq(&a->action, &b->action);
+}
+
+/*
+ * Plan compilation
+ */
+
+static unsigned hash_str(char const *str, bool ignore_case)
+{
+	unsigned h = 2166136261U;
+	while (*str) {
+		unsigned char c = *str++;
+		if (ignore_case) c = tolower(c);
+		h = (h ^ c) * 16777619U;
+	}
+	return h;
+}
+
+static struct plan_field *plan_field_lookup(struct strib_plan const *plan, char const *name)
+{
+	struct plan_field *field;
+	LIST_FOREACH(field, plan->fields_hash + hash_str(name, true) % FIELD_HASH_SIZE, h_entry) {
+		if (0 == strcasecmp(field->name, name)) return field;
+	}
+	return NULL;
+}
+
+static unsigned plan_field_get(struct strib_plan *plan, char const *name)
+{
+	struct plan_field *field = plan_field_lookup(plan, name);
+	if (field) return field - plan->fields;
+	field = plan->fields + plan->nb_fields;
+	memset(field, 0, sizeof(*field));
+	field->name = name;
+	LIST_INSERT_HEAD(plan->fields_hash + hash_str(name, true) % FIELD_HASH_SIZE, field, h_entry);
+	return plan->nb_fields++;
+}
+
+// Make room for one more item in this array
+static void *grow(void *array, unsigned nb, size_t size)
+{
+	void *new = realloc(array, (nb+1) * size);
+	if (! new) with_error(ENOMEM, "Cannot realloc plan") return NULL;
+	return new;
+}
+
+static enum num_op op2num(enum strib_op op)
+{
+	switch (op) {
+		case OP_GT: return NUM_GT;
+		case OP_GE: return NUM_GE;
+		case OP_LT: return NUM_LT;
+		case OP_LE: return NUM_LE;
+		case OP_EQ: return NUM_EQ;
+		default:    assert(0);
+	}
+	return NB_NUM_OPS;
+}
+
+static void add_threshold(struct plan_field *field, enum strib_op op, long long value, unsigned test)
+{
+	struct num_tests *num = field->num + op2num(op);
+	struct threshold *th;
+	if_fail (th = grow(num->thresholds, num->nb, sizeof(*th))) return;
+	num->thresholds = th;
+	th[num->nb].value = value;
+	th[num->nb].test = test;
+	num->nb ++;
+}
+
+static void add_eq(struct strib_plan *plan, unsigned field, char const *value, unsigned test)
+{
+	struct eq_test *eq = Malloc(sizeof(*eq));
+	on_error return;
+	eq->field = field;
+	eq->value = value;
+	eq->test = test;
+	LIST_INSERT_HEAD(plan->eq_hash + (hash_str(value, false) + field) % EQ_HASH_SIZE, eq, h_entry);
+	plan->fields[field].has_eq = true;
+}
+
+static void add_index(unsigned **array, unsigned *nb, unsigned test)
+{
+	unsigned *new;
+	if_fail (new = grow(*array, *nb, sizeof(*new))) return;
+	*array = new;
+	new[(*nb)++] = test;
+}
+
+static int threshold_cmp(void const *a_, void const *b_)
+{
+	struct threshold const *a = a_, *b = b_;
+	return a->value < b->value ? -1 : a->value > b->value ? 1 : 0;
+}
+
+// Back-references would be renumbered by the merge
+static bool has_backref(char const *re)
+{
+	for (char const *c = re; *c; c++) {
+		if (c[0] == '\\') {
+			if (c[1] >= '1' && c[1] <= '9') return true;
+			if (c[1] != '\0') c++;
+		}
+	}
+	return false;
+}
+
+/* The merged expression is only a filter : regexec() reports a single alternative
+ * while several of them may match, so when the merged expression matches each
+ * expression is still evaluated on its own. Values that match none of the
+ * expressions (the common case) are rejected with one regexec() instead of
+ * nb_res, but values that match cost one more regexec() than without the merge.
+ */
+static void merge_res(struct plan_field *field, struct strib_test const *tests)
+{
+	struct varbuf vb;
+	if_fail (varbuf_ctor(&vb, 1024, true)) return;
+	varbuf_clean(&vb);
+	for (unsigned r = 0; r < field->nb_res; r++) {
+		char const *re = tests[field->re_tests[r]].condition.value.string;
+		if (has_backref(re)) goto quit;
+		if_fail (varbuf_append_strs(&vb, r > 0 ? "|(":"(", re, ")", NULL)) goto quit;
+	}
+	if (0 == regcomp(&field->re_merged, vb.buf, REG_EXTENDED|REG_ICASE|REG_NOSUB)) {
+		field->re_merged_set = true;
+	} else {
+		warning("Cannot merge regular expressions on field %s", field->name);	// we will do without
+	}
+quit:
+	varbuf_dtor(&vb);
+}
+
+static void plan_del(struct strib_plan *plan)
+{
+	for (unsigned f = 0; f < plan->nb_fields; f++) {
+		struct plan_field *field = plan->fields + f;
+		for (unsigned o = 0; o < NB_NUM_OPS; o++) free(field->num[o].thresholds);
+		free(field->re_tests);
+		if (field->re_merged_set) regfree(&field->re_merged);
+	}
+	for (unsigned h = 0; h < EQ_HASH_SIZE; h++) {
+		struct eq_test *eq;
+		while (NULL != (eq = LIST_FIRST(plan->eq_hash+h))) {
+			LIST_REMOVE(eq, h_entry);
+			free(eq);
+		}
+	}
+	free(plan->fields);
+	free(plan->tests);
+	free(plan->generics);
+	free(plan);
+}
+
+static void compile_test(struct strib_plan *plan, struct strib_test const *test, unsigned t)
+{
+	struct strib_condition const *cond = &test->condition;
+	struct plan_test *pt = plan->tests + t;
+	if (cond->op != OP_ALWAYS) pt->field = plan_field_get(plan, cond->field_name);
+	if (is_binary(cond->op) && cond->value_type == TYPE_DEREF) pt->deref = plan_field_get(plan, cond->value.deref.name);
+
+	if (is_binary(cond->op) && cond->op != OP_RE && cond->value_type == TYPE_NUMBER) {
+		add_threshold(plan->fields + pt->field, cond->op, cond->value.number, t);
+	} else if (cond->op == OP_EQ && cond->value_type == TYPE_STRING) {
+		add_eq(plan, pt->field, cond->value.string, t);
+	} else if (cond->op == OP_RE && cond->re_match_set) {
+		struct plan_field *field = plan->fields + pt->field;
+		add_index(&field->re_tests, &field->nb_res, t);
+	} else {
+		add_index(&plan->generics, &plan->nb_generics, t);
+	}
+}
+
+static struct strib_plan *plan_new(struct stribution const *c)
+{
+	struct strib_plan *plan = Calloc(sizeof(*plan));
+	on_error return NULL;
+	plan->fields = Calloc((2*c->nb_tests + 1) * sizeof(*plan->fields));	// at most a field and a deref per test
+	plan->tests = Calloc((c->nb_tests + 1) * sizeof(*plan->tests));
+	for (unsigned h = 0; h < FIELD_HASH_SIZE; h++) LIST_INIT(plan->fields_hash+h);
+	for (unsigned h = 0; h < EQ_HASH_SIZE; h++) LIST_INIT(plan->eq_hash+h);
+	on_error goto fail;
+
+	for (unsigned t = 0; t < c->nb_tests; t++) {
+		if_fail (compile_test(plan, c->tests+t, t)) goto fail;
+	}
+	for (unsigned f = 0; f < plan->nb_fields; f++) {
+		struct plan_field *field = plan->fields + f;
+		for (unsigned o = 0; o < NB_NUM_OPS; o++) {
+			struct num_tests *num = field->num + o;
+			if (num->nb > 1) qsort(num->thresholds, num->nb, sizeof(*num->thresholds), threshold_cmp);
+		}
+		if (field->nb_res > 1) if_fail (merge_res(field, c->tests)) goto fail;
+	}
+	debug("Compiled %u tests on %u fields (%u evaluated one by one)", c->nb_tests, plan->nb_fields, plan->nb_generics);
+	return plan;
+fail:
+	plan_del(plan);
+	return NULL;
+}
+
+/*
+ * Plan evaluation
+ */
+
+// Locate all the fields used by the plan with a single walk through the header
+static void resolve_fields(struct strib_plan const *plan, struct header const *h, char const **values)
+{
+	unsigned nb_found = 0;
+	struct header_field *hf;
+	TAILQ_FOREACH(hf, &h->fields, entry) {
+		if (nb_found >= plan->nb_fields) break;
+		struct plan_field const *field = plan_field_lookup(plan, hf->name);
+		if (! field) continue;
+		unsigned const f = field - plan->fields;
+		if (values[f]) continue;	// the first one is the one header_find() would return
+		values[f] = hf->value;
+		nb_found ++;
+	}
+}
+
+static void match_eq(struct strib_plan const *plan, unsigned f, char const *value, bool *matched)
+{
+	struct eq_test *eq;
+	LIST_FOREACH(eq, plan->eq_hash + (hash_str(value, false) + f) % EQ_HASH_SIZE, h_entry) {
+		if (eq->field == f && 0 == strcmp(eq->value, value)) matched[eq->test] = true;
+	}
+}
+
+// Returns the index of the first threshold greater than (or equal to, if or_equal) value
+static unsigned bisect(struct num_tests const *num, long long value, bool or_equal)
+{
+	unsigned lo = 0, hi = num->nb;
+	while (lo < hi) {
+		unsigned const mid = lo + (hi - lo)/2;
+		long long const th = num->thresholds[mid].value;
+		if (th > value || (or_equal && th == value)) hi = mid;
+		else lo = mid + 1;
+	}
+	return lo;
+}
+
+static void match_range(struct num_tests const *num, unsigned from, unsigned to, bool *matched)
+{
+	for (unsigned i = from; i < to; i++) matched[num->thresholds[i].test] = true;
+}
+
+static void match_num(struct plan_field const *field, char const *value, bool *matched)
+{
+	unsigned nb = 0;
+	for (unsigned o = 0; o < NB_NUM_OPS; o++) nb += field->num[o].nb;
+	if (nb == 0) return;
+	long long n;
+	if (-1 == str2num(&n, value)) {
+		warning("Cannot compare integers with field %s value '%s'", field->name, value);
+		return;
+	}
+	struct num_tests const *num = field->num;
+	// field > threshold for thresholds < n, field >= threshold for thresholds <= n, and so on
+	match_range(num+NUM_GT, 0, bisect(num+NUM_GT, n, true), matched);
+	match_range(num+NUM_GE, 0, bisect(num+NUM_GE, n, false), matched);
+	match_range(num+NUM_LT, bisect(num+NUM_LT, n, false), num[NUM_LT].nb, matched);
+	match_range(num+NUM_LE, bisect(num+NUM_LE, n, true), num[NUM_LE].nb, matched);
+	match_range(num+NUM_EQ, bisect(num+NUM_EQ, n, true), bisect(num+NUM_EQ, n, false), matched);
+}
+
+static void match_re(struct stribution const *c, struct plan_field const *field, char const *value, bool *matched)
+{
+	if (field->nb_res == 0) return;
+	if (field->re_merged_set && ! re_match_str(value, &field->re_merged)) return;
+	for (unsigned r = 0; r < field->nb_res; r++) {
+		unsigned const t = field->re_tests[r];
+		matched[t] = re_match_str(value, &c->tests[t].condition.re_match);
+	}
+}
+
+static void strib_dtor(struct stribution *c)
+{
+	if (c->plan) {
+		plan_del(c->plan);
+		c->plan = NULL;
+	}
+	for (unsigned t=0; t<c->nb_tests; t++) {
+		test_dtor(c->tests+t);
+	}
+}
+
 /*
  * Public Functions
  */
@@ -277,10 +632,13 @@ struct stribution *strib_new(struct header const *h)
 	}
 
 	struct stribution *smaller_c = realloc(c, sizeof(*c) + c->nb_tests*sizeof(c->tests[0]));
-	if (! smaller_c) {
-		return c;
+	if (smaller_c) c = smaller_c;
+
+	if_fail (c->plan = plan_new(c)) {
+		strib_del(c);
+		return NULL;
 	}
-	return smaller_c;
+	return c;
 }
 
 void strib_del(struct stribution *stribution)
@@ -297,12 +655,47 @@ void strib_dump(struct stribution const *stribution, void (*printer)(char const
 	}
 }
 
-void strib_eval(struct stribution *stribution, struct header const *h, void (*cb)(struct header const *, struct strib_action const *, void *), void *data)
+void strib_diff(struct stribution const *stribution, struct stribution const *previous, bool *changed)
 {
-	for (unsigned t=0; t<stribution->nb_tests; t++) {
-		if (condition_eval(&stribution->tests[t].condition, h)) {
-			cb(h, &stribution->tests[t].action, data);
+	for (unsigned t = 0; t < stribution->nb_tests; t++) {
+		changed[t] = true;
+		if (! previous) continue;
+		for (unsigned p = 0; p < previous->nb_tests; p++) {
+			if (test_eq(stribution->tests+t, previous->tests+p)) {
+				changed[t] = false;
+				break;
+			}
 		}
 	}
 }
 
+void strib_eval(struct stribution *stribution, struct header const *h, void (*cb)(struct header const *, struct strib_action const *, void *), void *data)
+{
+	struct strib_plan const *plan = stribution->plan;
+	char const **values = Calloc(plan->nb_fields * sizeof(*values) + stribution->nb_tests * sizeof(bool));
+	on_error return;
+	bool *matched = (bool *)(values + plan->nb_fields);
+
+	resolve_fields(plan, h, values);
+	for (unsigned f = 0; f < plan->nb_fields; f++) {
+		if (! values[f]) continue;
+		struct plan_field const *field = plan->fields + f;
+		if (field->has_eq) match_eq(plan, f, values[f], matched);
+		match_num(field, values[f], matched);
+		match_re(stribution, field, values[f], matched);
+	}
+	for (unsigned g = 0; g < plan->nb_generics; g++) {
+		unsigned const t = plan->generics[g];
+		struct strib_condition const *cond = &stribution->tests[t].condition;
+		struct plan_test const *pt = plan->tests + t;
+		char const *field_value = cond->op != OP_ALWAYS ? values[pt->field] : NULL;
+		char const *deref_value = is_binary(cond->op) && cond->value_type == TYPE_DEREF ? values[pt->deref] : NULL;
+		matched[t] = condition_eval(cond, field_value, deref_value);
+	}
+
+	// Perform the actions in the order of the tests
+	for (unsigned t=0; t<stribution->nb_tests; t++) {
+		if (matched[t]) cb(h, &stribution->tests[t].action, data);
+	}
+	free(values);
+}
@@ -49,7 +49,9 @@ struct strib_test {
 
 #define NB_MAX_TESTS 1000	// FIXME: resizeable
 
+struct strib_plan;
 struct stribution {
+	struct strib_plan *plan;	// tests compiled for strib_eval()
 	unsigned nb_tests;
 	struct strib_test tests[];	// Variable size
 };
@@ -58,6 +60,8 @@ struct header;
 struct stribution *strib_new(struct header const *);
 void strib_del(struct stribution *);
 void strib_dump(struct stribution const *, void (*printer)(char const *fmt, ...));
+// Tells, for each test, whether previous (which may be NULL) has no identical one
+void strib_diff(struct stribution const *, struct stribution const *previous, bool *changed);
 void strib_eval(struct stribution *, struct header const *, void (*action)(struct header const *, struct strib_action const *, void *data), void *data);
 
 #endif
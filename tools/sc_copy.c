@@ -26,6 +26,7 @@
 #include <pth.h>
 #include "scambio.h"
 #include "options.h"
+#include "misc.h"
 #include "scambio/channel.h"
 
 static enum action { SEND, GET, NONE } action = NONE;
@@ -35,10 +36,34 @@ static char const *host = "localhost";
 static char const *port = DEFAULT_FILED_PORT;
 static struct chn_cnx *cnx;
 
+// Read from stdin straight into a new resource
+static void send_stdin(char ref[PATH_MAX])
+{
+	int fd;
+	if_fail (fd = chn_resource_create(ref)) return;
+	char buf[65536];
+	ssize_t ret;
+	while (0 != (ret = pth_read(0, buf, sizeof(buf)))) {
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+			with_error(errno, "Cannot read stdin") break;
+		}
+		if_fail (Write(fd, buf, ret)) break;
+	}
+	on_error {
+		error_save();
+		chn_resource_abort(fd, ref);
+		error_restore();
+		return;
+	}
+	chn_resource_close(cnx, fd, ref, NULL, NULL);
+}
+
 static void do_send(void)
 {
 	char ref[PATH_MAX];
-	chn_send_file_request(cnx, filename, ref);
+	if (0 == strcmp(filename, "-")) send_stdin(ref);
+	else chn_send_file_request(cnx, filename, ref);
 	unless_error puts(ref);
 }
 
@@ -77,7 +102,7 @@ int main(int nb_args, char const**args)
 			"resource name", {},
 		}, {
 			'f', "file",     OPT_STRING, &filename,
-			"local file name to send", {},
+			"local file name to send (- for stdin)", {},
 		},
 	};
 	if_fail (option_parse(nb_args, args, options, sizeof_array(options))) return EXIT_FAILURE;